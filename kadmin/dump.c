@@ -37,12 +37,106 @@
 
 extern int local_flag;
 
+/*
+ * With --threads the entries are still read by a single hdb_foreach()
+ * (the HDB backends have no way to iterate over parts of the keyspace),
+ * but formatting them, which is most of the work, is done in batches by a
+ * pool of threads.  The batches are written out in the order they were
+ * read, so the output is the same as without --threads.
+ */
+
+#define DUMP_BATCH_SIZE 64
+
+struct dump_batch {
+    hdb_dump_format_t fmt;
+    size_t len;
+    hdb_entry_ex entries[DUMP_BATCH_SIZE];
+    krb5_storage *sp;
+    krb5_error_code ret;
+};
+
+struct dump_state {
+    FILE *out;
+    hdb_dump_format_t fmt;
+    struct pipeline *pl;
+    struct dump_batch *batch;
+    krb5_error_code ret;
+};
+
+static void
+free_dump_batch(struct dump_batch *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->len; i++)
+	hdb_free_entry(context, &b->entries[i]);
+    if (b->sp)
+	krb5_storage_free(b->sp);
+    free(b);
+}
+
+/* pipeline work function, may run in any thread */
+static void
+format_dump_batch(krb5_context ctx, void *ptr)
+{
+    struct dump_batch *b = ptr;
+    size_t i;
+
+    b->sp = krb5_storage_emem();
+    if (b->sp == NULL) {
+	b->ret = ENOMEM;
+	return;
+    }
+    for (i = 0; i < b->len && b->ret == 0; i++)
+	b->ret = hdb_entry2dump(ctx, &b->entries[i].entry, b->fmt, b->sp);
+}
+
+/* pipeline done function, runs in order in the main thread */
+static int
+write_dump_batch(void *ptr, void *arg)
+{
+    struct dump_batch *b = ptr;
+    struct dump_state *st = arg;
+    krb5_data data;
+
+    if (st->ret == 0)
+	st->ret = b->ret;
+    if (st->ret == 0)
+	st->ret = krb5_storage_to_data(b->sp, &data);
+    if (st->ret == 0) {
+	if (fwrite(data.data, 1, data.length, st->out) != data.length)
+	    st->ret = errno ? errno : EIO;
+	krb5_data_free(&data);
+    }
+    free_dump_batch(b);
+    return st->ret;
+}
+
+static krb5_error_code
+dump_entry(krb5_context ctx, HDB *db, hdb_entry_ex *entry, void *data)
+{
+    struct dump_state *st = data;
+    struct dump_batch *b = st->batch;
+
+    if (b == NULL) {
+	b = st->batch = ecalloc(1, sizeof(*b));
+	b->fmt = st->fmt;
+    }
+    /* take over the entry; hdb_foreach() frees what is left behind */
+    b->entries[b->len++] = *entry;
+    memset(entry, 0, sizeof(*entry));
+    if (b->len < DUMP_BATCH_SIZE)
+	return 0;
+    st->batch = NULL;
+    return pipeline_submit(st->pl, b);
+}
+
 int
 dump(struct dump_options *opt, int argc, char **argv)
 {
     krb5_error_code ret;
     FILE *f;
-    struct hdb_print_entry_arg parg;
+    struct dump_state st;
     HDB *db = NULL;
 
     if (!local_flag) {
@@ -68,16 +162,31 @@ dump(struct dump_options *opt, int argc, char **argv)
     }
 
     if (!opt->format_string || strcmp(opt->format_string, "Heimdal") == 0) {
-        parg.fmt = HDB_DUMP_HEIMDAL;
+        st.fmt = HDB_DUMP_HEIMDAL;
     } else if (opt->format_string && strcmp(opt->format_string, "MIT") == 0) {
-        parg.fmt = HDB_DUMP_MIT;
+        st.fmt = HDB_DUMP_MIT;
         fprintf(f, "kdb5_util load_dump version 5\n"); /* 5||6, either way */
     } else {
         krb5_errx(context, 1, "Supported dump formats: Heimdal and MIT");
     }
-    parg.out = f;
-    hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
-		hdb_print_entry, &parg);
+    st.out = f;
+    st.batch = NULL;
+    st.ret = 0;
+    st.pl = pipeline_create(opt->threads_integer, format_dump_batch,
+                            write_dump_batch, &st);
+    ret = hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
+		      dump_entry, &st);
+    if (st.batch && st.ret == 0)
+	(void) pipeline_submit(st.pl, st.batch);
+    else if (st.batch)
+	free_dump_batch(st.batch);
+    (void) pipeline_finish(st.pl);
+    if (st.ret)
+	ret = st.ret;
+    if (ret == 0 && fflush(f) != 0)
+	ret = errno;
+    if (ret)
+	krb5_warn(context, ret, "dump");
 
     db->hdb_close(context, db);
 out:
@@ -156,6 +156,17 @@ kadmind_loop (krb5_context, krb5_keytab, int, int);
 int
 handle_mit(krb5_context, void *, size_t, int, int);
 
+/* pipeline.c */
+
+struct pipeline;
+typedef void (*pipeline_work_f)(krb5_context, void *);
+typedef int (*pipeline_done_f)(void *, void *);
+
+struct pipeline *
+pipeline_create(int, pipeline_work_f, pipeline_done_f, void *);
+int pipeline_submit(struct pipeline *, void *);
+int pipeline_finish(struct pipeline *);
+
 /* mod.c */
 
 void
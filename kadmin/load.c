@@ -150,7 +150,7 @@ parse_integer_alloc (unsigned int **u, const char *s)
  */
 
 static int
-parse_keys(hdb_entry *ent, char *str)
+parse_keys(krb5_context ctx, hdb_entry *ent, char *str)
 {
     krb5_error_code ret;
     int tmp;
@@ -167,7 +167,7 @@ parse_keys(hdb_entry *ent, char *str)
 	key = realloc(ent->keys.val,
 		      (ent->keys.len + 1) * sizeof(*ent->keys.val));
 	if(key == NULL)
-	    krb5_errx (context, 1, "realloc: out of memory");
+	    krb5_errx (ctx, 1, "realloc: out of memory");
 	ent->keys.val = key;
 	key = ent->keys.val + ent->keys.len;
 	ent->keys.len++;
@@ -184,7 +184,7 @@ parse_keys(hdb_entry *ent, char *str)
 	p = strsep(&str, ":");
 	ret = krb5_data_alloc(&key->key.keyvalue, (strlen(p) - 1) / 2 + 1);
 	if (ret)
-	    krb5_err (context, 1, ret, "krb5_data_alloc");
+	    krb5_err (ctx, 1, ret, "krb5_data_alloc");
 	for(i = 0; i < strlen(p); i += 2) {
 	    if(sscanf(p + i, "%02x", &tmp) != 1)
 		return 1;
@@ -205,19 +205,19 @@ parse_keys(hdb_entry *ent, char *str)
 
 	    key->salt = calloc(1, sizeof(*key->salt));
 	    if (key->salt == NULL)
-		krb5_errx (context, 1, "malloc: out of memory");
+		krb5_errx (ctx, 1, "malloc: out of memory");
 	    key->salt->type = type;
 
 	    if (p_len) {
 		if(*p == '\"') {
 		    ret = krb5_data_copy(&key->salt->salt, p + 1, p_len - 2);
 		    if (ret)
-			krb5_err (context, 1, ret, "krb5_data_copy");
+			krb5_err (ctx, 1, ret, "krb5_data_copy");
 		} else {
 		    ret = krb5_data_alloc(&key->salt->salt,
 					  (p_len - 1) / 2 + 1);
 		    if (ret)
-			krb5_err (context, 1, ret, "krb5_data_alloc");
+			krb5_err (ctx, 1, ret, "krb5_data_alloc");
 		    for(i = 0; i < p_len; i += 2){
 			if (sscanf(p + i, "%02x", &tmp) != 1)
 			    return 1;
@@ -237,7 +237,7 @@ parse_keys(hdb_entry *ent, char *str)
  */
 
 static int
-parse_event(Event *ev, char *s)
+parse_event(krb5_context ctx, Event *ev, char *s)
 {
     krb5_error_code ret;
     char *p;
@@ -249,24 +249,24 @@ parse_event(Event *ev, char *s)
     if(parse_time_string(&ev->time, p) != 1)
 	return -1;
     p = strsep(&s, ":");
-    ret = krb5_parse_name(context, p, &ev->principal);
+    ret = krb5_parse_name(ctx, p, &ev->principal);
     if (ret)
 	return -1;
     return 1;
 }
 
 static int
-parse_event_alloc (Event **ev, char *s)
+parse_event_alloc (krb5_context ctx, Event **ev, char *s)
 {
     Event tmp;
     int ret;
 
     *ev = NULL;
-    ret = parse_event (&tmp, s);
+    ret = parse_event (ctx, &tmp, s);
     if (ret == 1) {
 	*ev = malloc (sizeof (**ev));
 	if (*ev == NULL)
-	    krb5_errx (context, 1, "malloc: out of memory");
+	    krb5_errx (ctx, 1, "malloc: out of memory");
 	**ev = tmp;
     }
     return ret;
@@ -400,13 +400,224 @@ my_fgetln(FILE *f, char **bufp, size_t *szp, size_t *lenp)
     return 0; /* *len == 0 || no EOL -> EOF */
 }
 
+/*
+ * Lines are read and stored in order by the main thread.  With --threads,
+ * parsing them, which is most of the work in a load, is done in batches
+ * by a pool of threads in between.
+ */
+
+#define LOAD_BATCH_SIZE 64
+
+struct load_line {
+    char *line;
+    int lineno;
+    hdb_entry_ex ent;
+    char *msg;
+    const char *what;
+    char *field;
+};
+
+struct load_batch {
+    size_t len;
+    struct load_line lines[LOAD_BATCH_SIZE];
+};
+
+/*
+ * Parse one dump line in `l->line' into `l->ent'.  On failure return
+ * non-zero with `l->msg' (allocated) or `l->what' describing the problem
+ * and `l->field' pointing to the offending part of the line.  This only
+ * touches `l' and `ctx', so lines may be parsed in several threads at
+ * once, each with its own context.
+ */
+
+static int
+parse_line(krb5_context ctx, struct load_line *l)
+{
+    krb5_error_code ret;
+    hdb_entry_ex *ent = &l->ent;
+    struct entry e;
+    char *p;
+
+    p = l->line;
+    while (isspace((unsigned char)*p))
+	p++;
+
+    e.principal = p;
+    for (p = l->line; *p; p++){
+	if (*p == '\\') /* Support '\n' escapes??? */
+	    p++;
+	else if (isspace((unsigned char)*p)) {
+	    *p = 0;
+	    break;
+	}
+    }
+    p = skip_next(p);
+
+    e.key = p;
+    p = skip_next(p);
+
+    e.created = p;
+    p = skip_next(p);
+
+    e.modified = p;
+    p = skip_next(p);
+
+    e.valid_start = p;
+    p = skip_next(p);
+
+    e.valid_end = p;
+    p = skip_next(p);
+
+    e.pw_end = p;
+    p = skip_next(p);
+
+    e.max_life = p;
+    p = skip_next(p);
+
+    e.max_renew = p;
+    p = skip_next(p);
+
+    e.flags = p;
+    p = skip_next(p);
+
+    e.generation = p;
+    p = skip_next(p);
+
+    e.extensions = p;
+    skip_next(p);
+
+    ret = krb5_parse_name(ctx, e.principal, &ent->entry.principal);
+    if (ret) {
+	const char *msg = krb5_get_error_message(ctx, ret);
+
+	l->msg = estrdup(msg);
+	krb5_free_error_message(ctx, msg);
+	l->field = e.principal;
+	return 1;
+    }
+
+    if (parse_keys(ctx, &ent->entry, e.key)) {
+	l->what = "error parsing keys";
+	l->field = e.key;
+	return 1;
+    }
+
+    if (parse_event(ctx, &ent->entry.created_by, e.created) == -1) {
+	l->what = "error parsing created event";
+	l->field = e.created;
+	return 1;
+    }
+    if (parse_event_alloc (ctx, &ent->entry.modified_by, e.modified) == -1) {
+	l->what = "error parsing event";
+	l->field = e.modified;
+	return 1;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_start, e.valid_start) == -1) {
+	l->what = "error parsing time";
+	l->field = e.valid_start;
+	return 1;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_end,   e.valid_end) == -1) {
+	l->what = "error parsing time";
+	l->field = e.valid_end;
+	return 1;
+    }
+    if (parse_time_string_alloc (&ent->entry.pw_end,      e.pw_end) == -1) {
+	l->what = "error parsing time";
+	l->field = e.pw_end;
+	return 1;
+    }
+
+    if (parse_integer_alloc (&ent->entry.max_life,  e.max_life) == -1) {
+	l->what = "error parsing lifetime";
+	l->field = e.max_life;
+	return 1;
+    }
+    if (parse_integer_alloc (&ent->entry.max_renew, e.max_renew) == -1) {
+	l->what = "error parsing lifetime";
+	l->field = e.max_renew;
+	return 1;
+    }
+
+    if (parse_hdbflags2int (&ent->entry.flags, e.flags) != 1) {
+	l->what = "error parsing flags";
+	l->field = e.flags;
+	return 1;
+    }
+
+    if(parse_generation(e.generation, &ent->entry.generation) == -1) {
+	l->what = "error parsing generation";
+	l->field = e.generation;
+	return 1;
+    }
+
+    if (parse_extensions(&e.extensions, &ent->entry.extensions) == -1) {
+	l->what = "error parsing extension";
+	l->field = e.extensions;
+	return 1;
+    }
+    return 0;
+}
+
+struct load_state {
+    const char *filename;
+    HDB *db;
+    int parse_failed;
+    krb5_error_code store_ret;
+};
+
+/* pipeline work function, may run in any thread */
+static void
+parse_load_batch(krb5_context ctx, void *ptr)
+{
+    struct load_batch *b = ptr;
+    size_t i;
+
+    for (i = 0; i < b->len; i++) {
+	memset(&b->lines[i].ent, 0, sizeof(b->lines[i].ent));
+	if (parse_line(ctx, &b->lines[i]))
+	    hdb_free_entry(ctx, &b->lines[i].ent);
+    }
+}
+
+/* pipeline done function, runs in order in the main thread */
+static int
+store_load_batch(void *ptr, void *arg)
+{
+    struct load_batch *b = ptr;
+    struct load_state *st = arg;
+    struct load_line *l;
+    size_t i;
+
+    for (i = 0; i < b->len; i++) {
+	l = &b->lines[i];
+	if (l->msg || l->what) {
+	    fprintf(stderr, "%s:%d:%s (%s)\n", st->filename, l->lineno,
+		    l->msg ? l->msg : l->what, l->field);
+	    free(l->msg);
+	    st->parse_failed = 1;
+	} else {
+	    if (st->store_ret == 0) {
+		st->store_ret = st->db->hdb_store(context, st->db,
+						  HDB_F_REPLACE, &l->ent);
+		if (st->store_ret)
+		    krb5_warn(context, st->store_ret, "db_store");
+	    }
+	    hdb_free_entry(context, &l->ent);
+	}
+	free(l->line);
+    }
+    free(b);
+    return st->store_ret;
+}
+
 /*
  * Parse the dump file in `filename' and create the database (merging
  * iff merge)
  */
 
 static int
-doit(const char *filename, int mergep)
+doit(const char *filename, int mergep, int nthreads)
 {
     krb5_error_code ret = 0;
     krb5_error_code ret2 = 0;
@@ -414,11 +625,11 @@ doit(const char *filename, int mergep)
     char *line = NULL;
     size_t linesz = 0;
     size_t linelen = 0;
-    char *p;
     int lineno;
     int flags = O_RDWR;
-    struct entry e;
-    hdb_entry_ex ent;
+    struct load_state st;
+    struct load_batch *b = NULL;
+    struct pipeline *pl;
     HDB *db = _kadm5_s_get_db(kadm_handle);
 
     f = fopen(filename, "r");
@@ -454,160 +665,33 @@ doit(const char *filename, int mergep)
 	return 1;
     }
     (void) db->hdb_set_sync(context, db, 0);
+    st.filename = filename;
+    st.db = db;
+    st.parse_failed = 0;
+    st.store_ret = 0;
+    pl = pipeline_create(nthreads, parse_load_batch, store_load_batch, &st);
     for (lineno = 1;
          (ret2 = my_fgetln(f, &line, &linesz, &linelen)) == 0 && linelen > 0;
 	 ++lineno) {
-	p = line;
-	while (isspace((unsigned char)*p))
-	    p++;
-
-	e.principal = p;
-	for (p = line; *p; p++){
-	    if (*p == '\\') /* Support '\n' escapes??? */
-		p++;
-	    else if (isspace((unsigned char)*p)) {
-		*p = 0;
-		break;
-	    }
-	}
-	p = skip_next(p);
-
-	e.key = p;
-	p = skip_next(p);
-
-	e.created = p;
-	p = skip_next(p);
-
-	e.modified = p;
-	p = skip_next(p);
-
-	e.valid_start = p;
-	p = skip_next(p);
-
-	e.valid_end = p;
-	p = skip_next(p);
-
-	e.pw_end = p;
-	p = skip_next(p);
-
-	e.max_life = p;
-	p = skip_next(p);
-
-	e.max_renew = p;
-	p = skip_next(p);
-
-	e.flags = p;
-	p = skip_next(p);
-
-	e.generation = p;
-	p = skip_next(p);
-
-	e.extensions = p;
-	skip_next(p);
-
-	memset(&ent, 0, sizeof(ent));
-	ret2 = krb5_parse_name(context, e.principal, &ent.entry.principal);
-	if (ret2) {
-	    const char *msg = krb5_get_error_message(context, ret);
-	    fprintf(stderr, "%s:%d:%s (%s)\n",
-		    filename, lineno, msg, e.principal);
-	    krb5_free_error_message(context, msg);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_keys(&ent.entry, e.key)) {
-	    fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
-		     filename, lineno, e.key);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_event(&ent.entry.created_by, e.created) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
-		     filename, lineno, e.created);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
+	if (b == NULL)
+	    b = ecalloc(1, sizeof(*b));
+	b->lines[b->len].line = estrdup(line);
+	b->lines[b->len].lineno = lineno;
+	if (++b->len < LOAD_BATCH_SIZE)
 	    continue;
-	}
-	if (parse_event_alloc (&ent.entry.modified_by, e.modified) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing event (%s)\n",
-		     filename, lineno, e.modified);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_start, e.valid_start) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_start);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_end,   e.valid_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.pw_end,      e.pw_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.pw_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_integer_alloc (&ent.entry.max_life,  e.max_life) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_life);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-
-	}
-	if (parse_integer_alloc (&ent.entry.max_renew, e.max_renew) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_renew);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_hdbflags2int (&ent.entry.flags, e.flags) != 1) {
-	    fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
-		     filename, lineno, e.flags);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if(parse_generation(e.generation, &ent.entry.generation) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
-		     filename, lineno, e.generation);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_extensions(&e.extensions, &ent.entry.extensions) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
-		     filename, lineno, e.extensions);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	ret2 = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
-	hdb_free_entry (context, &ent);
-	if (ret2) {
-	    krb5_warn(context, ret2, "db_store");
+	ret2 = pipeline_submit(pl, b);
+	b = NULL;
+	if (ret2)
 	    break;
-	}
     }
+    if (b)
+	(void) pipeline_submit(pl, b);
+    (void) pipeline_finish(pl);
     free(line);
+    if (st.parse_failed)
+        ret = 1;
+    if (st.store_ret)
+        ret2 = st.store_ret;
     if (ret2)
         ret = ret2;
     ret2 = db->hdb_set_sync(context, db, 1);
@@ -627,24 +711,24 @@ doit(const char *filename, int mergep)
 extern int local_flag;
 
 static int
-loadit(int mergep, const char *name, int argc, char **argv)
+loadit(int mergep, const char *name, int nthreads, int argc, char **argv)
 {
     if(!local_flag) {
 	krb5_warnx(context, "%s is only available in local (-l) mode", name);
 	return 0;
     }
 
-    return doit(argv[0], mergep);
+    return doit(argv[0], mergep, nthreads);
 }
 
 int
-load(void *opt, int argc, char **argv)
+load(struct load_options *opt, int argc, char **argv)
 {
-    return loadit(0, "load", argc, argv);
+    return loadit(0, "load", opt->threads_integer, argc, argv);
 }
 
 int
-merge(void *opt, int argc, char **argv)
+merge(struct merge_options *opt, int argc, char **argv)
 {
-    return loadit(1, "merge", argc, argv);
+    return loadit(1, "merge", opt->threads_integer, argc, argv);
 }
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kadmin_locl.h"
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define KADMIN_USE_THREADS 1
+#endif
+
+/*
+ * A small ordered work pipeline for dump and load.
+ *
+ * Items are handed to pipeline_submit() in order.  The `work' function
+ * runs on them in a pool of worker threads, each with its own copy of
+ * the krb5 context, and the `done' function runs on them in the
+ * submitting thread, strictly in submission order.  Only `done' may
+ * touch the database or the output file, so neither has to be
+ * thread-safe.  At most a few items per thread are in flight, which
+ * bounds memory use regardless of the size of the database.
+ *
+ * Without thread support, or with a single thread, `work' and `done' are
+ * simply called back to back from pipeline_submit(), and `work' gets the
+ * global context.
+ */
+
+#ifdef KADMIN_USE_THREADS
+struct pipeline_thread {
+    struct pipeline *pl;
+    krb5_context context;
+    pthread_t thread;
+};
+#endif
+
+struct pipeline_item {
+    struct pipeline_item *next;		/* submission order */
+    struct pipeline_item *qnext;	/* work queue */
+    void *data;
+    int finished;
+};
+
+struct pipeline {
+    pipeline_work_f work;
+    pipeline_done_f done;
+    void *arg;
+    int error;
+#ifdef KADMIN_USE_THREADS
+    size_t nthreads;
+    struct pipeline_thread *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    struct pipeline_item *head, *tail;
+    struct pipeline_item *qhead, *qtail;
+    size_t inflight;
+    size_t max_inflight;
+    int stop;
+#endif
+};
+
+static void
+complete(struct pipeline *pl, void *data)
+{
+    int ret;
+
+    ret = pl->done(data, pl->arg);
+    if (ret && pl->error == 0)
+        pl->error = ret;
+}
+
+#ifdef KADMIN_USE_THREADS
+
+static void *
+pipeline_worker(void *ptr)
+{
+    struct pipeline_thread *t = ptr;
+    struct pipeline *pl = t->pl;
+    struct pipeline_item *item;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        while (pl->qhead == NULL && !pl->stop)
+            pthread_cond_wait(&pl->work_cond, &pl->lock);
+        if ((item = pl->qhead) == NULL)
+            break;
+        if ((pl->qhead = item->qnext) == NULL)
+            pl->qtail = NULL;
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->work(t->context, item->data);
+
+        pthread_mutex_lock(&pl->lock);
+        item->finished = 1;
+        pthread_cond_signal(&pl->done_cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/*
+ * Run `done' on finished items at the head of the queue; if `wait' is
+ * set, block until the number of items in flight drops below `wait'.
+ * Called with the lock held.
+ */
+static void
+drain(struct pipeline *pl, size_t wait)
+{
+    struct pipeline_item *item;
+
+    for (;;) {
+        while ((item = pl->head) != NULL && item->finished) {
+            if ((pl->head = item->next) == NULL)
+                pl->tail = NULL;
+            pl->inflight--;
+            pthread_mutex_unlock(&pl->lock);
+            complete(pl, item->data);
+            free(item);
+            pthread_mutex_lock(&pl->lock);
+        }
+        if (pl->inflight < wait || pl->inflight == 0)
+            break;
+        pthread_cond_wait(&pl->done_cond, &pl->lock);
+    }
+}
+
+#endif
+
+struct pipeline *
+pipeline_create(int nthreads, pipeline_work_f work, pipeline_done_f done,
+                void *arg)
+{
+    struct pipeline *pl;
+
+    pl = ecalloc(1, sizeof(*pl));
+    pl->work = work;
+    pl->done = done;
+    pl->arg = arg;
+#ifdef KADMIN_USE_THREADS
+    if (nthreads <= 1)
+        return pl;
+    pl->threads = ecalloc(nthreads, sizeof(pl->threads[0]));
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_cond_init(&pl->done_cond, NULL);
+    pl->max_inflight = 2 * nthreads;
+    for (pl->nthreads = 0; pl->nthreads < (size_t)nthreads; pl->nthreads++) {
+        struct pipeline_thread *t = &pl->threads[pl->nthreads];
+
+        t->pl = pl;
+        if (krb5_copy_context(context, &t->context) != 0)
+            t->context = NULL;
+        if (t->context == NULL ||
+            pthread_create(&t->thread, NULL, pipeline_worker, t) != 0) {
+            if (t->context)
+                krb5_free_context(t->context);
+            krb5_warnx(context, "could only start %lu of %d threads",
+                       (unsigned long)pl->nthreads, nthreads);
+            break;
+        }
+    }
+#else
+    if (nthreads > 1)
+        krb5_warnx(context, "no thread support, using a single thread");
+#endif
+    return pl;
+}
+
+/*
+ * Queue `data'.  May run `done' for earlier items before returning.
+ * Returns the first non-zero result of `done' so far, so that callers
+ * can stop producing input early.
+ */
+int
+pipeline_submit(struct pipeline *pl, void *data)
+{
+#ifdef KADMIN_USE_THREADS
+    struct pipeline_item *item;
+
+    if (pl->nthreads > 0) {
+        item = ecalloc(1, sizeof(*item));
+        item->data = data;
+        pthread_mutex_lock(&pl->lock);
+        if (pl->tail)
+            pl->tail->next = item;
+        else
+            pl->head = item;
+        pl->tail = item;
+        if (pl->qtail)
+            pl->qtail->qnext = item;
+        else
+            pl->qhead = item;
+        pl->qtail = item;
+        pl->inflight++;
+        pthread_cond_signal(&pl->work_cond);
+        drain(pl, pl->max_inflight);
+        pthread_mutex_unlock(&pl->lock);
+        return pl->error;
+    }
+#endif
+    pl->work(context, data);
+    complete(pl, data);
+    return pl->error;
+}
+
+/*
+ * Wait for all submitted items to complete, stop the workers and free
+ * `pl'.  Returns the first non-zero result of `done', if any.
+ */
+int
+pipeline_finish(struct pipeline *pl)
+{
+    int ret;
+
+#ifdef KADMIN_USE_THREADS
+    if (pl->nthreads > 0) {
+        size_t i;
+
+        pthread_mutex_lock(&pl->lock);
+        drain(pl, 1);
+        pl->stop = 1;
+        pthread_cond_broadcast(&pl->work_cond);
+        pthread_mutex_unlock(&pl->lock);
+        for (i = 0; i < pl->nthreads; i++) {
+            pthread_join(pl->threads[i].thread, NULL);
+            krb5_free_context(pl->threads[i].context);
+        }
+        pthread_cond_destroy(&pl->done_cond);
+        pthread_cond_destroy(&pl->work_cond);
+        pthread_mutex_destroy(&pl->lock);
+    }
+    free(pl->threads);
+#endif
+    ret = pl->error;
+    free(pl);
+    return ret;
+}
@@ -34,19 +34,127 @@
 
 #include "kcm_locl.h"
 
-HEIMDAL_MUTEX ccache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+/*
+ * All caches are on the ccache_head list and, to make resolving them by
+ * name or UUID cheap with many caches, in two hash tables chained
+ * through name_next and uuid_next.  The list and the tables are
+ * protected by ccache_lock; lookups only need to take it for reading.
+ * Each cache has its own mutex for its contents.
+ */
+static HEIMDAL_RWLOCK ccache_lock = HEIMDAL_RWLOCK_INITIALIZER;
 kcm_ccache_data *ccache_head = NULL;
+static kcm_ccache *ccache_by_name = NULL;
+static kcm_ccache *ccache_by_uuid = NULL;
+static size_t ccache_table_size = 0;	/* power of two, or 0 */
+static size_t ccache_count = 0;
+
+static HEIMDAL_MUTEX ccache_nextid_mutex = HEIMDAL_MUTEX_INITIALIZER;
 static unsigned int ccache_nextid = 0;
 
+static uint32_t
+kcm_hash(const void *ptr, size_t len, uint32_t h)
+{
+    const unsigned char *p = ptr;
+
+    while (len--)
+	h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+#define KCM_HASH_INIT 2166136261U
+
+static uint32_t
+kcm_name_hash(const char *name)
+{
+    return kcm_hash(name, strlen(name), KCM_HASH_INIT);
+}
+
+static uint32_t
+kcm_uuid_hash(const kcmuuid_t uuid)
+{
+    return kcm_hash(uuid, sizeof(kcmuuid_t), KCM_HASH_INIT);
+}
+
+/* Called with ccache_lock held for writing */
+static int
+ccache_table_grow(void)
+{
+    kcm_ccache *by_name, *by_uuid, p;
+    size_t size, b;
+
+    size = ccache_table_size ? ccache_table_size * 2 : 64;
+    by_name = calloc(size, sizeof(by_name[0]));
+    by_uuid = calloc(size, sizeof(by_uuid[0]));
+    if (by_name == NULL || by_uuid == NULL) {
+	free(by_name);
+	free(by_uuid);
+	return ENOMEM;
+    }
+    for (p = ccache_head; p != NULL; p = p->next) {
+	b = kcm_name_hash(p->name) & (size - 1);
+	p->name_next = by_name[b];
+	by_name[b] = p;
+	b = kcm_uuid_hash(p->uuid) & (size - 1);
+	p->uuid_next = by_uuid[b];
+	by_uuid[b] = p;
+    }
+    free(ccache_by_name);
+    free(ccache_by_uuid);
+    ccache_by_name = by_name;
+    ccache_by_uuid = by_uuid;
+    ccache_table_size = size;
+    return 0;
+}
+
+/* Called with ccache_lock held */
+static kcm_ccache
+ccache_find_name(const char *name)
+{
+    kcm_ccache p;
+
+    if (ccache_table_size == 0)
+	return NULL;
+    p = ccache_by_name[kcm_name_hash(name) & (ccache_table_size - 1)];
+    for (; p != NULL; p = p->name_next) {
+	if ((p->flags & KCM_FLAGS_VALID) && strcmp(p->name, name) == 0)
+	    return p;
+    }
+    return NULL;
+}
+
+/* Called with ccache_lock held for writing */
+static void
+ccache_table_remove(kcm_ccache ccache)
+{
+    kcm_ccache *p;
+
+    p = &ccache_by_name[kcm_name_hash(ccache->name) & (ccache_table_size - 1)];
+    for (; *p != NULL; p = &(*p)->name_next) {
+	if (*p == ccache) {
+	    *p = ccache->name_next;
+	    break;
+	}
+    }
+    p = &ccache_by_uuid[kcm_uuid_hash(ccache->uuid) & (ccache_table_size - 1)];
+    for (; *p != NULL; p = &(*p)->uuid_next) {
+	if (*p == ccache) {
+	    *p = ccache->uuid_next;
+	    break;
+	}
+    }
+    ccache->name_next = ccache->uuid_next = NULL;
+    ccache_count--;
+}
+
 char *kcm_ccache_nextid(pid_t pid, uid_t uid, gid_t gid)
 {
     unsigned n;
     char *name;
     int ret;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&ccache_nextid_mutex);
     n = ++ccache_nextid;
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&ccache_nextid_mutex);
 
     ret = asprintf(&name, "%ld:%u", (long)uid, n);
     if (ret == -1)
@@ -67,23 +175,16 @@ kcm_ccache_resolve(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_RWLOCK_rdlock(&ccache_lock);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if ((p->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	if (strcmp(p->name, name) == 0) {
-	    ret = 0;
-	    break;
-	}
-    }
-
-    if (ret == 0) {
+    p = ccache_find_name(name);
+    if (p != NULL) {
+	ret = 0;
 	kcm_retain_ccache(context, p);
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
 
     return ret;
 }
@@ -100,12 +201,16 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_RWLOCK_rdlock(&ccache_lock);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
+    if (ccache_table_size)
+	p = ccache_by_uuid[kcm_uuid_hash(uuid) & (ccache_table_size - 1)];
+    else
+	p = NULL;
+    for (; p != NULL; p = p->uuid_next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
-	if (memcmp(p->uuid, uuid, sizeof(*uuid)) == 0) {
+	if (memcmp(p->uuid, uuid, sizeof(kcmuuid_t)) == 0) {
 	    ret = 0;
 	    break;
 	}
@@ -116,7 +221,7 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
 
     return ret;
 }
@@ -129,7 +234,7 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_RWLOCK_rdlock(&ccache_lock);
 
     for (p = ccache_head; p != NULL; p = p->next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
@@ -142,7 +247,7 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 	krb5_storage_write(sp, p->uuid, sizeof(p->uuid));
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
 
     return ret;
 }
@@ -235,30 +340,26 @@ kcm_ccache_destroy(krb5_context context, const char *name)
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-    for (p = &ccache_head; *p != NULL; p = &(*p)->next) {
-	if (((*p)->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	if (strcmp((*p)->name, name) == 0) {
-	    ret = 0;
-	    break;
-	}
-    }
-    if (ret)
+    HEIMDAL_RWLOCK_wrlock(&ccache_lock);
+    ccache = ccache_find_name(name);
+    if (ccache == NULL)
 	goto out;
 
-    if ((*p)->refcnt != 1) {
+    if (ccache->refcnt != 1) {
 	ret = EAGAIN;
 	goto out;
     }
 
-    ccache = *p;
-    *p = (*p)->next;
+    for (p = &ccache_head; *p != ccache; p = &(*p)->next)
+	;
+    *p = ccache->next;
+    ccache_table_remove(ccache);
     kcm_free_ccache_data_internal(context, ccache);
     free(ccache);
+    ret = 0;
 
 out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
 
     return ret;
 }
@@ -268,49 +369,42 @@ kcm_ccache_alloc(krb5_context context,
 		 const char *name,
 		 kcm_ccache *ccache)
 {
-    kcm_ccache slot = NULL, p;
+    kcm_ccache slot;
     krb5_error_code ret;
-    int new_slot = 0;
+    size_t b;
 
     *ccache = NULL;
 
     /* First, check for duplicates */
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-    ret = 0;
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (p->flags & KCM_FLAGS_VALID) {
-	    if (strcmp(p->name, name) == 0) {
-		ret = KRB5_CC_WRITE;
-		break;
-	    }
-	} else if (slot == NULL)
-	    slot = p;
+    HEIMDAL_RWLOCK_wrlock(&ccache_lock);
+    if (ccache_find_name(name) != NULL) {
+	ret = KRB5_CC_WRITE;
+	goto out;
     }
 
-    if (ret)
+    if (ccache_count >= ccache_table_size && ccache_table_grow() != 0) {
+	ret = KRB5_CC_NOMEM;
 	goto out;
+    }
 
     /*
-     * Create an enpty slot for us.
+     * Create an empty slot for us.
      */
+    slot = (kcm_ccache_data *)calloc(1, sizeof(*slot));
     if (slot == NULL) {
-	slot = (kcm_ccache_data *)malloc(sizeof(*slot));
-	if (slot == NULL) {
-	    ret = KRB5_CC_NOMEM;
-	    goto out;
-	}
-	slot->next = ccache_head;
-	HEIMDAL_MUTEX_init(&slot->mutex);
-	new_slot = 1;
+	ret = KRB5_CC_NOMEM;
+	goto out;
     }
 
     RAND_bytes(slot->uuid, sizeof(slot->uuid));
 
     slot->name = strdup(name);
     if (slot->name == NULL) {
+	free(slot);
 	ret = KRB5_CC_NOMEM;
 	goto out;
     }
+    HEIMDAL_MUTEX_init(&slot->mutex);
 
     slot->refcnt = 1;
     slot->flags = KCM_FLAGS_VALID;
@@ -325,21 +419,96 @@ kcm_ccache_alloc(krb5_context context,
     slot->renew_life = 0;
     slot->kdc_offset = 0;
 
-    if (new_slot)
-	ccache_head = slot;
+    slot->next = ccache_head;
+    ccache_head = slot;
+    b = kcm_name_hash(slot->name) & (ccache_table_size - 1);
+    slot->name_next = ccache_by_name[b];
+    ccache_by_name[b] = slot;
+    b = kcm_uuid_hash(slot->uuid) & (ccache_table_size - 1);
+    slot->uuid_next = ccache_by_uuid[b];
+    ccache_by_uuid[b] = slot;
+    ccache_count++;
 
     *ccache = slot;
+    ret = 0;
+
+out:
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
+    return ret;
+}
+
+/*
+ * The creds of a cache are also hashed by the name of their server
+ * principal, without the realm, so that retrieving a ticket does not
+ * have to compare every cred in a large cache.  Each bucket is kept in
+ * list order so that the first match is the same as with a linear scan.
+ */
+
+static uint32_t
+kcm_server_hash(krb5_const_principal server)
+{
+    uint32_t h = KCM_HASH_INIT;
+    size_t i;
+
+    if (server == NULL)
+	return h;
+    for (i = 0; i < server->name.name_string.len; i++)
+	h = kcm_hash(server->name.name_string.val[i],
+		     strlen(server->name.name_string.val[i]) + 1, h);
+    return h;
+}
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+static void
+creds_index_link(struct kcm_creds_index *idx, struct kcm_creds *c)
+{
+    struct kcm_creds **p;
+
+    p = &idx->buckets[c->server_hash & (idx->size - 1)];
+    while (*p != NULL)
+	p = &(*p)->server_next;
+    c->server_next = NULL;
+    *p = c;
+}
+
+static krb5_error_code
+creds_index_add(kcm_ccache ccache, struct kcm_creds *c)
+{
+    struct kcm_creds_index *idx = &ccache->creds_index;
+
+    c->server_hash = kcm_server_hash(c->cred.server);
+    if (idx->count >= idx->size) {
+	struct kcm_creds **buckets, *k;
+	size_t size = idx->size ? idx->size * 2 : 16;
+
+	buckets = calloc(size, sizeof(buckets[0]));
+	if (buckets == NULL)
+	    return KRB5_CC_NOMEM;
+	free(idx->buckets);
+	idx->buckets = buckets;
+	idx->size = size;
+	/* `c' is already on the list, so this re-adds it too */
+	for (k = ccache->creds; k != NULL; k = k->next)
+	    creds_index_link(idx, k);
+    } else
+	creds_index_link(idx, c);
+    idx->count++;
     return 0;
+}
 
-out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    if (new_slot && slot != NULL) {
-	HEIMDAL_MUTEX_destroy(&slot->mutex);
-	free(slot);
+static void
+creds_index_remove(kcm_ccache ccache, struct kcm_creds *c)
+{
+    struct kcm_creds_index *idx = &ccache->creds_index;
+    struct kcm_creds **p;
+
+    p = &idx->buckets[c->server_hash & (idx->size - 1)];
+    for (; *p != NULL; p = &(*p)->server_next) {
+	if (*p == c) {
+	    *p = c->server_next;
+	    idx->count--;
+	    break;
+	}
     }
-    return ret;
 }
 
 krb5_error_code
@@ -358,6 +527,10 @@ kcm_ccache_remove_creds_internal(krb5_context context,
 	free(old);
     }
     ccache->creds = NULL;
+    free(ccache->creds_index.buckets);
+    ccache->creds_index.buckets = NULL;
+    ccache->creds_index.size = 0;
+    ccache->creds_index.count = 0;
 
     return 0;
 }
@@ -559,10 +732,17 @@ kcm_ccache_store_cred_internal(krb5_context context,
 	if (ret) {
 	    free(*c);
 	    *c = NULL;
+	    return ret;
 	}
-    } else {
+    } else
 	**credp = *creds;
-	ret = 0;
+
+    ret = creds_index_add(ccache, *c);
+    if (ret) {
+	if (copy)
+	    krb5_free_cred_contents(context, *credp);
+	free(*c);
+	*c = NULL;
     }
 
     return ret;
@@ -584,6 +764,7 @@ kcm_ccache_remove_cred_internal(krb5_context context,
 	    struct kcm_creds *cred = *c;
 
 	    *c = cred->next;
+	    creds_index_remove(ccache, cred);
 	    krb5_free_cred_contents(context, &cred->cred);
 	    free(cred);
 	    ret = 0;
@@ -628,10 +809,23 @@ kcm_ccache_retrieve_cred_internal(krb5_context context,
     ret = KRB5_CC_END;
 
     match = FALSE;
-    for (c = ccache->creds; c != NULL; c = c->next) {
-	match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
-	if (match)
-	    break;
+    if (mcreds->server != NULL && ccache->creds_index.size != 0) {
+	uint32_t h = kcm_server_hash(mcreds->server);
+
+	c = ccache->creds_index.buckets[h & (ccache->creds_index.size - 1)];
+	for (; c != NULL; c = c->server_next) {
+	    if (c->server_hash != h)
+		continue;
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
+    } else {
+	for (c = ccache->creds; c != NULL; c = c->next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
     }
 
     if (match) {
@@ -667,7 +861,7 @@ kcm_ccache_first_name(kcm_client *client)
     kcm_ccache p;
     char *name = NULL;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_RWLOCK_rdlock(&ccache_lock);
 
     for (p = ccache_head; p != NULL; p = p->next) {
 	if (kcm_is_same_session(client, p->uid, p->session))
@@ -675,6 +869,6 @@ kcm_ccache_first_name(kcm_client *client)
     }
     if (p)
 	name = strdup(p->name);
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_RWLOCK_unlock(&ccache_lock);
     return name;
 }
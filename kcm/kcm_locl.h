@@ -80,6 +80,15 @@ struct kcm_creds {
     kcmuuid_t uuid;
     krb5_creds cred;
     struct kcm_creds *next;
+    uint32_t server_hash;
+    struct kcm_creds *server_next;	/* same hash bucket, in list order */
+};
+
+/* creds of a cache, hashed by server principal name */
+struct kcm_creds_index {
+    struct kcm_creds **buckets;
+    size_t size;			/* power of two, or 0 */
+    size_t count;
 };
 
 typedef struct kcm_ccache_data {
@@ -94,6 +103,7 @@ typedef struct kcm_ccache_data {
     krb5_principal client; /* primary client principal */
     krb5_principal server; /* primary server principal (TGS if NULL) */
     struct kcm_creds *creds;
+    struct kcm_creds_index creds_index;
     krb5_deltat tkt_life;
     krb5_deltat renew_life;
     int32_t kdc_offset;
@@ -103,6 +113,8 @@ typedef struct kcm_ccache_data {
     } key;
     HEIMDAL_MUTEX mutex;
     struct kcm_ccache_data *next;
+    struct kcm_ccache_data *name_next;	/* hash chains, see cache.c */
+    struct kcm_ccache_data *uuid_next;
 } kcm_ccache_data;
 
 #define KCM_ASSERT_VALID(_ccache)		do { \
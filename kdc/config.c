@@ -151,6 +151,52 @@ add_one_address (krb5_context context, const char *str, int first)
     krb5_free_addresses (context, &tmp);
 }
 
+static void
+load_config_files(krb5_context context)
+{
+    krb5_error_code ret;
+    char **files;
+    int aret;
+
+    if (config_file == NULL) {
+	aret = asprintf(&config_file, "%s/kdc.conf", hdb_db_dir(context));
+	if (aret == -1 || config_file == NULL)
+	    errx(1, "out of memory");
+    }
+
+    ret = krb5_prepend_config_files_default(config_file, &files);
+    if (ret)
+	krb5_err(context, 1, ret, "getting configuration files");
+
+    ret = krb5_set_config_files(context, files);
+    krb5_free_config_files(files);
+    if(ret)
+	krb5_err(context, 1, ret, "reading configuration files");
+}
+
+/*
+ * Create a context for a KDC worker thread that reads the same
+ * configuration files as the one passed to configure(), and has the
+ * HDBGET: keytab type registered, as main() does for the master's.
+ */
+
+krb5_error_code
+kdc_worker_context(krb5_context *context)
+{
+    krb5_error_code ret;
+
+    ret = krb5_init_context(context);
+    if (ret)
+	return ret;
+    load_config_files(*context);
+    ret = krb5_kt_register(*context, &hdb_get_kt_ops);
+    if (ret) {
+	krb5_free_context(*context);
+	*context = NULL;
+    }
+    return ret;
+}
+
 krb5_kdc_configuration *
 configure(krb5_context context, int argc, char **argv, int *optidx)
 {
@@ -191,25 +237,7 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if (detach_from_console && daemon_child == -1)
         daemon_child = roken_detach_prep(argc, argv, "--daemon-child");
 
-    {
-	char **files;
-	int aret;
-
-	if (config_file == NULL) {
-	    aret = asprintf(&config_file, "%s/kdc.conf", hdb_db_dir(context));
-	    if (aret == -1 || config_file == NULL)
-		errx(1, "out of memory");
-	}
-
-	ret = krb5_prepend_config_files_default(config_file, &files);
-	if (ret)
-	    krb5_err(context, 1, ret, "getting configuration files");
-
-	ret = krb5_set_config_files(context, files);
-	krb5_free_config_files(files);
-	if(ret)
-	    krb5_err(context, 1, ret, "reading configuration files");
-    }
+    load_config_files(context);
 
     ret = krb5_kdc_get_config(context, &config);
     if (ret)
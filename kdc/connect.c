@@ -33,6 +33,17 @@
 
 #include "kdc_locl.h"
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_FORK) && (defined(SO_REUSEPORT_LB) || defined(SO_REUSEPORT))
+#include <pthread.h>
+#define KDC_USE_THREADS 1
+#ifdef SO_REUSEPORT_LB
+#define KDC_SO_REUSEPORT SO_REUSEPORT_LB
+#else
+#define KDC_SO_REUSEPORT SO_REUSEPORT
+#endif
+#endif
+
 /*
  * a tuple describing on what to listen
  */
@@ -191,6 +202,8 @@ parse_ports(krb5_context context,
  * every socket we listen on
  */
 
+struct tcp_buf_pool;
+
 struct descr {
     krb5_socket_t s;
     int type;
@@ -198,6 +211,12 @@ struct descr {
     unsigned char *buf;
     size_t size;
     size_t len;
+    size_t need;		/* length of the framed message, 0 if unknown */
+    struct tcp_buf_pool *pool;	/* where `buf' goes back to, if pooled */
+    unsigned char *out;		/* reply data the socket wouldn't take yet */
+    size_t out_len;
+    size_t out_off;		/* how much of `out' has been sent */
+    int close_after_out;	/* close once `out' has been sent */
     time_t timeout;
     struct sockaddr_storage __ss;
     struct sockaddr *sa;
@@ -227,13 +246,16 @@ reinit_descrs (struct descr *d, int n)
 }
 
 /*
- * Create the socket (family, type, port) in `d'
+ * Create the socket (family, type, port) in `d'.  With `reuseport'
+ * set, other sockets may be bound to the same address so the kernel
+ * can spread the load over them.
  */
 
 static void
 init_socket(krb5_context context,
 	    krb5_kdc_configuration *config,
-	    struct descr *d, krb5_address *a, int family, int type, int port)
+	    struct descr *d, krb5_address *a, int family, int type, int port,
+	    krb5_boolean reuseport)
 {
     krb5_error_code ret;
     struct sockaddr_storage __ss;
@@ -265,6 +287,15 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#ifdef KDC_USE_THREADS
+    if (reuseport) {
+	int one = 1;
+
+	if (setsockopt(d->s, SOL_SOCKET, KDC_SO_REUSEPORT,
+		       (void *)&one, sizeof(one)) < 0)
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
 #endif
     d->type = type;
     d->port = port;
@@ -302,7 +333,7 @@ init_socket(krb5_context context,
 static int
 init_sockets(krb5_context context,
 	     krb5_kdc_configuration *config,
-	     struct descr **desc)
+	     struct descr **desc, krb5_boolean reuseport)
 {
     krb5_error_code ret;
     size_t i, j;
@@ -326,7 +357,8 @@ init_sockets(krb5_context context,
     for (i = 0; i < num_ports; i++){
 	for (j = 0; j < addresses.len; ++j) {
 	    init_socket(context, config, &d[num], &addresses.val[j],
-			ports[i].family, ports[i].type, ports[i].port);
+			ports[i].family, ports[i].type, ports[i].port,
+			reuseport);
 	    if(d[num].s != rk_INVALID_SOCKET){
 		char a_str[80];
 		size_t len;
@@ -343,7 +375,8 @@ init_sockets(krb5_context context,
 	    }
 	}
     }
-    krb5_free_addresses (context, &addresses);
+    if (addresses.val != explicit_addresses.val)
+	krb5_free_addresses (context, &addresses);
     d = realloc(d, num * sizeof(*d));
     if (d == NULL && num != 0)
 	krb5_errx(context, 1, "realloc(%lu) failed",
@@ -383,10 +416,132 @@ addr_to_string(krb5_context context,
 }
 
 /*
- *
+ * Append `iov[0..niov)' to the output queued on the stream socket in `d'
+ */
+
+static int
+queue_iov(krb5_context context,
+	  krb5_kdc_configuration *config,
+	  struct descr *d,
+	  struct iovec *iov, int niov)
+{
+    unsigned char *tmp;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < niov; i++)
+	len += iov[i].iov_len;
+    if (len == 0)
+	return 0;
+    if (d->out_off) {
+	memmove(d->out, d->out + d->out_off, d->out_len - d->out_off);
+	d->out_len -= d->out_off;
+	d->out_off = 0;
+    }
+    tmp = realloc(d->out, d->out_len + len);
+    if (tmp == NULL) {
+	kdc_log(context, config, 1, "Failed to queue %lu bytes for %s",
+		(unsigned long)len, d->addr_string);
+	return -1;
+    }
+    d->out = tmp;
+    for (i = 0; i < niov; i++) {
+	memcpy(d->out + d->out_len, iov[i].iov_base, iov[i].iov_len);
+	d->out_len += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/*
+ * Write all of `iov[0..niov)' to the stream socket in `d' with as few
+ * system calls as the kernel allows.  Whatever the (non-blocking) socket
+ * won't take now is queued, and handle_tcp() sends it once the socket
+ * is writable again.
+ */
+
+static int
+send_iov(krb5_context context,
+	 krb5_kdc_configuration *config,
+	 struct descr *d,
+	 struct iovec *iov, int niov)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    while (niov > 0 && d->out_len == 0) {
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	n = sendmsg(d->s, &msg, 0);
+	if (rk_IS_SOCKET_ERROR(n)) {
+	    if (rk_SOCK_ERRNO == EINTR)
+		continue;
+	    if (rk_SOCK_ERRNO == EAGAIN || rk_SOCK_ERRNO == EWOULDBLOCK)
+		break;
+	    kdc_log(context, config, 1, "sendmsg(%s): %s", d->addr_string,
+		    strerror(rk_SOCK_ERRNO));
+	    return -1;
+	}
+	/* Skip over what was written and retry with the rest */
+	while (niov > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    niov--;
+	}
+	if (niov > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return queue_iov(context, config, d, iov, niov);
+}
+
+/*
+ * Send the output queued on `d'.  Return -1 on error, 0 if some of it
+ * is still queued, and 1 once it has all been sent.
  */
 
+static int
+send_queued(krb5_context context,
+	    krb5_kdc_configuration *config,
+	    struct descr *d)
+{
+    ssize_t n;
+
+    while (d->out_off < d->out_len) {
+	n = send(d->s, d->out + d->out_off, d->out_len - d->out_off, 0);
+	if (rk_IS_SOCKET_ERROR(n)) {
+	    if (rk_SOCK_ERRNO == EINTR)
+		continue;
+	    if (rk_SOCK_ERRNO == EAGAIN || rk_SOCK_ERRNO == EWOULDBLOCK)
+		return 0;
+	    kdc_log(context, config, 1, "send(%s): %s", d->addr_string,
+		    strerror(rk_SOCK_ERRNO));
+	    return -1;
+	}
+	d->out_off += n;
+    }
+    free(d->out);
+    d->out = NULL;
+    d->out_len = d->out_off = 0;
+    return 1;
+}
+
 static void
+encode_length(unsigned char l[4], size_t len)
+{
+    l[0] = (len >> 24) & 0xff;
+    l[1] = (len >> 16) & 0xff;
+    l[2] = (len >> 8) & 0xff;
+    l[3] = len & 0xff;
+}
+
+/*
+ * Send `reply' to the peer in `d'.  Returns -1 if it could not be sent
+ * (or queued), in which case a stream connection should be closed.
+ */
+
+static int
 send_reply(krb5_context context,
 	   krb5_kdc_configuration *config,
 	   krb5_boolean prependlength,
@@ -398,57 +553,74 @@ send_reply(krb5_context context,
 	    d->addr_string);
     if(prependlength){
 	unsigned char l[4];
-	l[0] = (reply->length >> 24) & 0xff;
-	l[1] = (reply->length >> 16) & 0xff;
-	l[2] = (reply->length >> 8) & 0xff;
-	l[3] = reply->length & 0xff;
-	if(rk_IS_SOCKET_ERROR(sendto(d->s, l, sizeof(l), 0, d->sa, d->sock_len))) {
-	    kdc_log (context, config,
-		     1, "sendto(%s): %s", d->addr_string,
-		     strerror(rk_SOCK_ERRNO));
-	    return;
-	}
+	struct iovec iov[2];
+
+	encode_length(l, reply->length);
+	iov[0].iov_base = (void *)l;
+	iov[0].iov_len = sizeof(l);
+	iov[1].iov_base = reply->data;
+	iov[1].iov_len = reply->length;
+	return send_iov(context, config, d, iov, 2);
     }
     if(rk_IS_SOCKET_ERROR(sendto(d->s, reply->data, reply->length, 0, d->sa, d->sock_len))) {
 	kdc_log (context, config, 1, "sendto(%s): %s", d->addr_string,
 		 strerror(rk_SOCK_ERRNO));
-	return;
+	return -1;
     }
+    return 0;
 }
 
 /*
- * Handle the request in `buf, len' to socket `d'
+ * Process the request in `buf, len' from the peer in `d', leaving the
+ * reply (if any) in `reply'
  */
 
 static void
-do_request(krb5_context context,
-	   krb5_kdc_configuration *config,
-	   void *buf, size_t len, krb5_boolean prependlength,
-	   struct descr *d)
+process_request(krb5_context context,
+		krb5_kdc_configuration *config,
+		void *buf, size_t len, krb5_boolean *prependlength,
+		struct descr *d, krb5_data *reply)
 {
     krb5_error_code ret;
-    krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
 
     krb5_kdc_update_time(NULL);
 
-    krb5_data_zero(&reply);
+    krb5_data_zero(reply);
     ret = krb5_kdc_process_request(context, config,
-				   buf, len, &reply, &prependlength,
+				   buf, len, reply, prependlength,
 				   d->addr_string, d->sa,
 				   datagram_reply);
     if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
-    if(reply.length){
-	send_reply(context, config, prependlength, d, &reply);
-	krb5_data_free(&reply);
-    }
+	krb5_kdc_save_request(context, request_log, buf, len, reply, d->sa);
     if(ret)
 	kdc_log(context, config, 1,
 		"Failed processing %lu byte request from %s",
 		(unsigned long)len, d->addr_string);
 }
 
+/*
+ * Handle the request in `buf, len' to socket `d'.  Returns -1 if the
+ * reply could not be sent.
+ */
+
+static int
+do_request(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   void *buf, size_t len, krb5_boolean prependlength,
+	   struct descr *d)
+{
+    krb5_data reply;
+    int ret = 0;
+
+    process_request(context, config, buf, len, &prependlength, d, &reply);
+    if(reply.length){
+	ret = send_reply(context, config, prependlength, d, &reply);
+	krb5_data_free(&reply);
+    }
+    return ret;
+}
+
 /*
  * Handle incoming data to the UDP socket in `d'
  */
@@ -490,43 +662,105 @@ handle_udp(krb5_context context,
 			  NULL,
 			  NULL,
 			  &data);
-	    send_reply(context, config, FALSE, d, &data);
+	    (void) send_reply(context, config, FALSE, d, &data);
 	    krb5_data_free(&data);
 	} else {
-	    do_request(context, config, buf, n, FALSE, d);
+	    (void) do_request(context, config, buf, n, FALSE, d);
 	}
     }
     free (buf);
 }
 
+/*
+ * Receive buffers for TCP connections are taken from a small per-worker
+ * free list when a connection has data buffered and returned to it as
+ * soon as the connection has none, so idle and keep-alive connections
+ * cost no memory and a steady stream of requests costs no malloc(3).
+ * Buffers grown past TCP_BUF_SIZE for large requests are not pooled.
+ */
+
+#define TCP_BUF_SIZE 4096
+#define TCP_BUF_POOL_MAX 64
+
+struct tcp_buf_pool {
+    unsigned char *free[TCP_BUF_POOL_MAX];
+    size_t nfree;
+};
+
+static unsigned char *
+tcp_buf_get(struct tcp_buf_pool *pool)
+{
+    if (pool->nfree > 0)
+	return pool->free[--pool->nfree];
+    return malloc(TCP_BUF_SIZE);
+}
+
+/* Clear the buffer of `d' and return it to its pool */
+static void
+tcp_buf_put(struct descr *d)
+{
+    struct tcp_buf_pool *pool = d->pool;
+
+    memset(d->buf, 0, d->size);
+    if (d->size == TCP_BUF_SIZE && pool->nfree < TCP_BUF_POOL_MAX)
+	pool->free[pool->nfree++] = d->buf;
+    else
+	free(d->buf);
+    d->buf = NULL;
+    d->size = 0;
+}
+
+static void
+tcp_buf_pool_free(struct tcp_buf_pool *pool)
+{
+    while (pool->nfree > 0)
+	free(pool->free[--pool->nfree]);
+}
+
 static void
 clear_descr(struct descr *d)
 {
-    if(d->buf)
+    if (d->buf && d->pool)
+	tcp_buf_put(d);
+    else if(d->buf)
 	memset(d->buf, 0, d->size);
     d->len = 0;
+    d->need = 0;
+    free(d->out);
+    d->out = NULL;
+    d->out_len = d->out_off = 0;
+    d->close_after_out = 0;
     if(d->s != rk_INVALID_SOCKET)
 	rk_closesocket(d->s);
     d->s = rk_INVALID_SOCKET;
 }
 
+static int
+hex_nibble(int c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
+}
+
 
 /* remove HTTP %-quoting from buf */
 static int
 de_http(char *buf)
 {
     unsigned char *p, *q;
-    unsigned int x;
+    int hi, lo;
 
     for (p = q = (unsigned char *)buf; *p; p++, q++) {
 	if (*p == '%') {
-	    if (!(isxdigit(p[1]) && isxdigit(p[2])))
+	    if ((hi = hex_nibble(p[1])) < 0 || (lo = hex_nibble(p[2])) < 0)
 		return -1;
 
-	    if (sscanf((char *)p + 1, "%2x", &x) != 1)
-		return -1;
-
-	    *q = x;
+	    *q = (hi << 4) | lo;
 	    p += 2;
 	} else {
 	    *q = *p;
@@ -539,128 +773,676 @@ de_http(char *buf)
 #define TCP_TIMEOUT 4
 
 /*
- * accept a new TCP connection on `d[parent]' and store it in `d[child]'
+ * Per-worker event state.  Sockets stay registered with the event
+ * backend (epoll(7) where available, select(2) otherwise) for as long
+ * as they are open, so a wakeup costs O(ready) rather than O(open).
+ *
+ * TCP connection expiry is driven by a timer wheel with one slot per
+ * second.  Connections are not unlinked from the wheel when they are
+ * closed; stale entries are dropped when their slot comes around.
  */
 
-static void
-add_new_tcp (krb5_context context,
-	     krb5_kdc_configuration *config,
-	     struct descr *d, int parent, int child)
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define KDC_USE_EPOLL 1
+#define KDC_MAX_EVENTS 64
+#define ISLIVE_IDX 0xffffffffU
+#endif
+
+/* Must be a power of two greater than TCP_TIMEOUT */
+#define TCP_WHEEL_SLOTS 8
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define KDC_USE_MMSG 1
+#define KDC_UDP_BATCH_MAX 64
+#define KDC_UDP_STATS_INTERVAL 4096
+#endif
+
+struct udp_batch;
+
+struct tcp_wheel_slot {
+    unsigned int *idx;
+    size_t len;
+    size_t alloc;
+};
+
+struct kdc_events {
+    struct descr **dp;
+    unsigned int *ndescrp;
+    int islive;
+#ifdef KDC_USE_EPOLL
+    int epfd;
+#endif
+    time_t wheel_now;
+    size_t wheel_count;
+    struct tcp_wheel_slot wheel[TCP_WHEEL_SLOTS];
+    struct udp_batch *udp;	/* NULL: one datagram per wakeup */
+    struct tcp_buf_pool tcp_bufs;
+};
+
+static krb5_boolean
+realloc_descrs(struct descr **d, unsigned int *ndescr)
 {
-    krb5_socket_t s;
+    struct descr *tmp;
+    unsigned int grow = *ndescr < 4 ? 4 : *ndescr;
+    size_t i;
 
-    if (child == -1)
-	return;
+    tmp = realloc(*d, (*ndescr + grow) * sizeof(**d));
+    if(tmp == NULL)
+        return FALSE;
 
-    d[child].sock_len = sizeof(d[child].__ss);
-    s = accept(d[parent].s, d[child].sa, &d[child].sock_len);
-    if(rk_IS_BAD_SOCKET(s)) {
-	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
-	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
-	return;
+    *d = tmp;
+    reinit_descrs (*d, *ndescr);
+    memset(*d + *ndescr, 0, grow * sizeof(**d));
+    for(i = *ndescr; i < *ndescr + grow; i++)
+        init_descr (*d + i);
+
+    *ndescr += grow;
+
+    return TRUE;
+}
+
+static int
+next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
+{
+    size_t i;
+    int min_free;
+
+    for(i = 0; i < *ndescr; i++) {
+        int s = (*d + i)->s;
+        if(rk_IS_BAD_SOCKET(s))
+            return i;
     }
 
-#ifdef FD_SETSIZE
-    if (s >= FD_SETSIZE) {
-	krb5_warnx(context, "socket FD too large");
-	rk_closesocket (s);
-	return;
+    min_free = *ndescr;
+    if(!realloc_descrs(d, ndescr)) {
+        min_free = -1;
+        krb5_warnx(context, "No memory");
     }
-#endif
 
-    d[child].s = s;
-    d[child].timeout = time(NULL) + TCP_TIMEOUT;
-    d[child].type = SOCK_STREAM;
-    addr_to_string (context,
-		    d[child].sa, d[child].sock_len,
-		    d[child].addr_string, sizeof(d[child].addr_string));
+    return min_free;
 }
 
 /*
- * Grow `d' to handle at least `n'.
- * Return != 0 if fails
+ * Batched UDP: drain up to [kdc]udp-batch-size datagrams from a socket
+ * with one recvmmsg(2), process them in order, and send all the replies
+ * with one sendmmsg(2).  The number of datagrams each call returned is
+ * counted in power-of-two buckets and logged every
+ * KDC_UDP_STATS_INTERVAL calls, so the batch size can be tuned against
+ * real traffic.
  */
 
-static int
-grow_descr (krb5_context context,
-	    krb5_kdc_configuration *config,
-	    struct descr *d, size_t n)
+#ifdef KDC_USE_MMSG
+
+#define UDP_BATCH_BUCKETS 7	/* 1, 2-3, 4-7, ..., 32-63, 64 */
+
+struct udp_batch {
+    unsigned int size;
+    unsigned char *buf;		/* size * max_request_udp */
+    struct mmsghdr in[KDC_UDP_BATCH_MAX];
+    struct iovec in_iov[KDC_UDP_BATCH_MAX];
+    struct sockaddr_storage addr[KDC_UDP_BATCH_MAX];
+    struct mmsghdr out[KDC_UDP_BATCH_MAX];
+    struct iovec out_iov[KDC_UDP_BATCH_MAX];
+    krb5_data reply[KDC_UDP_BATCH_MAX];
+    uint64_t calls;
+    uint64_t datagrams;
+    uint64_t hist[UDP_BATCH_BUCKETS];
+};
+
+static struct udp_batch *
+udp_batch_alloc(krb5_context context, krb5_kdc_configuration *config)
 {
-    if (d->size - d->len < n) {
-	unsigned char *tmp;
-	size_t grow;
-
-	grow = max(1024, d->len + n);
-	if (d->size + grow > max_request_tcp) {
-	    kdc_log(context, config, 2, "Request exceeds max request size (%lu bytes).",
-		    (unsigned long)d->size + grow);
-	    clear_descr(d);
-	    return -1;
+    struct udp_batch *b;
+    unsigned int i;
+
+    if (config->udp_batch_size <= 1)
+	return NULL;
+
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+	return NULL;
+    b->size = config->udp_batch_size > KDC_UDP_BATCH_MAX ?
+	KDC_UDP_BATCH_MAX : config->udp_batch_size;
+    b->buf = malloc(b->size * max_request_udp);
+    if (b->buf == NULL) {
+	kdc_log(context, config, 1, "Failed to allocate %lu bytes, "
+		"not batching UDP requests",
+		(unsigned long)(b->size * max_request_udp));
+	free(b);
+	return NULL;
+    }
+    for (i = 0; i < b->size; i++) {
+	b->in_iov[i].iov_base = b->buf + i * max_request_udp;
+	b->in_iov[i].iov_len = max_request_udp;
+	b->in[i].msg_hdr.msg_name = &b->addr[i];
+	b->in[i].msg_hdr.msg_iov = &b->in_iov[i];
+	b->in[i].msg_hdr.msg_iovlen = 1;
+    }
+    return b;
+}
+
+static void
+udp_batch_log_stats(krb5_context context, krb5_kdc_configuration *config,
+		    struct udp_batch *b)
+{
+    kdc_log(context, config, 4,
+	    "UDP batches: %llu calls, %llu datagrams; per call "
+	    "1: %llu, 2-3: %llu, 4-7: %llu, 8-15: %llu, 16-31: %llu, "
+	    "32-63: %llu, 64: %llu",
+	    (unsigned long long)b->calls, (unsigned long long)b->datagrams,
+	    (unsigned long long)b->hist[0], (unsigned long long)b->hist[1],
+	    (unsigned long long)b->hist[2], (unsigned long long)b->hist[3],
+	    (unsigned long long)b->hist[4], (unsigned long long)b->hist[5],
+	    (unsigned long long)b->hist[6]);
+}
+
+static void
+udp_batch_count(krb5_context context, krb5_kdc_configuration *config,
+		struct udp_batch *b, unsigned int n)
+{
+    size_t bucket = 0;
+
+    while (bucket < UDP_BATCH_BUCKETS - 1 && (2U << bucket) <= n)
+	bucket++;
+    b->hist[bucket]++;
+    b->datagrams += n;
+    if (++b->calls % KDC_UDP_STATS_INTERVAL == 0)
+	udp_batch_log_stats(context, config, b);
+}
+
+static void
+handle_udp_batch(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct udp_batch *b,
+		 struct descr *d)
+{
+    unsigned int i, nout = 0;
+    int n;
+
+    for (i = 0; i < b->size; i++)
+	b->in[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+
+    n = recvmmsg(d->s, b->in, b->size, 0, NULL);
+    if (n < 0) {
+	if (errno != EAGAIN && errno != EINTR)
+	    krb5_warn(context, errno, "recvmmsg");
+	return;
+    }
+    udp_batch_count(context, config, b, n);
+
+    for (i = 0; i < (unsigned int)n; i++) {
+	krb5_boolean prependlength = FALSE;
+	krb5_data *reply = &b->reply[i];
+	size_t len = b->in[i].msg_len;
+
+	d->sock_len = b->in[i].msg_hdr.msg_namelen;
+	memcpy(d->sa, &b->addr[i], d->sock_len);
+	addr_to_string(context, d->sa, d->sock_len,
+		       d->addr_string, sizeof(d->addr_string));
+
+	krb5_data_zero(reply);
+	if (len == max_request_udp) {
+	    krb5_warnx(context,
+		       "recvmmsg: truncated packet from %s, asking for TCP",
+		       d->addr_string);
+	    krb5_mk_error(context, KRB5KRB_ERR_RESPONSE_TOO_BIG,
+			  NULL, NULL, NULL, NULL, NULL, NULL, reply);
+	} else {
+	    process_request(context, config, b->in_iov[i].iov_base, len,
+			    &prependlength, d, reply);
 	}
-	tmp = realloc (d->buf, d->size + grow);
-	if (tmp == NULL) {
-	    kdc_log(context, config, 1, "Failed to re-allocate %lu bytes.",
-		    (unsigned long)d->size + grow);
-	    clear_descr(d);
-	    return -1;
+	if (reply->length == 0)
+	    continue;
+
+	kdc_log(context, config, 4, "sending %lu bytes to %s",
+		(unsigned long)reply->length, d->addr_string);
+	b->out_iov[nout].iov_base = reply->data;
+	b->out_iov[nout].iov_len = reply->length;
+	memset(&b->out[nout], 0, sizeof(b->out[nout]));
+	b->out[nout].msg_hdr.msg_name = &b->addr[i];
+	b->out[nout].msg_hdr.msg_namelen = b->in[i].msg_hdr.msg_namelen;
+	b->out[nout].msg_hdr.msg_iov = &b->out_iov[nout];
+	b->out[nout].msg_hdr.msg_iovlen = 1;
+	nout++;
+    }
+
+    for (i = 0; i < nout; ) {
+	int sent = sendmmsg(d->s, &b->out[i], nout - i, 0);
+
+	if (sent < 0 && errno == EINTR)
+	    continue;
+	if (sent <= 0) {
+	    /* The first message in this call failed; drop it and go on */
+	    addr_to_string(context, b->out[i].msg_hdr.msg_name,
+			   b->out[i].msg_hdr.msg_namelen,
+			   d->addr_string, sizeof(d->addr_string));
+	    kdc_log(context, config, 1, "sendmmsg(%s): %s", d->addr_string,
+		    strerror(errno));
+	    sent = 1;
 	}
-	d->size += grow;
-	d->buf = tmp;
+	i += sent;
     }
-    return 0;
+
+    for (i = 0; i < (unsigned int)n; i++)
+	krb5_data_free(&b->reply[i]);
+}
+
+static void
+udp_batch_free(struct udp_batch *b)
+{
+    if (b == NULL)
+	return;
+    free(b->buf);
+    free(b);
 }
 
+#else
+
+#define udp_batch_alloc(context, config) NULL
+#define udp_batch_free(b)
+
+#endif /* KDC_USE_MMSG */
+
 /*
- * Try to handle the TCP data at `d->buf, d->len'.
- * Return -1 if failed, 0 if succesful, and 1 if data is complete.
+ * Register the socket in `d[idx]' with the event backend.  Sockets
+ * are deregistered implicitly when clear_descr() closes them.
  */
 
 static int
-handle_vanilla_tcp (krb5_context context,
-		    krb5_kdc_configuration *config,
-		    struct descr *d)
+events_add(krb5_context context, struct kdc_events *ev, unsigned int idx)
 {
-    krb5_storage *sp;
-    uint32_t len;
-
-    sp = krb5_storage_from_mem(d->buf, d->len);
-    if (sp == NULL) {
-	kdc_log (context, config, 1, "krb5_storage_from_mem failed");
-	return -1;
-    }
-    krb5_ret_uint32(sp, &len);
-    krb5_storage_free(sp);
-    if(d->len - 4 >= len) {
-	memmove(d->buf, d->buf + 4, d->len - 4);
-	d->len -= 4;
-	return 1;
+#ifdef KDC_USE_EPOLL
+    struct descr *d = &(*ev->dp)[idx];
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    /* Listeners are shared by all workers; wake only one of them */
+    if (d->timeout == 0)
+	e.events |= EPOLLEXCLUSIVE;
+#endif
+    e.data.u64 = ((uint64_t)(unsigned int)d->s << 32) | idx;
+    if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, d->s, &e) == -1) {
+	krb5_warn(context, errno, "epoll_ctl(%s)", d->addr_string);
+	return errno;
     }
+#endif
     return 0;
 }
 
 /*
- * Try to handle the TCP/HTTP data at `d->buf, d->len'.
- * Return -1 if failed, 0 if succesful, and 1 if data is complete.
+ * Wait for the TCP connection in `d[idx]' to become writable (`out'
+ * set) rather than readable.  A connection with a reply queued reads no
+ * further requests until the reply has gone out.
  */
 
 static int
-handle_http_tcp (krb5_context context,
-		 krb5_kdc_configuration *config,
-		 struct descr *d)
+events_want_output(krb5_context context, struct kdc_events *ev,
+		   unsigned int idx, int out)
 {
-    char *s, *p, *t;
-    void *data;
-    char *proto;
-    int len;
+#ifdef KDC_USE_EPOLL
+    struct descr *d = &(*ev->dp)[idx];
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = out ? EPOLLOUT : EPOLLIN;
+    e.data.u64 = ((uint64_t)(unsigned int)d->s << 32) | idx;
+    if (epoll_ctl(ev->epfd, EPOLL_CTL_MOD, d->s, &e) == -1) {
+	krb5_warn(context, errno, "epoll_ctl(%s)", d->addr_string);
+	return errno;
+    }
+#endif
+    return 0;
+}
 
-    s = (char *)d->buf;
+static void
+events_init(krb5_context context, struct kdc_events *ev,
+	    struct descr **dp, unsigned int *ndescrp, int islive)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->dp = dp;
+    ev->ndescrp = ndescrp;
+    ev->islive = islive;
+    ev->wheel_now = time(NULL);
 
-    /* If its a multi line query, truncate off the first line */
-    p = strstr(s, "\r\n");
-    if (p)
-	*p = 0;
+#ifdef KDC_USE_EPOLL
+    {
+	struct epoll_event e;
+	unsigned int i;
+
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev->epfd == -1)
+	    krb5_err(context, 1, errno, "epoll_create1");
+
+	if (islive > -1) {
+	    memset(&e, 0, sizeof(e));
+	    e.events = EPOLLIN;
+	    e.data.u64 = ISLIVE_IDX;
+	    if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, islive, &e) == -1)
+		krb5_err(context, 1, errno, "epoll_ctl");
+	}
+	for (i = 0; i < *ndescrp; i++) {
+	    if (!rk_IS_BAD_SOCKET((*dp)[i].s) &&
+		events_add(context, ev, i) != 0)
+		krb5_errx(context, 1, "Failed to register listener");
+	}
+    }
+#endif
+}
 
-    p = NULL;
+static void
+events_free(struct kdc_events *ev)
+{
+    size_t i;
+
+#ifdef KDC_USE_EPOLL
+    close(ev->epfd);
+#endif
+    for (i = 0; i < TCP_WHEEL_SLOTS; i++)
+	free(ev->wheel[i].idx);
+    udp_batch_free(ev->udp);
+
+    /* Buffers still held by connections now belong to their descr */
+    for (i = 0; i < *ev->ndescrp; i++) {
+	if ((*ev->dp)[i].pool == &ev->tcp_bufs)
+	    (*ev->dp)[i].pool = NULL;
+    }
+    tcp_buf_pool_free(&ev->tcp_bufs);
+}
+
+/*
+ * Arm the expiry of the TCP connection in `d[idx]'
+ */
+
+static int
+tcp_wheel_insert(krb5_context context, struct kdc_events *ev,
+		 unsigned int idx)
+{
+    struct descr *d = &(*ev->dp)[idx];
+    struct tcp_wheel_slot *slot;
+
+    slot = &ev->wheel[d->timeout & (TCP_WHEEL_SLOTS - 1)];
+    if (slot->len == slot->alloc) {
+	size_t n = slot->alloc ? slot->alloc * 2 : 16;
+	unsigned int *tmp;
+
+	tmp = realloc(slot->idx, n * sizeof(slot->idx[0]));
+	if (tmp == NULL) {
+	    krb5_warnx(context, "No memory");
+	    return ENOMEM;
+	}
+	slot->idx = tmp;
+	slot->alloc = n;
+    }
+    slot->idx[slot->len++] = idx;
+    ev->wheel_count++;
+    return 0;
+}
+
+/*
+ * Close all TCP connections that have been idle past their timeout.
+ * Only the wheel slots for the seconds that passed since the last call
+ * are visited.
+ */
+
+static void
+tcp_wheel_expire(krb5_context context, krb5_kdc_configuration *config,
+		 struct kdc_events *ev, time_t now)
+{
+    struct descr *d = *ev->dp;
+    time_t t;
+
+    t = ev->wheel_now;
+    if (now - t > TCP_WHEEL_SLOTS)
+	t = now - TCP_WHEEL_SLOTS;
+    for (; t < now; t++) {
+	struct tcp_wheel_slot *slot = &ev->wheel[t & (TCP_WHEEL_SLOTS - 1)];
+	size_t i, keep = 0;
+
+	for (i = 0; i < slot->len; i++) {
+	    unsigned int idx = slot->idx[i];
+
+	    /* Closed, or reused with an expiry in another slot */
+	    if (idx >= *ev->ndescrp || rk_IS_BAD_SOCKET(d[idx].s) ||
+		d[idx].type != SOCK_STREAM || d[idx].timeout == 0 ||
+		(d[idx].timeout & (TCP_WHEEL_SLOTS - 1)) !=
+		(t & (TCP_WHEEL_SLOTS - 1)))
+		continue;
+	    if (d[idx].timeout < now) {
+		kdc_log(context, config, 2,
+			"TCP-connection from %s expired after %lu bytes",
+			d[idx].addr_string, (unsigned long)d[idx].len);
+		clear_descr(&d[idx]);
+		continue;
+	    }
+	    slot->idx[keep++] = idx;
+	}
+	ev->wheel_count -= slot->len - keep;
+	slot->len = keep;
+    }
+    ev->wheel_now = now;
+}
+
+/*
+ * accept a new TCP connection on `d[parent]' and store it in the
+ * first free descriptor
+ */
+
+static void
+add_new_tcp (krb5_context context,
+	     krb5_kdc_configuration *config,
+	     struct kdc_events *ev, int parent)
+{
+    struct descr *d;
+    krb5_socket_t s;
+    int child;
+
+    child = next_min_free(context, ev->dp, ev->ndescrp);
+    if (child == -1)
+	return;
+    d = *ev->dp;
+
+    d[child].sock_len = sizeof(d[child].__ss);
+    s = accept(d[parent].s, d[child].sa, &d[child].sock_len);
+    if(rk_IS_BAD_SOCKET(s)) {
+	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
+	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
+	return;
+    }
+
+#if !defined(KDC_USE_EPOLL) && defined(FD_SETSIZE)
+    if (s >= FD_SETSIZE) {
+	krb5_warnx(context, "socket FD too large");
+	rk_closesocket (s);
+	return;
+    }
+#endif
+
+    d[child].s = s;
+    d[child].timeout = time(NULL) + TCP_TIMEOUT;
+    d[child].type = SOCK_STREAM;
+    addr_to_string (context,
+		    d[child].sa, d[child].sock_len,
+		    d[child].addr_string, sizeof(d[child].addr_string));
+    if (events_add(context, ev, child) ||
+	tcp_wheel_insert(context, ev, child))
+	clear_descr(&d[child]);
+}
+
+/*
+ * Make room for at least `want' bytes in the buffer of `d'.
+ * Return != 0 if fails
+ */
+
+static int
+grow_descr (krb5_context context,
+	    krb5_kdc_configuration *config,
+	    struct kdc_events *ev,
+	    struct descr *d, size_t want)
+{
+    unsigned char *tmp;
+    size_t size;
+
+    if (want <= d->size)
+	return 0;
+    if (want > max_request_tcp) {
+	kdc_log(context, config, 2, "Request exceeds max request size (%lu bytes).",
+		(unsigned long)want);
+	return -1;
+    }
+    d->pool = &ev->tcp_bufs;
+    if (d->buf == NULL && want <= TCP_BUF_SIZE) {
+	d->buf = tcp_buf_get(d->pool);
+	if (d->buf == NULL) {
+	    kdc_log(context, config, 1, "Failed to allocate %lu bytes.",
+		    (unsigned long)TCP_BUF_SIZE);
+	    return -1;
+	}
+	d->size = TCP_BUF_SIZE;
+	return 0;
+    }
+    size = max(want, d->size * 2);
+    if (size > max_request_tcp)
+	size = max_request_tcp;
+    tmp = realloc (d->buf, size);
+    if (tmp == NULL) {
+	kdc_log(context, config, 1, "Failed to re-allocate %lu bytes.",
+		(unsigned long)size);
+	return -1;
+    }
+    d->size = size;
+    d->buf = tmp;
+    return 0;
+}
+
+/*
+ * Drop the first `n' bytes, a message that has been handled, from the
+ * buffer of `d'; what remains is the start of the next message, if any.
+ */
+
+static void
+consume_descr(struct descr *d, size_t n)
+{
+    memmove(d->buf, d->buf + n, d->len - n);
+    d->len -= n;
+    d->need = 0;
+}
+
+/*
+ * Try to handle the TCP data at `d->buf, d->len'.  The length prefix is
+ * parsed once per message.
+ * Return -1 if failed, 0 if more data is needed, and 1 if a request was
+ * handled.
+ */
+
+static int
+handle_vanilla_tcp (krb5_context context,
+		    krb5_kdc_configuration *config,
+		    struct kdc_events *ev,
+		    struct descr *d)
+{
+    if (d->need == 0) {
+	uint32_t len;
+
+	if (d->len < 4)
+	    return 0;
+	len = ((uint32_t)d->buf[0] << 24) | ((uint32_t)d->buf[1] << 16) |
+	    ((uint32_t)d->buf[2] << 8) | d->buf[3];
+	if (len > max_request_tcp - 4) {
+	    kdc_log(context, config, 2,
+		    "Request exceeds max request size (%lu bytes).",
+		    (unsigned long)len + 4);
+	    return -1;
+	}
+	d->need = 4 + len;
+    }
+    if (d->len < d->need)
+	return grow_descr(context, config, ev, d, d->need) ? -1 : 0;
+
+    /* On error the caller closes the connection */
+    if (do_request(context, config, d->buf + 4, d->need - 4, TRUE, d))
+	return -1;
+    consume_descr(d, d->need);
+    return 1;
+}
+
+/* Look for "Connection: close" among the HTTP header lines in `h' */
+static int
+http1_connection_close(char *h)
+{
+    char *p;
+
+    for (; h != NULL && *h != '\0'; h = p) {
+	p = strstr(h, "\r\n");
+	if (p) {
+	    *p = '\0';
+	    p += 2;
+	}
+	if (strncasecmp(h, "Connection:", sizeof("Connection:") - 1) == 0) {
+	    h += sizeof("Connection:") - 1;
+	    h += strspn(h, " \t");
+	    if (strncasecmp(h, "close", sizeof("close") - 1) == 0)
+		return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Try to handle the TCP/HTTP data at `d->buf, d->len'.  The request is
+ * decoded in place and the whole response goes out in one sendmsg(2).
+ * HTTP/1.1 clients that do not ask for "Connection: close" may send
+ * further requests on the same connection.
+ * Return -1 if failed or the connection is done, 0 if more data is
+ * needed, and 1 if a request was handled.
+ */
+
+static int
+handle_http_tcp (krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct descr *d)
+{
+    unsigned char *end;
+    char *s, *p, *t, *hdrs;
+    char *proto;
+    size_t reqlen;
+    int keepalive;
+    int len;
+
+    end = memmem(d->buf, d->len, "\r\n\r\n", sizeof("\r\n\r\n") - 1);
+    if (end == NULL)
+	return 0;
+
+    /*
+     * For POST (the MSFT variant of this protocol) we'll need something like
+     * this (plus check for Content-Length/Transfer-Encoding):
+     *
+     *  const unsigned char *body;
+     *  if ((body = memmem(req, len, "\r\n\r\n", sizeof("\r\n\r\n") - 1)) == NULL)
+     *      return 0;
+     *  body += sizeof("\r\n\r\n") - 1;
+     *  len -= (body - req);
+     *  return memmem(body, len, "\r\n\r\n", sizeof("\r\n\r\n") - 1) != NULL;
+     *
+     * Since the POST-based variant runs over HTTPS, we'll probably implement
+     * that in a proxy instead of here.
+     */
+
+    reqlen = end - d->buf + sizeof("\r\n\r\n") - 1;
+
+    /* NUL-terminate at the request header ending \r\n\r\n */
+    *end = '\0';
+    s = (char *)d->buf;
+
+    /* If its a multi line query, split off the header lines */
+    hdrs = strstr(s, "\r\n");
+    if (hdrs) {
+	*hdrs = '\0';
+	hdrs += 2;
+    }
+
+    p = NULL;
     t = strtok_r(s, " \t", &p);
     if (t == NULL) {
 	kdc_log(context, config, 2,
@@ -675,27 +1457,23 @@ handle_http_tcp (krb5_context context,
 	return -1;
     }
 
-    data = malloc(strlen(t));
-    if (data == NULL) {
-	kdc_log(context, config, 1, "Failed to allocate %lu bytes",
-		(unsigned long)strlen(t));
-	return -1;
-    }
     if(*t == '/')
 	t++;
     if(de_http(t) != 0) {
 	kdc_log(context, config, 2, "Malformed HTTP request from %s", d->addr_string);
 	kdc_log(context, config, 4, "HTTP request: %s", t);
-	free(data);
 	return -1;
     }
     proto = strtok_r(NULL, " \t", &p);
     if (proto == NULL) {
 	kdc_log(context, config, 2, "Malformed HTTP request from %s", d->addr_string);
-	free(data);
 	return -1;
     }
-    len = rk_base64_decode(t, data);
+    keepalive = strcmp(proto, "HTTP/1.1") == 0 &&
+	!http1_connection_close(hdrs);
+
+    /* The decoded data is never longer than its encoding */
+    len = rk_base64_decode(t, t);
     if(len <= 0){
 	const char *msg =
 	    " 404 Not found\r\n"
@@ -708,47 +1486,61 @@ handle_http_tcp (krb5_context context,
 	    "<H1>404 Not found</H1>\r\n"
 	    "That page doesn't exist, maybe you are looking for "
 	    "<A HREF=\"http://www.h5l.org/\">Heimdal</A>?\r\n";
+	struct iovec iov[2];
+
 	kdc_log(context, config, 2, "HTTP request from %s is non KDC request", d->addr_string);
 	kdc_log(context, config, 4, "HTTP request: %s", t);
-	free(data);
-	if (rk_IS_SOCKET_ERROR(send(d->s, proto, strlen(proto), 0))) {
-	    kdc_log(context, config, 1, "HTTP write failed: %s: %s",
-		    d->addr_string, strerror(rk_SOCK_ERRNO));
-	    return -1;
-	}
-	if (rk_IS_SOCKET_ERROR(send(d->s, msg, strlen(msg), 0))) {
-	    kdc_log(context, config, 1, "HTTP write failed: %s: %s",
-		    d->addr_string, strerror(rk_SOCK_ERRNO));
-	    return -1;
-	}
+	iov[0].iov_base = proto;
+	iov[0].iov_len = strlen(proto);
+	iov[1].iov_base = rk_UNCONST(msg);
+	iov[1].iov_len = strlen(msg);
+	if (send_iov(context, config, d, iov, 2) == 0)
+	    d->close_after_out = 1;
 	return -1;
     }
     {
-	const char *msg =
-	    " 200 OK\r\n"
-	    "Server: Heimdal/" VERSION "\r\n"
-	    "Cache-Control: no-cache\r\n"
-	    "Pragma: no-cache\r\n"
-	    "Content-type: application/octet-stream\r\n"
-	    "Content-transfer-encoding: binary\r\n\r\n";
-	if (rk_IS_SOCKET_ERROR(send(d->s, proto, strlen(proto), 0))) {
-	    free(data);
-	    kdc_log(context, config, 1, "HTTP write failed: %s: %s",
-		    d->addr_string, strerror(rk_SOCK_ERRNO));
-	    return -1;
-	}
-	if (rk_IS_SOCKET_ERROR(send(d->s, msg, strlen(msg), 0))) {
-	    free(data);
-	    kdc_log(context, config, 1, "HTTP write failed: %s: %s",
-		    d->addr_string, strerror(rk_SOCK_ERRNO));
-	    return -1;
+	krb5_boolean prependlength = TRUE;
+	unsigned char l[4];
+	struct iovec iov[4];
+	krb5_data reply;
+	char msg[256];
+	int niov = 0;
+
+	process_request(context, config, t, len, &prependlength, d, &reply);
+	snprintf(msg, sizeof(msg),
+		 " 200 OK\r\n"
+		 "Server: Heimdal/" VERSION "\r\n"
+		 "Cache-Control: no-cache\r\n"
+		 "Pragma: no-cache\r\n"
+		 "Content-type: application/octet-stream\r\n"
+		 "Content-transfer-encoding: binary\r\n"
+		 "Content-Length: %lu\r\n\r\n",
+		 (unsigned long)reply.length +
+		 (reply.length && prependlength ? sizeof(l) : 0));
+	iov[niov].iov_base = proto;
+	iov[niov++].iov_len = strlen(proto);
+	iov[niov].iov_base = msg;
+	iov[niov++].iov_len = strlen(msg);
+	if (reply.length) {
+	    kdc_log(context, config, 4, "sending %lu bytes to %s",
+		    (unsigned long)reply.length, d->addr_string);
+	    if (prependlength) {
+		encode_length(l, reply.length);
+		iov[niov].iov_base = (void *)l;
+		iov[niov++].iov_len = sizeof(l);
+	    }
+	    iov[niov].iov_base = reply.data;
+	    iov[niov++].iov_len = reply.length;
 	}
+	if (send_iov(context, config, d, iov, niov))
+	    keepalive = 0;
+	krb5_data_free(&reply);
     }
-    if ((size_t)len > d->len)
-        len = d->len;
-    memcpy(d->buf, data, len);
-    d->len = len;
-    free(data);
+    if (!keepalive) {
+	d->close_after_out = 1;
+	return -1;
+    }
+    consume_descr(d, reqlen);
     return 1;
 }
 
@@ -761,118 +1553,161 @@ http1_request_taste(const unsigned char *req, size_t len)
                memcmp(req, "HEAD ", sizeof("HEAD ") - 1) == 0));
 }
 
+/*
+ * Try to handle the next message buffered for the TCP socket in `d'.
+ * Return -1 to close the connection, 0 if more data is needed, and 1
+ * if a request was handled.  A handler that queued a final reply before
+ * returning -1 sets close_after_out, and the connection is only closed
+ * once that reply has been sent.
+ */
+
 static int
-http1_request_is_complete(const unsigned char *req, size_t len)
+handle_tcp_message(krb5_context context,
+		   krb5_kdc_configuration *config,
+		   struct kdc_events *ev,
+		   struct descr *d)
 {
+    int ret;
 
-    return http1_request_taste(req, len) &&
-        memmem(req, len, "\r\n\r\n", sizeof("\r\n\r\n") - 4) != NULL;
+    if (d->need || (d->len >= 4 && d->buf[0] == 0))
+	return handle_vanilla_tcp (context, config, ev, d);
+    if (enable_http && http1_request_taste(d->buf, d->len))
+	return handle_http_tcp (context, config, d);
+    if (d->len <= 4)
+	return 0;
 
-    /*
-     * For POST (the MSFT variant of this protocol) we'll need something like
-     * this (plus check for Content-Length/Transfer-Encoding):
-     *
-     *  const unsigned char *body;
-     *  if ((body = memmem(req, len, "\r\n\r\n", sizeof("\r\n\r\n") - 4)) == NULL)
-     *      return 0;
-     *  body += sizeof("\r\n\r\n") - 4;
-     *  len -= (body - req);
-     *  return memmem(body, len, "\r\n\r\n", sizeof("\r\n\r\n") - 4) != NULL;
-     *
-     * Since the POST-based variant runs over HTTPS, we'll probably implement
-     * that in a proxy instead of here.
-     */
+    kdc_log (context, config,
+	     2, "TCP data of strange type from %s to %s/%d",
+	     d->addr_string, descr_type(d), ntohs(d->port));
+    if (d->buf[0] & 0x80) {
+	krb5_data reply;
+
+	kdc_log (context, config, 2, "TCP extension not supported");
+
+	ret = krb5_mk_error(context,
+			    KRB5KRB_ERR_FIELD_TOOLONG,
+			    NULL,
+			    NULL,
+			    NULL,
+			    NULL,
+			    NULL,
+			    NULL,
+			    &reply);
+	if (ret == 0) {
+	    if (send_reply(context, config, TRUE, d, &reply) == 0)
+		d->close_after_out = 1;
+	    krb5_data_free(&reply);
+	}
+    }
+    return -1;
 }
 
 /*
- * Handle incoming data to the TCP socket in `d[index]'
+ * Handle incoming data to the TCP socket in `d[index]'.  Data is read
+ * straight into the connection's buffer and every complete request in
+ * it is handled; the connection stays open for more until the client
+ * closes it or it goes idle for TCP_TIMEOUT seconds.  If a reply could
+ * not be sent in full, the rest is sent when the socket is writable
+ * and only then are further requests handled.
  */
 
 static void
 handle_tcp(krb5_context context,
 	   krb5_kdc_configuration *config,
-	   struct descr *d, int idx, int min_free)
+	   struct kdc_events *ev, int idx)
 {
-    unsigned char buf[1024];
-    int n;
+    struct descr *d = *ev->dp;
+    size_t limit;
+    ssize_t n;
     int ret = 0;
+    int handled = 0;
 
     if (d[idx].timeout == 0) {
-	add_new_tcp (context, config, d, idx, min_free);
+	add_new_tcp (context, config, ev, idx);
 	return;
     }
 
-    n = recvfrom(d[idx].s, buf, sizeof(buf), 0, NULL, NULL);
+    if (d[idx].out_len) {
+	ret = send_queued(context, config, &d[idx]);
+	if (ret == 0)
+	    return;
+	if (ret < 0 || d[idx].close_after_out ||
+	    events_want_output(context, ev, idx, 0)) {
+	    clear_descr(d + idx);
+	    return;
+	}
+	/* Now handle what was buffered while the reply went out */
+	goto handle;
+    }
+
+    limit = min(d[idx].size, max_request_tcp);
+    if (d[idx].len >= limit &&
+	grow_descr(context, config, ev, &d[idx], d[idx].len + 1)) {
+	clear_descr(d + idx);
+	return;
+    }
+    limit = min(d[idx].size, max_request_tcp);
+
+    n = recv(d[idx].s, d[idx].buf + d[idx].len, limit - d[idx].len, 0);
     if(rk_IS_SOCKET_ERROR(n)){
+	if (rk_SOCK_ERRNO == EAGAIN || rk_SOCK_ERRNO == EINTR)
+	    return;
 	krb5_warn(context, rk_SOCK_ERRNO, "recvfrom failed from %s to %s/%d",
 		  d[idx].addr_string, descr_type(d + idx),
 		  ntohs(d[idx].port));
+	clear_descr (d + idx);
 	return;
     } else if (n == 0) {
-	krb5_warnx(context, "connection closed before end of data after %lu "
-		   "bytes from %s to %s/%d", (unsigned long)d[idx].len,
-		   d[idx].addr_string, descr_type(d + idx),
-		   ntohs(d[idx].port));
+	if (d[idx].len == 0)
+	    kdc_log(context, config, 4, "connection closed by %s",
+		    d[idx].addr_string);
+	else
+	    krb5_warnx(context, "connection closed before end of data after "
+		       "%lu bytes from %s to %s/%d", (unsigned long)d[idx].len,
+		       d[idx].addr_string, descr_type(d + idx),
+		       ntohs(d[idx].port));
 	clear_descr (d + idx);
 	return;
     }
-    if (grow_descr (context, config, &d[idx], n))
-	return;
-    memcpy(d[idx].buf + d[idx].len, buf, n);
     d[idx].len += n;
-    if(d[idx].len > 4 && d[idx].buf[0] == 0) {
-	ret = handle_vanilla_tcp (context, config, &d[idx]);
-    } else if (enable_http &&
-               http1_request_taste(d[idx].buf, d[idx].len)) {
-
-        if (http1_request_is_complete(d[idx].buf, d[idx].len)) {
-            /* NUL-terminate at the request header ending \r\n\r\n */
-            d[idx].buf[d[idx].len - 4] = '\0';
-            ret = handle_http_tcp (context, config, &d[idx]);
-        }
-    } else if (d[idx].len > 4) {
-	kdc_log (context, config,
-		 2, "TCP data of strange type from %s to %s/%d",
-		 d[idx].addr_string, descr_type(d + idx),
-		 ntohs(d[idx].port));
-	if (d[idx].buf[0] & 0x80) {
-	    krb5_data reply;
-
-	    kdc_log (context, config, 2, "TCP extension not supported");
-
-	    ret = krb5_mk_error(context,
-				KRB5KRB_ERR_FIELD_TOOLONG,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				&reply);
-	    if (ret == 0) {
-		send_reply(context, config, TRUE, d + idx, &reply);
-		krb5_data_free(&reply);
-	    }
-	}
+
+handle:
+    while (d[idx].out_len == 0 &&
+	   (ret = handle_tcp_message(context, config, ev, &d[idx])) == 1) {
+	handled = 1;
+	if (d[idx].len == 0)
+	    break;
+    }
+    if (ret < 0 && d[idx].out_len == 0) {
+	clear_descr(d + idx);
+	return;
+    }
+    if (ret < 0 && !d[idx].close_after_out) {
+	/* An error left a partial reply queued; don't send the rest */
+	clear_descr(d + idx);
+	return;
+    }
+    if (d[idx].out_len && events_want_output(context, ev, idx, 1)) {
 	clear_descr(d + idx);
 	return;
     }
 
-    /*
-     * ret == 0 -> not enough of request buffered -> wait for more
-     * ret == 1 -> go ahead and perform the request
-     * ret != 0 (really, < 0) -> error, probably ENOMEM, close connection
-     */
-    if (ret == 1)
-	do_request(context, config,
-		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
+    if (handled) {
+	time_t timeout = time(NULL) + TCP_TIMEOUT;
+	int moved = (timeout & (TCP_WHEEL_SLOTS - 1)) !=
+	    (d[idx].timeout & (TCP_WHEEL_SLOTS - 1));
 
-    /*
-     * Note: this means we don't keep the connection open even where we
-     * the protocol permits it.
-     */
-    if (ret != 0)
-	clear_descr(d + idx);
+	/* The entry in the old wheel slot goes stale and is dropped */
+	d[idx].timeout = timeout;
+	if (moved && tcp_wheel_insert(context, ev, idx)) {
+	    clear_descr(d + idx);
+	    return;
+	}
+    }
+
+    /* Nothing buffered: let another connection use the buffer */
+    if (d[idx].len == 0 && d[idx].buf && d[idx].pool)
+	tcp_buf_put(&d[idx]);
 }
 
 #ifdef HAVE_FORK
@@ -883,82 +1718,106 @@ handle_islive(int fd)
     int ret;
 
     ret = read(fd, &buf, 1);
-    if (ret != 1)
+    if (ret != 1 && exit_flag == 0)
 	exit_flag = -1;
 }
 #endif
 
-static krb5_boolean
-realloc_descrs(struct descr **d, unsigned int *ndescr)
-{
-    struct descr *tmp;
-    size_t i;
-
-    tmp = realloc(*d, (*ndescr + 4) * sizeof(**d));
-    if(tmp == NULL)
-        return FALSE;
-
-    *d = tmp;
-    reinit_descrs (*d, *ndescr);
-    memset(*d + *ndescr, 0, 4 * sizeof(**d));
-    for(i = *ndescr; i < *ndescr + 4; i++)
-        init_descr (*d + i);
+/*
+ * Dispatch activity on the socket in `d[idx]'.  `s' is the socket the
+ * event was registered for; if the descriptor has since been closed
+ * or reused for another connection the event is ignored.
+ */
 
-    *ndescr += 4;
+static void
+handle_descr(krb5_context context, krb5_kdc_configuration *config,
+	     struct kdc_events *ev, unsigned int idx, krb5_socket_t s)
+{
+    struct descr *d = *ev->dp;
 
-    return TRUE;
+    if (idx >= *ev->ndescrp || rk_IS_BAD_SOCKET(d[idx].s) || d[idx].s != s)
+	return;
+    if (d[idx].type == SOCK_DGRAM) {
+#ifdef KDC_USE_MMSG
+	if (ev->udp)
+	    handle_udp_batch(context, config, ev->udp, &d[idx]);
+	else
+#endif
+	handle_udp(context, config, &d[idx]);
+    } else if (d[idx].type == SOCK_STREAM)
+	handle_tcp(context, config, ev, idx);
 }
 
-static int
-next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
+/*
+ * Close the log facility, writing out anything AFILE destinations still
+ * have buffered.  It is also the context's warn destination, so unset
+ * that to keep krb5_free_context() from closing it a second time.
+ */
+static void
+close_kdc_log(krb5_context context, krb5_kdc_configuration *config)
 {
-    size_t i;
-    int min_free;
-
-    for(i = 0; i < *ndescr; i++) {
-        int s = (*d + i)->s;
-        if(rk_IS_BAD_SOCKET(s))
-            return i;
-    }
-
-    min_free = *ndescr;
-    if(!realloc_descrs(d, ndescr)) {
-        min_free = -1;
-        krb5_warnx(context, "No memory");
-    }
-
-    return min_free;
+    if (krb5_get_warn_dest(context) == config->logf)
+	krb5_set_warn_dest(context, NULL);
+    krb5_closelog(context, config->logf);
+    config->logf = NULL;
 }
 
 static void
 loop(krb5_context context, krb5_kdc_configuration *config,
      struct descr **dp, unsigned int *ndescrp, int islive)
 {
-    struct descr *d = *dp;
-    unsigned int ndescr = *ndescrp;
+    struct kdc_events ev;
+#ifdef KDC_USE_EPOLL
+    struct epoll_event events[KDC_MAX_EVENTS];
+#endif
+
+    events_init(context, &ev, dp, ndescrp, islive);
+    ev.udp = udp_batch_alloc(context, config);
 
     while (exit_flag == 0) {
+	int timeout_sec;
+#ifdef KDC_USE_EPOLL
+	int i, n;
+#else
 	struct timeval tmout;
-	fd_set fds;
-	int min_free = -1;
+	struct descr *d;
+	fd_set fds, wfds;
 	int max_fd = 0;
 	size_t i;
+#endif
+
+	tcp_wheel_expire(context, config, &ev, time(NULL));
+	timeout_sec = ev.wheel_count ? 1 : TCP_TIMEOUT;
+
+#ifdef KDC_USE_EPOLL
+	n = epoll_wait(ev.epfd, events, KDC_MAX_EVENTS, timeout_sec * 1000);
+	if (n == -1) {
+	    if (errno != EINTR)
+		krb5_warn(context, errno, "epoll_wait");
+	    continue;
+	}
+	for (i = 0; i < n; i++) {
+	    unsigned int idx = (unsigned int)(events[i].data.u64 & 0xffffffffU);
 
+	    if (idx == ISLIVE_IDX) {
+#ifdef HAVE_FORK
+		handle_islive(islive);
+#endif
+		continue;
+	    }
+	    handle_descr(context, config, &ev, idx,
+			 (krb5_socket_t)(events[i].data.u64 >> 32));
+	}
+#else
+	d = *dp;
 	FD_ZERO(&fds);
+	FD_ZERO(&wfds);
         if (islive > -1) {
             FD_SET(islive, &fds);
             max_fd = islive;
         }
-	for (i = 0; i < ndescr; i++) {
+	for (i = 0; i < *ndescrp; i++) {
 	    if (!rk_IS_BAD_SOCKET(d[i].s)) {
-		if (d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 2,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
-		    continue;
-		}
 #ifndef NO_LIMIT_FD_SETSIZE
 		if (max_fd < d[i].s)
 		    max_fd = d[i].s;
@@ -967,13 +1826,16 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 		    krb5_errx(context, 1, "fd too large");
 #endif
 #endif
-		FD_SET(d[i].s, &fds);
+		if (d[i].out_len)
+		    FD_SET(d[i].s, &wfds);
+		else
+		    FD_SET(d[i].s, &fds);
 	    }
 	}
 
-	tmout.tv_sec = TCP_TIMEOUT;
+	tmout.tv_sec = timeout_sec;
 	tmout.tv_usec = 0;
-	switch(select(max_fd + 1, &fds, 0, 0, &tmout)){
+	switch(select(max_fd + 1, &fds, &wfds, 0, &tmout)){
 	case 0:
 	    break;
 	case -1:
@@ -985,20 +1847,23 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 	    if (islive > -1 && FD_ISSET(islive, &fds))
 		handle_islive(islive);
 #endif
-	    for (i = 0; i < ndescr; i++)
-		if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-		    min_free = next_min_free(context, dp, ndescrp);
-                    ndescr = *ndescrp;
-                    d = *dp;
-
-		    if (d[i].type == SOCK_DGRAM)
-			handle_udp(context, config, &d[i]);
-		    else if (d[i].type == SOCK_STREAM)
-			handle_tcp(context, config, d, i, min_free);
-		}
+	    /* Sockets accepted below are not in `fds' */
+	    for (i = 0; i < *ndescrp; i++) {
+		d = *dp;
+		if (!rk_IS_BAD_SOCKET(d[i].s) &&
+		    (FD_ISSET(d[i].s, &fds) || FD_ISSET(d[i].s, &wfds)))
+		    handle_descr(context, config, &ev, i, d[i].s);
+	    }
 	}
+#endif
     }
 
+#ifdef KDC_USE_MMSG
+    if (ev.udp && ev.udp->calls)
+	udp_batch_log_stats(context, config, ev.udp);
+#endif
+    events_free(&ev);
+
     switch (exit_flag) {
     case -1:
 	kdc_log(context, config, 0,
@@ -1138,6 +2003,131 @@ select_sleep(int microseconds)
 }
 #endif
 
+#ifdef KDC_USE_THREADS
+/*
+ * A KDC worker thread.  Each thread has its own krb5_context, its own
+ * HDB handles and its own set of SO_REUSEPORT sockets, so the kernel
+ * shards incoming requests over the threads and they never contend
+ * for a socket or share per-request state.
+ */
+
+struct kdc_thread {
+    pthread_t id;
+    krb5_context context;
+    krb5_kdc_configuration config;
+    struct descr *d;
+    unsigned int ndescr;
+    int islive;
+};
+
+static void *
+kdc_thread(void *arg)
+{
+    struct kdc_thread *t = arg;
+
+    loop(t->context, &t->config, &t->d, &t->ndescr, t->islive);
+    return NULL;
+}
+
+static void
+start_kdc_threads(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_thread *threads;
+    krb5_error_code ret;
+    int nthreads = config->num_kdc_threads;
+    int islive[2];
+    unsigned int j;
+    int i;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL)
+	krb5_err(context, 1, errno, "malloc");
+
+    /*
+     * The threads watch the read end of this pipe and notice an EOF
+     * when we close the write end on the way out.
+     */
+
+    if (pipe(islive) == -1)
+	krb5_err(context, 1, errno, "pipe");
+    rk_cloexec(islive[0]);
+    rk_cloexec(islive[1]);
+
+    for (i = 0; i < nthreads; i++) {
+	struct kdc_thread *t = &threads[i];
+	int ndescr;
+
+	ret = kdc_worker_context(&t->context);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_init_context");
+
+	/*
+	 * The rest of the configuration is shared: it is read-only once
+	 * the KDC is running, apart from the log facility, whose file
+	 * destinations lock their streams.  pkinit.c loads a PKINIT
+	 * identity per worker, keyed on its context.
+	 */
+	t->config = *config;
+	t->config.db = NULL;
+	t->config.num_db = 0;
+	t->config.entry_cache = NULL;
+	t->config.req_arena = NULL;
+	ret = krb5_kdc_set_dbinfo(t->context, &t->config);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
+
+	ndescr = init_sockets(t->context, &t->config, &t->d, TRUE);
+	if (ndescr <= 0)
+	    krb5_errx(context, 1, "No sockets!");
+	t->ndescr = ndescr;
+	t->islive = islive[0];
+    }
+
+    kdc_log(context, config, 3, "KDC started pid=%d with %d worker threads",
+	    getpid(), nthreads);
+
+    roken_detach_finish(NULL, daemon_child);
+
+    for (i = 0; i < nthreads; i++) {
+	ret = pthread_create(&threads[i].id, NULL, kdc_thread, &threads[i]);
+	if (ret)
+	    krb5_err(context, 1, ret, "pthread_create");
+    }
+
+    /* Signals may be delivered to any thread, so poll for them */
+    while (exit_flag == 0)
+	select_sleep(500000);
+
+    close(islive[1]);
+
+    for (i = 0; i < nthreads; i++) {
+	struct kdc_thread *t = &threads[i];
+
+	pthread_join(t->id, NULL);
+	for (j = 0; j < t->ndescr; j++)
+	    clear_descr(&t->d[j]);
+	free(t->d);
+	krb5_kdc_free_entry_cache(t->context, &t->config);
+	asn1_arena_destroy(t->config.req_arena);
+	for (j = 0; j < (unsigned int)t->config.num_db; j++) {
+	    HDB *db = t->config.db[j];
+
+	    if (db->hdb_openp)
+		(void) db->hdb_close(t->context, db);
+	    (void) db->hdb_destroy(t->context, db);
+	}
+	free(t->config.db);
+	krb5_free_context(t->context);
+    }
+    close(islive[0]);
+    free(threads);
+
+    kdc_log(context, config, 3, "KDC exiting");
+    /* The threads share the log facility, close it once they are all gone */
+    close_kdc_log(context, config);
+}
+#endif
+
 void
 start_kdc(krb5_context context,
 	  krb5_kdc_configuration *config, const char *argv0)
@@ -1160,6 +2150,13 @@ start_kdc(krb5_context context,
         bonjour_kid(context, config, argv0, NULL);
 #endif
 
+#ifdef KDC_USE_THREADS
+    if (config->num_kdc_threads > 0) {
+	start_kdc_threads(context, config);
+	return;
+    }
+#endif
+
 #ifdef HAVE_FORK
 #ifdef _SC_NPROCESSORS_ONLN
     if (max_kdcs < 1)
@@ -1184,7 +2181,7 @@ start_kdc(krb5_context context,
     socket_set_nonblocking(islive[1], 1);
 #endif
 
-    ndescr = init_sockets(context, config, &d);
+    ndescr = init_sockets(context, config, &d, FALSE);
     if(ndescr <= 0)
 	krb5_errx(context, 1, "No sockets!");
 
@@ -1220,6 +2217,7 @@ start_kdc(krb5_context context,
             case 0:
                 close(islive[0]);
                 loop(context, config, &d, &ndescr, islive[1]);
+                close_kdc_log(context, config);
                 exit(0);
             case -1:
                 /* XXXrcd: hmmm, do something useful?? */
@@ -1308,5 +2306,6 @@ start_kdc(krb5_context context,
     kdc_log(context, config, 3, "KDC exiting");
 #endif
 
+    close_kdc_log(context, config);
     free(d);
 }
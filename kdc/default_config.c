@@ -85,6 +85,8 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 
     c->app = "kdc";
     c->num_kdc_processes = -1;
+    c->num_kdc_threads = 0;
+    c->udp_batch_size = 16;
     c->require_preauth = TRUE;
     c->kdc_warn_pwexpire = 0;
     c->encode_as_rep_as_tgs_rep = FALSE;
@@ -103,11 +105,32 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->pkinit_require_binding = TRUE;
     c->db = NULL;
     c->num_db = 0;
+    c->entry_cache = NULL;
+    c->req_arena = NULL;
     c->logf = NULL;
 
     c->num_kdc_processes =
         krb5_config_get_int_default(context, NULL, c->num_kdc_processes,
 				    "kdc", "num-kdc-processes", NULL);
+    c->num_kdc_threads =
+        krb5_config_get_int_default(context, NULL, c->num_kdc_threads,
+				    "kdc", "num-kdc-threads", NULL);
+    c->udp_batch_size =
+        krb5_config_get_int_default(context, NULL, c->udp_batch_size,
+				    "kdc", "udp-batch-size", NULL);
+
+    {
+	int n = krb5_config_get_int_default(context, NULL, 1024,
+					    "kdc", "entry-cache-size", NULL);
+
+	c->entry_cache_size = n > 0 ? n : 0;
+    }
+    c->entry_cache_lifetime =
+        krb5_config_get_time_default(context, NULL, 300,
+				     "kdc", "entry-cache-lifetime", NULL);
+    c->entry_cache_check_interval =
+        krb5_config_get_time_default(context, NULL, 1,
+				     "kdc", "entry-cache-check-interval", NULL);
 
     c->require_preauth =
 	krb5_config_get_bool_default(context, NULL,
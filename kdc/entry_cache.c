@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A bounded cache of decoded and decrypted HDB entries in front of
+ * _kdc_db_fetch().
+ *
+ * Entries are keyed by principal name (including name type), fetch flags
+ * and kvno, and are handed out as copies so that callers own what they get
+ * exactly as if it had come from the backend.  The whole cache is flushed
+ * whenever any of the database files changes (see db_stamp()); databases
+ * whose files we can't find (e.g., LDAP) disable caching entirely.  The
+ * files are stat()ed at most once every `entry-cache-check-interval'
+ * seconds.  Entries expire after `entry-cache-lifetime' seconds, except
+ * the krbtgt, which only goes away when the database changes or when it
+ * is evicted.
+ *
+ * The cache hangs off the krb5_kdc_configuration, so each KDC worker thread
+ * has its own and no locking is needed.
+ */
+
+#include "kdc_locl.h"
+#include <heimqueue.h>
+
+struct entry_cache_ent {
+    HEIM_TAILQ_ENTRY(entry_cache_ent) lru;
+    struct entry_cache_ent *chain;
+    uint32_t hash;
+    krb5_principal principal;
+    unsigned flags;
+    krb5uint32 kvno;
+    int db;
+    time_t expires;             /* 0 -> until the DB changes */
+    hdb_entry_ex ent;
+};
+
+struct kdc_entry_cache {
+    struct entry_cache_ent **buckets;
+    size_t nbuckets;            /* power of 2 */
+    size_t count;
+    HEIM_TAILQ_HEAD(entry_cache_lru, entry_cache_ent) lru;
+    uint64_t stamp;
+    time_t checked;             /* when stamp was last computed */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define ENTRY_CACHE_LOG_INTERVAL 4096
+
+static void
+stamp_add(uint64_t *stamp, uint64_t v)
+{
+    /* FNV-1a over 64-bit words; good enough to notice any change */
+    *stamp ^= v;
+    *stamp *= 0x100000001b3ULL;
+}
+
+/*
+ * Compute a stamp covering the files that may hold each database: the name
+ * itself, and with the suffixes used by the db1/db3/ndbm (.db), LMDB (.mdb)
+ * and SQLite WAL (-wal) backends.  Returns 0 if any database has no such
+ * file, in which case we can't tell when it changes and must not cache.
+ */
+static uint64_t
+db_stamp(krb5_context context, krb5_kdc_configuration *config)
+{
+    static const char *suffixes[] = { "", ".db", ".mdb", "-wal" };
+    uint64_t stamp = 0xcbf29ce484222325ULL;
+    char path[MAXPATHLEN];
+    struct stat st;
+    size_t k;
+    int i, found;
+
+    for (i = 0; i < config->num_db; i++) {
+        const char *name = config->db[i]->hdb_name;
+
+        if (name == NULL)
+            return 0;
+        for (found = 0, k = 0; k < sizeof(suffixes)/sizeof(suffixes[0]); k++) {
+            if (snprintf(path, sizeof(path), "%s%s", name,
+                         suffixes[k]) >= (int)sizeof(path))
+                return 0;
+            if (stat(path, &st) == -1)
+                continue;
+            found = 1;
+            stamp_add(&stamp, k);
+            stamp_add(&stamp, st.st_dev);
+            stamp_add(&stamp, st.st_ino);
+            stamp_add(&stamp, st.st_size);
+            stamp_add(&stamp, st.st_mtime);
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+            stamp_add(&stamp, st.st_mtim.tv_nsec);
+#endif
+        }
+        if (!found)
+            return 0;
+    }
+    return stamp ? stamp : 1;
+}
+
+static uint32_t
+principal_hash(krb5_const_principal p, unsigned flags, krb5uint32 kvno)
+{
+    uint32_t h = 2166136261U;
+    const unsigned char *s;
+    unsigned int i;
+
+#define HASH_BYTE(c) do { h ^= (unsigned char)(c); h *= 16777619U; } while (0)
+    for (s = (const unsigned char *)p->realm; s && *s; s++)
+        HASH_BYTE(*s);
+    for (i = 0; i < p->name.name_string.len; i++) {
+        HASH_BYTE('/');
+        for (s = (const unsigned char *)p->name.name_string.val[i]; *s; s++)
+            HASH_BYTE(*s);
+    }
+    HASH_BYTE(p->name.name_type);
+    HASH_BYTE(flags);
+    HASH_BYTE(flags >> 8);
+    HASH_BYTE(flags >> 16);
+    HASH_BYTE(kvno);
+    HASH_BYTE(kvno >> 8);
+#undef HASH_BYTE
+    return h;
+}
+
+static void
+remove_ent(krb5_context context,
+           struct kdc_entry_cache *cache,
+           struct entry_cache_ent *e)
+{
+    struct entry_cache_ent **pp;
+
+    for (pp = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+         *pp != e;
+         pp = &(*pp)->chain)
+        ;
+    *pp = e->chain;
+    HEIM_TAILQ_REMOVE(&cache->lru, e, lru);
+    cache->count--;
+
+    hdb_free_entry(context, &e->ent);
+    krb5_free_principal(context, e->principal);
+    free(e);
+}
+
+static void
+flush(krb5_context context, struct kdc_entry_cache *cache)
+{
+    struct entry_cache_ent *e;
+
+    while ((e = HEIM_TAILQ_FIRST(&cache->lru)) != NULL)
+        remove_ent(context, cache, e);
+}
+
+static struct kdc_entry_cache *
+get_cache(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *cache = config->entry_cache;
+    size_t n;
+
+    if (cache != NULL || config->entry_cache_size == 0)
+        return cache;
+
+    if ((cache = calloc(1, sizeof(*cache))) == NULL)
+        return NULL;
+    for (n = 16; n < config->entry_cache_size && n < (1U << 20); n <<= 1)
+        ;
+    if ((cache->buckets = calloc(n, sizeof(cache->buckets[0]))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->nbuckets = n;
+    HEIM_TAILQ_INIT(&cache->lru);
+    return config->entry_cache = cache;
+}
+
+/*
+ * Look up a cached entry.  Returns 0 and outputs a copy of the entry on a
+ * hit, HDB_ERR_NOENTRY on a miss (or if the cache is disabled).
+ */
+krb5_error_code
+_kdc_entry_cache_get(krb5_context context,
+                     krb5_kdc_configuration *config,
+                     krb5_const_principal principal,
+                     unsigned flags,
+                     krb5uint32 kvno,
+                     HDB **db,
+                     hdb_entry_ex **h)
+{
+    struct kdc_entry_cache *cache;
+    struct entry_cache_ent *e;
+    hdb_entry_ex *ent;
+    uint64_t stamp;
+    uint32_t hash;
+
+    if ((cache = get_cache(context, config)) == NULL)
+        return HDB_ERR_NOENTRY;
+
+    if (cache->checked == 0 ||
+        kdc_time - cache->checked >= config->entry_cache_check_interval) {
+        if ((stamp = db_stamp(context, config)) != cache->stamp) {
+            if (cache->count)
+                kdc_log(context, config, 5,
+                        "HDB changed; flushing %lu cached entries",
+                        (unsigned long)cache->count);
+            flush(context, cache);
+            cache->stamp = stamp;
+        }
+        cache->checked = kdc_time;
+    }
+    if (cache->stamp == 0)
+        return HDB_ERR_NOENTRY;
+
+    if (((cache->hits + cache->misses + 1) % ENTRY_CACHE_LOG_INTERVAL) == 0)
+        kdc_log(context, config, 4,
+                "entry cache: %llu hits, %llu misses, %lu entries",
+                (unsigned long long)cache->hits,
+                (unsigned long long)cache->misses,
+                (unsigned long)cache->count);
+
+    hash = principal_hash(principal, flags, kvno);
+    for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->chain) {
+        if (e->hash == hash && e->flags == flags && e->kvno == kvno &&
+            e->principal->name.name_type == principal->name.name_type &&
+            krb5_principal_compare(context, e->principal, principal))
+            break;
+    }
+    if (e != NULL && e->expires != 0 && e->expires <= kdc_time) {
+        remove_ent(context, cache, e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        cache->misses++;
+        return HDB_ERR_NOENTRY;
+    }
+
+    if ((ent = calloc(1, sizeof(*ent))) == NULL)
+        return krb5_enomem(context);
+    if (copy_hdb_entry(&e->ent.entry, &ent->entry)) {
+        free(ent);
+        return krb5_enomem(context);
+    }
+    HEIM_TAILQ_REMOVE(&cache->lru, e, lru);
+    HEIM_TAILQ_INSERT_HEAD(&cache->lru, e, lru);
+    cache->hits++;
+
+    if (db)
+        *db = config->db[e->db];
+    *h = ent;
+    return 0;
+}
+
+/*
+ * Add an entry fetched from config->db[dbidx] to the cache.  Entries whose
+ * contents depend on the time of the fetch, or that carry backend state,
+ * are not cached.
+ */
+void
+_kdc_entry_cache_put(krb5_context context,
+                     krb5_kdc_configuration *config,
+                     krb5_const_principal principal,
+                     unsigned flags,
+                     krb5uint32 kvno,
+                     int dbidx,
+                     const hdb_entry_ex *ent)
+{
+    struct kdc_entry_cache *cache = config->entry_cache;
+    struct entry_cache_ent *e, **bucket;
+
+    if (cache == NULL || cache->stamp == 0)
+        return;
+    if (ent->ctx != NULL || ent->free_entry != NULL ||
+        ent->entry.flags.virtual || ent->entry.flags.virtual_keys)
+        return;
+    if ((flags & HDB_F_DELAY_NEW_KEYS) &&
+        config->db[dbidx]->new_service_key_delay > 0)
+        return;
+
+    while (cache->count >= config->entry_cache_size &&
+           (e = HEIM_TAILQ_LAST(&cache->lru, entry_cache_lru)) != NULL)
+        remove_ent(context, cache, e);
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    if (krb5_copy_principal(context, principal, &e->principal)) {
+        free(e);
+        return;
+    }
+    if (copy_hdb_entry(&ent->entry, &e->ent.entry)) {
+        krb5_free_principal(context, e->principal);
+        free(e);
+        return;
+    }
+    e->hash = principal_hash(principal, flags, kvno);
+    e->flags = flags;
+    e->kvno = kvno;
+    e->db = dbidx;
+    if (!krb5_principal_is_krbtgt(context, principal))
+        e->expires = kdc_time + config->entry_cache_lifetime;
+
+    bucket = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    HEIM_TAILQ_INSERT_HEAD(&cache->lru, e, lru);
+    cache->count++;
+}
+
+/**
+ * Return the number of hits and misses of the KDC's HDB entry cache, and
+ * the number of entries currently in it.
+ *
+ * @param config KDC configuration
+ * @param hits number of lookups satisfied from the cache
+ * @param misses number of lookups that went to the HDB
+ * @param entries number of entries in the cache
+ */
+void
+krb5_kdc_entry_cache_stats(krb5_kdc_configuration *config,
+                           uint64_t *hits,
+                           uint64_t *misses,
+                           size_t *entries)
+{
+    struct kdc_entry_cache *cache = config->entry_cache;
+
+    *hits = cache ? cache->hits : 0;
+    *misses = cache ? cache->misses : 0;
+    *entries = cache ? cache->count : 0;
+}
+
+/**
+ * Free the KDC's HDB entry cache.  It will be recreated as needed.
+ *
+ * @param context Kerberos 5 context
+ * @param config KDC configuration
+ */
+void
+krb5_kdc_free_entry_cache(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *cache = config->entry_cache;
+
+    if (cache == NULL)
+        return;
+    flush(context, cache);
+    free(cache->buckets);
+    free(cache);
+    config->entry_cache = NULL;
+}
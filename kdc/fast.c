@@ -455,7 +455,7 @@ _kdc_fast_unwrap_request(astgs_request_t r)
 			      &ap_req,
 			      armor_server,
 			      &armor_key->key,
-			      0,
+			      KRB5_VERIFY_AP_REQ_CACHED_KEY,
 			      &ap_req_options,
 			      &ticket, 
 			      KRB5_KU_AP_REQ_AUTH);
@@ -525,7 +525,16 @@ _kdc_fast_unwrap_request(astgs_request_t r)
     }		
     krb5_data_free(&data);
 
-    free_KDC_REQ_BODY(&r->req.req_body);
+    /*
+     * An arena-decoded request is freed with the arena; the parts
+     * replaced here are heap copies and are freed separately (see
+     * free_kdc_req() in process.c).
+     */
+    if (r->req_in_arena)
+	memset(&r->req.req_body, 0, sizeof(r->req.req_body));
+    else
+	free_KDC_REQ_BODY(&r->req.req_body);
+    r->fast_req_body = 1;
     ret = copy_KDC_REQ_BODY(&fastreq.req_body, &r->req.req_body);
     if (ret)
 	goto out;
@@ -539,10 +548,15 @@ _kdc_fast_unwrap_request(astgs_request_t r)
     }
 
     /* KDC MUST ignore outer pa data preauth-14 - 6.5.5 */
-    if (r->req.padata)
+    if (r->req.padata && !r->req_in_arena)
 	free_METHOD_DATA(r->req.padata);
     else
 	ALLOC(r->req.padata);
+    if (r->req.padata == NULL) {
+	ret = krb5_enomem(r->context);
+	goto out;
+    }
+    r->fast_padata = 1;
 
     ret = copy_METHOD_DATA(&fastreq.padata, r->req.padata);
     if (ret)
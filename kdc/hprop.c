@@ -35,6 +35,11 @@
 
 #include "hprop.h"
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define HPROP_USE_THREADS 1
+#endif
+
 static int version_flag;
 static int help_flag;
 static const char *ktname = HPROP_KEYTAB;
@@ -44,6 +49,8 @@ static int to_stdout;
 static int verbose_flag;
 static int encrypt_flag;
 static int decrypt_flag;
+static int batch_size;
+static int nthreads = 1;
 static hdb_master_key mkey5;
 
 static char *source_type;
@@ -86,33 +93,309 @@ open_socket(krb5_context context, const char *hostname, const char *port)
     return -1;
 }
 
-krb5_error_code
-v5_prop(krb5_context context, HDB *db, hdb_entry_ex *entry, void *appdata)
+static krb5_error_code
+encode_entry(krb5_context context, hdb_master_key mkey, hdb_entry *entry,
+	     krb5_data *data)
 {
     krb5_error_code ret;
-    struct prop_data *pd = appdata;
-    krb5_data data;
 
     if(encrypt_flag) {
-	ret = hdb_seal_keys_mkey(context, &entry->entry, mkey5);
+	ret = hdb_seal_keys_mkey(context, entry, mkey);
 	if (ret) {
 	    krb5_warn(context, ret, "hdb_seal_keys_mkey");
 	    return ret;
 	}
     }
     if(decrypt_flag) {
-	ret = hdb_unseal_keys_mkey(context, &entry->entry, mkey5);
+	ret = hdb_unseal_keys_mkey(context, entry, mkey);
 	if (ret) {
 	    krb5_warn(context, ret, "hdb_unseal_keys_mkey");
 	    return ret;
 	}
     }
 
-    ret = hdb_entry2value(context, &entry->entry, &data);
-    if(ret) {
+    ret = hdb_entry2value(context, entry, data);
+    if(ret)
 	krb5_warn(context, ret, "hdb_entry2value");
+    return ret;
+}
+
+/*
+ * Batched propagation (hprop-0.1): entries are collected into batches of
+ * `batch_size', and each batch is sent as one priv message.  With more
+ * than one thread the batches are handed to threads that seal/unseal and
+ * encode them in parallel; only the writing of the priv messages, which
+ * must happen in sequence number order, is serialized.
+ */
+
+struct prop_batch {
+    struct prop_batch *next;
+    size_t len;
+    hdb_entry *entries;
+};
+
+#ifdef HPROP_USE_THREADS
+struct prop_worker {
+    pthread_t tid;
+    krb5_context context;
+    struct prop_data *pd;
+    hdb_master_key mkey;
+};
+
+struct prop_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t send_lock;
+    struct prop_batch *head, **tail;
+    size_t count;
+    size_t max;
+    int done;
+    krb5_error_code error;
+    int nworkers;
+    struct prop_worker *workers;
+};
+#endif
+
+static struct prop_batch *
+alloc_batch(size_t size)
+{
+    struct prop_batch *b;
+
+    if ((b = calloc(1, sizeof(*b))) == NULL)
+	return NULL;
+    if ((b->entries = calloc(size, sizeof(b->entries[0]))) == NULL) {
+	free(b);
+	return NULL;
+    }
+    return b;
+}
+
+static void
+free_batch(struct prop_batch *b)
+{
+    size_t i;
+
+    if (b == NULL)
+	return;
+    for (i = 0; i < b->len; i++)
+	free_hdb_entry(&b->entries[i]);
+    free(b->entries);
+    free(b);
+}
+
+static krb5_error_code
+send_batch(krb5_context context, struct prop_data *pd, hdb_master_key mkey,
+	   struct prop_batch *b)
+{
+    krb5_error_code ret = 0;
+    krb5_storage *sp;
+    krb5_data data;
+    size_t i;
+
+    if ((sp = krb5_storage_emem()) == NULL)
+	return krb5_enomem(context);
+    for (i = 0; ret == 0 && i < b->len; i++) {
+	ret = encode_entry(context, mkey, &b->entries[i], &data);
+	if (ret == 0) {
+	    ret = krb5_store_data(sp, data);
+	    krb5_data_free(&data);
+	}
+    }
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, &data);
+    krb5_storage_free(sp);
+    if (ret)
 	return ret;
+
+    /*
+     * The auth context belongs to pd->context; writes are serialized by
+     * send_lock, so workers may use it even though they encode with
+     * their own contexts.
+     */
+#ifdef HPROP_USE_THREADS
+    if (pd->queue)
+	pthread_mutex_lock(&pd->queue->send_lock);
+#endif
+    ret = krb5_write_priv_message(pd->context, pd->auth_context, &pd->sock,
+				  &data);
+#ifdef HPROP_USE_THREADS
+    if (pd->queue)
+	pthread_mutex_unlock(&pd->queue->send_lock);
+#endif
+    krb5_data_free(&data);
+    return ret;
+}
+
+#ifdef HPROP_USE_THREADS
+static void *
+prop_worker_thread(void *ptr)
+{
+    struct prop_worker *w = ptr;
+    struct prop_queue *q = w->pd->queue;
+    krb5_context context = w->context;
+    krb5_error_code ret;
+    struct prop_batch *b;
+
+    for (;;) {
+	pthread_mutex_lock(&q->lock);
+	while (q->head == NULL && !q->done)
+	    pthread_cond_wait(&q->cond, &q->lock);
+	if ((b = q->head) == NULL) {
+	    pthread_mutex_unlock(&q->lock);
+	    break;
+	}
+	if ((q->head = b->next) == NULL)
+	    q->tail = &q->head;
+	q->count--;
+	ret = q->error;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	/* After an error just drain the queue */
+	if (ret == 0)
+	    ret = send_batch(context, w->pd, w->mkey, b);
+	free_batch(b);
+	if (ret) {
+	    pthread_mutex_lock(&q->lock);
+	    if (q->error == 0)
+		q->error = ret;
+	    pthread_cond_broadcast(&q->cond);
+	    pthread_mutex_unlock(&q->lock);
+	}
     }
+    return NULL;
+}
+
+static krb5_error_code
+start_workers(krb5_context context, struct prop_data *pd, int nworkers)
+{
+    struct prop_queue *q;
+    int i;
+
+    if ((q = calloc(1, sizeof(*q))) == NULL ||
+	(q->workers = calloc(nworkers, sizeof(q->workers[0]))) == NULL) {
+	free(q);
+	return krb5_enomem(context);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_mutex_init(&q->send_lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->tail = &q->head;
+    q->max = 2 * nworkers;
+    pd->queue = q;
+
+    for (i = 0; i < nworkers; i++) {
+	struct prop_worker *w = &q->workers[i];
+	krb5_error_code ret = 0;
+
+	w->pd = pd;
+	/* Neither krb5 contexts nor master key crypto is safe to share */
+	ret = krb5_copy_context(context, &w->context);
+	if (ret == 0 && (encrypt_flag || decrypt_flag))
+	    ret = hdb_read_master_key(w->context, mkeyfile, &w->mkey);
+	if (ret == 0)
+	    ret = pthread_create(&w->tid, NULL, prop_worker_thread, w);
+	if (ret) {
+	    if (w->mkey)
+		hdb_free_master_key(w->context, w->mkey);
+	    if (w->context)
+		krb5_free_context(w->context);
+	    krb5_warn(context, ret, "could not start encoding thread");
+	    break;
+	}
+	q->nworkers++;
+    }
+    return 0;
+}
+
+static krb5_error_code
+stop_workers(krb5_context context, struct prop_data *pd)
+{
+    struct prop_queue *q = pd->queue;
+    krb5_error_code ret;
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    for (i = 0; i < q->nworkers; i++) {
+	pthread_join(q->workers[i].tid, NULL);
+	if (q->workers[i].mkey)
+	    hdb_free_master_key(q->workers[i].context, q->workers[i].mkey);
+	krb5_free_context(q->workers[i].context);
+    }
+    ret = q->error;
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->send_lock);
+    pthread_mutex_destroy(&q->lock);
+    free(q->workers);
+    free(q);
+    pd->queue = NULL;
+    return ret;
+}
+#endif
+
+/* Send or hand off the batch being filled */
+static krb5_error_code
+flush_batch(krb5_context context, struct prop_data *pd)
+{
+    struct prop_batch *b = pd->batch;
+    krb5_error_code ret;
+
+    if (b == NULL || b->len == 0)
+	return 0;
+    pd->batch = NULL;
+
+#ifdef HPROP_USE_THREADS
+    if (pd->queue && pd->queue->nworkers > 0) {
+	struct prop_queue *q = pd->queue;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count >= q->max && q->error == 0)
+	    pthread_cond_wait(&q->cond, &q->lock);
+	if ((ret = q->error) == 0) {
+	    b->next = NULL;
+	    *q->tail = b;
+	    q->tail = &b->next;
+	    q->count++;
+	    b = NULL;
+	    pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	free_batch(b);
+	return ret;
+    }
+#endif
+
+    ret = send_batch(context, pd, mkey5, b);
+    free_batch(b);
+    return ret;
+}
+
+krb5_error_code
+v5_prop(krb5_context context, HDB *db, hdb_entry_ex *entry, void *appdata)
+{
+    krb5_error_code ret;
+    struct prop_data *pd = appdata;
+    krb5_data data;
+
+    if (pd->batch_size > 0) {
+	if (pd->batch == NULL &&
+	    (pd->batch = alloc_batch(pd->batch_size)) == NULL)
+	    return krb5_enomem(context);
+	ret = copy_hdb_entry(&entry->entry,
+			     &pd->batch->entries[pd->batch->len]);
+	if (ret)
+	    return ret;
+	if (++pd->batch->len == pd->batch_size)
+	    return flush_batch(context, pd);
+	return 0;
+    }
+
+    ret = encode_entry(context, mkey5, &entry->entry, &data);
+    if (ret)
+	return ret;
 
     if(to_stdout)
 	ret = krb5_write_message(context, &pd->sock, &data);
@@ -137,6 +420,10 @@ struct getargs args[] = {
     { "decrypt",  'D',  arg_flag,   &decrypt_flag,   "decrypt keys", NULL },
     { "encrypt",  'E',  arg_flag,   &encrypt_flag,   "encrypt keys", NULL },
     { "stdout",	  'n',  arg_flag,   &to_stdout, "dump to stdout", NULL },
+    { "batch-size", 0,	arg_integer, &batch_size,
+      "entries per message (needs a batch-capable hpropd)", "number" },
+    { "threads",  0,	arg_integer, &nthreads,
+      "threads for encoding batches", "number" },
     { "verbose",  'v',	arg_flag, &verbose_flag, NULL, NULL },
     { "version",   0,	arg_flag, &version_flag, NULL, NULL },
     { "help",     'h',	arg_flag, &help_flag, NULL, NULL }
@@ -244,6 +531,10 @@ iterate (krb5_context context,
     default:
 	krb5_errx(context, 1, "unknown prop type: %d", type);
     }
+    if (ret == 0)
+	ret = flush_batch(context, pd);
+    free_batch(pd->batch);
+    pd->batch = NULL;
     return ret;
 }
 
@@ -255,6 +546,7 @@ dump_database (krb5_context context, int type,
     struct prop_data pd;
     krb5_data data;
 
+    memset(&pd, 0, sizeof(pd));
     pd.context      = context;
     pd.auth_context = NULL;
     pd.sock         = STDOUT_FILENO;
@@ -325,7 +617,7 @@ propagate_database (krb5_context context, int type,
 	ret = krb5_sendauth(context,
 			    &auth_context,
 			    &fd,
-			    HPROP_VERSION,
+			    batch_size > 0 ? HPROP_VERSION_BATCH : HPROP_VERSION,
 			    NULL,
 			    server,
 			    AP_OPTS_MUTUAL_REQUIRED | AP_OPTS_USE_SUBKEY,
@@ -344,11 +636,30 @@ propagate_database (krb5_context context, int type,
 	    goto next_host;
 	}
 
+	memset(&pd, 0, sizeof(pd));
 	pd.context      = context;
 	pd.auth_context = auth_context;
 	pd.sock         = fd;
-
+	pd.batch_size   = batch_size;
+
+#ifdef HPROP_USE_THREADS
+	if (batch_size > 0 && nthreads > 1) {
+	    ret = start_workers(context, &pd, nthreads);
+	    if (ret) {
+		failed++;
+		goto next_host;
+	    }
+	}
+#endif
 	ret = iterate (context, database_name, db, type, &pd);
+#ifdef HPROP_USE_THREADS
+	if (pd.queue) {
+	    krb5_error_code ret2 = stop_workers(context, &pd);
+
+	    if (ret == 0)
+		ret = ret2;
+	}
+#endif
 	if (ret) {
 	    krb5_warnx(context, "iterate to host %s failed", host);
 	    failed++;
@@ -420,6 +731,15 @@ main(int argc, char **argv)
 	krb5_errx(context, 1,
 		  "only one of `--encrypt' and `--decrypt' is meaningful");
 
+    if (batch_size < 0 || nthreads < 1)
+	krb5_errx(context, 1, "bad --batch-size or --threads");
+    if (to_stdout)
+	batch_size = 0;
+#ifndef HPROP_USE_THREADS
+    if (nthreads > 1)
+	krb5_warnx(context, "no thread support, encoding in one thread");
+#endif
+
     if(source_type != NULL) {
 	type = parse_source_type(source_type);
 	if(type == 0)
@@ -38,13 +38,25 @@
 
 #include "headers.h"
 
+struct prop_batch;
+struct prop_queue;
+
 struct prop_data{
     krb5_context context;
     krb5_auth_context auth_context;
     int sock;
+    size_t batch_size;		/* entries per message, 0 for hprop-0.0 */
+    struct prop_batch *batch;	/* batch being filled */
+    struct prop_queue *queue;	/* encoding threads, if any */
 };
 
 #define HPROP_VERSION "hprop-0.0"
+/*
+ * Like hprop-0.0, but each message carries a batch of entries, each
+ * stored with krb5_store_data().  An empty message still ends the
+ * stream.
+ */
+#define HPROP_VERSION_BATCH "hprop-0.1"
 #define HPROP_NAME "hprop"
 #define HPROP_KEYTAB "HDBGET:"
 #define HPROP_PORT 754
@@ -66,6 +66,79 @@ usage(int ret)
     exit (ret);
 }
 
+static krb5_boolean
+match_version(const void *data, const char *version)
+{
+    int *batched = rk_UNCONST(data);
+
+    if (strcmp(version, HPROP_VERSION) == 0) {
+	*batched = 0;
+	return TRUE;
+    }
+    if (strcmp(version, HPROP_VERSION_BATCH) == 0) {
+	*batched = 1;
+	return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+receive_entry(krb5_context context, HDB *db, krb5_data *data, int *nprincs)
+{
+    krb5_error_code ret;
+    hdb_entry_ex entry;
+
+    memset(&entry, 0, sizeof(entry));
+    ret = hdb_value2entry(context, data, &entry.entry);
+    if (ret)
+	krb5_err(context, 1, ret, "hdb_value2entry");
+    if (print_dump) {
+	struct hdb_print_entry_arg parg;
+
+	parg.out = stdout;
+	parg.fmt = HDB_DUMP_HEIMDAL;
+	hdb_print_entry(context, db, &entry, &parg);
+    } else {
+	ret = db->hdb_store(context, db, 0, &entry);
+	if (ret == HDB_ERR_EXISTS) {
+	    char *s;
+	    ret = krb5_unparse_name(context, entry.entry.principal, &s);
+	    if (ret)
+		s = strdup(unparseable_name);
+	    krb5_warnx(context, "Entry exists: %s", s);
+	    free(s);
+	} else if (ret)
+	    krb5_err(context, 1, ret, "db_store");
+	else
+	    (*nprincs)++;
+    }
+    hdb_free_entry(context, &entry);
+}
+
+/* Receive the entries of a batch message, see HPROP_VERSION_BATCH */
+static void
+receive_batch(krb5_context context, HDB *db, krb5_data *data, int *nprincs)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data value;
+    off_t left = data->length;
+
+    sp = krb5_storage_from_readonly_mem(data->data, data->length);
+    if (sp == NULL)
+	krb5_errx(context, 1, "out of memory");
+    krb5_storage_set_max_alloc(sp, data->length);
+    while (left > 0) {
+	ret = krb5_ret_data(sp, &value);
+	if (ret)
+	    krb5_err(context, 1, ret, "malformed batch");
+	receive_entry(context, db, &value, nprincs);
+	krb5_data_free(&value);
+	left = data->length - krb5_storage_seek(sp, 0, SEEK_CUR);
+    }
+    krb5_storage_free(sp);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -81,6 +154,7 @@ main(int argc, char **argv)
     char *tmp_db;
     krb5_log_facility *fac;
     int nprincs;
+    int batched = 0;
 
     setprogname(argv[0]);
 
@@ -169,8 +243,9 @@ main(int argc, char **argv)
 		krb5_err (context, 1, ret, "krb5_kt_default");
 	}
 
-	ret = krb5_recvauth(context, &ac, &sock, HPROP_VERSION, NULL,
-			    0, keytab, &ticket);
+	ret = krb5_recvauth_match_version(context, &ac, &sock,
+					  match_version, &batched, NULL,
+					  0, keytab, &ticket);
 	if (ret)
 	    krb5_err(context, 1, ret, "krb5_recvauth");
 
@@ -220,12 +295,17 @@ main(int argc, char **argv)
 	ret = db->hdb_open(context, db, O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (ret)
 	    krb5_err(context, 1, ret, "hdb_open(%s)", tmp_db);
+	/*
+	 * Nothing reads the new DB until it's renamed into place, so don't
+	 * sync each store; we sync once before the rename.
+	 */
+	if (db->hdb_set_sync)
+	    (void) db->hdb_set_sync(context, db, 0);
     }
 
     nprincs = 0;
     while (1){
 	krb5_data data;
-	hdb_entry_ex entry;
 
 	if (from_stdin) {
 	    ret = krb5_read_message(context, &sock, &data);
@@ -244,6 +324,9 @@ main(int argc, char **argv)
 		krb5_write_priv_message(context, ac, &sock, &data);
 	    }
 	    if (!print_dump) {
+		ret = db->hdb_set_sync ? db->hdb_set_sync(context, db, 1) : 0;
+		if (ret)
+		    krb5_err(context, 1, ret, "failed to sync the HDB");
 		ret = db->hdb_close(context, db);
 		if (ret)
 		    krb5_err(context, 1, ret, "db_close");
@@ -253,32 +336,11 @@ main(int argc, char **argv)
 	    }
 	    break;
 	}
-	memset(&entry, 0, sizeof(entry));
-	ret = hdb_value2entry(context, &data, &entry.entry);
+	if (batched)
+	    receive_batch(context, db, &data, &nprincs);
+	else
+	    receive_entry(context, db, &data, &nprincs);
 	krb5_data_free(&data);
-	if (ret)
-	    krb5_err(context, 1, ret, "hdb_value2entry");
-	if (print_dump) {
-            struct hdb_print_entry_arg parg;
-
-            parg.out = stdout;
-            parg.fmt = HDB_DUMP_HEIMDAL;
-	    hdb_print_entry(context, db, &entry, &parg);
-        } else {
-	    ret = db->hdb_store(context, db, 0, &entry);
-	    if (ret == HDB_ERR_EXISTS) {
-		char *s;
-		ret = krb5_unparse_name(context, entry.entry.principal, &s);
-		if (ret)
-		    s = strdup(unparseable_name);
-		krb5_warnx(context, "Entry exists: %s", s);
-		free(s);
-	    } else if (ret)
-		krb5_err(context, 1, ret, "db_store");
-	    else
-		nprincs++;
-	}
-	hdb_free_entry(context, &entry);
     }
     if (!print_dump)
 	krb5_log(context, fac, 0, "Received %d principals", nprincs);
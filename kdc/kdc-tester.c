@@ -35,6 +35,14 @@
 
 #include "kdc_locl.h"
 #include "send_to_kdc_plugin.h"
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define TESTER_USE_THREADS 1
+#endif
 
 struct perf {
     unsigned long as_req;
@@ -42,7 +50,52 @@ struct perf {
     struct timeval start;
     struct timeval stop;
     struct perf *next;
-} *ptop;
+};
+
+/*
+ * Latency histogram with LAT_SUB buckets per power of two microseconds,
+ * so percentiles are accurate to within 1/LAT_SUB of their value.
+ */
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (40 * LAT_SUB)
+
+struct latency {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t bucket[LAT_BUCKETS];
+};
+
+enum { LAT_AS, LAT_TGS, LAT_KDC, LAT_NUM };
+
+static const char *lat_names[LAT_NUM] = {
+    "as-req", "tgs-req", "kdc-request"
+};
+
+struct bench {
+    struct latency lat[LAT_NUM];
+};
+
+/*
+ * Everything an evaluation needs.  Benchmark workers each get their own
+ * context and KDC configuration, like the KDC's worker threads do.
+ */
+
+struct worker {
+    krb5_context context;
+    krb5_kdc_configuration *config;
+    struct perf *ptop;
+    struct bench *bench;	/* NULL when not benchmarking */
+    int in_process;		/* answer requests here, not over the network */
+    int id;
+    heim_object_t job;
+    int num;
+#ifdef TESTER_USE_THREADS
+    pthread_t tid;
+#endif
+};
 
 int detach_from_console = -1;
 int daemon_child = -1;
@@ -51,10 +104,128 @@ int do_bonjour = -1;
 static krb5_kdc_configuration *kdc_config;
 static krb5_context kdc_context;
 
+static struct worker main_worker;
+
+/* Workers by context, for the send_to_kdc plugin */
+static struct worker **workers;
+static size_t num_workers;
+
 static struct sockaddr_storage sa;
 static const char *astr = "0.0.0.0";
 
-static void eval_object(heim_object_t);
+static void eval_object(struct worker *, heim_object_t);
+
+static struct worker *
+find_worker(krb5_context context)
+{
+    size_t i;
+
+    for (i = 0; i < num_workers; i++) {
+	if (workers[i]->context == context)
+	    return workers[i];
+    }
+    return &main_worker;
+}
+
+static void
+lat_record(struct latency *l, const struct timeval *start)
+{
+    struct timeval now;
+    uint64_t usec;
+    unsigned int shift = 0;
+    size_t idx;
+
+    gettimeofday(&now, NULL);
+    timevalsub(&now, start);
+    usec = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+    if (usec < LAT_SUB) {
+	idx = usec;
+    } else {
+	while ((usec >> shift) >= 2 * LAT_SUB)
+	    shift++;
+	idx = (shift + 1) * LAT_SUB + ((usec >> shift) - LAT_SUB);
+	if (idx >= LAT_BUCKETS)
+	    idx = LAT_BUCKETS - 1;
+    }
+    l->bucket[idx]++;
+    l->count++;
+    l->total += usec;
+    if (usec > l->max)
+	l->max = usec;
+}
+
+/* The latency, in microseconds, that `permille' of requests are within */
+static uint64_t
+lat_percentile(const struct latency *l, unsigned int permille)
+{
+    uint64_t want, seen = 0;
+    uint64_t val = l->max;
+    size_t i;
+
+    want = (l->count * permille + 999) / 1000;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	seen += l->bucket[i];
+	if (seen >= want && seen > 0) {
+	    if (i < LAT_SUB) {
+		val = i;
+	    } else {
+		unsigned int shift = i / LAT_SUB - 1;
+		uint64_t mant = LAT_SUB + i % LAT_SUB;
+
+		/* Upper bound of the bucket */
+		val = ((mant + 1) << shift) - 1;
+	    }
+	    break;
+	}
+    }
+    return val < l->max ? val : l->max;
+}
+
+static void
+bench_merge(struct bench *to, const struct bench *from)
+{
+    size_t i, j;
+
+    for (i = 0; i < LAT_NUM; i++) {
+	struct latency *t = &to->lat[i];
+	const struct latency *f = &from->lat[i];
+
+	t->count += f->count;
+	t->total += f->total;
+	if (f->max > t->max)
+	    t->max = f->max;
+	for (j = 0; j < LAT_BUCKETS; j++)
+	    t->bucket[j] += f->bucket[j];
+    }
+}
+
+static void
+bench_report(const struct bench *b, struct timeval *elapsed, int nworkers)
+{
+    double usec;
+    size_t i;
+
+    usec = (double)elapsed->tv_sec * 1000000 + elapsed->tv_usec;
+    printf("benchmark: %d workers, time: %lu.%06lu\n", nworkers,
+	   (unsigned long)elapsed->tv_sec, (unsigned long)elapsed->tv_usec);
+
+    for (i = 0; i < LAT_NUM; i++) {
+	const struct latency *l = &b->lat[i];
+
+	if (l->count == 0)
+	    continue;
+	printf("%s/s %.2lf (total %llu requests)\n", lat_names[i],
+	       (l->count * 1000000) / usec, (unsigned long long)l->count);
+	printf("%s latency usec: avg %llu p50 %llu p99 %llu p999 %llu "
+	       "max %llu\n", lat_names[i],
+	       (unsigned long long)(l->total / l->count),
+	       (unsigned long long)lat_percentile(l, 500),
+	       (unsigned long long)lat_percentile(l, 990),
+	       (unsigned long long)lat_percentile(l, 999),
+	       (unsigned long long)l->max);
+    }
+}
 
 
 /*
@@ -92,16 +263,27 @@ plugin_send_to_realm(krb5_context context,
 		     const krb5_data *in,
 		     krb5_data *out)
 {
+    struct worker *w = find_worker(context);
+    struct timeval start;
     int ret;
 
+    if (!w->in_process)
+	return KRB5_PLUGIN_NO_HANDLE;
+
+    if (w->bench)
+	gettimeofday(&start, NULL);
+
     krb5_kdc_update_time(NULL);
 
-    ret = krb5_kdc_process_request(kdc_context, kdc_config,
+    ret = krb5_kdc_process_request(w->context, w->config,
 				   in->data, in->length,
 				   out, NULL, astr,
 				   (struct sockaddr *)&sa, 0);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_kdc_process_request");
+	krb5_err(w->context, 1, ret, "krb5_kdc_process_request");
+
+    if (w->bench)
+	lat_record(&w->bench->lat[LAT_KDC], &start);
 
     return 0;
 }
@@ -115,20 +297,22 @@ static krb5plugin_send_to_kdc_ftable send_to_kdc = {
 };
 
 static void
-perf_start(struct perf *perf)
+perf_start(struct worker *w, struct perf *perf)
 {
     memset(perf, 0, sizeof(*perf));
 
     gettimeofday(&perf->start, NULL);
-    perf->next = ptop;
-    ptop = perf;
+    perf->next = w->ptop;
+    w->ptop = perf;
 }
 
 static void
-perf_stop(struct perf *perf)
+perf_stop(struct worker *w, struct perf *perf)
 {
+    struct perf *ptop;
+
     gettimeofday(&perf->stop, NULL);
-    ptop = perf->next;
+    ptop = w->ptop = perf->next;
 
     if (ptop) {
 	ptop->as_req += perf->as_req;
@@ -160,14 +344,14 @@ perf_stop(struct perf *perf)
  */
 
 static void
-eval_repeat(heim_dict_t o)
+eval_repeat(struct worker *w, heim_dict_t o)
 {
     heim_object_t or = heim_dict_get_value(o, HSTR("value"));
     heim_number_t n = heim_dict_get_value(o, HSTR("num"));
     int i, num;
     struct perf perf;
 
-    perf_start(&perf);
+    perf_start(w, &perf);
 
     heim_assert(or != NULL, "value missing");
     heim_assert(n != NULL, "num missing");
@@ -176,9 +360,9 @@ eval_repeat(heim_dict_t o)
     heim_assert(num >= 0, "num >= 0");
 
     for (i = 0; i < num; i++)
-	eval_object(or);
+	eval_object(w, or);
 
-    perf_stop(&perf);
+    perf_stop(w, &perf);
 }
 
 /*
@@ -207,7 +391,7 @@ copy_keytab(krb5_context context, krb5_keytab from, krb5_keytab to)
  */
 
 static void
-eval_kinit(heim_dict_t o)
+eval_kinit(struct worker *w, heim_dict_t o)
 {
     heim_string_t user, password, keytab, fast_armor_cc, pk_user_id, ccache;
     krb5_get_init_creds_opt *opt;
@@ -215,122 +399,132 @@ eval_kinit(heim_dict_t o)
     krb5_principal client;
     krb5_keytab ktmem = NULL;
     krb5_ccache fast_cc = NULL;
+    krb5_context context = w->context;
+    struct timeval start;
     krb5_error_code ret;
 
-    if (ptop)
-	ptop->as_req++;
+    gettimeofday(&start, NULL);
+
+    if (w->ptop)
+	w->ptop->as_req++;
 
     user = heim_dict_get_value(o, HSTR("client"));
     if (user == NULL)
-	krb5_errx(kdc_context, 1, "no client");
+	krb5_errx(context, 1, "no client");
 
     password = heim_dict_get_value(o, HSTR("password"));
     keytab = heim_dict_get_value(o, HSTR("keytab"));
     pk_user_id = heim_dict_get_value(o, HSTR("pkinit-user-cert-id"));
     if (password == NULL && keytab == NULL && pk_user_id == NULL)
-	krb5_errx(kdc_context, 1, "password, keytab, nor PKINIT user cert ID");
+	krb5_errx(context, 1, "password, keytab, nor PKINIT user cert ID");
 
     ccache = heim_dict_get_value(o, HSTR("ccache"));
 
-    ret = krb5_parse_name(kdc_context, heim_string_get_utf8(user), &client);
+    ret = krb5_parse_name(context, heim_string_get_utf8(user), &client);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_unparse_name");
+	krb5_err(context, 1, ret, "krb5_unparse_name");
 
     /* PKINIT parts */
-    ret = krb5_get_init_creds_opt_alloc (kdc_context, &opt);
+    ret = krb5_get_init_creds_opt_alloc (context, &opt);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_get_init_creds_opt_alloc");
+	krb5_err(context, 1, ret, "krb5_get_init_creds_opt_alloc");
 
     if (pk_user_id) {
 	heim_bool_t rsaobj = heim_dict_get_value(o, HSTR("pkinit-use-rsa"));
 	int use_rsa = rsaobj ? heim_bool_val(rsaobj) : 0;
 
-	ret = krb5_get_init_creds_opt_set_pkinit(kdc_context, opt,
+	ret = krb5_get_init_creds_opt_set_pkinit(context, opt,
 						 client,
 						 heim_string_get_utf8(pk_user_id),
 						 NULL, NULL, NULL,
 						 use_rsa ? 2 : 0,
 						 NULL, NULL, NULL);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_get_init_creds_opt_set_pkinit");
+	    krb5_err(context, 1, ret, "krb5_get_init_creds_opt_set_pkinit");
     }
 
-    ret = krb5_init_creds_init(kdc_context, client, NULL, NULL, 0, opt, &ctx);
+    ret = krb5_init_creds_init(context, client, NULL, NULL, 0, opt, &ctx);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_init_creds_init");
+	krb5_err(context, 1, ret, "krb5_init_creds_init");
 
     fast_armor_cc = heim_dict_get_value(o, HSTR("fast-armor-cc"));
     if (fast_armor_cc) {
 
-	ret = krb5_cc_resolve(kdc_context, heim_string_get_utf8(fast_armor_cc), &fast_cc);
+	ret = krb5_cc_resolve(context, heim_string_get_utf8(fast_armor_cc), &fast_cc);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
+	    krb5_err(context, 1, ret, "krb5_cc_resolve");
 
-	ret = krb5_init_creds_set_fast_ccache(kdc_context, ctx, fast_cc);
+	ret = krb5_init_creds_set_fast_ccache(context, ctx, fast_cc);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_init_creds_set_fast_ccache");
+	    krb5_err(context, 1, ret, "krb5_init_creds_set_fast_ccache");
     }
     
     if (password) {
-	ret = krb5_init_creds_set_password(kdc_context, ctx, 
+	ret = krb5_init_creds_set_password(context, ctx, 
 					   heim_string_get_utf8(password));
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_init_creds_set_password");
+	    krb5_err(context, 1, ret, "krb5_init_creds_set_password");
     }
     if (keytab) {
+	char ktname[sizeof("MEMORY:keytab-") + 11];
 	krb5_keytab kt = NULL;
 
-	ret = krb5_kt_resolve(kdc_context, heim_string_get_utf8(keytab), &kt);
+	ret = krb5_kt_resolve(context, heim_string_get_utf8(keytab), &kt);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_kt_resolve");
+	    krb5_err(context, 1, ret, "krb5_kt_resolve");
 
-	ret = krb5_kt_resolve(kdc_context, "MEMORY:keytab", &ktmem);
+	/* MEMORY keytabs are process wide; keep workers' copies apart */
+	snprintf(ktname, sizeof(ktname), "MEMORY:keytab-%d", w->id);
+	ret = krb5_kt_resolve(context, ktname, &ktmem);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_kt_resolve(MEMORY)");
+	    krb5_err(context, 1, ret, "krb5_kt_resolve(MEMORY)");
 
-	ret = copy_keytab(kdc_context, kt, ktmem);
+	ret = copy_keytab(context, kt, ktmem);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "copy_keytab");
+	    krb5_err(context, 1, ret, "copy_keytab");
 
-	krb5_kt_close(kdc_context, kt);
+	krb5_kt_close(context, kt);
 
-	ret = krb5_init_creds_set_keytab(kdc_context, ctx, ktmem);
+	ret = krb5_init_creds_set_keytab(context, ctx, ktmem);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_init_creds_set_keytab");
+	    krb5_err(context, 1, ret, "krb5_init_creds_set_keytab");
     }
 
-    ret = krb5_init_creds_get(kdc_context, ctx);
+    ret = krb5_init_creds_get(context, ctx);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_init_creds_get");
+	krb5_err(context, 1, ret, "krb5_init_creds_get");
 
     if (ccache) {
 	const char *name = heim_string_get_utf8(ccache);
 	krb5_creds cred;
 	krb5_ccache cc;
 
-	ret = krb5_init_creds_get_creds(kdc_context, ctx, &cred);
+	ret = krb5_init_creds_get_creds(context, ctx, &cred);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_init_creds_get_creds");
+	    krb5_err(context, 1, ret, "krb5_init_creds_get_creds");
 
-	ret = krb5_cc_resolve(kdc_context, name, &cc);
+	ret = krb5_cc_resolve(context, name, &cc);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
+	    krb5_err(context, 1, ret, "krb5_cc_resolve");
 
-	krb5_init_creds_store(kdc_context, ctx, cc);
+	krb5_init_creds_store(context, ctx, cc);
 
-	ret = krb5_cc_close(kdc_context, cc);
+	ret = krb5_cc_close(context, cc);
 	if (ret)
-	    krb5_err(kdc_context, 1, ret, "krb5_cc_close");
+	    krb5_err(context, 1, ret, "krb5_cc_close");
 
-	krb5_free_cred_contents(kdc_context, &cred);
+	krb5_free_cred_contents(context, &cred);
     }
 
-    krb5_init_creds_free(kdc_context, ctx);
+    krb5_init_creds_free(context, ctx);
 
     if (ktmem)
-	krb5_kt_close(kdc_context, ktmem);
+	krb5_kt_close(context, ktmem);
     if (fast_cc)
-	krb5_cc_close(kdc_context, fast_cc);
+	krb5_cc_close(context, fast_cc);
+
+    if (w->bench)
+	lat_record(&w->bench->lat[LAT_AS], &start);
 }
 
 /*
@@ -338,7 +532,7 @@ eval_kinit(heim_dict_t o)
  */
 
 static void
-eval_kgetcred(heim_dict_t o)
+eval_kgetcred(struct worker *w, heim_dict_t o)
 {
     heim_string_t server, ccache;
     krb5_get_creds_opt opt;
@@ -347,45 +541,52 @@ eval_kgetcred(heim_dict_t o)
     krb5_ccache cc = NULL;
     krb5_principal s;
     krb5_creds *out = NULL;
+    krb5_context context = w->context;
+    struct timeval start;
 
-    if (ptop)
-	ptop->tgs_req++;
+    gettimeofday(&start, NULL);
+
+    if (w->ptop)
+	w->ptop->tgs_req++;
 
     server = heim_dict_get_value(o, HSTR("server"));
     if (server == NULL)
-	krb5_errx(kdc_context, 1, "no server");
+	krb5_errx(context, 1, "no server");
 
     ccache = heim_dict_get_value(o, HSTR("ccache"));
     if (ccache == NULL)
-	krb5_errx(kdc_context, 1, "no ccache");
+	krb5_errx(context, 1, "no ccache");
 
     nostore = heim_dict_get_value(o, HSTR("nostore"));
     if (nostore == NULL)
 	nostore = heim_bool_create(1);
 
-    ret = krb5_cc_resolve(kdc_context, heim_string_get_utf8(ccache), &cc);
+    ret = krb5_cc_resolve(context, heim_string_get_utf8(ccache), &cc);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
+	krb5_err(context, 1, ret, "krb5_cc_resolve");
 
-    ret = krb5_parse_name(kdc_context, heim_string_get_utf8(server), &s);
+    ret = krb5_parse_name(context, heim_string_get_utf8(server), &s);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_parse_name");
+	krb5_err(context, 1, ret, "krb5_parse_name");
 
-    ret = krb5_get_creds_opt_alloc(kdc_context, &opt);
+    ret = krb5_get_creds_opt_alloc(context, &opt);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_get_creds_opt_alloc");
+	krb5_err(context, 1, ret, "krb5_get_creds_opt_alloc");
 
     if (heim_bool_val(nostore))
-	krb5_get_creds_opt_add_options(kdc_context, opt, KRB5_GC_NO_STORE);
+	krb5_get_creds_opt_add_options(context, opt, KRB5_GC_NO_STORE);
 
-    ret = krb5_get_creds(kdc_context, opt, cc, s, &out);
+    ret = krb5_get_creds(context, opt, cc, s, &out);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_get_creds");
+	krb5_err(context, 1, ret, "krb5_get_creds");
     
-    krb5_free_creds(kdc_context, out);
-    krb5_free_principal(kdc_context, s);
-    krb5_get_creds_opt_free(kdc_context, opt);
-    krb5_cc_close(kdc_context, cc);
+    krb5_free_creds(context, out);
+    krb5_free_principal(context, s);
+    krb5_get_creds_opt_free(context, opt);
+    krb5_cc_close(context, cc);
+
+    if (w->bench)
+	lat_record(&w->bench->lat[LAT_TGS], &start);
 }
 
 
@@ -394,9 +595,10 @@ eval_kgetcred(heim_dict_t o)
  */
 
 static void
-eval_kdestroy(heim_dict_t o)
+eval_kdestroy(struct worker *w, heim_dict_t o)
 {
     heim_string_t ccache = heim_dict_get_value(o, HSTR("ccache"));;
+    krb5_context context = w->context;
     krb5_error_code ret;
     const char *name;
     krb5_ccache cc;
@@ -405,13 +607,259 @@ eval_kdestroy(heim_dict_t o)
 	
     name = heim_string_get_utf8(ccache);
 
-    ret = krb5_cc_resolve(kdc_context, name, &cc);
+    ret = krb5_cc_resolve(context, name, &cc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_resolve");
+
+    krb5_cc_destroy(context, cc);
+}
+
+
+/*
+ * Benchmarks run `num' iterations of `value' in each of `threads'
+ * threads or `processes' processes and report throughput and latency
+ * percentiles for AS and TGS exchanges and for the KDC requests that
+ * make them up.  Requests are answered in-process unless "kdc" is
+ * "network", in which case they go to the KDCs krb5.conf names.
+ */
+
+static void
+worker_init(struct worker *w, int id, int in_process,
+	    heim_object_t job, int num)
+{
+    krb5_error_code ret;
+
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->in_process = in_process;
+    w->job = job;
+    w->num = num;
+
+    ret = kdc_worker_context(&w->context);
     if (ret)
-	krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
+	krb5_err(kdc_context, 1, ret, "krb5_init_context");
+
+    w->config = malloc(sizeof(*w->config));
+    w->bench = calloc(1, sizeof(*w->bench));
+    if (w->config == NULL || w->bench == NULL)
+	krb5_errx(kdc_context, 1, "out of memory");
+
+    *w->config = *kdc_config;
+    w->config->db = NULL;
+    w->config->num_db = 0;
+    w->config->entry_cache = NULL;
+    w->config->req_arena = NULL;
+    ret = krb5_kdc_set_dbinfo(w->context, w->config);
+    if (ret)
+	krb5_err(w->context, 1, ret, "krb5_kdc_set_dbinfo");
 
-    krb5_cc_destroy(kdc_context, cc);
+    krb5_plugin_register(w->context, PLUGIN_TYPE_DATA,
+			 KRB5_PLUGIN_SEND_TO_KDC, &send_to_kdc);
 }
 
+static void
+worker_free(struct worker *w)
+{
+    int i;
+
+    krb5_kdc_free_entry_cache(w->context, w->config);
+    asn1_arena_destroy(w->config->req_arena);
+    for (i = 0; i < w->config->num_db; i++) {
+	HDB *db = w->config->db[i];
+
+	if (db->hdb_openp)
+	    (void) db->hdb_close(w->context, db);
+	(void) db->hdb_destroy(w->context, db);
+    }
+    free(w->config->db);
+    free(w->config);
+    free(w->bench);
+    krb5_free_context(w->context);
+}
+
+static void
+worker_run(struct worker *w)
+{
+    int i;
+
+    for (i = 0; i < w->num; i++)
+	eval_object(w, w->job);
+}
+
+#ifdef TESTER_USE_THREADS
+static void *
+worker_thread(void *ptr)
+{
+    worker_run(ptr);
+    return NULL;
+}
+#endif
+
+static void
+bench_threads(struct worker *w, int nworkers, struct bench *total)
+{
+    int i;
+
+    workers = calloc(nworkers, sizeof(workers[0]));
+    if (workers == NULL)
+	krb5_errx(kdc_context, 1, "out of memory");
+    for (i = 0; i < nworkers; i++)
+	workers[i] = &w[i];
+    num_workers = nworkers;
+
+    if (nworkers == 1) {
+	worker_run(&w[0]);
+    } else {
+#ifdef TESTER_USE_THREADS
+	for (i = 0; i < nworkers; i++) {
+	    errno = pthread_create(&w[i].tid, NULL, worker_thread, &w[i]);
+	    if (errno)
+		krb5_err(kdc_context, 1, errno, "pthread_create");
+	}
+	for (i = 0; i < nworkers; i++)
+	    pthread_join(w[i].tid, NULL);
+#else
+	krb5_errx(kdc_context, 1, "no thread support, use \"processes\"");
+#endif
+    }
+
+    num_workers = 0;
+    free(workers);
+    workers = NULL;
+
+    for (i = 0; i < nworkers; i++)
+	bench_merge(total, w[i].bench);
+}
+
+#ifdef HAVE_FORK
+/* Each process sets up its own worker so no database handles are shared */
+static void
+bench_processes(heim_object_t job, int num, int in_process,
+		int nworkers, struct bench *total)
+{
+    struct bench b;
+    pid_t *pids;
+    int *fds;
+    int i;
+
+    pids = calloc(nworkers, sizeof(pids[0]));
+    fds = calloc(nworkers, sizeof(fds[0]));
+    if (pids == NULL || fds == NULL)
+	krb5_errx(kdc_context, 1, "out of memory");
+
+    for (i = 0; i < nworkers; i++) {
+	int fd[2];
+
+	if (pipe(fd) < 0)
+	    krb5_err(kdc_context, 1, errno, "pipe");
+	fflush(stdout);
+	pids[i] = fork();
+	if (pids[i] < 0)
+	    krb5_err(kdc_context, 1, errno, "fork");
+	if (pids[i] == 0) {
+	    struct worker w, *wp = &w;
+
+	    close(fd[0]);
+	    worker_init(&w, i + 1, in_process, job, num);
+	    workers = &wp;
+	    num_workers = 1;
+	    worker_run(&w);
+	    if (net_write(fd[1], w.bench, sizeof(*w.bench)) !=
+		sizeof(*w.bench))
+		_exit(1);
+	    fflush(stdout);
+	    _exit(0);
+	}
+	close(fd[1]);
+	fds[i] = fd[0];
+    }
+
+    for (i = 0; i < nworkers; i++) {
+	int status;
+
+	if (net_read(fds[i], &b, sizeof(b)) != sizeof(b))
+	    krb5_errx(kdc_context, 1, "benchmark process %d failed", i);
+	close(fds[i]);
+	if (waitpid(pids[i], &status, 0) != pids[i] ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	    krb5_errx(kdc_context, 1, "benchmark process %d failed", i);
+	bench_merge(total, &b);
+    }
+    free(pids);
+    free(fds);
+}
+#endif
+
+static void
+eval_benchmark(struct worker *parent, heim_dict_t o)
+{
+    heim_object_t value = heim_dict_get_value(o, HSTR("value"));
+    heim_number_t n = heim_dict_get_value(o, HSTR("num"));
+    heim_number_t nthreads = heim_dict_get_value(o, HSTR("threads"));
+    heim_number_t nprocs = heim_dict_get_value(o, HSTR("processes"));
+    heim_string_t kdc = heim_dict_get_value(o, HSTR("kdc"));
+    struct timeval start, stop;
+    struct bench total;
+    struct worker *w = NULL;
+    int i, num, nworkers = 1, in_process = 1;
+
+    heim_assert(parent == &main_worker, "benchmarks do not nest");
+    heim_assert(value != NULL, "value missing");
+    heim_assert(n != NULL, "num missing");
+    heim_assert(nthreads == NULL || nprocs == NULL,
+		"both threads and processes given");
+
+    num = heim_number_get_int(n);
+    heim_assert(num >= 0, "num >= 0");
+    if (nthreads)
+	nworkers = heim_number_get_int(nthreads);
+    if (nprocs)
+	nworkers = heim_number_get_int(nprocs);
+    heim_assert(nworkers > 0, "workers > 0");
+
+    if (kdc) {
+	const char *k = heim_string_get_utf8(kdc);
+
+	if (strcmp(k, "network") == 0)
+	    in_process = 0;
+	else if (strcmp(k, "in-process") != 0)
+	    errx(1, "unsupported kdc %s", k);
+    }
+
+    if (nprocs == NULL) {
+	w = calloc(nworkers, sizeof(*w));
+	if (w == NULL)
+	    krb5_errx(kdc_context, 1, "out of memory");
+	for (i = 0; i < nworkers; i++)
+	    worker_init(&w[i], i + 1, in_process, value, num);
+    }
+
+    memset(&total, 0, sizeof(total));
+    gettimeofday(&start, NULL);
+    if (nprocs) {
+#ifdef HAVE_FORK
+	bench_processes(value, num, in_process, nworkers, &total);
+#else
+	krb5_errx(kdc_context, 1, "no fork support, use \"threads\"");
+#endif
+    } else {
+	bench_threads(w, nworkers, &total);
+    }
+    gettimeofday(&stop, NULL);
+    timevalsub(&stop, &start);
+
+    bench_report(&total, &stop, nworkers);
+
+    /* Count the exchanges in any enclosing repeat */
+    if (parent->ptop) {
+	parent->ptop->as_req += total.lat[LAT_AS].count;
+	parent->ptop->tgs_req += total.lat[LAT_TGS].count;
+    }
+
+    for (i = 0; w != NULL && i < nworkers; i++)
+	worker_free(&w[i]);
+    free(w);
+}
 
 /*
  *
@@ -420,29 +868,31 @@ eval_kdestroy(heim_dict_t o)
 static void
 eval_array_element(heim_object_t o, void *ptr, int *stop)
 {
-    eval_object(o);
+    eval_object(ptr, o);
 }
 
 static void
-eval_object(heim_object_t o)
+eval_object(struct worker *w, heim_object_t o)
 {
     heim_tid_t t = heim_get_tid(o);
 
     if (t == heim_array_get_type_id()) {
-	heim_array_iterate_f(o, NULL, eval_array_element);
+	heim_array_iterate_f(o, w, eval_array_element);
     } else if (t == heim_dict_get_type_id()) {
 	const char *op = heim_dict_get_value(o, HSTR("op"));
 
 	heim_assert(op != NULL, "op missing");
 
 	if (strcmp(op, "repeat") == 0) {
-	    eval_repeat(o);
+	    eval_repeat(w, o);
+	} else if (strcmp(op, "benchmark") == 0) {
+	    eval_benchmark(w, o);
 	} else if (strcmp(op, "kinit") == 0) {
-	    eval_kinit(o);
+	    eval_kinit(w, o);
 	} else if (strcmp(op, "kgetcred") == 0) {
-	    eval_kgetcred(o);
+	    eval_kgetcred(w, o);
 	} else if (strcmp(op, "kdestroy") == 0) {
-	    eval_kdestroy(o);
+	    eval_kdestroy(w, o);
 	} else {
 	    errx(1, "unsupported ops %s", op);
 	}
@@ -497,8 +947,11 @@ main(int argc, char **argv)
 	/*
 	 * do the work here
 	 */
-	
-	eval_object(o);
+
+	main_worker.context = kdc_context;
+	main_worker.config = kdc_config;
+	main_worker.in_process = 1;
+	eval_object(&main_worker, o);
 
 	heim_release(o);
     }
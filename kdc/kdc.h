@@ -96,6 +96,16 @@ typedef struct krb5_kdc_configuration {
     int enable_kx509;
 
     const char *app;
+
+    /* Add new fields at the end, this struct is part of the libkdc ABI */
+    size_t entry_cache_size; /* max. cached HDB entries, 0 to disable */
+    time_t entry_cache_lifetime;
+    time_t entry_cache_check_interval; /* how often to stat() the DB files */
+    struct kdc_entry_cache *entry_cache;
+    struct asn1_arena *req_arena; /* AS-/TGS-REQs are decoded into this */
+
+    int num_kdc_threads;
+    int udp_batch_size; /* datagrams per recvmmsg(2)/sendmmsg(2) call */
 } krb5_kdc_configuration;
 
 typedef struct kdc_request_desc *kdc_request_t;
@@ -68,6 +68,9 @@ struct astgs_request_desc {
 
     /* Both AS and TGS */
     KDC_REQ req;
+    unsigned int req_in_arena:1;	/* decoded into config->req_arena */
+    unsigned int fast_req_body:1;	/* req_body replaced with a heap copy */
+    unsigned int fast_padata:1;		/* padata replaced with a heap copy */
 
     /* Only AS */
     METHOD_DATA *padata;
@@ -131,7 +134,7 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
-extern struct timeval _kdc_now;
+extern HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
 extern char *runas_string;
@@ -143,6 +146,9 @@ start_kdc(krb5_context context, krb5_kdc_configuration *config, const char *argv
 krb5_kdc_configuration *
 configure(krb5_context context, int argc, char **argv, int *optidx);
 
+krb5_error_code
+kdc_worker_context(krb5_context *context);
+
 #ifdef __APPLE__
 void bonjour_announce(krb5_context, krb5_kdc_configuration *);
 #endif
@@ -31,6 +31,7 @@
  * SUCH DAMAGE.
  */
 
+#define ASN1_BUF_ENCODERS	/* for ASN1_BUF_ENCODE() */
 #include "kdc_locl.h"
 
 #define MAX_TIME ((time_t)((1U << 31) - 1))
@@ -935,6 +936,70 @@ log_patypes(astgs_request_t r, METHOD_DATA *padata)
     free(str);
 }
 
+/*
+ * Set up `job' to encrypt `len' bytes at `data' into `cipher', laid out
+ * as krb5_encrypt() would, so that the ticket and the reply can be
+ * encrypted together by krb5_encrypt_iov_ivec_multi().  Fails for the
+ * enctypes that have no iov support (DES, RC4).
+ */
+
+static krb5_error_code
+encrypt_job_init(krb5_context context,
+		 krb5_crypto crypto,
+		 unsigned usage,
+		 const void *data,
+		 size_t len,
+		 krb5_crypto_iov iov[4],
+		 krb5_crypto_iov_job *job,
+		 krb5_data *cipher)
+{
+    krb5_error_code ret;
+    unsigned char *p;
+    size_t padsz = 0;
+    int i;
+
+    krb5_data_zero(cipher);
+    iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+    iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[2].flags = KRB5_CRYPTO_TYPE_PADDING;
+    iov[3].flags = KRB5_CRYPTO_TYPE_TRAILER;
+    ret = krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_HEADER,
+			     &iov[0].data.length);
+    if (ret == 0)
+	ret = krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_PADDING,
+				 &padsz);
+    if (ret == 0)
+	ret = krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_TRAILER,
+				 &iov[3].data.length);
+    if (ret) {
+	krb5_clear_error_message(context);
+	return ret;
+    }
+    iov[1].data.length = len;
+    iov[2].data.length = 0;
+    if (padsz > 1)
+	iov[2].data.length = (padsz - (iov[0].data.length + len) % padsz) %
+	    padsz;
+
+    ret = krb5_data_alloc(cipher, iov[0].data.length + len +
+			  iov[2].data.length + iov[3].data.length);
+    if (ret)
+	return ret;
+    for (p = cipher->data, i = 0; i < 4; i++) {
+	iov[i].data.data = p;
+	p += iov[i].data.length;
+    }
+    memcpy(iov[1].data.data, data, len);
+
+    job->crypto = crypto;
+    job->usage = usage;
+    job->data = iov;
+    job->num_data = 4;
+    job->ivec = NULL;
+    job->ret = 0;
+    return 0;
+}
+
 /*
  *
  */
@@ -952,46 +1017,109 @@ _kdc_encode_reply(krb5_context context,
 		  krb5_data *reply)
 {
     unsigned char *buf;
-    size_t buf_size;
     size_t len = 0;
     krb5_error_code ret;
-    krb5_crypto crypto;
+    krb5_crypto crypto = NULL, reply_crypto = NULL;
+    krb5_crypto_iov iov[2][4];
+    krb5_crypto_iov_job jobs[2];
+    krb5_data cipher[2];
+    EncryptedData *enc[2];
+    int kvno[2];
+    size_t i, njobs = 0;
+    unsigned usage;
+
+    if (rep->msg_type == krb_as_rep)
+	usage = KRB5_KU_AS_REP_ENC_PART;
+    else if (rk_is_subkey)
+	usage = KRB5_KU_TGS_REP_ENC_PART_SUB_KEY;
+    else
+	usage = KRB5_KU_TGS_REP_ENC_PART_SESSION;
+
+    /*
+     * The server key is long-lived (often the krbtgt key), so keep a
+     * prepared crypto context for it whose derived keys later requests
+     * can reuse.
+     */
+    ret = krb5_crypto_init_cached(context, skey, etype, &crypto);
+    if (ret == 0)
+	ret = krb5_crypto_init(context, reply_key, 0, &reply_crypto);
+    if (ret) {
+        const char *msg = krb5_get_error_message(context, ret);
+	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
+	krb5_free_error_message(context, msg);
+	goto out;
+    }
 
-    ASN1_MALLOC_ENCODE(EncTicketPart, buf, buf_size, et, &len, ret);
+    /*
+     * The plaintext parts are encoded in one pass into this thread's
+     * reusable ASN.1 buffer, which is cleared once they are copied out
+     * (or encrypted).  The ticket and the reply are then encrypted
+     * together, which lets AES-NI interleave them.
+     */
+    ASN1_BUF_ENCODE(EncTicketPart, NULL, buf, len, et, ret);
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encode ticket: %s", msg);
 	krb5_free_error_message(context, msg);
-	return ret;
+	goto out;
     }
-    if(buf_size != len)
-	krb5_abortx(context, "Internal error in ASN.1 encoder");
+    if (encrypt_job_init(context, crypto, KRB5_KU_TICKET, buf, len,
+			 iov[njobs], &jobs[njobs], &cipher[njobs]) == 0) {
+	enc[njobs] = &rep->ticket.enc_part;
+	kvno[njobs++] = skvno;
+    } else {
+	ret = krb5_encrypt_EncryptedData(context, crypto, KRB5_KU_TICKET,
+					 buf, len, skvno,
+					 &rep->ticket.enc_part);
+    }
+    asn1_buf_clear(NULL);
+    if (ret)
+	goto encrypt_failed;
 
-    ret = krb5_crypto_init(context, skey, etype, &crypto);
-    if (ret) {
-        const char *msg = krb5_get_error_message(context, ret);
-	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
+    if(rep->msg_type == krb_as_rep && !config->encode_as_rep_as_tgs_rep)
+	ASN1_BUF_ENCODE(EncASRepPart, NULL, buf, len, ek, ret);
+    else
+	ASN1_BUF_ENCODE(EncTGSRepPart, NULL, buf, len, ek, ret);
+    if(ret) {
+	const char *msg = krb5_get_error_message(context, ret);
+	kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
 	krb5_free_error_message(context, msg);
-	free(buf);
-	return ret;
+	goto out;
     }
-
-    ret = krb5_encrypt_EncryptedData(context,
-				     crypto,
-				     KRB5_KU_TICKET,
-				     buf,
-				     len,
-				     skvno,
-				     &rep->ticket.enc_part);
-    free(buf);
-    krb5_crypto_destroy(context, crypto);
+    if (encrypt_job_init(context, reply_crypto, usage, buf, len,
+			 iov[njobs], &jobs[njobs], &cipher[njobs]) == 0) {
+	enc[njobs] = &rep->enc_part;
+	kvno[njobs++] = ckvno;
+    } else {
+	ret = krb5_encrypt_EncryptedData(context, reply_crypto, usage,
+					 buf, len, ckvno, &rep->enc_part);
+    }
+    asn1_buf_clear(NULL);
+    if (ret)
+	goto encrypt_failed;
+
+    if (njobs)
+	ret = krb5_encrypt_iov_ivec_multi(context, jobs, njobs);
+    for (i = 0; ret == 0 && i < njobs; i++) {
+	ret = krb5_crypto_getenctype(context, jobs[i].crypto, &enc[i]->etype);
+	if (ret == 0 && kvno[i]) {
+	    if ((enc[i]->kvno = malloc(sizeof(*enc[i]->kvno))) == NULL)
+		ret = krb5_enomem(context);
+	    else
+		*enc[i]->kvno = kvno[i];
+	}
+	if (ret == 0) {
+	    enc[i]->cipher = cipher[i];
+	    krb5_data_zero(&cipher[i]);
+	}
+    }
+  encrypt_failed:
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encrypt data: %s", msg);
 	krb5_free_error_message(context, msg);
-	return ret;
+	goto out;
     }
-
     if (armor_crypto) {
 	krb5_data data;
 	krb5_keyblock *strengthen_key = NULL;
@@ -1007,27 +1135,23 @@ _kdc_encode_reply(krb5_context context,
 	finished.crealm = et->crealm;
 	finished.cname = et->cname;
 
-	ASN1_MALLOC_ENCODE(Ticket, data.data, data.length,
-			   &rep->ticket, &len, ret);
+	ASN1_BUF_ENCODE(Ticket, NULL, buf, len, &rep->ticket, ret);
 	if (ret)
-	    return ret;
-	if (data.length != len)
-	    krb5_abortx(context, "internal asn.1 error");
+	    goto out;
 
 	ret = krb5_create_checksum(context, armor_crypto,
 				   KRB5_KU_FAST_FINISHED, 0,
-				   data.data, data.length,
+				   buf, len,
 				   &finished.ticket_checksum);
-	krb5_data_free(&data);
 	if (ret)
-	    return ret;
+	    goto out;
 
 	ret = _kdc_fast_mk_response(context, armor_crypto,
 				    rep->padata, strengthen_key, &finished,
 				    nonce, &data);
 	free_Checksum(&finished.ticket_checksum);
 	if (ret)
-	    return ret;
+	    goto out;
 
 	if (rep->padata) {
 	    free_METHOD_DATA(rep->padata);
@@ -1035,7 +1159,8 @@ _kdc_encode_reply(krb5_context context,
 	    rep->padata = calloc(1, sizeof(*(rep->padata)));
 	    if (rep->padata == NULL) {
 		krb5_data_free(&data);
-		return ENOMEM;
+		ret = ENOMEM;
+		goto out;
 	    }
 	}
 
@@ -1043,7 +1168,7 @@ _kdc_encode_reply(krb5_context context,
 			      KRB5_PADATA_FX_FAST,
 			      data.data, data.length);
 	if (ret)
-	    return ret;
+	    goto out;
 
 	/*
 	 * Hide client name of privacy reasons
@@ -1055,67 +1180,29 @@ _kdc_encode_reply(krb5_context context,
 	}
     }
 
-    if(rep->msg_type == krb_as_rep && !config->encode_as_rep_as_tgs_rep)
-	ASN1_MALLOC_ENCODE(EncASRepPart, buf, buf_size, ek, &len, ret);
+    if(rep->msg_type == krb_as_rep)
+	ASN1_BUF_MALLOC_ENCODE(AS_REP, NULL, reply->data, reply->length,
+			       rep, ret);
     else
-	ASN1_MALLOC_ENCODE(EncTGSRepPart, buf, buf_size, ek, &len, ret);
+	ASN1_BUF_MALLOC_ENCODE(TGS_REP, NULL, reply->data, reply->length,
+			       rep, ret);
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
 	krb5_free_error_message(context, msg);
-	return ret;
-    }
-    if(buf_size != len) {
-	free(buf);
-	kdc_log(context, config, 4, "Internal error in ASN.1 encoder");
-	*e_text = "KDC internal error";
-	return KRB5KRB_ERR_GENERIC;
-    }
-    ret = krb5_crypto_init(context, reply_key, 0, &crypto);
-    if (ret) {
-	const char *msg = krb5_get_error_message(context, ret);
-	free(buf);
-	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
-	krb5_free_error_message(context, msg);
-	return ret;
-    }
-    if(rep->msg_type == krb_as_rep) {
-	krb5_encrypt_EncryptedData(context,
-				   crypto,
-				   KRB5_KU_AS_REP_ENC_PART,
-				   buf,
-				   len,
-				   ckvno,
-				   &rep->enc_part);
-	free(buf);
-	ASN1_MALLOC_ENCODE(AS_REP, buf, buf_size, rep, &len, ret);
-    } else {
-	krb5_encrypt_EncryptedData(context,
-				   crypto,
-				   rk_is_subkey ? KRB5_KU_TGS_REP_ENC_PART_SUB_KEY : KRB5_KU_TGS_REP_ENC_PART_SESSION,
-				   buf,
-				   len,
-				   ckvno,
-				   &rep->enc_part);
-	free(buf);
-	ASN1_MALLOC_ENCODE(TGS_REP, buf, buf_size, rep, &len, ret);
-    }
-    krb5_crypto_destroy(context, crypto);
-    if(ret) {
-	const char *msg = krb5_get_error_message(context, ret);
-	kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
-	krb5_free_error_message(context, msg);
-	return ret;
     }
-    if(buf_size != len) {
-	free(buf);
-	kdc_log(context, config, 4, "Internal error in ASN.1 encoder");
-	*e_text = "KDC internal error";
-	return KRB5KRB_ERR_GENERIC;
+
+  out:
+    /* on failure these may still hold the plaintext */
+    for (i = 0; i < njobs; i++) {
+	memset_s(cipher[i].data, cipher[i].length, 0, cipher[i].length);
+	krb5_data_free(&cipher[i]);
     }
-    reply->data = buf;
-    reply->length = buf_size;
-    return 0;
+    if (reply_crypto)
+	krb5_crypto_destroy(context, reply_crypto);
+    if (crypto)
+	krb5_crypto_destroy(context, crypto);
+    return ret;
 }
 
 /*
@@ -1229,8 +1229,10 @@ tgs_parse_request(astgs_request_t r,
     *cusec = NULL;
     *replykey = NULL;
 
+    /* The ticket and authenticator ciphertexts stay in the request */
     memset(&ap_req, 0, sizeof(ap_req));
-    ret = krb5_decode_ap_req(context, &tgs_req->padata_value, &ap_req);
+    ret = _krb5_decode_ap_req_borrowed(context, &tgs_req->padata_value,
+				       &ap_req);
     if(ret){
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to decode AP-REQ: %s", msg);
@@ -1336,10 +1338,14 @@ next_kvno:
 	goto out;
     }
 
+    /*
+     * The krbtgt key is long-lived: decrypt the ticket with a clone of a
+     * crypto context kept in the (per-thread) Kerberos context, which has
+     * its derived keys and their key schedules ready.
+     */
+    verify_ap_req_flags = KRB5_VERIFY_AP_REQ_CACHED_KEY;
     if (b->kdc_options.validate)
-	verify_ap_req_flags = KRB5_VERIFY_AP_REQ_IGNORE_INVALID;
-    else
-	verify_ap_req_flags = 0;
+	verify_ap_req_flags |= KRB5_VERIFY_AP_REQ_IGNORE_INVALID;
 
     ret = krb5_verify_ap_req2(context,
 			      &ac,
@@ -1472,7 +1478,7 @@ next_kvno:
     krb5_auth_con_free(context, ac);
 
 out:
-    free_AP_REQ(&ap_req);
+    free_AP_REQ_borrowed(&ap_req);
 
     return ret;
 }
@@ -49,7 +49,7 @@ name_type_ok(krb5_context context,
     return 0;
 }
 
-struct timeval _kdc_now;
+HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 
 krb5_error_code
 _kdc_db_fetch(krb5_context context,
@@ -80,6 +80,10 @@ _kdc_db_fetch(krb5_context context,
 	flags |= HDB_F_ALL_KVNOS;
     }
 
+    ret = _kdc_entry_cache_get(context, config, principal, flags, kvno, db, h);
+    if (ret != HDB_ERR_NOENTRY)
+        return ret;
+
     ent = calloc(1, sizeof (*ent));
     if (ent == NULL)
         return krb5_enomem(context);
@@ -102,12 +106,21 @@ _kdc_db_fetch(krb5_context context,
     for (i = 0; i < config->num_db; i++) {
 	HDB *curdb = config->db[i];
 
-	ret = curdb->hdb_open(context, curdb, O_RDONLY, 0);
-	if (ret) {
-	    const char *msg = krb5_get_error_message(context, ret);
-	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
-	    krb5_free_error_message(context, msg);
-	    continue;
+	/*
+	 * Backends that advertise HDB_CAP_F_KEEP_OPEN are opened once and
+	 * left open (hdb_openp) across fetches; they notice replacement of
+	 * the underlying database themselves.
+	 */
+	if (!curdb->hdb_openp) {
+	    ret = curdb->hdb_open(context, curdb, O_RDONLY, 0);
+	    if (ret) {
+		const char *msg = krb5_get_error_message(context, ret);
+		kdc_log(context, config, 0, "Failed to open database: %s", msg);
+		krb5_free_error_message(context, msg);
+		continue;
+	    }
+	    if (curdb->hdb_capability_flags & HDB_CAP_F_KEEP_OPEN)
+		curdb->hdb_openp = 1;
 	}
 
         princ = principal;
@@ -115,7 +128,14 @@ _kdc_db_fetch(krb5_context context,
             princ = enterprise_principal;
 
         ret = hdb_fetch_kvno(context, curdb, princ, flags, 0, 0, kvno, ent);
-	curdb->hdb_close(context, curdb);
+	if (!curdb->hdb_openp) {
+	    curdb->hdb_close(context, curdb);
+	} else if (ret != 0 && ret != HDB_ERR_NOENTRY &&
+		   ret != HDB_ERR_WRONG_REALM) {
+	    /* Start over with a fresh handle next time */
+	    curdb->hdb_close(context, curdb);
+	    curdb->hdb_openp = 0;
+	}
 
 	switch (ret) {
 	case HDB_ERR_WRONG_REALM:
@@ -126,6 +146,9 @@ _kdc_db_fetch(krb5_context context,
 	     */
 	    /* fall through */
 	case 0:
+	    if (ret == 0)
+		_kdc_entry_cache_put(context, config, principal, flags, kvno,
+				     i, ent);
 	    if (db)
 		*db = curdb;
 	    *h = ent;
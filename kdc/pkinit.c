@@ -85,6 +85,72 @@ static struct {
     time_t next_update;
 } ocsp;
 
+/*
+ * The KDC identity holds hx509 objects (certificate stores, and the
+ * revocation context, which hx509 reloads in place) that are not safe
+ * to share between threads.  kdc_identity belongs to the context that
+ * krb5_kdc_pk_initialize() was called with; the worker threads of a
+ * threaded KDC, which have contexts of their own, each load a copy of
+ * the identity on first use (see pk_identity()).  The moduli and the
+ * principal mappings are read-only once loaded, which leaves the OCSP
+ * response as the only state that requests share, behind ocsp_mutex.
+ */
+static krb5_context kdc_identity_context;
+static struct {
+    const char *user_id;
+    const char *anchors;
+    char **pool;
+    char **revoke_list;
+} kdc_identity_args;
+static HEIMDAL_thread_key kdc_identity_key;
+static int kdc_identity_key_created;
+static HEIMDAL_MUTEX ocsp_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+static void
+pk_free_identity(void *ptr)
+{
+    struct krb5_pk_identity *id = ptr;
+
+    if (id == NULL)
+	return;
+    hx509_verify_destroy_ctx(id->verify_ctx);
+    hx509_certs_free(&id->certs);
+    hx509_cert_free(id->cert);
+    hx509_certs_free(&id->anchors);
+    hx509_certs_free(&id->certpool);
+    hx509_revoke_free(&id->revokectx);
+    free(id);
+}
+
+static struct krb5_pk_identity *
+pk_identity(krb5_context context)
+{
+    struct krb5_pk_identity *id;
+    krb5_error_code ret;
+
+    if (context == kdc_identity_context || !kdc_identity_key_created)
+	return kdc_identity;
+    id = HEIMDAL_getspecific(kdc_identity_key);
+    if (id)
+	return id;
+    ret = _krb5_pk_load_id(context, &id,
+			   kdc_identity_args.user_id,
+			   kdc_identity_args.anchors,
+			   kdc_identity_args.pool,
+			   kdc_identity_args.revoke_list,
+			   NULL, NULL, NULL);
+    if (ret) {
+	krb5_warn(context, ret, "PKINIT: failed to load the KDC identity");
+	return NULL;
+    }
+    HEIMDAL_setspecific(kdc_identity_key, id, ret);
+    if (ret) {
+	pk_free_identity(id);
+	return NULL;
+    }
+    return id;
+}
+
 /*
  *
  */
@@ -410,6 +476,7 @@ _kdc_pk_rd_padata(astgs_request_t priv,
     hx509_certs trust_anchors;
     int have_data = 0;
     const HDB_Ext_PKINIT_cert *pc;
+    struct krb5_pk_identity *id;
 
     *ret_params = NULL;
 
@@ -426,6 +493,13 @@ _kdc_pk_rd_padata(astgs_request_t priv,
 	goto out;
     }
 
+    id = pk_identity(context);
+    if (id == NULL) {
+	ret = KRB5_KDC_ERR_CANT_VERIFY_CERTIFICATE;
+	krb5_set_error_message(context, ret, "PKINIT: no KDC identity");
+	goto out;
+    }
+
     ret = hx509_certs_init(context->hx509ctx,
 			   "MEMORY:trust-anchors",
 			   0, NULL, &trust_anchors);
@@ -435,7 +509,7 @@ _kdc_pk_rd_padata(astgs_request_t priv,
     }
 
     ret = hx509_certs_merge(context->hx509ctx, trust_anchors,
-			    kdc_identity->anchors);
+			    id->anchors);
     if (ret) {
 	hx509_certs_free(&trust_anchors);
 	krb5_set_error_message(context, ret, "failed to create verify context");
@@ -577,7 +651,7 @@ _kdc_pk_rd_padata(astgs_request_t priv,
 		}
 
 		ret = hx509_certs_find(context->hx509ctx,
-				       kdc_identity->certs,
+				       id->certs,
 				       q,
 				       &cert);
 		hx509_query_free(context->hx509ctx, q);
@@ -635,7 +709,7 @@ _kdc_pk_rd_padata(astgs_request_t priv,
 				      signed_content.data,
 				      signed_content.length,
 				      NULL,
-				      kdc_identity->certpool,
+				      id->certpool,
 				      &eContentType,
 				      &eContent,
 				      &signer_certs);
@@ -832,12 +906,20 @@ pk_mk_pa_reply_enckey(krb5_context context,
     krb5_data buf, signed_data;
     size_t size = 0;
     int do_win2k = 0;
+    struct krb5_pk_identity *id;
 
     krb5_data_zero(&buf);
     krb5_data_zero(&signed_data);
 
     *kdc_cert = NULL;
 
+    id = pk_identity(context);
+    if (id == NULL) {
+	ret = KRB5_KDC_ERR_CANT_VERIFY_CERTIFICATE;
+	krb5_set_error_message(context, ret, "PKINIT: no KDC identity");
+	return ret;
+    }
+
     /*
      * If the message client is a win2k-type but it send pa data
      * 09-binding it expects a IETF (checksum) reply so there can be
@@ -934,7 +1016,7 @@ pk_mk_pa_reply_enckey(krb5_context context,
 	    hx509_query_match_friendly_name(q, config->pkinit_kdc_friendly_name);
 
 	ret = hx509_certs_find(context->hx509ctx,
-			       kdc_identity->certs,
+			       id->certs,
 			       q,
 			       &cert);
 	hx509_query_free(context->hx509ctx, q);
@@ -950,7 +1032,7 @@ pk_mk_pa_reply_enckey(krb5_context context,
 					cert,
 					cp->peer,
 					cp->client_anchors,
-					kdc_identity->certpool,
+					id->certpool,
 					&signed_data);
 	*kdc_cert = cert;
     }
@@ -1011,6 +1093,7 @@ pk_mk_pa_reply_dh(krb5_context context,
     hx509_cert cert;
     hx509_query *q;
     size_t size = 0;
+    struct krb5_pk_identity *id;
 
     memset(&contentinfo, 0, sizeof(contentinfo));
     memset(&dh_info, 0, sizeof(dh_info));
@@ -1019,6 +1102,13 @@ pk_mk_pa_reply_dh(krb5_context context,
 
     *kdc_cert = NULL;
 
+    id = pk_identity(context);
+    if (id == NULL) {
+	ret = KRB5_KDC_ERR_CANT_VERIFY_CERTIFICATE;
+	krb5_set_error_message(context, ret, "PKINIT: no KDC identity");
+	return ret;
+    }
+
     if (cp->keyex == USE_DH) {
 	DH *kdc_dh = cp->u.dh.key;
 	heim_integer i;
@@ -1077,7 +1167,7 @@ pk_mk_pa_reply_dh(krb5_context context,
 	hx509_query_match_friendly_name(q, config->pkinit_kdc_friendly_name);
 
     ret = hx509_certs_find(context->hx509ctx,
-			   kdc_identity->certs,
+			   id->certs,
 			   q,
 			   &cert);
     hx509_query_free(context->hx509ctx, q);
@@ -1093,7 +1183,7 @@ pk_mk_pa_reply_dh(krb5_context context,
 				    cert,
 				    cp->peer,
 				    cp->client_anchors,
-				    kdc_identity->certpool,
+				    id->certpool,
 				    &signed_data);
     if (ret) {
 	kdc_log(context, config, 0, "Failed signing the DH* reply: %d", ret);
@@ -1446,6 +1536,10 @@ _kdc_pk_mk_pa_reply(astgs_request_t r, pk_client_params *cp)
     }
 
     if (config->pkinit_kdc_ocsp_file) {
+	krb5_data ocsp_data;
+
+	krb5_data_zero(&ocsp_data);
+	HEIMDAL_MUTEX_lock(&ocsp_mutex);
 
 	if (ocsp.expire == 0 && ocsp.next_update > kdc_time) {
 	    struct stat sb;
@@ -1508,16 +1602,21 @@ _kdc_pk_mk_pa_reply(astgs_request_t r, pk_client_params *cp)
 	    ret = 0;
 	}
 
-	if (ocsp.expire != 0 && ocsp.expire > kdc_time) {
+	if (ocsp.expire != 0 && ocsp.expire > kdc_time)
+	    ret = krb5_data_copy(&ocsp_data, ocsp.data.data, ocsp.data.length);
+	HEIMDAL_MUTEX_unlock(&ocsp_mutex);
 
+	if (ret == 0 && ocsp_data.length) {
 	    ret = krb5_padata_add(context, md,
 				  KRB5_PADATA_PA_PK_OCSP_RESPONSE,
-				  ocsp.data.data, ocsp.data.length);
-	    if (ret) {
-		krb5_set_error_message(context, ret,
-				       "Failed adding OCSP response %d", ret);
-		goto out;
-	    }
+				  ocsp_data.data, ocsp_data.length);
+	    if (ret)
+		krb5_data_free(&ocsp_data);
+	}
+	if (ret) {
+	    krb5_set_error_message(context, ret,
+				   "Failed adding OCSP response %d", ret);
+	    goto out;
 	}
     }
 
@@ -1949,6 +2048,16 @@ krb5_kdc_pk_initialize(krb5_context context,
 	return ret;
     }
 
+    kdc_identity_context = context;
+    kdc_identity_args.user_id = user_id;
+    kdc_identity_args.anchors = anchors;
+    kdc_identity_args.pool = pool;
+    kdc_identity_args.revoke_list = revoke_list;
+    if (!kdc_identity_key_created) {
+	HEIMDAL_key_create(&kdc_identity_key, pk_free_identity, ret);
+	kdc_identity_key_created = (ret == 0);
+    }
+
     {
 	hx509_query *q;
 	hx509_cert cert;
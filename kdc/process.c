@@ -167,9 +167,43 @@ krb5_kdc_update_time(struct timeval *tv)
 	       sizeof(*RHS) - sizeof(*LHS));		\
     } while (0)
 
+/*
+ * AS- and TGS-REQs are decoded into a per-worker arena, which is reset
+ * once the request has been handled, rather than malloc(3)ed piece by
+ * piece.  Only FAST replaces parts of a decoded request, with heap
+ * copies that are freed here.
+ */
+
+static struct asn1_arena *
+req_arena(astgs_request_t r)
+{
+    if (r->config->req_arena == NULL &&
+	asn1_arena_create(0, &r->config->req_arena) != 0)
+	return NULL;
+    return r->config->req_arena;
+}
+
+static void
+free_kdc_req(astgs_request_t r)
+{
+    if (!r->req_in_arena) {
+	free_AS_REQ(&r->req);	/* a TGS_REQ is a KDC_REQ too */
+	return;
+    }
+    if (r->fast_req_body)
+	free_KDC_REQ_BODY(&r->req.req_body);
+    if (r->fast_padata) {
+	free_METHOD_DATA(r->req.padata);
+	free(r->req.padata);
+    }
+    memset(&r->req, 0, sizeof(r->req));
+    asn1_arena_reset(r->config->req_arena);
+}
+
 static krb5_error_code
 kdc_as_req(kdc_request_t *rptr, int *claim)
 {
+    struct asn1_arena *arena;
     astgs_request_t r;
     krb5_error_code ret;
     size_t len;
@@ -177,16 +211,26 @@ kdc_as_req(kdc_request_t *rptr, int *claim)
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
-    ret = decode_AS_REQ(r->request.data, r->request.length, &r->req, &len);
-    if (ret)
-	return ret;
+    if ((arena = req_arena(r)) != NULL) {
+	ret = decode_AS_REQ_arena(r->request.data, r->request.length,
+				  &r->req, &len, arena);
+	if (ret) {
+	    asn1_arena_reset(arena);
+	    return ret;
+	}
+	r->req_in_arena = 1;
+    } else {
+	ret = decode_AS_REQ(r->request.data, r->request.length, &r->req, &len);
+	if (ret)
+	    return ret;
+    }
 
     r->reqtype = "AS-REQ";
     r->use_request_t = 1;
     *claim = 1;
 
     ret = _kdc_as_rep(r);
-    free_AS_REQ(&r->req);
+    free_kdc_req(r);
     return ret;
 }
 
@@ -194,6 +238,7 @@ kdc_as_req(kdc_request_t *rptr, int *claim)
 static krb5_error_code
 kdc_tgs_req(kdc_request_t *rptr, int *claim)
 {
+    struct asn1_arena *arena;
     astgs_request_t r;
     krb5_error_code ret;
     size_t len;
@@ -201,16 +246,27 @@ kdc_tgs_req(kdc_request_t *rptr, int *claim)
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
-    ret = decode_TGS_REQ(r->request.data, r->request.length, &r->req, &len);
-    if (ret)
-	return ret;
+    if ((arena = req_arena(r)) != NULL) {
+	ret = decode_TGS_REQ_arena(r->request.data, r->request.length,
+				   &r->req, &len, arena);
+	if (ret) {
+	    asn1_arena_reset(arena);
+	    return ret;
+	}
+	r->req_in_arena = 1;
+    } else {
+	ret = decode_TGS_REQ(r->request.data, r->request.length, &r->req,
+			     &len);
+	if (ret)
+	    return ret;
+    }
 
     r->reqtype = "TGS-REQ";
     r->use_request_t = 1;
     *claim = 1;
 
     ret = _kdc_tgs_rep(r);
-    free_TGS_REQ(&r->req);
+    free_kdc_req(r);
     return ret;
 }
 
@@ -38,6 +38,8 @@ typedef struct heim_universal_string {
     uint32_t *data;
 } heim_universal_string;
 
+struct asn1_arena;
+
 typedef char *heim_visible_string;
 
 typedef struct heim_oid {
@@ -81,4 +83,30 @@ typedef struct heim_base_data heim_any_set;
 #define ASN1CALL
 #endif
 
+struct asn1_buf;
+typedef int (ASN1CALL *asn1_buf_encoder)(unsigned char *, size_t,
+					 const void *, size_t *);
+
+/*
+ * The generated headers only declare the asn1_buf_encoder_<T> adapters
+ * these use when ASN1_BUF_ENCODERS is defined before they are included.
+ */
+
+#define ASN1_BUF_ENCODE(T, AB, B, BL, S, R)                    \
+  do {                                                         \
+    void *asn1_buf_p_;                                         \
+    (R) = asn1_buf_encode((AB), asn1_buf_encoder_##T,          \
+                          (S), &asn1_buf_p_, &(BL));           \
+    (B) = asn1_buf_p_;                                         \
+  } while (0)
+
+#define ASN1_BUF_MALLOC_ENCODE(T, AB, B, BL, S, R)             \
+  do {                                                         \
+    void *asn1_buf_p_;                                         \
+    (R) = asn1_buf_encode_copy((AB),                           \
+                               asn1_buf_encoder_##T,           \
+                               (S), &asn1_buf_p_, &(BL));      \
+    (B) = asn1_buf_p_;                                         \
+  } while (0)
+
 #endif
@@ -34,6 +34,7 @@
  */
 
 #include <config.h>
+#define ASN1_BUF_ENCODERS	/* for ASN1_BUF_ENCODE() */
 #include <stdio.h>
 #include <string.h>
 #include <err.h>
@@ -1473,6 +1474,178 @@ check_seq_of_size(void)
     return 0;
 }
 
+/*
+ * Decode into an arena repeatedly, resetting in between.  A small
+ * `chunk_size' makes the decoder cross chunk boundaries.
+ */
+
+static int
+test_seqof3_arena(size_t chunk_size)
+{
+    const unsigned char der[] =
+	"\x30\x0c\x30\x0a\x1b\x03\x66\x6f\x6f\x1b\x03\x62\x61\x72";
+    struct asn1_arena *arena;
+    TESTSeqOf3 c;
+    size_t size;
+    int i, ret = 0;
+
+    if (asn1_arena_create(chunk_size, &arena))
+	errx(1, "asn1_arena_create");
+
+    for (i = 0; i < 100; i++) {
+	if (decode_TESTSeqOf3_arena(der, sizeof(der) - 1, &c, &size, arena) ||
+	    size != sizeof(der) - 1 || c.strings == NULL ||
+	    c.strings->len != 2 ||
+	    strcmp(c.strings->val[0], "foo") != 0 ||
+	    strcmp(c.strings->val[1], "bar") != 0) {
+	    printf("seqof3 arena decode %d failed\n", i);
+	    ret++;
+	}
+	if (asn1_arena_used(arena) == 0) {
+	    printf("seqof3 arena not used\n");
+	    ret++;
+	}
+	free_TESTSeqOf3_arena(&c);
+	asn1_arena_reset(arena);
+    }
+
+    if (decode_TESTSeqOf3_arena(der, sizeof(der) - 2, &c, &size, arena) == 0) {
+	printf("seqof3 arena decode of truncated data succeeded\n");
+	ret++;
+    }
+
+    /* Outside of the arena decoding is back on the heap */
+    if (decode_TESTSeqOf3(der, sizeof(der) - 1, &c, &size)) {
+	printf("seqof3 heap decode failed\n");
+	ret++;
+    } else
+	free_TESTSeqOf3(&c);
+
+    asn1_arena_destroy(arena);
+    return ret;
+}
+
+/*
+ * A borrowed decode leaves the OCTET STRINGs pointing into the input,
+ * a normal decode copies them.
+ */
+
+static int
+test_seqof5_borrowed(void)
+{
+    const unsigned char der[] =
+	"\x30\x7c\x30\x7a\x30\x78"
+	"\x02\x01\x01" "\x04\x06\x01\x01\x01\x01\x01\x01"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xfe"
+	"\x04\x06\x02\x02\x02\x02\x02\x02"
+	"\x02\x01\x02" "\x04\x06\x03\x03\x03\x03\x03\x03"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xfd"
+	"\x04\x06\x04\x04\x04\x04\x04\x04"
+	"\x02\x01\x03" "\x04\x06\x05\x05\x05\x05\x05\x05"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xfc"
+	"\x04\x06\x06\x06\x06\x06\x06\x06"
+	"\x02\x01\x04" "\x04\x06\x07\x07\x07\x07\x07\x07"
+	"\x02\x09\x00\xff\xff\xff\xff\xff\xff\xff\xfb"
+	"\x04\x06\x08\x08\x08\x08\x08\x08";
+    const unsigned char *end = der + sizeof(der) - 1;
+    const unsigned char *s0, *s7;
+    TESTSeqOf5 c;
+    size_t size;
+    int ret = 0;
+
+    if (decode_TESTSeqOf5_borrowed(der, sizeof(der) - 1, &c, &size) ||
+	size != sizeof(der) - 1 || c.outer == NULL) {
+	printf("seqof5 borrowed decode failed\n");
+	return 1;
+    }
+    s0 = c.outer->inner.s0.data;
+    s7 = c.outer->inner.s7.data;
+    if (s0 < der || s0 >= end || s7 < der || s7 >= end ||
+	c.outer->inner.s7.length != 6 || memcmp(s7, "\x08\x08\x08\x08\x08\x08", 6) != 0) {
+	printf("seqof5 borrowed strings not in the input\n");
+	ret++;
+    }
+    free_TESTSeqOf5_borrowed(&c);
+
+    if (decode_TESTSeqOf5(der, sizeof(der) - 1, &c, &size)) {
+	printf("seqof5 decode failed\n");
+	return ret + 1;
+    }
+    s0 = c.outer->inner.s0.data;
+    if (s0 >= der && s0 < end) {
+	printf("seqof5 decode borrowed a string\n");
+	ret++;
+    }
+    free_TESTSeqOf5(&c);
+
+    /* Truncated input fails and cleans up without freeing the input */
+    if (decode_TESTSeqOf5_borrowed(der, sizeof(der) - 2, &c, &size) == 0) {
+	printf("seqof5 borrowed decode of truncated data succeeded\n");
+	ret++;
+    }
+    return ret;
+}
+
+/*
+ * Single pass encoding into a reusable buffer, starting out too small
+ * so that it has to grow, must give the same bytes as
+ * ASN1_MALLOC_ENCODE().
+ */
+
+static int
+test_asn1_buf(void)
+{
+    struct asn1_buf *abuf;
+    TESTSeqOf3 c;
+    struct TESTSeqOf3_strings strings;
+    heim_general_string s[3];
+    unsigned char *expect, *buf;
+    void *copy;
+    size_t expect_len, len, size;
+    int i, ret = 0, e;
+
+    s[0] = "foo";
+    s[1] = "a somewhat longer string than the others";
+    s[2] = "bar";
+    strings.len = 3;
+    strings.val = s;
+    c.strings = &strings;
+
+    ASN1_MALLOC_ENCODE(TESTSeqOf3, expect, expect_len, &c, &size, e);
+    if (e)
+	errx(1, "ASN1_MALLOC_ENCODE: %d", e);
+
+    if (asn1_buf_create(8, &abuf))
+	errx(1, "asn1_buf_create");
+    for (i = 0; i < 3; i++) {
+	ASN1_BUF_ENCODE(TESTSeqOf3, abuf, buf, len, &c, e);
+	if (e || len != expect_len || memcmp(buf, expect, len) != 0) {
+	    printf("asn1_buf encode %d failed: %d\n", i, e);
+	    ret++;
+	}
+    }
+    asn1_buf_clear(abuf);
+    asn1_buf_destroy(abuf);
+
+    /* The calling thread's buffer */
+    ASN1_BUF_ENCODE(TESTSeqOf3, NULL, buf, len, &c, e);
+    if (e || len != expect_len || memcmp(buf, expect, len) != 0) {
+	printf("asn1_buf thread encode failed: %d\n", e);
+	ret++;
+    }
+    ASN1_BUF_MALLOC_ENCODE(TESTSeqOf3, NULL, copy, len, &c, e);
+    if (e || len != expect_len || memcmp(copy, expect, len) != 0) {
+	printf("asn1_buf copy encode failed: %d\n", e);
+	ret++;
+    }
+    if (e == 0)
+	free(copy);
+    asn1_buf_destroy(NULL);
+
+    free(expect);
+    return ret;
+}
+
 static int
 check_TESTMechTypeList(void)
 {
@@ -1805,8 +1978,12 @@ main(int argc, char **argv)
     ret += test_SignedData();
 
     ret += check_TESTMechTypeList();
+    ret += test_seqof3_arena(0);
+    ret += test_seqof3_arena(32);
     ret += test_seq4();
     ret += test_seqof5();
+    ret += test_seqof5_borrowed();
+    ret += test_asn1_buf();
 
     return ret;
 }
@@ -279,7 +279,6 @@ test_seqof3(void)
     return ret;
 }
 
-
 static int
 test_seqof4(void)
 {
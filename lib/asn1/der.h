@@ -97,10 +97,20 @@ typedef struct heim_ber_time_t {
 } heim_ber_time_t;
 
 struct asn1_template;
+struct asn1_arena;
+struct asn1_buf;
 
 #include <der-protos.h>
 
 int _heim_fix_dce(size_t reallen, size_t *len);
+struct asn1_arena * ASN1CALL _asn1_arena_enter(struct asn1_arena *);
+void ASN1CALL _asn1_arena_leave(struct asn1_arena *);
+int ASN1CALL _asn1_borrow_enter(void);
+void ASN1CALL _asn1_borrow_leave(int);
+void * ASN1CALL _der_malloc(size_t);
+void * ASN1CALL _der_calloc(size_t, size_t);
+void * ASN1CALL _der_realloc(void *, size_t);
+void ASN1CALL _der_free(void *);
 int _heim_der_set_sort(const void *, const void *);
 int _heim_time2generalizedtime (time_t, heim_octet_string *, int);
 
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "der_locl.h"
+#include <heim_threads.h>
+
+/*
+ * Arena decoding.  While an arena is entered on a thread, every
+ * allocation the decoders make goes through _der_malloc() and friends
+ * and is carved out of the arena, and every _der_free() is ignored.
+ * The decoded value is then released all at once with
+ * asn1_arena_reset() or asn1_arena_destroy() instead of with free_*().
+ *
+ * Outside of an arena the wrappers are plain malloc(3) and free(3).
+ */
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HDR ARENA_ROUND(sizeof(size_t))
+#define ARENA_DEFAULT_SIZE 4096
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;		/* usable bytes following the header */
+};
+
+#define ARENA_CHUNK_HDR ARENA_ROUND(sizeof(struct arena_chunk))
+
+struct asn1_arena {
+    struct arena_chunk *chunks;	/* the one allocated from first */
+    unsigned char *ptr;		/* free space in chunks */
+    size_t left;
+    unsigned char *last;	/* latest allocation, can grow in place */
+    size_t chunk_size;
+    size_t used;
+};
+
+static HEIMDAL_THREAD_LOCAL struct asn1_arena *current_arena;
+
+/**
+ * Create an arena that allocates `chunk_size' bytes (or a default
+ * size if 0) from the system at a time.
+ */
+
+int ASN1CALL
+asn1_arena_create(size_t chunk_size, struct asn1_arena **arena)
+{
+    struct asn1_arena *a;
+
+    *arena = NULL;
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+	return ENOMEM;
+    a->chunk_size = chunk_size ? ARENA_ROUND(chunk_size) : ARENA_DEFAULT_SIZE;
+    *arena = a;
+    return 0;
+}
+
+/**
+ * Release everything decoded into `arena', keeping one chunk around
+ * for the next use.  Released memory is cleared first, as decoded
+ * values may hold keys.
+ */
+
+void ASN1CALL
+asn1_arena_reset(struct asn1_arena *arena)
+{
+    struct arena_chunk *c, *next, *keep = NULL;
+
+    if (arena == NULL)
+	return;
+    for (c = arena->chunks; c != NULL; c = next) {
+	next = c->next;
+	if (keep == NULL && c->size == arena->chunk_size) {
+	    keep = c;
+	    continue;
+	}
+	memset_s((unsigned char *)c + ARENA_CHUNK_HDR, c->size, 0, c->size);
+	free(c);
+    }
+    arena->chunks = keep;
+    arena->ptr = NULL;
+    arena->left = 0;
+    if (keep) {
+	keep->next = NULL;
+	arena->ptr = (unsigned char *)keep + ARENA_CHUNK_HDR;
+	arena->left = keep->size;
+	memset_s(arena->ptr, keep->size, 0, keep->size);
+    }
+    arena->last = NULL;
+    arena->used = 0;
+}
+
+void ASN1CALL
+asn1_arena_destroy(struct asn1_arena *arena)
+{
+    if (arena == NULL)
+	return;
+    asn1_arena_reset(arena);
+    if (arena->chunks) {
+	memset_s(arena->chunks, ARENA_CHUNK_HDR, 0, ARENA_CHUNK_HDR);
+	free(arena->chunks);
+    }
+    free(arena);
+}
+
+/**
+ * Bytes handed out by `arena' since it was created or last reset.
+ */
+
+size_t ASN1CALL
+asn1_arena_used(const struct asn1_arena *arena)
+{
+    return arena->used;
+}
+
+static void *
+arena_alloc(struct asn1_arena *a, size_t n)
+{
+    unsigned char *p;
+    size_t need;
+
+    if (n > SIZE_MAX - ARENA_HDR - ARENA_ALIGN)
+	return NULL;
+    need = ARENA_HDR + ARENA_ROUND(n);
+    if (need > a->left) {
+	struct arena_chunk *c;
+	size_t size = need > a->chunk_size ? need : a->chunk_size;
+
+	if (size > SIZE_MAX - ARENA_CHUNK_HDR)
+	    return NULL;
+	c = malloc(ARENA_CHUNK_HDR + size);
+	if (c == NULL)
+	    return NULL;
+	c->size = size;
+	p = (unsigned char *)c + ARENA_CHUNK_HDR;
+	if (need > a->chunk_size && a->chunks) {
+	    /* Oversized: give it a chunk of its own, keep using the current */
+	    c->next = a->chunks->next;
+	    a->chunks->next = c;
+	    *(size_t *)p = n;
+	    a->used += need;
+	    return p + ARENA_HDR;
+	}
+	c->next = a->chunks;
+	a->chunks = c;
+	a->ptr = p;
+	a->left = size;
+    }
+    p = a->ptr;
+    *(size_t *)p = n;
+    a->ptr += need;
+    a->left -= need;
+    a->used += need;
+    a->last = p + ARENA_HDR;
+    return a->last;
+}
+
+static void *
+arena_realloc(struct asn1_arena *a, void *old, size_t n)
+{
+    size_t *oldn;
+    void *p;
+
+    if (old == NULL)
+	return arena_alloc(a, n);
+    oldn = (size_t *)((unsigned char *)old - ARENA_HDR);
+    if (n <= *oldn)
+	return old;
+    if (n > SIZE_MAX - ARENA_HDR - ARENA_ALIGN)
+	return NULL;
+
+    /* SEQUENCE OF arrays mostly grow while they are the latest allocation */
+    if (old == a->last &&
+	ARENA_ROUND(n) - ARENA_ROUND(*oldn) <= a->left) {
+	size_t delta = ARENA_ROUND(n) - ARENA_ROUND(*oldn);
+
+	a->ptr += delta;
+	a->left -= delta;
+	a->used += delta;
+	*oldn = n;
+	return old;
+    }
+
+    p = arena_alloc(a, n);
+    if (p)
+	memcpy(p, old, *oldn);
+    return p;
+}
+
+/*
+ * Make `arena' (which may be NULL) the one decoders on this thread
+ * allocate from.  Returns the arena to restore with _asn1_arena_leave().
+ */
+
+struct asn1_arena * ASN1CALL
+_asn1_arena_enter(struct asn1_arena *arena)
+{
+    struct asn1_arena *prev = current_arena;
+
+    current_arena = arena;
+    return prev;
+}
+
+void ASN1CALL
+_asn1_arena_leave(struct asn1_arena *prev)
+{
+    current_arena = prev;
+}
+
+void * ASN1CALL
+_der_malloc(size_t n)
+{
+    if (current_arena)
+	return arena_alloc(current_arena, n);
+    return malloc(n);
+}
+
+void * ASN1CALL
+_der_calloc(size_t count, size_t n)
+{
+    void *p;
+
+    if (current_arena == NULL)
+	return calloc(count, n);
+    if (n && count > SIZE_MAX / n)
+	return NULL;
+    p = arena_alloc(current_arena, count * n);
+    if (p)
+	memset(p, 0, count * n);
+    return p;
+}
+
+void * ASN1CALL
+_der_realloc(void *ptr, size_t n)
+{
+    if (current_arena)
+	return arena_realloc(current_arena, ptr, n);
+    return realloc(ptr, n);
+}
+
+void ASN1CALL
+_der_free(void *ptr)
+{
+    if (current_arena == NULL)
+	free(ptr);
+}
+
+/*
+ * Borrowed decoding.  While borrowing, der_get_octet_string() and the
+ * other decoders of raw octets point into the input buffer instead of
+ * copying from it, and der_free_octet_string() only forgets the
+ * pointer.  The decoded value must not outlive the input.
+ */
+
+static HEIMDAL_THREAD_LOCAL int borrowing;
+
+int ASN1CALL
+_asn1_borrow_enter(void)
+{
+    int prev = borrowing;
+
+    borrowing = 1;
+    return prev;
+}
+
+void ASN1CALL
+_asn1_borrow_leave(int prev)
+{
+    borrowing = prev;
+}
+
+int
+_asn1_borrowing(void)
+{
+    return borrowing;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "der_locl.h"
+#include <heim_threads.h>
+
+/*
+ * Reusable output buffers for single pass encoding.
+ *
+ * The encoders write backwards from the end of the buffer they are
+ * given and fail with ASN1_OVERFLOW when they reach its start, so
+ * instead of running length_*() first and allocating exactly, encode
+ * into a buffer that is kept around and only grow it (and encode
+ * again) when it turns out to be too small.  Once the buffer has
+ * grown to fit the usual messages every encode is one traversal and
+ * no allocation.
+ *
+ * A NULL buffer means one private to the calling thread.  It is also
+ * registered with a thread key so that it is freed when the thread
+ * exits.
+ */
+
+#define ASN1_BUF_DEFAULT_SIZE 2048
+#define ASN1_BUF_MAX_SIZE (64 * 1024 * 1024)
+
+struct asn1_buf {
+    unsigned char *data;
+    size_t size;
+    size_t used;		/* length of the latest encoding */
+};
+
+static HEIMDAL_THREAD_LOCAL struct asn1_buf *thread_buf;
+
+static HEIMDAL_MUTEX thread_buf_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static HEIMDAL_thread_key thread_buf_key;
+static int created_key;
+
+static void
+destroy_thread_buf(void *ptr)
+{
+    struct asn1_buf *b = ptr;
+
+    if (b == NULL)
+	return;
+    memset_s(b->data, b->size, 0, b->size);
+    free(b->data);
+    free(b);
+}
+
+int ASN1CALL
+asn1_buf_create(size_t size, struct asn1_buf **buf)
+{
+    struct asn1_buf *b;
+
+    *buf = NULL;
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+	return ENOMEM;
+    b->size = size ? size : ASN1_BUF_DEFAULT_SIZE;
+    b->data = malloc(b->size);
+    if (b->data == NULL) {
+	free(b);
+	return ENOMEM;
+    }
+    *buf = b;
+    return 0;
+}
+
+/**
+ * Free `buf', or the calling thread's buffer if `buf' is NULL.
+ */
+
+void ASN1CALL
+asn1_buf_destroy(struct asn1_buf *buf)
+{
+    int ret;
+
+    if (buf == NULL) {
+	buf = thread_buf;
+	thread_buf = NULL;
+	if (buf == NULL)
+	    return;
+	HEIMDAL_setspecific(thread_buf_key, NULL, ret);
+	(void) ret;
+    }
+    destroy_thread_buf(buf);
+}
+
+static struct asn1_buf *
+get_buf(struct asn1_buf *buf)
+{
+    int ret = 0;
+
+    if (buf)
+	return buf;
+    if (thread_buf)
+	return thread_buf;
+
+    HEIMDAL_MUTEX_lock(&thread_buf_mutex);
+    if (!created_key) {
+	HEIMDAL_key_create(&thread_buf_key, destroy_thread_buf, ret);
+	if (ret == 0)
+	    created_key = 1;
+    }
+    HEIMDAL_MUTEX_unlock(&thread_buf_mutex);
+    if (ret)
+	return NULL;
+
+    if (asn1_buf_create(0, &buf))
+	return NULL;
+    HEIMDAL_setspecific(thread_buf_key, buf, ret);
+    if (ret) {
+	destroy_thread_buf(buf);
+	return NULL;
+    }
+    thread_buf = buf;
+    return thread_buf;
+}
+
+/*
+ * Double the buffer.  The contents are not kept (the caller encodes
+ * again), but they are cleared as they may hold keys.
+ */
+
+static int
+grow_buf(struct asn1_buf *b)
+{
+    unsigned char *p;
+    size_t size;
+
+    if (b->size >= ASN1_BUF_MAX_SIZE)
+	return ASN1_OVERFLOW;
+    size = b->size * 2;
+    p = malloc(size);
+    if (p == NULL)
+	return ENOMEM;
+    memset_s(b->data, b->size, 0, b->size);
+    free(b->data);
+    b->data = p;
+    b->size = size;
+    return 0;
+}
+
+/**
+ * Encode `data' with `encoder' (an encode_*() function) into `buf'.
+ * On success `*out' points to the `*size' bytes of the encoding at the
+ * end of the buffer; they stay valid until the next use of `buf'.
+ */
+
+int ASN1CALL
+asn1_buf_encode(struct asn1_buf *buf, asn1_buf_encoder encoder,
+		const void *data, void **out, size_t *size)
+{
+    struct asn1_buf *b = get_buf(buf);
+    size_t len = 0;
+    int ret;
+
+    *out = NULL;
+    *size = 0;
+    if (b == NULL)
+	return ENOMEM;
+
+    while ((ret = (*encoder)(b->data + b->size - 1, b->size, data, &len))
+	   == ASN1_OVERFLOW) {
+	ret = grow_buf(b);
+	if (ret)
+	    break;
+    }
+    if (ret) {
+	b->used = 0;
+	return ret;
+    }
+    b->used = len;
+    *out = b->data + b->size - len;
+    *size = len;
+    return 0;
+}
+
+/**
+ * Like asn1_buf_encode(), but return the encoding in memory from
+ * malloc(3), and clear it from `buf'.
+ */
+
+int ASN1CALL
+asn1_buf_encode_copy(struct asn1_buf *buf, asn1_buf_encoder encoder,
+		     const void *data, void **out, size_t *size)
+{
+    void *p;
+    int ret;
+
+    ret = asn1_buf_encode(buf, encoder, data, &p, size);
+    if (ret)
+	return ret;
+    *out = malloc(*size ? *size : 1);
+    if (*out)
+	memcpy(*out, p, *size);
+    else
+	ret = ENOMEM;
+    asn1_buf_clear(buf);
+    if (ret)
+	*size = 0;
+    return ret;
+}
+
+/**
+ * Clear the latest encoding in `buf', for when it held secrets.
+ */
+
+void ASN1CALL
+asn1_buf_clear(struct asn1_buf *buf)
+{
+    struct asn1_buf *b = buf ? buf : thread_buf;
+
+    if (b == NULL || b->used == 0)
+	return;
+    memset_s(b->data + b->size - b->used, b->used, 0, b->used);
+    b->used = 0;
+}
@@ -40,7 +40,7 @@ RCSID("$Id$");
 void
 der_free_general_string (heim_general_string *str)
 {
-    free(*str);
+    _der_free(*str);
     *str = NULL;
 }
 
@@ -84,26 +84,28 @@ der_free_utctime(time_t *t)
 void
 der_free_utf8string (heim_utf8_string *str)
 {
-    free(*str);
+    _der_free(*str);
     *str = NULL;
 }
 
 void
 der_free_printable_string (heim_printable_string *str)
 {
-    der_free_octet_string(str);
+    _der_free(str->data);
+    str->data = NULL;
+    str->length = 0;
 }
 
 void
 der_free_ia5_string (heim_ia5_string *str)
 {
-    der_free_octet_string(str);
+    der_free_printable_string(str);
 }
 
 void
 der_free_bmp_string (heim_bmp_string *k)
 {
-    free(k->data);
+    _der_free(k->data);
     k->data = NULL;
     k->length = 0;
 }
@@ -111,7 +113,7 @@ der_free_bmp_string (heim_bmp_string *k)
 void
 der_free_universal_string (heim_universal_string *k)
 {
-    free(k->data);
+    _der_free(k->data);
     k->data = NULL;
     k->length = 0;
 }
@@ -119,14 +121,15 @@ der_free_universal_string (heim_universal_string *k)
 void
 der_free_visible_string (heim_visible_string *str)
 {
-    free(*str);
+    _der_free(*str);
     *str = NULL;
 }
 
 void
 der_free_octet_string (heim_octet_string *k)
 {
-    free(k->data);
+    if (!_asn1_borrowing())
+	_der_free(k->data);
     k->data = NULL;
     k->length = 0;
 }
@@ -134,7 +137,7 @@ der_free_octet_string (heim_octet_string *k)
 void
 der_free_heim_integer (heim_integer *k)
 {
-    free(k->data);
+    _der_free(k->data);
     k->data = NULL;
     k->length = 0;
 }
@@ -142,7 +145,7 @@ der_free_heim_integer (heim_integer *k)
 void
 der_free_oid (heim_oid *k)
 {
-    free(k->components);
+    _der_free(k->components);
     k->components = NULL;
     k->length = 0;
 }
@@ -150,7 +153,7 @@ der_free_oid (heim_oid *k)
 void
 der_free_bit_string (heim_bit_string *k)
 {
-    free(k->data);
+    _der_free(k->data);
     k->data = NULL;
     k->length = 0;
 }
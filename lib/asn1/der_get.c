@@ -193,7 +193,7 @@ der_get_general_string (const unsigned char *p, size_t len,
 	return ASN1_BAD_LENGTH;
     }
 
-    *str = s = malloc (len + 1);
+    *str = s = _der_malloc(len + 1);
     if (s == NULL)
 	return ENOMEM;
     memcpy (s, p, len);
@@ -222,7 +222,7 @@ der_get_printable_string(const unsigned char *p, size_t len,
 	return ASN1_BAD_LENGTH;
     }
     str->length = len;
-    str->data = malloc(len + 1);
+    str->data = _der_malloc(len + 1);
     if (str->data == NULL) {
 	gen_data_zero(str);
 	return ENOMEM;
@@ -255,7 +255,7 @@ der_get_bmp_string (const unsigned char *p, size_t len,
 	gen_data_zero(data);
 	return ERANGE;
     }
-    data->data = malloc(data->length * sizeof(data->data[0]));
+    data->data = _der_malloc(data->length * sizeof(data->data[0]));
     if (data->data == NULL && data->length != 0) {
 	gen_data_zero(data);
 	return ENOMEM;
@@ -266,7 +266,7 @@ der_get_bmp_string (const unsigned char *p, size_t len,
 	p += 2;
 	/* check for NUL in the middle of the string */
 	if (data->data[i] == 0 && i != (data->length - 1)) {
-	    free(data->data);
+	    _der_free(data->data);
 	    gen_data_zero(data);
 	    return ASN1_BAD_CHARACTER;
 	}
@@ -291,7 +291,7 @@ der_get_universal_string (const unsigned char *p, size_t len,
 	gen_data_zero(data);
 	return ERANGE;
     }
-    data->data = malloc(data->length * sizeof(data->data[0]));
+    data->data = _der_malloc(data->length * sizeof(data->data[0]));
     if (data->data == NULL && data->length != 0) {
 	gen_data_zero(data);
 	return ENOMEM;
@@ -302,7 +302,7 @@ der_get_universal_string (const unsigned char *p, size_t len,
 	p += 4;
 	/* check for NUL in the middle of the string */
 	if (data->data[i] == 0 && i != (data->length - 1)) {
-	    free(data->data);
+	    _der_free(data->data);
 	    gen_data_zero(data);
 	    return ASN1_BAD_CHARACTER;
 	}
@@ -323,7 +323,12 @@ der_get_octet_string (const unsigned char *p, size_t len,
 		      heim_octet_string *data, size_t *size)
 {
     data->length = len;
-    data->data = malloc(len);
+    if (_asn1_borrowing()) {
+	data->data = len ? rk_UNCONST(p) : NULL;
+	if(size) *size = len;
+	return 0;
+    }
+    data->data = _der_malloc(len);
     if (data->data == NULL && data->length != 0)
 	return ENOMEM;
     memcpy (data->data, p, len);
@@ -374,7 +379,20 @@ der_get_octet_string_ber (const unsigned char *p, size_t len,
 	if (type == PRIM) {
 	    void *ptr;
 
-	    ptr = realloc(data->data, data->length + datalen);
+	    /* A borrowed string has to be one contiguous segment */
+	    if (_asn1_borrowing()) {
+		if (depth != 0 || data->length != 0) {
+		    e = ASN1_BAD_FORMAT;
+		    goto out;
+		}
+		data->data = datalen ? rk_UNCONST(p) : NULL;
+		data->length = datalen;
+		p += datalen;
+		len -= datalen;
+		continue;
+	    }
+
+	    ptr = _der_realloc(data->data, data->length + datalen);
 	    if (ptr == NULL) {
 		e = ENOMEM;
 		goto out;
@@ -393,7 +411,8 @@ der_get_octet_string_ber (const unsigned char *p, size_t len,
     if(size) *size = oldlen - len;
     return 0;
  out:
-    free(data->data);
+    if (!_asn1_borrowing())
+	_der_free(data->data);
     data->data = NULL;
     data->length = 0;
     return e;
@@ -424,7 +443,7 @@ der_get_heim_integer (const unsigned char *p, size_t len,
 	    p++;
 	    data->length--;
 	}
-	data->data = malloc(data->length);
+	data->data = _der_malloc(data->length);
 	if (data->data == NULL) {
 	    data->length = 0;
 	    if (size)
@@ -448,7 +467,7 @@ der_get_heim_integer (const unsigned char *p, size_t len,
 	    p++;
 	    data->length--;
 	}
-	data->data = malloc(data->length);
+	data->data = _der_malloc(data->length);
 	if (data->data == NULL && data->length != 0) {
 	    data->length = 0;
 	    if (size)
@@ -496,13 +515,13 @@ der_get_time (const unsigned char *p, size_t len,
     if (len == SIZE_MAX || len == 0)
 	return ASN1_BAD_LENGTH;
 
-    times = malloc(len + 1);
+    times = _der_malloc(len + 1);
     if (times == NULL)
 	return ENOMEM;
     memcpy(times, p, len);
     times[len] = '\0';
     e = generalizedtime2time(times, data);
-    free (times);
+    _der_free(times);
     if(size) *size = len;
     return e;
 }
@@ -537,7 +556,7 @@ der_get_oid (const unsigned char *p, size_t len,
     if (len + 1 > UINT_MAX/sizeof(data->components[0]))
 	return ERANGE;
 
-    data->components = malloc((len + 1) * sizeof(data->components[0]));
+    data->components = _der_malloc((len + 1) * sizeof(data->components[0]));
     if (data->components == NULL)
 	return ENOMEM;
     data->components[0] = (*p) / 40;
@@ -701,7 +720,7 @@ der_get_bit_string (const unsigned char *p, size_t len,
      */
     if (len - 1 > 0) {
 	data->length = (len - 1) * 8;
-	data->data = malloc(len - 1);
+	data->data = _der_malloc(len - 1);
 	if (data->data == NULL)
 	    return ENOMEM;
 	memcpy (data->data, p + 1, len - 1);
@@ -72,11 +72,9 @@ decode_heim_any(const unsigned char *p, size_t len,
 	    return ASN1_OVERFLOW;
     }
 
-    data->data = malloc(length + len_len + l);
-    if (data->data == NULL)
-	return ENOMEM;
-    data->length = length + len_len + l;
-    memcpy(data->data, p, length + len_len + l);
+    e = der_get_octet_string(p, length + len_len + l, data, NULL);
+    if (e)
+	return e;
 
     if (size)
 	*size = length + len_len + l;
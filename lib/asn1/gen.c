@@ -244,7 +244,29 @@ init_generate (const char *filename, const char *base)
 	  "#define ASN1CALL\n"
 	  "#endif\n",
 	  headerfile);
-    fprintf (headerfile, "struct units;\n\n");
+    fprintf (headerfile, "struct units;\n");
+    fprintf (headerfile, "struct asn1_arena;\n");
+    fprintf (headerfile, "struct asn1_buf;\n\n");
+    fputs("typedef int (ASN1CALL *asn1_buf_encoder)(unsigned char *, size_t,\n"
+	  "\t\t\t\t\t const void *, size_t *);\n\n",
+	  headerfile);
+    fputs("#define ASN1_BUF_ENCODE(T, AB, B, BL, S, R)                    \\\n"
+	  "  do {                                                         \\\n"
+	  "    void *asn1_buf_p_;                                         \\\n"
+	  "    (R) = asn1_buf_encode((AB), asn1_buf_encoder_##T,          \\\n"
+	  "                          (S), &asn1_buf_p_, &(BL));           \\\n"
+	  "    (B) = asn1_buf_p_;                                         \\\n"
+	  "  } while (0)\n"
+	  "\n"
+	  "#define ASN1_BUF_MALLOC_ENCODE(T, AB, B, BL, S, R)             \\\n"
+	  "  do {                                                         \\\n"
+	  "    void *asn1_buf_p_;                                         \\\n"
+	  "    (R) = asn1_buf_encode_copy((AB),                           \\\n"
+	  "                               asn1_buf_encoder_##T,           \\\n"
+	  "                               (S), &asn1_buf_p_, &(BL));      \\\n"
+	  "    (B) = asn1_buf_p_;                                         \\\n"
+	  "  } while (0)\n\n",
+	  headerfile);
     fprintf (headerfile, "#endif\n\n");
     if (asprintf(&fn, "%s_files", base) < 0 || fn == NULL)
 	errx(1, "malloc");
@@ -1080,6 +1102,8 @@ generate_type (const Symbol *s)
 	generate_type_copy (s);
     }
     generate_type_seq (s);
+    generate_type_arena (s);
+    generate_type_borrow (s);
     generate_glue (s->type, s->gen_name);
 
     /* generate prototypes */
@@ -1114,6 +1138,17 @@ generate_type (const Symbol *s)
 	     "%svoid   ASN1CALL free_%s  (%s *);\n",
 	     exp,
 	     s->gen_name, s->gen_name);
+    /* Typed adapter for asn1_buf_encode(), see ASN1_BUF_ENCODE() */
+    fprintf (h,
+	     "#ifdef ASN1_BUF_ENCODERS\n"
+	     "static inline int ASN1CALL\n"
+	     "asn1_buf_encoder_%s(unsigned char *p, size_t len, "
+	     "const void *data, size_t *size)\n"
+	     "{\n"
+	     "    return encode_%s(p, len, (const %s *)data, size);\n"
+	     "}\n"
+	     "#endif\n",
+	     s->gen_name, s->gen_name, s->gen_name);
 
     fprintf(h, "\n\n");
 
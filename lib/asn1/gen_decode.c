@@ -216,7 +216,7 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
     case TType: {
 	if (optional)
 	    fprintf(codefile,
-		    "%s = calloc(1, sizeof(*%s));\n"
+		    "%s = _der_calloc(1, sizeof(*%s));\n"
 		    "if (%s == NULL) %s;\n",
 		    name, name, name, forwstr);
 	fprintf (codefile,
@@ -225,7 +225,7 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 	if (optional) {
 	    fprintf (codefile,
 		     "if(e) {\n"
-		     "free(%s);\n"
+		     "_der_free(%s);\n"
 		     "%s = NULL;\n"
 		     "} else {\n"
 		     "p += l; len -= l; ret += l;\n"
@@ -378,7 +378,7 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 		errx(1, "malloc");
 	    if(m->optional)
 		fprintf(codefile,
-			"%s = calloc(1, sizeof(*%s));\n"
+			"%s = _der_calloc(1, sizeof(*%s));\n"
 			"if (%s == NULL) { e = ENOMEM; %s; }\n",
 			s, s, s, forwstr);
 	    decode_type (s, m->type, 0, NULL, forwstr, m->gen_name, NULL, depth + 1);
@@ -439,7 +439,7 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 		 "size_t %s_nlen = %s_olen + sizeof(*((%s)->val));\n"
 		 "if (%s_olen > %s_nlen) { e = ASN1_OVERFLOW; %s; }\n"
 		 "%s_olen = %s_nlen;\n"
-		 "%s_tmp = realloc((%s)->val, %s_olen);\n"
+		 "%s_tmp = _der_realloc((%s)->val, %s_olen);\n"
 		 "if (%s_tmp == NULL) { e = ENOMEM; %s; }\n"
 		 "(%s)->val = %s_tmp;\n",
 		 tmpstr,
@@ -516,7 +516,7 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 		    "if(e) {\n"
 		    "%s = NULL;\n"
 		    "} else {\n"
-		     "%s = calloc(1, sizeof(*%s));\n"
+		     "%s = _der_calloc(1, sizeof(*%s));\n"
 		     "if (%s == NULL) { e = ENOMEM; %s; }\n",
 		     name, name, name, name, forwstr);
 	} else {
@@ -622,22 +622,15 @@ decode_type(const char *name, const Type *t, int optional, struct value *defval,
 	if (have_ellipsis) {
 	    fprintf(codefile,
 		    "else {\n"
-		    "(%s)->u.%s.data = calloc(1, len);\n"
-		    "if ((%s)->u.%s.data == NULL) {\n"
-		    "e = ENOMEM; %s;\n"
-		    "}\n"
-		    "(%s)->u.%s.length = len;\n"
-		    "memcpy((%s)->u.%s.data, p, len);\n"
+		    "e = der_get_octet_string(p, len, &(%s)->u.%s, NULL);\n"
+		    "if (e) %s;\n"
 		    "(%s)->element = %s;\n"
 		    "p += len;\n"
 		    "ret += len;\n"
 		    "len = 0;\n"
 		    "}\n",
 		    name, have_ellipsis->gen_name,
-		    name, have_ellipsis->gen_name,
 		    forwstr,
-		    name, have_ellipsis->gen_name,
-		    name, have_ellipsis->gen_name,
 		    name, have_ellipsis->label);
 	} else {
 	    fprintf(codefile,
@@ -731,12 +724,8 @@ generate_type_decode (const Symbol *s)
 	decode_type("data", s->type, 0, NULL, "goto fail", "Top", NULL, 1);
 	if (preserve)
 	    fprintf (codefile,
-		     "data->_save.data = calloc(1, ret);\n"
-		     "if (data->_save.data == NULL) { \n"
-		     "e = ENOMEM; goto fail; \n"
-		     "}\n"
-		     "data->_save.length = ret;\n"
-		     "memcpy(data->_save.data, begin, ret);\n");
+		     "e = der_get_octet_string(begin, ret, &data->_save, NULL);\n"
+		     "if (e) goto fail;\n");
 	fprintf (codefile,
 		 "if(size) *size = ret;\n"
 		 "return 0;\n");
@@ -751,3 +740,96 @@ generate_type_decode (const Symbol *s)
     }
     fprintf (codefile, "}\n\n");
 }
+
+/*
+ * Generate decode_X_arena()/free_X_arena() for the types named with
+ * --arena.  All memory for the decoded value comes from the arena, so
+ * freeing is just forgetting; the arena itself is reset or destroyed
+ * by the caller.
+ */
+
+void
+generate_type_arena (const Symbol *s)
+{
+    FILE *f = codefile;
+
+    if (!arena_type(s->name))
+	return;
+
+    /* With --template the per-type code files are not compiled */
+    if (template_flag && !one_code_file)
+	f = templatefile;
+
+    fprintf (headerfile,
+	     "ASN1EXP int   ASN1CALL decode_%s_arena(const unsigned char *, size_t, %s *, size_t *, struct asn1_arena *);\n"
+	     "ASN1EXP void  ASN1CALL free_%s_arena(%s *);\n",
+	     s->gen_name, s->gen_name,
+	     s->gen_name, s->gen_name);
+
+    fprintf (f, "int ASN1CALL\n"
+	     "decode_%s_arena(const unsigned char *p, size_t len, "
+	     "%s *data, size_t *size, struct asn1_arena *arena)\n"
+	     "{\n"
+	     "struct asn1_arena *prev;\n"
+	     "int ret;\n\n"
+	     "prev = _asn1_arena_enter(arena);\n"
+	     "ret = decode_%s(p, len, data, size);\n"
+	     "_asn1_arena_leave(prev);\n"
+	     "return ret;\n"
+	     "}\n\n",
+	     s->gen_name, s->gen_name, s->gen_name);
+
+    fprintf (f, "void ASN1CALL\n"
+	     "free_%s_arena(%s *data)\n"
+	     "{\n"
+	     "memset(data, 0, sizeof(*data));\n"
+	     "}\n\n",
+	     s->gen_name, s->gen_name);
+}
+
+/*
+ * Generate decode_X_borrowed()/free_X_borrowed() for the types named
+ * with --borrow.  The OCTET STRINGs of the decoded value point into the
+ * input buffer, which has to outlive the value; free_X_borrowed()
+ * releases everything else.
+ */
+
+void
+generate_type_borrow (const Symbol *s)
+{
+    FILE *f = codefile;
+
+    if (!borrow_type(s->name))
+	return;
+
+    if (template_flag && !one_code_file)
+	f = templatefile;
+
+    fprintf (headerfile,
+	     "ASN1EXP int   ASN1CALL decode_%s_borrowed(const unsigned char *, size_t, %s *, size_t *);\n"
+	     "ASN1EXP void  ASN1CALL free_%s_borrowed(%s *);\n",
+	     s->gen_name, s->gen_name,
+	     s->gen_name, s->gen_name);
+
+    fprintf (f, "int ASN1CALL\n"
+	     "decode_%s_borrowed(const unsigned char *p, size_t len, "
+	     "%s *data, size_t *size)\n"
+	     "{\n"
+	     "int prev, ret;\n\n"
+	     "prev = _asn1_borrow_enter();\n"
+	     "ret = decode_%s(p, len, data, size);\n"
+	     "_asn1_borrow_leave(prev);\n"
+	     "return ret;\n"
+	     "}\n\n",
+	     s->gen_name, s->gen_name, s->gen_name);
+
+    fprintf (f, "void ASN1CALL\n"
+	     "free_%s_borrowed(%s *data)\n"
+	     "{\n"
+	     "int prev;\n\n"
+	     "prev = _asn1_borrow_enter();\n"
+	     "free_%s(data);\n"
+	     "_asn1_borrow_leave(prev);\n"
+	     "}\n\n",
+	     s->gen_name, s->gen_name, s->gen_name);
+}
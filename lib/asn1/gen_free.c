@@ -102,7 +102,7 @@ free_type (const char *name, const Type *t, int preserve)
 	    free_type (s, m->type, FALSE);
 	    if(m->optional)
 		fprintf(codefile,
-			"free(%s);\n"
+			"_der_free(%s);\n"
 			"%s = NULL;\n"
 			"}\n",s, s);
 	    free (s);
@@ -135,7 +135,7 @@ free_type (const char *name, const Type *t, int preserve)
 		"}\n",
 		name);
 	fprintf(codefile,
-		"free((%s)->val);\n"
+		"_der_free((%s)->val);\n"
 		"(%s)->val = NULL;\n", name, name);
 	free(n);
 	break;
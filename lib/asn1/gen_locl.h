@@ -59,6 +59,8 @@ void generate_constant (const Symbol *);
 void generate_type_encode (const Symbol *);
 void generate_type_decode (const Symbol *);
 void generate_type_free (const Symbol *);
+void generate_type_arena (const Symbol *);
+void generate_type_borrow (const Symbol *);
 void generate_type_length (const Symbol *);
 void generate_type_copy (const Symbol *);
 void generate_type_seq (const Symbol *);
@@ -82,6 +84,8 @@ int is_primitive_type(int);
 
 int preserve_type(const char *);
 int seq_type(const char *);
+int arena_type(const char *);
+int borrow_type(const char *);
 
 void generate_header_of_codefile(const char *);
 void close_codefile(void);
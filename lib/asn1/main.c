@@ -39,6 +39,8 @@ extern FILE *yyin;
 
 static getarg_strings preserve;
 static getarg_strings seq;
+static getarg_strings arena;
+static getarg_strings borrow;
 
 int
 preserve_type(const char *p)
@@ -60,6 +62,26 @@ seq_type(const char *p)
     return 0;
 }
 
+int
+arena_type(const char *p)
+{
+    int i;
+    for (i = 0; i < arena.num_strings; i++)
+	if (strcmp(arena.strings[i], p) == 0)
+	    return 1;
+    return 0;
+}
+
+int
+borrow_type(const char *p)
+{
+    int i;
+    for (i = 0; i < borrow.num_strings; i++)
+	if (strcmp(borrow.strings[i], p) == 0)
+	    return 1;
+    return 0;
+}
+
 const char *fuzzer_string = "";
 int fuzzer_flag;
 int support_ber;
@@ -79,6 +101,8 @@ struct getargs args[] = {
     { "support-ber", 0, arg_flag, &support_ber, NULL, NULL },
     { "preserve-binary", 0, arg_strings, &preserve, NULL, NULL },
     { "sequence", 0, arg_strings, &seq, NULL, NULL },
+    { "arena", 0, arg_strings, &arena, NULL, NULL },
+    { "borrow", 0, arg_strings, &borrow, NULL, NULL },
     { "one-code-file", 0, arg_flag, &one_code_file, NULL, NULL },
     { "option-file", 0, arg_string, &option_file, NULL, NULL },
     { "parse-units", 0, arg_negative_flag, &parse_units_flag, NULL, NULL },
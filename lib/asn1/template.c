@@ -170,7 +170,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    }
 
 	    if (t->tt & A1_FLAG_OPTIONAL) {
-		*pel = calloc(1, elsize);
+		*pel = _der_calloc(1, elsize);
 		if (*pel == NULL)
 		    return ENOMEM;
 		el = *pel;
@@ -183,7 +183,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    }
 	    if (ret) {
 		if (t->tt & A1_FLAG_OPTIONAL) {
-		    free(*pel);
+		    _der_free(*pel);
 		    *pel = NULL;
 		    break;
 		}
@@ -244,7 +244,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		void **el = (void **)data;
 		size_t ellen = _asn1_sizeofType(t->ptr);
 
-		*el = calloc(1, ellen);
+		*el = _der_calloc(1, ellen);
 		if (*el == NULL)
 		    return ENOMEM;
 		data = *el;
@@ -322,7 +322,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		if (vallength > newlen)
 		    return ASN1_OVERFLOW;
 
-		tmp = realloc(el->val, newlen);
+		tmp = _der_realloc(el->val, newlen);
 		if (tmp == NULL)
 		    return ENOMEM;
 
@@ -425,15 +425,9 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
      * verification.
      */
     if (startp) {
-	heim_octet_string *save = data;
-
-	save->data = malloc(oldlen);
-	if (save->data == NULL)
-	    return ENOMEM;
-	else {
-	    save->length = oldlen;
-	    memcpy(save->data, startp, oldlen);
-	}
+	ret = der_get_octet_string(startp, oldlen, data, NULL);
+	if (ret)
+	    return ret;
     }
     return 0;
 }
@@ -852,7 +846,7 @@ _asn1_free(const struct asn1_template *t, void *data)
 		(f->release)(el);
 	    }
 	    if (t->tt & A1_FLAG_OPTIONAL)
-		free(el);
+		_der_free(el);
 
 	    break;
 	}
@@ -880,7 +874,7 @@ _asn1_free(const struct asn1_template *t, void *data)
 	    _asn1_free(t->ptr, el);
 
 	    if (t->tt & A1_FLAG_OPTIONAL)
-		free(el);
+		_der_free(el);
 
 	    break;
 	}
@@ -895,7 +889,7 @@ _asn1_free(const struct asn1_template *t, void *data)
 		_asn1_free(t->ptr, element);
 		element += ellen;
 	    }
-	    free(el->val);
+	    _der_free(el->val);
 	    el->val = NULL;
 	    el->len = 0;
 
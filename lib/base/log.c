@@ -41,6 +41,11 @@
 #include <stdarg.h>
 #include <vis.h>
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define HEIM_LOG_USE_THREADS 1
+#endif
+
 struct heim_log_facility_internal {
     int min;
     int max;
@@ -227,6 +232,7 @@ struct file_data {
     const char *mode;
     struct timeval tv;
     FILE *fd;
+    HEIMDAL_MUTEX lock;     /* for fd and tv; a facility may be shared */
     int disp;
 #define FILEDISP_KEEPOPEN       0x1
 #define FILEDISP_REOPEN         0x2
@@ -237,15 +243,16 @@ struct file_data {
 #define O_CLOEXEC 0
 #endif
 
-static void
-log_file(heim_context context, const char *timestr, const char *msg, void *data)
+/*
+ * Return the stream to log to, opening the file if need be, or NULL if
+ * it cannot be opened (or is known not to exist).
+ */
+static FILE *
+log_file_open(struct file_data *f)
 {
     struct timeval tv;
-    struct file_data *f = data;
     FILE *logf = f->fd;
-    char *msgclean;
     size_t i = 0;
-    size_t j;
 
     if (logf == NULL || (f->disp & FILEDISP_REOPEN)) {
         int flags = O_WRONLY|O_APPEND;
@@ -264,7 +271,7 @@ log_file(heim_context context, const char *timestr, const char *msg, void *data)
             /* Cache failure for 1s */
             gettimeofday(&tv, NULL);
             if (tv.tv_sec == f->tv.tv_sec)
-                return;
+                return NULL;
         } else {
             flags |= O_CREAT;
         }
@@ -273,29 +280,60 @@ log_file(heim_context context, const char *timestr, const char *msg, void *data)
         if (fd == -1) {
             if (f->disp & FILEDISP_IFEXISTS)
                 gettimeofday(&f->tv, NULL);
-            return;
+            return NULL;
         }
         rk_cloexec(fd);
         logf = fdopen(fd, f->mode);
     }
     if (f->fd == NULL && (f->disp & FILEDISP_KEEPOPEN))
         f->fd = logf;
+    return logf;
+}
+
+/*
+ * Copy a log line into `buf' as "timestr msg\n", eating special
+ * characters:  we used to use strvisx(3) to encode the log, but this is
+ * inconsistent with our syslog(3) code which does not do this.  It also
+ * makes it inelegant to write data which has already been quoted such
+ * as what krb5_unparse_principal() gives us.  So, we change here to eat
+ * the special characters, instead.
+ *
+ * `buf' must have room for strlen(timestr) + strlen(msg) + 2 bytes.
+ * Returns the length of the line.
+ */
+static size_t
+log_file_line(char *buf, const char *timestr, const char *msg)
+{
+    size_t i, j = 0;
+
+    if (timestr) {
+        j = strlen(timestr);
+        memcpy(buf, timestr, j);
+    }
+    buf[j++] = ' ';
+    for (i = 0; msg[i]; i++)
+        if (msg[i] >= 32 || msg[i] == '\t')
+            buf[j++] = msg[i];
+    buf[j++] = '\n';
+    return j;
+}
+
+static void
+log_file(heim_context context, const char *timestr, const char *msg, void *data)
+{
+    struct file_data *f = data;
+    FILE *logf;
+    char *line;
+
+    HEIMDAL_MUTEX_lock(&f->lock);
+    logf = log_file_open(f);
+    HEIMDAL_MUTEX_unlock(&f->lock);
     if (logf == NULL)
         return;
-    /*
-     * make sure the log doesn't contain special chars:
-     * we used to use strvisx(3) to encode the log, but this is
-     * inconsistent with our syslog(3) code which does not do this.
-     * It also makes it inelegant to write data which has already
-     * been quoted such as what krb5_unparse_principal() gives us.
-     * So, we change here to eat the special characters, instead.
-     */
-    if (msg && (msgclean = strdup(msg))) {
-        for (i = 0, j = 0; msg[i]; i++)
-            if (msg[i] >= 32 || msg[i] == '\t')
-                msgclean[j++] = msg[i];
-        fprintf(logf, "%s %s\n", timestr ? timestr : "", msgclean);
-        free(msgclean);
+    if (msg && (line = malloc((timestr ? strlen(timestr) : 0) +
+                              strlen(msg) + 2)) != NULL) {
+        fwrite(line, log_file_line(line, timestr, msg), 1, logf);
+        free(line);
     }
     if (logf != f->fd)
         fclose(logf);
@@ -307,10 +345,287 @@ close_file(void *data)
     struct file_data *f = data;
     if (f->fd && f->fd != stdout && f->fd != stderr)
         fclose(f->fd);
+    HEIMDAL_MUTEX_destroy(&f->lock);
     free(f->filename);
     free(data);
 }
 
+#ifdef HEIM_LOG_USE_THREADS
+
+/*
+ * Asynchronous file logging (AFILE: and AFILE=).
+ *
+ * Callers of heim_log() only copy the line into a fixed size buffer;
+ * a writer thread swaps it with a second buffer and writes that out in
+ * one go, so the file is opened (for AFILE:) and written once per batch
+ * rather than once per line.  When the buffer is full lines are dropped
+ * instead of blocking the caller, and the number dropped is logged with
+ * the next line that fits.
+ *
+ * The writer is started by the first line logged in a process, so that
+ * a destination opened before fork(2) gets its own writer in the child
+ * (what the parent had buffered is left to the parent).  Fork handlers
+ * hold every destination's locks across fork(2), so that the child
+ * doesn't inherit one held by a writer thread that it doesn't have.
+ * Lines still buffered are written out by heim_closelog(); programs
+ * that log to AFILE must close their logs before they exit.  (An
+ * atexit(3) handler would be left dangling if the library is unloaded.)
+ */
+
+#define ASYNC_LOG_BUFSIZE (256 * 1024)
+
+struct async_file_data {
+    struct file_data file;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int running;                /* writer started in this process */
+    int closing;
+    int sync;                   /* no writer could be started */
+    char *buf;                  /* lines being added */
+    char *spare;                /* lines being written */
+    size_t len;
+    unsigned long dropped;
+    unsigned long dropped_logged;
+    struct async_file_data *next;
+};
+
+/* Open AFILE destinations, for the fork handlers */
+static pthread_mutex_t async_dests_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct async_file_data *async_dests;
+static heim_base_once_t async_once = HEIM_BASE_ONCE_INIT;
+
+static void *
+async_writer(void *arg)
+{
+    struct async_file_data *a = arg;
+    FILE *logf;
+    char *p;
+    size_t len;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (a->len == 0 && !a->closing)
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (a->len == 0)
+            break;
+        p = a->buf;
+        a->buf = a->spare;
+        a->spare = p;
+        len = a->len;
+        a->len = 0;
+        pthread_mutex_unlock(&a->lock);
+
+        HEIMDAL_MUTEX_lock(&a->file.lock);
+        logf = log_file_open(&a->file);
+        HEIMDAL_MUTEX_unlock(&a->file.lock);
+        if (logf) {
+            fwrite(p, len, 1, logf);
+            if (logf != a->file.fd)
+                fclose(logf);
+            else
+                fflush(logf);
+        }
+
+        pthread_mutex_lock(&a->lock);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+/* Write out what is buffered and stop the writer */
+static void
+async_stop(struct async_file_data *a)
+{
+    int running;
+
+    pthread_mutex_lock(&a->lock);
+    running = a->running;
+    a->closing = 1;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    if (!running)
+        return;
+    pthread_join(a->writer, NULL);
+    pthread_mutex_lock(&a->lock);
+    a->running = 0;
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * The writer never holds both locks of a destination at once, and takes
+ * the file lock only without the buffer lock, so taking them in this
+ * order can't deadlock with it.
+ */
+static void
+async_atfork_prepare(void)
+{
+    struct async_file_data *a;
+
+    pthread_mutex_lock(&async_dests_lock);
+    for (a = async_dests; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        HEIMDAL_MUTEX_lock(&a->file.lock);
+    }
+}
+
+static void
+async_atfork_parent(void)
+{
+    struct async_file_data *a;
+
+    for (a = async_dests; a; a = a->next) {
+        HEIMDAL_MUTEX_unlock(&a->file.lock);
+        pthread_mutex_unlock(&a->lock);
+    }
+    pthread_mutex_unlock(&async_dests_lock);
+}
+
+static void
+async_atfork_child(void)
+{
+    struct async_file_data *a;
+
+    /* The parent's writers write what was buffered before the fork */
+    for (a = async_dests; a; a = a->next) {
+        a->running = 0;
+        a->len = 0;
+        HEIMDAL_MUTEX_init(&a->file.lock);
+        pthread_cond_init(&a->cond, NULL);
+        pthread_mutex_init(&a->lock, NULL);
+    }
+    pthread_mutex_init(&async_dests_lock, NULL);
+}
+
+static void
+async_init_once(void *arg)
+{
+    pthread_atfork(async_atfork_prepare, async_atfork_parent,
+                   async_atfork_child);
+}
+
+static void
+log_async_file(heim_context context, const char *timestr, const char *msg,
+               void *data)
+{
+    struct async_file_data *a = data;
+    size_t tlen = timestr ? strlen(timestr) : 0;
+    size_t need;
+    char notice[64];
+    size_t nlen = 0;
+
+    if (msg == NULL)
+        return;
+    need = tlen + strlen(msg) + 2;
+
+    pthread_mutex_lock(&a->lock);
+    if (!a->running && !a->sync && !a->closing) {
+        if (pthread_create(&a->writer, NULL, async_writer, a) == 0)
+            a->running = 1;
+        else
+            a->sync = 1;
+    }
+    if (!a->running) {
+        /* No writer, or we are exiting */
+        pthread_mutex_unlock(&a->lock);
+        log_file(context, timestr, msg, &a->file);
+        return;
+    }
+    if (a->dropped != a->dropped_logged) {
+        snprintf(notice, sizeof(notice), "%lu log messages dropped",
+                 a->dropped - a->dropped_logged);
+        nlen = tlen + strlen(notice) + 2;
+    }
+    if (a->len + nlen + need > ASYNC_LOG_BUFSIZE) {
+        a->dropped++;
+    } else {
+        if (a->len == 0)
+            pthread_cond_signal(&a->cond);
+        if (nlen) {
+            a->len += log_file_line(a->buf + a->len, timestr, notice);
+            a->dropped_logged = a->dropped;
+        }
+        a->len += log_file_line(a->buf + a->len, timestr, msg);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void
+free_async_file(struct async_file_data *a)
+{
+    free(a->file.filename);
+    free(a->buf);
+    free(a->spare);
+    free(a);
+}
+
+static void HEIM_CALLCONV
+close_async_file(void *data)
+{
+    struct async_file_data *a = data, **ap;
+
+    pthread_mutex_lock(&async_dests_lock);
+    for (ap = &async_dests; *ap; ap = &(*ap)->next) {
+        if (*ap == a) {
+            *ap = a->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&async_dests_lock);
+
+    async_stop(a);
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+    HEIMDAL_MUTEX_destroy(&a->file.lock);
+    if (a->file.fd)
+        fclose(a->file.fd);
+    free_async_file(a);
+}
+
+static heim_error_code
+open_async_file(heim_context context, heim_log_facility *fac, int min,
+                int max, const char *filename, int disp)
+{
+    heim_error_code ret;
+    struct async_file_data *a;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL)
+        return heim_enomem(context);
+    a->file.mode = "a";
+    a->file.disp = disp;
+    a->buf = malloc(ASYNC_LOG_BUFSIZE);
+    a->spare = malloc(ASYNC_LOG_BUFSIZE);
+    if (a->buf == NULL || a->spare == NULL) {
+        free_async_file(a);
+        return heim_enomem(context);
+    }
+    ret = heim_expand_path_tokens(context, filename, 1, &a->file.filename,
+                                  NULL);
+    if (ret) {
+        free_async_file(a);
+        return ret;
+    }
+    if (disp & FILEDISP_KEEPOPEN)
+        log_file_open(&a->file);
+
+    /* Ready before heim_addlog_func() makes it visible to loggers */
+    HEIMDAL_MUTEX_init(&a->file.lock);
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    heim_base_once_f(&async_once, NULL, async_init_once);
+    pthread_mutex_lock(&async_dests_lock);
+    a->next = async_dests;
+    async_dests = a;
+    pthread_mutex_unlock(&async_dests_lock);
+    ret = heim_addlog_func(context, fac, min, max, log_async_file,
+                           close_async_file, a);
+    if (ret)
+        close_async_file(a);
+    return ret;
+}
+
+#endif /* HEIM_LOG_USE_THREADS */
+
 static heim_error_code
 open_file(heim_context context, heim_log_facility *fac, int min, int max,
           const char *filename, const char *mode, FILE *f, int disp,
@@ -326,6 +641,7 @@ open_file(heim_context context, heim_log_facility *fac, int min, int max,
     fd->mode = mode;
     fd->fd = f;
     fd->disp = disp;
+    HEIMDAL_MUTEX_init(&fd->lock);
 
     if (filename) {
         if (exp_tokens)
@@ -336,8 +652,10 @@ open_file(heim_context context, heim_log_facility *fac, int min, int max,
     if (ret == 0)
         ret = heim_addlog_func(context, fac, min, max, log_file, close_file, fd);
     if (ret) {
+        HEIMDAL_MUTEX_destroy(&fd->lock);
         free(fd->filename);
         free(fd);
+        return ret;
     }
     if (disp & FILEDISP_KEEPOPEN)
         log_file(context, NULL, NULL, fd);
@@ -402,6 +720,22 @@ heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
     } else if (strncmp(p, "FILE=", sizeof("FILE=") - 1) == 0) {
         ret = open_file(context, f, min, max, p + sizeof("FILE=") - 1, "a",
                         NULL, FILEDISP_KEEPOPEN, 1);
+    } else if (strncmp(p, "AFILE:", sizeof("AFILE:") - 1) == 0) {
+#ifdef HEIM_LOG_USE_THREADS
+        ret = open_async_file(context, f, min, max, p + sizeof("AFILE:") - 1,
+                              FILEDISP_REOPEN);
+#else
+        ret = open_file(context, f, min, max, p + sizeof("AFILE:") - 1, "a",
+                        NULL, FILEDISP_REOPEN, 1);
+#endif
+    } else if (strncmp(p, "AFILE=", sizeof("AFILE=") - 1) == 0) {
+#ifdef HEIM_LOG_USE_THREADS
+        ret = open_async_file(context, f, min, max, p + sizeof("AFILE=") - 1,
+                              FILEDISP_KEEPOPEN);
+#else
+        ret = open_file(context, f, min, max, p + sizeof("AFILE=") - 1, "a",
+                        NULL, FILEDISP_KEEPOPEN, 1);
+#endif
     } else if (strncmp(p, "DEVICE:", sizeof("DEVICE:") - 1) == 0) {
         ret = open_file(context, f, min, max, p + sizeof("DEVICE:") - 1, "a",
                         NULL, FILEDISP_REOPEN, 0);
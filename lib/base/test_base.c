@@ -939,6 +939,53 @@ test_array()
     return 0;
 }
 
+static int
+test_log(const char *fn)
+{
+    heim_context context;
+    heim_log_facility *fac;
+    heim_error_code ret;
+    char spec[1024], line[128], expect[128];
+    FILE *f;
+    int i;
+
+    (void) unlink(fn);
+    context = heim_context_init();
+    if (context == NULL)
+        return ENOMEM;
+    snprintf(spec, sizeof(spec), "0-/AFILE:%s", fn);
+    ret = heim_initlog(context, "test_base", &fac);
+    if (ret == 0)
+        ret = heim_addlog_dest(context, fac, spec);
+    if (ret) {
+        heim_context_free(&context);
+        return ret;
+    }
+    for (i = 0; i < 2000; i++)
+        heim_log(context, fac, i % 4, "line %d\001", i);
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+
+    if ((f = fopen(fn, "r")) == NULL)
+        return errno;
+    for (i = 0; fgets(line, sizeof(line), f) != NULL; i++) {
+        /* The lines are "<timestamp> line <n>" in order */
+        snprintf(expect, sizeof(expect), " line %d\n", i);
+        if (strlen(line) < strlen(expect) ||
+            strcmp(line + strlen(line) - strlen(expect), expect) != 0) {
+            fprintf(stderr, "async log line %d is \"%s\"\n", i, line);
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+    if (i != 2000) {
+        fprintf(stderr, "async log has %d lines, expected 2000\n", i);
+        return 1;
+    }
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -956,6 +1003,7 @@ main(int argc, char **argv)
     res |= test_db(NULL, NULL);
     res |= test_db("json", argc > 1 ? argv[1] : "test_db.json");
     res |= test_array();
+    res |= test_log("test_log.txt");
 
     return res ? 1 : 0;
 }
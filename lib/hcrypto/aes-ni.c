@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * AES using the AES-NI instructions.
+ *
+ * The key schedules have the same layout as those of
+ * rijndael-alg-fst.c (round keys in order for encryption, reversed
+ * and passed through InvMixColumns for decryption), but the words are
+ * stored in memory byte order, so that the round keys can be loaded
+ * directly into XMM registers.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#include "cpu-x86.h"
+
+#ifdef HC_X86_ACCEL
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#define AESNI_TARGET __attribute__((__target__("aes,sse2")))
+
+int
+aesni_available(void)
+{
+    static int available = -1;
+    unsigned int eax, ebx, ecx, edx;
+
+    if (available == -1)
+	available = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	    (ecx & bit_AES) && (edx & bit_SSE2);
+    return available;
+}
+
+static int
+aesni_rounds(int bits)
+{
+    switch (bits) {
+    case 128: return 10;
+    case 192: return 12;
+    case 256: return 14;
+    default: return 0;
+    }
+}
+
+/*
+ * The FIPS-197 key expansion, with SubWord() done by AESKEYGENASSIST
+ * rather than by table lookups.
+ */
+static AESNI_TARGET void
+aesni_expand_key(uint32_t *w, const unsigned char *key, int nk, int nr)
+{
+    uint32_t temp, rcon = 1;
+    __m128i x;
+    int i;
+
+    memcpy(w, key, nk * 4);
+    for (i = nk; i < 4 * (nr + 1); i++) {
+	temp = w[i - 1];
+	if (i % nk == 0 || (nk > 6 && i % nk == 4)) {
+	    x = _mm_aeskeygenassist_si128(_mm_set1_epi32((int)temp), 0);
+	    if (i % nk == 0) {
+		/* RotWord(SubWord(temp)) */
+		temp = (uint32_t)_mm_cvtsi128_si32(_mm_shuffle_epi32(x, 0x55));
+		temp ^= rcon;
+		rcon = ((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0)) & 0xff;
+	    } else {
+		/* SubWord(temp) */
+		temp = (uint32_t)_mm_cvtsi128_si32(x);
+	    }
+	}
+	w[i] = w[i - nk] ^ temp;
+    }
+}
+
+int
+aesni_set_encrypt_key(uint32_t *rk, const unsigned char *key, int bits)
+{
+    int nr = aesni_rounds(bits);
+
+    if (nr == 0)
+	return 0;
+    aesni_expand_key(rk, key, bits / 32, nr);
+    return nr;
+}
+
+AESNI_TARGET int
+aesni_set_decrypt_key(uint32_t *rk, const unsigned char *key, int bits)
+{
+    uint32_t ek[4 * 15];
+    __m128i *d = (__m128i *)rk;
+    const __m128i *e = (const __m128i *)ek;
+    int nr = aesni_rounds(bits);
+    int i;
+
+    if (nr == 0)
+	return 0;
+    aesni_expand_key(ek, key, bits / 32, nr);
+    _mm_storeu_si128(&d[0], _mm_loadu_si128(&e[nr]));
+    for (i = 1; i < nr; i++)
+	_mm_storeu_si128(&d[i], _mm_aesimc_si128(_mm_loadu_si128(&e[nr - i])));
+    _mm_storeu_si128(&d[nr], _mm_loadu_si128(&e[0]));
+    memset_s(ek, sizeof(ek), 0, sizeof(ek));
+    return nr;
+}
+
+static inline AESNI_TARGET __m128i
+aesni_encrypt_block(const __m128i *k, int nr, __m128i m)
+{
+    int i;
+
+    m = _mm_xor_si128(m, _mm_loadu_si128(&k[0]));
+    for (i = 1; i < nr; i++)
+	m = _mm_aesenc_si128(m, _mm_loadu_si128(&k[i]));
+    return _mm_aesenclast_si128(m, _mm_loadu_si128(&k[nr]));
+}
+
+static inline AESNI_TARGET __m128i
+aesni_decrypt_block(const __m128i *k, int nr, __m128i m)
+{
+    int i;
+
+    m = _mm_xor_si128(m, _mm_loadu_si128(&k[0]));
+    for (i = 1; i < nr; i++)
+	m = _mm_aesdec_si128(m, _mm_loadu_si128(&k[i]));
+    return _mm_aesdeclast_si128(m, _mm_loadu_si128(&k[nr]));
+}
+
+AESNI_TARGET void
+aesni_encrypt(const uint32_t *rk, int nr,
+	      const unsigned char *in, unsigned char *out)
+{
+    __m128i m = _mm_loadu_si128((const __m128i *)in);
+
+    m = aesni_encrypt_block((const __m128i *)rk, nr, m);
+    _mm_storeu_si128((__m128i *)out, m);
+}
+
+AESNI_TARGET void
+aesni_decrypt(const uint32_t *rk, int nr,
+	      const unsigned char *in, unsigned char *out)
+{
+    __m128i m = _mm_loadu_si128((const __m128i *)in);
+
+    m = aesni_decrypt_block((const __m128i *)rk, nr, m);
+    _mm_storeu_si128((__m128i *)out, m);
+}
+
+/*
+ * CBC over whole blocks; `size' must be a multiple of 16.  Decryption
+ * is done four blocks at a time, as the blocks do not depend on each
+ * other.
+ */
+AESNI_TARGET void
+aesni_cbc_encrypt(const uint32_t *rk, int nr, const unsigned char *in,
+		  unsigned char *out, size_t size, unsigned char *ivec,
+		  int forward_encrypt)
+{
+    const __m128i *k = (const __m128i *)rk;
+    const __m128i *ip = (const __m128i *)in;
+    __m128i *op = (__m128i *)out;
+    __m128i iv = _mm_loadu_si128((const __m128i *)ivec);
+    size_t n = size / 16;
+
+    if (forward_encrypt) {
+	while (n--) {
+	    iv = _mm_xor_si128(iv, _mm_loadu_si128(ip++));
+	    iv = aesni_encrypt_block(k, nr, iv);
+	    _mm_storeu_si128(op++, iv);
+	}
+    } else {
+	__m128i c0, c1, c2, c3, m0, m1, m2, m3, key;
+	int i;
+
+	for (; n >= 4; n -= 4) {
+	    c0 = _mm_loadu_si128(ip++);
+	    c1 = _mm_loadu_si128(ip++);
+	    c2 = _mm_loadu_si128(ip++);
+	    c3 = _mm_loadu_si128(ip++);
+	    key = _mm_loadu_si128(&k[0]);
+	    m0 = _mm_xor_si128(c0, key);
+	    m1 = _mm_xor_si128(c1, key);
+	    m2 = _mm_xor_si128(c2, key);
+	    m3 = _mm_xor_si128(c3, key);
+	    for (i = 1; i < nr; i++) {
+		key = _mm_loadu_si128(&k[i]);
+		m0 = _mm_aesdec_si128(m0, key);
+		m1 = _mm_aesdec_si128(m1, key);
+		m2 = _mm_aesdec_si128(m2, key);
+		m3 = _mm_aesdec_si128(m3, key);
+	    }
+	    key = _mm_loadu_si128(&k[nr]);
+	    m0 = _mm_aesdeclast_si128(m0, key);
+	    m1 = _mm_aesdeclast_si128(m1, key);
+	    m2 = _mm_aesdeclast_si128(m2, key);
+	    m3 = _mm_aesdeclast_si128(m3, key);
+	    /* `in' and `out' may be the same buffer */
+	    _mm_storeu_si128(op++, _mm_xor_si128(m0, iv));
+	    _mm_storeu_si128(op++, _mm_xor_si128(m1, c0));
+	    _mm_storeu_si128(op++, _mm_xor_si128(m2, c1));
+	    _mm_storeu_si128(op++, _mm_xor_si128(m3, c2));
+	    iv = c3;
+	}
+	while (n--) {
+	    c0 = _mm_loadu_si128(ip++);
+	    m0 = aesni_decrypt_block(k, nr, c0);
+	    _mm_storeu_si128(op++, _mm_xor_si128(m0, iv));
+	    iv = c0;
+	}
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+}
+
+/*
+ * CBC encryption of several independent buffers.  Encrypting one
+ * buffer is bound by the latency of AESENC, as each block depends on
+ * the one before it, so up to four buffers are interleaved to keep the
+ * AES unit busy.  All keys must have `nr' rounds, and the sizes must be
+ * multiples of 16.
+ */
+
+#define AESNI_LANES 4
+
+AESNI_TARGET void
+aesni_cbc_encrypt_multi(size_t n, const uint32_t * const *rk, int nr,
+			const unsigned char * const *in,
+			unsigned char * const *out, const size_t *size,
+			unsigned char * const *ivec)
+{
+    const __m128i *k[AESNI_LANES], *ip[AESNI_LANES];
+    __m128i *op[AESNI_LANES], st[AESNI_LANES];
+    size_t left[AESNI_LANES], job[AESNI_LANES];
+    size_t next = 0, b, m;
+    int nl = 0, l, r;
+
+    for (;;) {
+	while (nl < AESNI_LANES && next < n) {
+	    if (size[next] >= 16) {
+		k[nl] = (const __m128i *)rk[next];
+		ip[nl] = (const __m128i *)in[next];
+		op[nl] = (__m128i *)out[next];
+		left[nl] = size[next] / 16;
+		job[nl] = next;
+		st[nl] = _mm_loadu_si128((const __m128i *)ivec[next]);
+		nl++;
+	    }
+	    next++;
+	}
+	if (nl == 0)
+	    break;
+
+	if (nl == AESNI_LANES) {
+	    /*
+	     * All lanes busy: run until the shortest one is done, with
+	     * the chaining values kept in registers.
+	     */
+	    __m128i s0 = st[0], s1 = st[1], s2 = st[2], s3 = st[3];
+
+	    for (m = left[0], l = 1; l < AESNI_LANES; l++)
+		if (left[l] < m)
+		    m = left[l];
+
+	    for (b = 0; b < m; b++) {
+		s0 = _mm_xor_si128(_mm_xor_si128(s0, _mm_loadu_si128(ip[0] + b)),
+				   _mm_loadu_si128(&k[0][0]));
+		s1 = _mm_xor_si128(_mm_xor_si128(s1, _mm_loadu_si128(ip[1] + b)),
+				   _mm_loadu_si128(&k[1][0]));
+		s2 = _mm_xor_si128(_mm_xor_si128(s2, _mm_loadu_si128(ip[2] + b)),
+				   _mm_loadu_si128(&k[2][0]));
+		s3 = _mm_xor_si128(_mm_xor_si128(s3, _mm_loadu_si128(ip[3] + b)),
+				   _mm_loadu_si128(&k[3][0]));
+		for (r = 1; r < nr; r++) {
+		    s0 = _mm_aesenc_si128(s0, _mm_loadu_si128(&k[0][r]));
+		    s1 = _mm_aesenc_si128(s1, _mm_loadu_si128(&k[1][r]));
+		    s2 = _mm_aesenc_si128(s2, _mm_loadu_si128(&k[2][r]));
+		    s3 = _mm_aesenc_si128(s3, _mm_loadu_si128(&k[3][r]));
+		}
+		s0 = _mm_aesenclast_si128(s0, _mm_loadu_si128(&k[0][nr]));
+		s1 = _mm_aesenclast_si128(s1, _mm_loadu_si128(&k[1][nr]));
+		s2 = _mm_aesenclast_si128(s2, _mm_loadu_si128(&k[2][nr]));
+		s3 = _mm_aesenclast_si128(s3, _mm_loadu_si128(&k[3][nr]));
+		_mm_storeu_si128(op[0] + b, s0);
+		_mm_storeu_si128(op[1] + b, s1);
+		_mm_storeu_si128(op[2] + b, s2);
+		_mm_storeu_si128(op[3] + b, s3);
+	    }
+
+	    st[0] = s0;
+	    st[1] = s1;
+	    st[2] = s2;
+	    st[3] = s3;
+	} else {
+	    /* Fewer buffers than lanes left, do a block at a time */
+	    m = 1;
+	    for (l = 0; l < nl; l++)
+		st[l] = _mm_xor_si128(_mm_xor_si128(st[l], _mm_loadu_si128(ip[l])),
+				      _mm_loadu_si128(&k[l][0]));
+	    for (r = 1; r < nr; r++)
+		for (l = 0; l < nl; l++)
+		    st[l] = _mm_aesenc_si128(st[l], _mm_loadu_si128(&k[l][r]));
+	    for (l = 0; l < nl; l++) {
+		st[l] = _mm_aesenclast_si128(st[l], _mm_loadu_si128(&k[l][nr]));
+		_mm_storeu_si128(op[l], st[l]);
+	    }
+	}
+
+	for (l = 0; l < nl; l++) {
+	    ip[l] += m;
+	    op[l] += m;
+	    left[l] -= m;
+	}
+
+	/* Retire finished lanes, moving the last lane into their place */
+	for (l = 0; l < nl; ) {
+	    if (left[l] > 0) {
+		l++;
+		continue;
+	    }
+	    _mm_storeu_si128((__m128i *)ivec[job[l]], st[l]);
+	    nl--;
+	    k[l] = k[nl];
+	    ip[l] = ip[nl];
+	    op[l] = op[nl];
+	    left[l] = left[nl];
+	    job[l] = job[nl];
+	    st[l] = st[nl];
+	}
+    }
+}
+
+#endif /* HC_X86_ACCEL */
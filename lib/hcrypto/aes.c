@@ -40,10 +40,21 @@
 
 #include "rijndael-alg-fst.h"
 #include "aes.h"
+#include "cpu-x86.h"
+
+/*
+ * When the CPU has AES-NI the key schedules in AES_KEY are made by,
+ * and only usable with, the functions in aes-ni.c.
+ */
 
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef HC_X86_ACCEL
+    if (aesni_available())
+	key->rounds = aesni_set_encrypt_key(key->key, userkey, bits);
+    else
+#endif
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -53,6 +64,11 @@ AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 int
 AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef HC_X86_ACCEL
+    if (aesni_available())
+	key->rounds = aesni_set_decrypt_key(key->key, userkey, bits);
+    else
+#endif
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -62,12 +78,24 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HC_X86_ACCEL
+    if (aesni_available()) {
+	aesni_encrypt(key->key, key->rounds, in, out);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HC_X86_ACCEL
+    if (aesni_available()) {
+	aesni_decrypt(key->key, key->rounds, in, out);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +107,18 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HC_X86_ACCEL
+    if (aesni_available() && size >= AES_BLOCK_SIZE) {
+	unsigned long n = size & ~(unsigned long)(AES_BLOCK_SIZE - 1);
+
+	aesni_cbc_encrypt(key->key, key->rounds, in, out, n, iv,
+			  forward_encrypt);
+	in += n;
+	out += n;
+	size -= n;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HEIM_CPU_X86_H
+#define HEIM_CPU_X86_H 1
+
+/*
+ * AES-NI and SHA-NI versions of the AES and SHA-1/SHA-256 block
+ * functions, used by aes.c, sha.c and sha256.c when the CPU supports
+ * them.  They are compiled with per-function target attributes, so
+ * the rest of the library does not need special compiler flags.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define HC_X86_ACCEL 1
+#endif
+
+#ifdef HC_X86_ACCEL
+
+/* symbol renaming */
+#define aesni_available _hc_aesni_available
+#define aesni_set_encrypt_key _hc_aesni_set_encrypt_key
+#define aesni_set_decrypt_key _hc_aesni_set_decrypt_key
+#define aesni_encrypt _hc_aesni_encrypt
+#define aesni_decrypt _hc_aesni_decrypt
+#define aesni_cbc_encrypt _hc_aesni_cbc_encrypt
+#define aesni_cbc_encrypt_multi _hc_aesni_cbc_encrypt_multi
+#define shani_available _hc_shani_available
+#define shani_sha1_blocks _hc_shani_sha1_blocks
+#define shani_sha256_blocks _hc_shani_sha256_blocks
+
+int aesni_available(void);
+int aesni_set_encrypt_key(uint32_t *, const unsigned char *, int);
+int aesni_set_decrypt_key(uint32_t *, const unsigned char *, int);
+void aesni_encrypt(const uint32_t *, int,
+		   const unsigned char *, unsigned char *);
+void aesni_decrypt(const uint32_t *, int,
+		   const unsigned char *, unsigned char *);
+void aesni_cbc_encrypt(const uint32_t *, int, const unsigned char *,
+		       unsigned char *, size_t, unsigned char *, int);
+void aesni_cbc_encrypt_multi(size_t, const uint32_t * const *, int,
+			     const unsigned char * const *,
+			     unsigned char * const *, const size_t *,
+			     unsigned char * const *);
+
+int shani_available(void);
+void shani_sha1_blocks(uint32_t *, const unsigned char *, size_t);
+void shani_sha256_blocks(uint32_t *, const unsigned char *, size_t);
+
+#endif /* HC_X86_ACCEL */
+
+#endif /* HEIM_CPU_X86_H */
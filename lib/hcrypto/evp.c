@@ -50,6 +50,9 @@
 #include <evp-pkcs11.h>
 #include <evp-openssl.h>
 
+#include <aes.h>
+#include "cpu-x86.h"
+
 #include <krb5-types.h>
 
 #ifndef HCRYPTO_DEF_PROVIDER
@@ -990,6 +993,105 @@ EVP_Cipher(EVP_CIPHER_CTX *ctx, void *out, const void *in,size_t size)
     return ctx->cipher->do_cipher(ctx, out, in, size);
 }
 
+#ifdef HC_X86_ACCEL
+
+/*
+ * hcrypto's own AES-CBC encryption contexts are batched with
+ * aesni_cbc_encrypt_multi(), everything else goes through EVP_Cipher().
+ */
+
+#define AESNI_MULTI_CHUNK 16
+
+static int
+is_hcrypto_aes_cbc_encrypt(EVP_CIPHER_CTX *ctx, size_t size)
+{
+    return ctx->encrypt && (size % AES_BLOCK_SIZE) == 0 &&
+	(ctx->cipher == EVP_hcrypto_aes_128_cbc() ||
+	 ctx->cipher == EVP_hcrypto_aes_192_cbc() ||
+	 ctx->cipher == EVP_hcrypto_aes_256_cbc());
+}
+
+static int
+aesni_cipher_multi(EVP_CIPHER_CTX * const *ctx, void * const *out,
+		   const void * const *in, const size_t *size, size_t num)
+{
+    const uint32_t *rk[AESNI_MULTI_CHUNK];
+    const unsigned char *ip[AESNI_MULTI_CHUNK];
+    unsigned char *op[AESNI_MULTI_CHUNK], *iv[AESNI_MULTI_CHUNK];
+    size_t sz[AESNI_MULTI_CHUNK];
+    size_t i, n;
+    int nr;
+
+    /* all lanes of a batch must have the same number of rounds */
+    for (nr = 10; nr <= 14; nr += 2) {
+	n = 0;
+	for (i = 0; i < num; i++) {
+	    const AES_KEY *k = ctx[i]->cipher_data;
+
+	    if (!is_hcrypto_aes_cbc_encrypt(ctx[i], size[i]) || k->rounds != nr)
+		continue;
+	    rk[n] = k->key;
+	    ip[n] = in[i];
+	    op[n] = out[i];
+	    sz[n] = size[i];
+	    iv[n] = ctx[i]->iv;
+	    if (++n == AESNI_MULTI_CHUNK) {
+		aesni_cbc_encrypt_multi(n, rk, nr, ip, op, sz, iv);
+		n = 0;
+	    }
+	}
+	if (n)
+	    aesni_cbc_encrypt_multi(n, rk, nr, ip, op, sz, iv);
+    }
+
+    for (i = 0; i < num; i++) {
+	if (is_hcrypto_aes_cbc_encrypt(ctx[i], size[i]))
+	    continue;
+	if (EVP_Cipher(ctx[i], out[i], in[i], size[i]) != 1)
+	    return 0;
+    }
+    return 1;
+}
+
+#endif /* HC_X86_ACCEL */
+
+/**
+ * Encipher/decipher several independent buffers, each with its own
+ * cipher context.
+ *
+ * The result is the same as calling EVP_Cipher() on each of them in
+ * turn, but where the cipher can work on several buffers at once,
+ * for example AES-CBC encryption using AES-NI, it does so.  Each
+ * context may appear only once, and the buffers must not overlap,
+ * except that out and in of the same operation may be the same
+ * buffer.
+ *
+ * @param ctx the cipher contexts.
+ * @param out out data from each operation.
+ * @param in in data to each operation.
+ * @param size length of data of each operation.
+ * @param num number of operations.
+ *
+ * @return 1 on success.
+ */
+
+int
+EVP_Cipher_multi(EVP_CIPHER_CTX * const *ctx, void * const *out,
+		 const void * const *in, const size_t *size, size_t num)
+{
+    size_t i;
+
+#ifdef HC_X86_ACCEL
+    if (num > 1 && aesni_available())
+	return aesni_cipher_multi(ctx, out, in, size, num);
+#endif
+
+    for (i = 0; i < num; i++)
+	if (EVP_Cipher(ctx[i], out[i], in[i], size[i]) != 1)
+	    return 0;
+    return 1;
+}
+
 /*
  *
  */
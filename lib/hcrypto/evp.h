@@ -55,6 +55,7 @@
 #define EVP_CIPHER_iv_length hc_EVP_CIPHER_iv_length
 #define EVP_CIPHER_key_length hc_EVP_CIPHER_key_length
 #define EVP_Cipher hc_EVP_Cipher
+#define EVP_Cipher_multi hc_EVP_Cipher_multi
 #define EVP_CipherInit_ex hc_EVP_CipherInit_ex
 #define EVP_CipherUpdate hc_EVP_CipherUpdate
 #define EVP_CipherFinal_ex hc_EVP_CipherFinal_ex
@@ -333,6 +334,8 @@ int	EVP_CipherUpdate(EVP_CIPHER_CTX *, void *, int *, void *, size_t);
 int	EVP_CipherFinal_ex(EVP_CIPHER_CTX *, void *, int *);
 
 int	EVP_Cipher(EVP_CIPHER_CTX *,void *,const void *,size_t);
+int	EVP_Cipher_multi(EVP_CIPHER_CTX * const *, void * const *,
+			 const void * const *, const size_t *, size_t);
 
 int	PKCS5_PBKDF2_HMAC(const void *, size_t, const void *, size_t,
 			  unsigned long, const EVP_MD *, size_t, void *);
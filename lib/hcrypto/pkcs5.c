@@ -39,8 +39,116 @@
 #endif
 
 #include <evp.h>
+#include <evp-hcrypto.h>
 #include <hmac.h>
 
+/*
+ * Each PBKDF2 iteration is an HMAC of one digest-sized block under the
+ * same key, so the hash states after the inner and outer key pads are
+ * the same every time.  For hcrypto's own digests, whose state is a
+ * plain structure, compute those states once and start each iteration
+ * from copies of them: that is two compression function calls per
+ * iteration instead of four plus the HMAC setup.
+ */
+
+static int
+is_hcrypto_md(const EVP_MD *md)
+{
+    return md == EVP_hcrypto_sha1() || md == EVP_hcrypto_sha256() ||
+	md == EVP_hcrypto_sha384() || md == EVP_hcrypto_sha512();
+}
+
+static int
+pbkdf2_hmac_precomputed(const void * password, size_t password_len,
+			const void * salt, size_t salt_len,
+			unsigned long iter,
+			const EVP_MD *md,
+			size_t keylen, void *key)
+{
+    size_t hsize = md->hash_size, bsize = md->block_size;
+    size_t csize = (md->ctx_size + 15) & ~(size_t)15; /* keep aligned */
+    size_t leftofkey, len, i, j;
+    unsigned char pad[128], u[EVP_MAX_MD_SIZE], t[EVP_MAX_MD_SIZE];
+    unsigned char counter[4];
+    unsigned char *p = key;
+    void *istate, *ostate, *state;
+    uint32_t keypart;
+    unsigned long n;
+
+    if (bsize > sizeof(pad) || hsize > sizeof(u))
+	return 0;
+
+    istate = malloc(csize * 3);
+    if (istate == NULL)
+	return 0;
+    ostate = (unsigned char *)istate + csize;
+    state = (unsigned char *)ostate + csize;
+
+    if (password_len > bsize) {
+	EVP_Digest(password, password_len, u, NULL, md, NULL);
+	password = u;
+	password_len = hsize;
+    }
+
+    memset(pad, 0x36, bsize);
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= ((const unsigned char *)password)[i];
+    (md->init)(istate);
+    (md->update)(istate, pad, bsize);
+
+    memset(pad, 0x5c, bsize);
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= ((const unsigned char *)password)[i];
+    (md->init)(ostate);
+    (md->update)(ostate, pad, bsize);
+
+    keypart = 1;
+    leftofkey = keylen;
+
+    while (leftofkey) {
+	len = leftofkey > hsize ? hsize : leftofkey;
+
+	counter[0] = (keypart >> 24) & 0xff;
+	counter[1] = (keypart >> 16) & 0xff;
+	counter[2] = (keypart >> 8)  & 0xff;
+	counter[3] = (keypart)       & 0xff;
+
+	memcpy(state, istate, csize);
+	(md->update)(state, salt, salt_len);
+	(md->update)(state, counter, sizeof(counter));
+	(md->final)(u, state);
+	memcpy(state, ostate, csize);
+	(md->update)(state, u, hsize);
+	(md->final)(u, state);
+
+	memcpy(t, u, hsize);
+	for (n = 1; n < iter; n++) {
+	    memcpy(state, istate, csize);
+	    (md->update)(state, u, hsize);
+	    (md->final)(u, state);
+	    memcpy(state, ostate, csize);
+	    (md->update)(state, u, hsize);
+	    (md->final)(u, state);
+
+	    for (j = 0; j < hsize; j++)
+		t[j] ^= u[j];
+	}
+
+	memcpy(p, t, len);
+	p += len;
+	leftofkey -= len;
+	keypart++;
+    }
+
+    memset_s(pad, sizeof(pad), 0, sizeof(pad));
+    memset_s(u, sizeof(u), 0, sizeof(u));
+    memset_s(t, sizeof(t), 0, sizeof(t));
+    memset_s(istate, csize * 3, 0, csize * 3);
+    free(istate);
+
+    return 1;
+}
+
 /**
  * As descriped in PKCS5, convert a password, salt, and iteration counter into a crypto key.
  *
@@ -72,10 +180,15 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
     int j;
     char *p;
     unsigned int hmacsize;
+    HMAC_CTX hctx;
 
     if (md == NULL)
 	return 0;
 
+    if (is_hcrypto_md(md))
+	return pbkdf2_hmac_precomputed(password, password_len, salt, salt_len,
+				       iter, md, keylen, key);
+
     checksumsize = EVP_MD_size(md);
     datalen = salt_len + 4;
 
@@ -87,6 +200,8 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 
     memcpy(data, salt, salt_len);
 
+    HMAC_CTX_init(&hctx);
+
     keypart = 1;
     leftofkey = keylen;
     p = key;
@@ -104,13 +219,15 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 	data[datalen - 2] = (keypart >> 8)  & 0xff;
 	data[datalen - 1] = (keypart)       & 0xff;
 
-	HMAC(md, password, password_len, data, datalen,
-	     tmpcksum, &hmacsize);
+	HMAC_Init_ex(&hctx, password, password_len, md, NULL);
+	HMAC_Update(&hctx, data, datalen);
+	HMAC_Final(&hctx, tmpcksum, &hmacsize);
 
 	memcpy(p, tmpcksum, len);
 	for (i = 1; i < iter; i++) {
-	    HMAC(md, password, password_len, tmpcksum, checksumsize,
-		 tmpcksum, &hmacsize);
+	    HMAC_Init_ex(&hctx, password, password_len, md, NULL);
+	    HMAC_Update(&hctx, tmpcksum, checksumsize);
+	    HMAC_Final(&hctx, tmpcksum, &hmacsize);
 
 	    for (j = 0; j < len; j++)
 		p[j] ^= tmpcksum[j];
@@ -121,6 +238,7 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 	keypart++;
     }
 
+    HMAC_CTX_cleanup(&hctx);
     free(tmpcksum);
 
     return 1;
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SHA-1 and SHA-256 block functions using the SHA extensions.
+ *
+ * These take the state words of struct sha / SHA256_CTX (`counter')
+ * and any number of whole 64 byte blocks.
+ */
+
+#include <config.h>
+#include <roken.h>
+
+#include "cpu-x86.h"
+
+#ifdef HC_X86_ACCEL
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((__target__("sha,sse4.1")))
+
+int
+shani_available(void)
+{
+    static int available = -1;
+    unsigned int eax, ebx, ecx, edx;
+
+    if (available == -1) {
+	available = 0;
+	if (__get_cpuid_max(0, NULL) >= 7 &&
+	    __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	    (ecx & bit_SSE4_1) && (ecx & bit_SSSE3)) {
+	    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+	    available = (ebx & bit_SHA) != 0;
+	}
+    }
+    return available;
+}
+
+/*
+ * Each group of four rounds uses four message words; w[g & 3] holds
+ * the words of group g, and the words of group g + 4 are computed
+ * from groups g to g + 3 once group g has been used.
+ */
+
+#define SHA1_GROUPS(f)							\
+    for (j = 0; j < 5; j++, g++) {					\
+	if (g >= 4)							\
+	    w[g & 3] = _mm_sha1msg2_epu32(				\
+		_mm_xor_si128(_mm_sha1msg1_epu32(w[g & 3], w[(g + 1) & 3]), \
+			      w[(g + 2) & 3]),				\
+		w[(g + 3) & 3]);					\
+	if (g == 0)							\
+	    e = _mm_add_epi32(e, w[0]);					\
+	else								\
+	    e = _mm_sha1nexte_epu32(e, w[g & 3]);			\
+	tmp = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f);				\
+	e = tmp;							\
+    }
+
+SHANI_TARGET void
+shani_sha1_blocks(uint32_t *state, const unsigned char *data, size_t n)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+					0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e, abcd_save, e_save, tmp, w[4];
+    int g, j;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    e = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    while (n--) {
+	abcd_save = abcd;
+	e_save = e;
+	for (g = 0; g < 4; g++)
+	    w[g] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+	g = 0;
+	SHA1_GROUPS(0);
+	SHA1_GROUPS(1);
+	SHA1_GROUPS(2);
+	SHA1_GROUPS(3);
+	e = _mm_sha1nexte_epu32(e, e_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+	data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e, 3);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+SHANI_TARGET void
+shani_sha256_blocks(uint32_t *state, const unsigned char *data, size_t n)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, msg, tmp, w[4];
+    int g;
+
+    /* state is A..H; the instructions want ABEF and CDGH */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    while (n--) {
+	abef_save = abef;
+	cdgh_save = cdgh;
+	for (g = 0; g < 4; g++)
+	    w[g] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+	for (g = 0; g < 16; g++) {
+	    msg = _mm_add_epi32(w[g & 3],
+				_mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+	    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+	    if (g < 12) {
+		tmp = _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4);
+		w[g & 3] = _mm_sha256msg2_epu32(
+		    _mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+				  tmp),
+		    w[(g + 3) & 3]);
+	    }
+	    abef = _mm_sha256rnds2_epu32(abef, cdgh,
+					 _mm_shuffle_epi32(msg, 0x0e));
+	}
+	abef = _mm_add_epi32(abef, abef_save);
+	cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif /* HC_X86_ACCEL */
@@ -36,6 +36,7 @@
 
 #include "hash.h"
 #include "sha.h"
+#include "cpu-x86.h"
 
 #define Ch(x,y,z) (((x) & (y)) ^ ((~(x)) & (z)))
 #define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
@@ -176,11 +177,28 @@ SHA256_Update (SHA256_CTX *m, const void *v, size_t len)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
-	size_t l = min(len, 64 - offset);
+	size_t l;
+#ifdef HC_X86_ACCEL
+	if (offset == 0 && len >= 64 && shani_available()) {
+	    l = len & ~(size_t)63;
+	    shani_sha256_blocks(m->counter, p, l / 64);
+	    p += l;
+	    len -= l;
+	    continue;
+	}
+#endif
+	l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
+#ifdef HC_X86_ACCEL
+	if (offset == 64 && shani_available()) {
+	    shani_sha256_blocks(m->counter, m->save, 1);
+	    offset = 0;
+	    continue;
+	}
+#endif
 	if(offset == 64){
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
 	    int i;
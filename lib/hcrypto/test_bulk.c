@@ -39,6 +39,7 @@
 #include <evp.h>
 #include <evp-hcrypto.h>
 #include <evp-cc.h>
+#include <evp-openssl.h>
 #if defined(_WIN32)
 #include <evp-w32.h>
 #endif
@@ -80,14 +81,20 @@ static int loops = 20;
 static char *provider = "hcrypto";
 static unsigned char *d;
 
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+#define OSSL_USAGE "|ossl"
+#else
+#define OSSL_USAGE ""
+#endif
+
 #ifdef __APPLE__
-#define PROVIDER_USAGE "hcrypto|cc"
+#define PROVIDER_USAGE "hcrypto|cc" OSSL_USAGE "|all"
 #elif defined(WIN32)
-#define PROVIDER_USAGE "hcrypto|w32crypto"
+#define PROVIDER_USAGE "hcrypto|w32crypto" OSSL_USAGE "|all"
 #elif __sun || defined(PKCS11_MODULE_PATH)
-#define PROVIDER_USAGE "hcrypto|pkcs11"
+#define PROVIDER_USAGE "hcrypto|pkcs11" OSSL_USAGE "|all"
 #else
-#define PROVIDER_USAGE "hcrypto"
+#define PROVIDER_USAGE "hcrypto" OSSL_USAGE "|all"
 #endif
 
 static struct getargs args[] = {
@@ -103,6 +110,17 @@ static struct getargs args[] = {
       NULL, 	NULL }
 };
 
+/* `bytes' processed in a mean time of M usecs */
+static void
+print_stats(const char *cname, int64_t M, size_t bytes)
+{
+    printf("%s: mean time %llu usec%s", cname, (unsigned long long)M,
+           (M == 1) ? "" : "s");
+    if (M > 0)
+        printf(", %.1f MB/s", (double)bytes / M);
+    printf("\n");
+}
+
 static void
 usage (int ret)
 {
@@ -162,8 +180,8 @@ test_bulk_cipher(const char *cname, const EVP_CIPHER *c)
 	    errx(1, "encrypt/decrypt inconsistent");
     }
 
-    printf("%s: mean time %llu usec%s\n", cname, (unsigned long long)M,
-           (M == 1) ? "" : "s");
+    /* each loop encrypts and decrypts */
+    print_stats(cname, M, 2 * (size_t)len);
 
     return 0;
 }
@@ -187,8 +205,7 @@ test_bulk_digest(const char *cname, const EVP_MD *md)
         STATS_END(M);
     }
 
-    printf("%s: mean time %llu usec%s\n", cname, (unsigned long long)M,
-           (M == 1) ? "" : "s");
+    print_stats(cname, M, len);
 
     return 0;
 }
@@ -196,6 +213,7 @@ test_bulk_digest(const char *cname, const EVP_MD *md)
 static void
 test_bulk_provider_hcrypto(void)
 {
+    test_bulk_cipher("hcrypto_aes_128_cbc",	EVP_hcrypto_aes_128_cbc());
     test_bulk_cipher("hcrypto_aes_256_cbc",	EVP_hcrypto_aes_256_cbc());
 #if 0
     test_bulk_cipher("hcrypto_aes_256_cfb8",	EVP_hcrypto_aes_256_cfb8());
@@ -210,6 +228,22 @@ test_bulk_provider_hcrypto(void)
     test_bulk_digest("hcrypto_sha512",		EVP_hcrypto_sha512());
 }
 
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+static void
+test_bulk_provider_ossl(void)
+{
+    test_bulk_cipher("ossl_aes_128_cbc",	EVP_ossl_aes_128_cbc());
+    test_bulk_cipher("ossl_aes_256_cbc",	EVP_ossl_aes_256_cbc());
+    test_bulk_cipher("ossl_rc4",		EVP_ossl_rc4());
+    test_bulk_digest("ossl_md4",		EVP_ossl_md4());
+    test_bulk_digest("ossl_md5",		EVP_ossl_md5());
+    test_bulk_digest("ossl_sha1",		EVP_ossl_sha1());
+    test_bulk_digest("ossl_sha256",		EVP_ossl_sha256());
+    test_bulk_digest("ossl_sha384",		EVP_ossl_sha384());
+    test_bulk_digest("ossl_sha512",		EVP_ossl_sha512());
+}
+#endif /* HAVE_HCRYPTO_W_OPENSSL */
+
 #ifdef __APPLE__
 static void
 test_bulk_provider_cc(void)
@@ -291,8 +325,26 @@ main(int argc, char **argv)
     for (i = 0; i < len; i++)
         d[i] = i & 0xff;
 
-    if (strcmp(provider, "hcrypto") == 0)
+    if (strcmp(provider, "all") == 0) {
         test_bulk_provider_hcrypto();
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+        test_bulk_provider_ossl();
+#endif
+#ifdef __APPLE__
+        test_bulk_provider_cc();
+#endif
+#ifdef WIN32
+        test_bulk_provider_w32crypto();
+#endif
+#if __sun || defined(PKCS11_MODULE_PATH)
+        test_bulk_provider_pkcs11();
+#endif
+    } else if (strcmp(provider, "hcrypto") == 0)
+        test_bulk_provider_hcrypto();
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+    else if (strcmp(provider, "ossl") == 0)
+        test_bulk_provider_ossl();
+#endif
 #ifdef __APPLE__
     else if (strcmp(provider, "cc") == 0)
         test_bulk_provider_cc();
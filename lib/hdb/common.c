@@ -445,11 +445,440 @@ hdb_derive_etypes(krb5_context context, hdb_entry *e, HDB_Ext_KeySet *base_keys)
     return 0;
 }
 
+/*
+ * State that lib/hdb keeps for each HDB handle: the derived key cache,
+ * the namespace index and their settings.  It lives in this table, keyed
+ * by handle, rather than in struct HDB, because backends, including
+ * plugins built against older versions of hdb.h, allocate the HDB and
+ * would not allocate room for it.
+ *
+ * An entry is made by hdb_create() and removed by the backend's destroy
+ * method (see hdb_free_private_state()).  A backend that doesn't
+ * remove it leaks it, but a new handle at the same address starts afresh.
+ * The table is hashed on the handle's address and locked, each entry is
+ * not: like the HDB itself, it is used by one thread at a time.  Each
+ * fetch, store or remove looks its entry up once, when it first needs it,
+ * and hands it down to the helpers.
+ */
+
+#define HDB_PRIVATE_BUCKETS 61
+
+struct hdb_private {
+    struct hdb_private *next;       /* hash chain */
+    HDB *db;
+    size_t derived_key_cache_size;
+    struct hdb_derived_key_cache *derived_key_cache;
+    int namespace_index_enabled;        /* [hdb] virtual_hostbased_princ_index */
+    time_t namespace_index_interval;    /* Min. time between rebuilds */
+    struct hdb_namespace_index *namespace_index;
+};
+
+static HEIMDAL_MUTEX hdb_privates_lock = HEIMDAL_MUTEX_INITIALIZER;
+static struct hdb_private *hdb_privates[HDB_PRIVATE_BUCKETS];
+
+#define hdb_private_bucket(db) \
+    (&hdb_privates[((uintptr_t)(db) >> 4) % HDB_PRIVATE_BUCKETS])
+
+static void free_derived_key_cache(struct hdb_derived_key_cache *);
+static void free_namespace_index(struct hdb_private *);
+
+static void
+free_hdb_private(struct hdb_private *hp)
+{
+    free_derived_key_cache(hp->derived_key_cache);
+    free_namespace_index(hp);
+    free(hp);
+}
+
+/* Unlink and return the entry for `db', if any; call with the lock held */
+static struct hdb_private *
+unlink_hdb_private(HDB *db)
+{
+    struct hdb_private **hpp, *hp;
+
+    for (hpp = hdb_private_bucket(db); (hp = *hpp) != NULL; hpp = &hp->next) {
+        if (hp->db == db) {
+            *hpp = hp->next;
+            return hp;
+        }
+    }
+    return NULL;
+}
+
+/* Returns NULL for handles not made by hdb_create() */
+static struct hdb_private *
+hdb_private(HDB *db)
+{
+    struct hdb_private *hp;
+
+    HEIMDAL_MUTEX_lock(&hdb_privates_lock);
+    for (hp = *hdb_private_bucket(db); hp; hp = hp->next)
+        if (hp->db == db)
+            break;
+    HEIMDAL_MUTEX_unlock(&hdb_privates_lock);
+    return hp;
+}
+
+/*
+ * Make the entry for a new handle `db'.  For hdb_create().
+ */
+krb5_error_code
+_hdb_private_init(krb5_context context,
+                  HDB *db,
+                  size_t derived_key_cache_size,
+                  int namespace_index_enabled,
+                  time_t namespace_index_interval)
+{
+    struct hdb_private *hp, *old, **bucket;
+
+    if ((hp = calloc(1, sizeof(*hp))) == NULL)
+        return krb5_enomem(context);
+    hp->db = db;
+    hp->derived_key_cache_size = derived_key_cache_size;
+    hp->namespace_index_enabled = namespace_index_enabled;
+    hp->namespace_index_interval = namespace_index_interval;
+
+    HEIMDAL_MUTEX_lock(&hdb_privates_lock);
+    old = unlink_hdb_private(db);
+    bucket = hdb_private_bucket(db);
+    hp->next = *bucket;
+    *bucket = hp;
+    HEIMDAL_MUTEX_unlock(&hdb_privates_lock);
+
+    if (old)
+        free_hdb_private(old);
+    return 0;
+}
+
+/**
+ * Free the derived key cache, namespace index and everything else
+ * lib/hdb keeps for `db'.  For HDB backends' destroy methods.
+ */
+
+void
+hdb_free_private_state(krb5_context context, HDB *db)
+{
+    struct hdb_private *hp;
+
+    HEIMDAL_MUTEX_lock(&hdb_privates_lock);
+    hp = unlink_hdb_private(db);
+    HEIMDAL_MUTEX_unlock(&hdb_privates_lock);
+    if (hp)
+        free_hdb_private(hp);
+}
+
+/*
+ * Namespace index.
+ *
+ * When a host-based principal is not found, fetch_it() looks for a
+ * namespace principal whose hostname is a suffix of the principal's
+ * hostname, longest first.  Without an index that is one backend fetch
+ * per candidate suffix.  Instead keep the hostnames of all the namespace
+ * principals in a trie of labels, right-most label first, so that only
+ * the candidates that exist get fetched.
+ *
+ * The index is optional ([hdb] virtual_hostbased_princ_index), and is
+ * built by iterating the database the first time it is needed.
+ * Namespaces stored or removed through this handle update it in place.
+ * Changes made by others are noticed by stamping the database files on
+ * every lookup: if they changed the index is rebuilt, but at most once
+ * every virtual_hostbased_princ_index_interval seconds, and until then
+ * lookups probe every candidate as if there were no index, so a new
+ * namespace is never missed.  Databases whose files we can't find (e.g.,
+ * LDAP) don't get an index.
+ */
+
+struct hdb_namespace_node {
+    struct hdb_namespace_node *children;
+    struct hdb_namespace_node *next;    /* sibling */
+    char *label;
+    size_t len;
+    unsigned int is_namespace;          /* # of namespace principals */
+};
+
+struct hdb_namespace_index {
+    struct hdb_namespace_node root;
+    uint64_t stamp;
+    time_t built;                       /* when it was last (re)built */
+    int failed;                         /* could not iterate the DB */
+};
+
+static void
+stamp_add(uint64_t *stamp, uint64_t v)
+{
+    *stamp ^= v;
+    *stamp *= 0x100000001b3ULL;
+}
+
+/*
+ * Stamp the files that may hold `db': its name, and with the suffixes
+ * used by the db1/db3/ndbm (.db), LMDB (.mdb) and SQLite WAL (-wal)
+ * backends.  Returns 0 if there is no such file.
+ */
+static uint64_t
+namespace_index_stamp(HDB *db)
+{
+    static const char *suffixes[] = { "", ".db", ".mdb", "-wal" };
+    uint64_t stamp = 0xcbf29ce484222325ULL;
+    char path[MAXPATHLEN];
+    struct stat st;
+    size_t k;
+    int found = 0;
+
+    if (db->hdb_name == NULL)
+        return 0;
+    for (k = 0; k < sizeof(suffixes)/sizeof(suffixes[0]); k++) {
+        if (snprintf(path, sizeof(path), "%s%s", db->hdb_name,
+                     suffixes[k]) >= (int)sizeof(path))
+            return 0;
+        if (stat(path, &st) == -1)
+            continue;
+        found = 1;
+        stamp_add(&stamp, k);
+        stamp_add(&stamp, st.st_dev);
+        stamp_add(&stamp, st.st_ino);
+        stamp_add(&stamp, st.st_size);
+        stamp_add(&stamp, st.st_mtime);
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+        stamp_add(&stamp, st.st_mtim.tv_nsec);
+#endif
+    }
+    if (!found)
+        return 0;
+    return stamp ? stamp : 1;
+}
+
+static int
+is_namespace_princ(krb5_const_principal p)
+{
+    return p->name.name_string.len >= 4 &&
+        strcmp(p->name.name_string.val[0], "WELLKNOWN") == 0 &&
+        strcmp(p->name.name_string.val[1], HDB_WK_NAMESPACE) == 0;
+}
+
+static void
+free_namespace_nodes(struct hdb_namespace_node *n)
+{
+    struct hdb_namespace_node *next;
+
+    for (; n; n = next) {
+        next = n->next;
+        free_namespace_nodes(n->children);
+        free(n->label);
+        free(n);
+    }
+}
+
+static struct hdb_namespace_node *
+namespace_node_child(struct hdb_namespace_node *n,
+                     const char *label,
+                     size_t len)
+{
+    for (n = n->children; n; n = n->next)
+        if (n->len == len && strncmp(n->label, label, len) == 0)
+            return n;
+    return NULL;
+}
+
+static struct hdb_namespace_node *
+namespace_index_find(struct hdb_namespace_index *idx, const char *host)
+{
+    struct hdb_namespace_node *n = &idx->root;
+    const char *end = host + strlen(host);
+    const char *start;
+
+    while (end > host && n) {
+        for (start = end; start > host && start[-1] != '.'; start--)
+            ;
+        n = namespace_node_child(n, start, end - start);
+        end = start > host ? start - 1 : start;
+    }
+    return n == &idx->root ? NULL : n;
+}
+
+static krb5_error_code
+namespace_index_add(krb5_context context,
+                    struct hdb_namespace_index *idx,
+                    const char *host)
+{
+    struct hdb_namespace_node *n = &idx->root;
+    struct hdb_namespace_node *c;
+    const char *end = host + strlen(host);
+    const char *start;
+
+    while (end > host) {
+        for (start = end; start > host && start[-1] != '.'; start--)
+            ;
+        if ((c = namespace_node_child(n, start, end - start)) == NULL) {
+            if ((c = calloc(1, sizeof(*c))) == NULL ||
+                (c->label = strndup(start, end - start)) == NULL) {
+                free(c);
+                return krb5_enomem(context);
+            }
+            c->len = end - start;
+            c->next = n->children;
+            n->children = c;
+        }
+        n = c;
+        end = start > host ? start - 1 : start;
+    }
+    if (n != &idx->root)
+        n->is_namespace++;
+    return 0;
+}
+
+static krb5_error_code
+namespace_index_add_entry(krb5_context context,
+                          HDB *db,
+                          hdb_entry_ex *entry,
+                          void *data)
+{
+    krb5_const_principal p = entry->entry.principal;
+
+    if (!is_namespace_princ(p))
+        return 0;
+    return namespace_index_add(context, data, p->name.name_string.val[3]);
+}
+
+/*
+ * Return the longest suffix of `host' with at most `maxd' dots that is
+ * the hostname of a namespace, and its number of dots in `*dots', or
+ * NULL if there is none.
+ */
+static const char *
+namespace_index_match(struct hdb_namespace_index *idx,
+                      const char *host,
+                      size_t maxd,
+                      size_t *dots)
+{
+    struct hdb_namespace_node *n = &idx->root;
+    const char *end = host + strlen(host);
+    const char *start;
+    const char *best = NULL;
+    size_t d;
+
+    for (d = 0; end > host; d++) {
+        for (start = end; start > host && start[-1] != '.'; start--)
+            ;
+        if (d > maxd ||
+            (n = namespace_node_child(n, start, end - start)) == NULL)
+            break;
+        if (n->is_namespace) {
+            best = start;
+            *dots = d;
+        }
+        if (start == host)
+            break;
+        end = start - 1;
+    }
+    return best;
+}
+
+/*
+ * Whether the index of `db' is current, i.e., nobody else changed the
+ * database since it was built.  Called before storing or removing an
+ * entry, so that namespace_index_update() can tell our own change from
+ * someone else's.
+ */
+static int
+namespace_index_current(HDB *db, struct hdb_private *hp)
+{
+    struct hdb_namespace_index *idx = hp ? hp->namespace_index : NULL;
+
+    return idx && !idx->failed && idx->stamp == namespace_index_stamp(db);
+}
+
+/*
+ * Keep the index of `db', if any, up to date with `p' being stored
+ * (`added') or removed.  If the index was `current' before the change,
+ * it is stamped again so that our own change does not look like someone
+ * else's.  A host that is no longer a namespace but is still indexed
+ * only costs a fetch.
+ */
+static void
+namespace_index_update(krb5_context context,
+                       HDB *db,
+                       struct hdb_private *hp,
+                       krb5_const_principal p,
+                       int added,
+                       int replaced,
+                       int current)
+{
+    struct hdb_namespace_index *idx = hp ? hp->namespace_index : NULL;
+    struct hdb_namespace_node *n;
+
+    if (idx == NULL || idx->failed)
+        return;
+    if (current)
+        idx->stamp = namespace_index_stamp(db);
+    if (!is_namespace_princ(p))
+        return;
+    n = namespace_index_find(idx, p->name.name_string.val[3]);
+    if (added) {
+        if (n && n->is_namespace && replaced)
+            return;
+        if (namespace_index_add(context, idx, p->name.name_string.val[3]))
+            free_namespace_index(hp);
+    } else if (n && n->is_namespace) {
+        n->is_namespace--;
+    }
+}
+
+/*
+ * Return the namespace index of `db', (re)building it if the database
+ * changed and it was not rebuilt too recently.  NULL means that every
+ * candidate namespace has to be fetched.
+ */
+static struct hdb_namespace_index *
+namespace_index_get(krb5_context context, HDB *db, struct hdb_private *hp)
+{
+    struct hdb_namespace_index *idx;
+    time_t now = time(NULL);
+    uint64_t stamp;
+
+    if (hp == NULL || !hp->namespace_index_enabled)
+        return NULL;
+    idx = hp->namespace_index;
+    stamp = namespace_index_stamp(db);
+    if (idx && idx->stamp == stamp && stamp != 0)
+        return idx->failed ? NULL : idx;
+    /* Stale: do without it rather than rebuild it on every request */
+    if (idx && stamp != 0 &&
+        now - idx->built < hp->namespace_index_interval)
+        return NULL;
+    free_namespace_index(hp);
+    if (stamp == 0 || (idx = calloc(1, sizeof(*idx))) == NULL)
+        return NULL;
+    if (hdb_foreach(context, db, 0, namespace_index_add_entry, idx)) {
+        /* Don't try again until the DB changes */
+        free_namespace_nodes(idx->root.children);
+        idx->root.children = NULL;
+        idx->failed = 1;
+    }
+    idx->stamp = stamp;
+    idx->built = now;
+    hp->namespace_index = idx;
+    return idx->failed ? NULL : idx;
+}
+
+static void
+free_namespace_index(struct hdb_private *hp)
+{
+    struct hdb_namespace_index *idx = hp->namespace_index;
+
+    if (idx == NULL)
+        return;
+    free_namespace_nodes(idx->root.children);
+    free(idx);
+    hp->namespace_index = NULL;
+}
+
 krb5_error_code
 _hdb_store(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
     krb5_data key, value;
-    int code;
+    struct hdb_private *hp;
+    int code, current;
 
     if (entry->entry.flags.do_not_store ||
 	entry->entry.flags.force_canonicalize)
@@ -506,11 +935,15 @@ _hdb_store(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 	return code;
     }
     hdb_entry2value(context, &entry->entry, &value);
+    hp = hdb_private(db);
+    current = namespace_index_current(db, hp);
     code = db->hdb__put(context, db, flags & HDB_F_REPLACE, key, value);
     krb5_data_free(&value);
     krb5_data_free(&key);
     if (code)
 	return code;
+    namespace_index_update(context, db, hp, entry->entry.principal, 1,
+                           !!(flags & HDB_F_REPLACE), current);
 
     code = hdb_add_aliases(context, db, flags, entry);
 
@@ -522,7 +955,8 @@ _hdb_remove(krb5_context context, HDB *db,
             unsigned flags, krb5_const_principal principal)
 {
     krb5_data key, value;
-    int code;
+    struct hdb_private *hp;
+    int code, current;
 
     hdb_principal2key(context, principal, &key);
 
@@ -549,8 +983,12 @@ _hdb_remove(krb5_context context, HDB *db,
 	krb5_data_free(&key);
 	return code;
     }
+    hp = hdb_private(db);
+    current = namespace_index_current(db, hp);
     code = db->hdb__del(context, db, key);
     krb5_data_free(&key);
+    if (code == 0)
+        namespace_index_update(context, db, hp, principal, 0, 0, current);
     return code;
 }
 
@@ -676,28 +1114,256 @@ derive_Keys(krb5_context context,
     return ret;
 }
 
+/*
+ * Derived key cache.
+ *
+ * Deriving the keys of a virtual principal costs two PRF+ invocations
+ * per enctype and kvno, on every fetch.  The derivation is
+ * deterministic, so keep the derived keysets, keyed by principal name,
+ * enctype, kvno, base keys and the epoch and period of the key rotation
+ * they were derived for (these determine the keyset's set_time).  An
+ * entry expires once its kvno can no longer be needed, half a rotation
+ * period after the end of the period it is current for.  Expiry is
+ * relative to the time the keys are fetched for, which is normally now.
+ */
+
+struct derived_key_cache_entry {
+    struct derived_key_cache_entry *next;
+    char *princ;                /* NULL when derived from `base' directly */
+    krb5int32 etype;
+    krb5uint32 kvno;
+    KerberosTime epoch;
+    unsigned int period;
+    KerberosTime expires;
+    Keys base;
+    hdb_keyset dks;
+};
+
+struct hdb_derived_key_cache {
+    struct derived_key_cache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static size_t
+derived_key_cache_hash(const char *princ, krb5int32 etype, krb5uint32 kvno)
+{
+    uint32_t h = 2166136261U;   /* FNV-1a */
+
+    while (princ && *princ) {
+        h ^= (unsigned char)*princ++;
+        h *= 16777619U;
+    }
+    h ^= kvno;
+    h *= 16777619U;
+    h ^= (uint32_t)etype;
+    h *= 16777619U;
+    return h;
+}
+
+static int
+same_keys(const Keys *a, const Keys *b)
+{
+    size_t i;
+
+    if (a->len != b->len)
+        return 0;
+    for (i = 0; i < a->len; i++) {
+        if (a->val[i].key.keytype != b->val[i].key.keytype ||
+            der_heim_octet_string_cmp(&a->val[i].key.keyvalue,
+                                      &b->val[i].key.keyvalue) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+free_derived_key_cache_entry(struct derived_key_cache_entry *e)
+{
+    free(e->princ);
+    free_Keys(&e->base);
+    free_hdb_keyset(&e->dks);
+    free(e);
+}
+
+/*
+ * Drop entries that expired as of `now', then more until there are fewer
+ * than `max' left
+ */
+static void
+prune_derived_key_cache(struct hdb_derived_key_cache *c,
+                        size_t max,
+                        KerberosTime now)
+{
+    struct derived_key_cache_entry **ep, *e;
+    size_t i;
+    int pass;
+
+    for (pass = 0; pass < 2 && c->count >= max; pass++) {
+        for (i = 0; i < c->nbuckets; i++) {
+            for (ep = &c->buckets[i]; (e = *ep) != NULL; ) {
+                if ((pass == 0 && e->expires - now < 0) ||
+                    (pass == 1 && c->count >= max)) {
+                    *ep = e->next;
+                    free_derived_key_cache_entry(e);
+                    c->count--;
+                } else {
+                    ep = &e->next;
+                }
+            }
+        }
+    }
+}
+
+static krb5_error_code
+derived_key_cache_get(struct hdb_private *hp,
+                      const Keys *base,
+                      const char *princ,
+                      krb5int32 etype,
+                      krb5uint32 kvno,
+                      const struct KeyRotation *krp,
+                      KerberosTime now,
+                      hdb_keyset *dks)
+{
+    struct hdb_derived_key_cache *c = hp ? hp->derived_key_cache : NULL;
+    struct derived_key_cache_entry *e;
+
+    if (c == NULL)
+        return HDB_ERR_NOENTRY;
+    e = c->buckets[derived_key_cache_hash(princ, etype, kvno) % c->nbuckets];
+    for (; e; e = e->next) {
+        if (e->kvno == kvno && e->etype == etype &&
+            e->epoch == krp->epoch && e->period == krp->period &&
+            e->expires - now >= 0 &&
+            (e->princ == NULL) == (princ == NULL) &&
+            (princ == NULL || strcmp(e->princ, princ) == 0) &&
+            same_keys(&e->base, base)) {
+            c->hits++;
+            return copy_hdb_keyset(&e->dks, dks);
+        }
+    }
+    c->misses++;
+    return HDB_ERR_NOENTRY;
+}
+
+/* Failure to cache is not an error, we just derive again next time */
+static void
+derived_key_cache_put(struct hdb_private *hp,
+                      const Keys *base,
+                      const char *princ,
+                      krb5int32 etype,
+                      krb5uint32 kvno,
+                      const struct KeyRotation *krp,
+                      KerberosTime now,
+                      KerberosTime expires,
+                      const hdb_keyset *dks)
+{
+    struct hdb_derived_key_cache *c;
+    struct derived_key_cache_entry *e;
+    size_t h;
+
+    if (hp == NULL || hp->derived_key_cache_size == 0)
+        return;
+    if ((c = hp->derived_key_cache) == NULL) {
+        if ((c = calloc(1, sizeof(*c))) == NULL)
+            return;
+        c->nbuckets = hp->derived_key_cache_size;
+        if ((c->buckets = calloc(c->nbuckets, sizeof(c->buckets[0]))) == NULL) {
+            free(c);
+            return;
+        }
+        hp->derived_key_cache = c;
+    }
+    if (c->count >= hp->derived_key_cache_size)
+        prune_derived_key_cache(c, hp->derived_key_cache_size, now);
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    if ((princ && (e->princ = strdup(princ)) == NULL) ||
+        copy_Keys(base, &e->base) ||
+        copy_hdb_keyset(dks, &e->dks)) {
+        free_derived_key_cache_entry(e);
+        return;
+    }
+    e->etype = etype;
+    e->kvno = kvno;
+    e->epoch = krp->epoch;
+    e->period = krp->period;
+    e->expires = expires;
+    h = derived_key_cache_hash(princ, etype, kvno) % c->nbuckets;
+    e->next = c->buckets[h];
+    c->buckets[h] = e;
+    c->count++;
+}
+
+static void
+free_derived_key_cache(struct hdb_derived_key_cache *c)
+{
+    if (c == NULL)
+        return;
+    prune_derived_key_cache(c, 0, 0);
+    free(c->buckets);
+    free(c);
+}
+
+/**
+ * Return the number of derived keyset lookups in the cache of `db'
+ * that hit and missed.
+ */
+
+krb5_error_code
+hdb_derived_key_cache_stats(krb5_context context,
+                            HDB *db,
+                            uint64_t *hits,
+                            uint64_t *misses)
+{
+    struct hdb_private *hp = hdb_private(db);
+    struct hdb_derived_key_cache *c = hp ? hp->derived_key_cache : NULL;
+
+    *hits = c ? c->hits : 0;
+    *misses = c ? c->misses : 0;
+    return 0;
+}
+
 /* Helper for derive_keys_for_kr() */
 static krb5_error_code
 derive_keyset(krb5_context context,
+              struct hdb_private *hp,
               const Keys *base_keys,
               const char *princ,
               krb5int32 etype,
               krb5uint32 kvno,
-              KerberosTime set_time, /* "now" */
+              const struct KeyRotation *krp,
+              KerberosTime t,
+              KerberosTime set_time,
+              KerberosTime expires,
               hdb_keyset *dks)
 {
+    krb5_error_code ret;
+
+    if (derived_key_cache_get(hp, base_keys, princ, etype, kvno, krp, t,
+                              dks) == 0)
+        return 0;
+
     dks->kvno = kvno;
     dks->keys.val = 0;
     dks->set_time = malloc(sizeof(dks->set_time));
     if (dks->set_time == NULL)
         return krb5_enomem(context);
     *dks->set_time = set_time;
-    return derive_Keys(context, princ, kvno, etype, base_keys, &dks->keys);
+    ret = derive_Keys(context, princ, kvno, etype, base_keys, &dks->keys);
+    if (ret == 0)
+        derived_key_cache_put(hp, base_keys, princ, etype, kvno, krp, t,
+                              expires, dks);
+    return ret;
 }
 
 /* Possibly derive and install in `h' a keyset identified by `t' */
 static krb5_error_code
 derive_keys_for_kr(krb5_context context,
+                   struct hdb_private *hp,
                    hdb_entry_ex *h,
                    HDB_Ext_KeySet *base_keys,
                    int is_current_keyset,
@@ -769,8 +1435,9 @@ derive_keys_for_kr(krb5_context context,
         return 0;
     }
 
-    ret = derive_keyset(context, &base_keys->val[i].keys, princ, etype, kvno,
-                        set_time, &dks);
+    ret = derive_keyset(context, hp, &base_keys->val[i].keys, princ, etype,
+                        kvno, krp, t, set_time,
+                        set_time + krp->period + (krp->period >> 1), &dks);
     if (ret == 0)
         ret = hdb_install_keyset(context, &h->entry, is_current_keyset, &dks);
 
@@ -781,6 +1448,7 @@ derive_keys_for_kr(krb5_context context,
 /* Derive and install current keys, and possibly preceding or next keys */
 static krb5_error_code
 derive_keys_for_current_kr(krb5_context context,
+                           struct hdb_private *hp,
                            hdb_entry_ex *h, 
                            HDB_Ext_KeySet *base_keys,
                            const char *princ,
@@ -794,7 +1462,7 @@ derive_keys_for_current_kr(krb5_context context,
     krb5_error_code ret;
 
     /* derive_keys_for_kr() for current kvno and install as the current keys */
-    ret = derive_keys_for_kr(context, h, base_keys, 1, 0, princ, etype,
+    ret = derive_keys_for_kr(context, hp, h, base_keys, 1, 0, princ, etype,
                              kvno_wanted, t, krp);
     if (!(flags & HDB_F_ALL_KVNOS))
         return ret;
@@ -811,8 +1479,8 @@ derive_keys_for_current_kr(krb5_context context,
      * sufficiently narrow.
      */
     if (ret == 0 && t - krp->epoch >= krp->period)
-        ret = derive_keys_for_kr(context, h, base_keys, 0, -1, princ, etype,
-                                 kvno_wanted, t, krp);
+        ret = derive_keys_for_kr(context, hp, h, base_keys, 0, -1, princ,
+                                 etype, kvno_wanted, t, krp);
     /*
      * derive_keys_for_kr() for next kvno if near enough, but only if it
      * doesn't start after the next KR's epoch.
@@ -827,8 +1495,8 @@ derive_keys_for_current_kr(krb5_context context,
             return ret;
     }
     if (ret == 0)
-        ret = derive_keys_for_kr(context, h, base_keys, 0, 1, princ, etype,
-                                 kvno_wanted, t, krp);
+        ret = derive_keys_for_kr(context, hp, h, base_keys, 0, 1, princ,
+                                 etype, kvno_wanted, t, krp);
     return ret;
 }
 
@@ -938,6 +1606,7 @@ derive_keys_for_current_kr(krb5_context context,
  */
 static krb5_error_code
 derive_keys(krb5_context context,
+            HDB *db,
             unsigned flags,
             krb5_const_principal princ,
             int h_is_namespace,
@@ -948,6 +1617,7 @@ derive_keys(krb5_context context,
 {
     HDB_Ext_KeyRotation kr;
     HDB_Ext_KeySet base_keys;
+    struct hdb_private *hp;
     krb5_error_code ret = 0;
     size_t current_kr, future_kr, past_kr, i;
     char *p = NULL;
@@ -955,6 +1625,7 @@ derive_keys(krb5_context context,
 
     if (!h_is_namespace && !h->entry.flags.virtual_keys)
         return 0;
+    hp = hdb_private(db);
     h->entry.flags.virtual = 1;
     if (h_is_namespace) {
         /* Set the entry's principal name */
@@ -1082,7 +1753,7 @@ derive_keys(krb5_context context,
      *    possibly one past keyset in hist_keys for the current_kr
      */
     if (ret == 0 && current_kr < kr.len)
-        ret = derive_keys_for_current_kr(context, h, &base_keys, p, flags,
+        ret = derive_keys_for_current_kr(context, hp, h, &base_keys, p, flags,
                                          etype, kvno, t, &kr.val[current_kr],
                                          current_kr ? kr.val[0].epoch : 0);
 
@@ -1096,8 +1767,9 @@ derive_keys(krb5_context context,
      * period.
      */
     if (ret == 0 && future_kr < kr.len && (flags & HDB_F_ALL_KVNOS))
-        ret = derive_keys_for_kr(context, h, &base_keys, 0, 0, p, etype, kvno,
-                                 kr.val[future_kr].epoch, &kr.val[future_kr]);
+        ret = derive_keys_for_kr(context, hp, h, &base_keys, 0, 0, p, etype,
+                                 kvno, kr.val[future_kr].epoch,
+                                 &kr.val[future_kr]);
 
     /*
      * Derive and set in `h' its past keys for the previous KR if its last time
@@ -1105,8 +1777,9 @@ derive_keys(krb5_context context,
      * its keys.
      */
     if (ret == 0 && past_kr < kr.len && (flags & HDB_F_ALL_KVNOS))
-        ret = derive_keys_for_kr(context, h, &base_keys, 0, 0, p, etype, kvno,
-                                 kr.val[current_kr].epoch - 1, &kr.val[past_kr]);
+        ret = derive_keys_for_kr(context, hp, h, &base_keys, 0, 0, p, etype,
+                                 kvno, kr.val[current_kr].epoch - 1,
+                                 &kr.val[past_kr]);
 
     /*
      * Impose a bound on h->entry.max_life so that [when the KDC is the caller]
@@ -1279,6 +1952,30 @@ make_namespace_princ(krb5_context context,
     return ret;
 }
 
+/*
+ * Return the next candidate namespace hostname for `host', which has
+ * `hdots' dots: the longest suffix with at most `limit' dots that is a
+ * namespace according to `idx', or without an index just the suffix with
+ * `limit' dots.
+ */
+static const char *
+next_namespace_candidate(struct hdb_namespace_index *idx,
+                         const char *host,
+                         size_t hdots,
+                         size_t limit,
+                         size_t *dots)
+{
+    if (idx)
+        return namespace_index_match(idx, host, limit, dots);
+    while (hdots > limit) {
+        /* host != NULL because hdots > 0 */
+        host = strchr(host, '.') + 1;
+        hdots--;
+    }
+    *dots = hdots;
+    return host;
+}
+
 /* Wrapper around db->hdb_fetch_kvno() that implements virtual princs/keys */
 static krb5_error_code
 fetch_it(krb5_context context,
@@ -1290,7 +1987,6 @@ fetch_it(krb5_context context,
          krb5uint32 kvno,
          hdb_entry_ex *ent)
 {
-    krb5_const_principal tmpprinc = princ;
     krb5_principal baseprinc = NULL;
     krb5_error_code ret = 0;
     const char *comp0 = krb5_principal_get_comp_string(context, princ, 0);
@@ -1299,6 +1995,7 @@ fetch_it(krb5_context context,
     size_t mindots = db->virtual_hostbased_princ_ndots;
     size_t maxdots = db->virtual_hostbased_princ_maxdots;
     size_t hdots = 0;
+    size_t limit, first, d;
     char *host = NULL;
     int do_search = 0;
 
@@ -1329,67 +2026,51 @@ fetch_it(krb5_context context,
         do_search = 1;
     }
 
-    tmp = host ? host : comp1;
-    for (ret = HDB_ERR_NOENTRY; ret == HDB_ERR_NOENTRY; tmpprinc = baseprinc) {
-        krb5_error_code ret2 = 0;
-
-        /*
-         * We break out of this loop with ret == 0 only if we found the HDB
-         * entry we were looking for or the HDB entry for a matching namespace.
-         *
-         * Otherwise we break out with ret != 0, typically HDB_ERR_NOENTRY.
-         *
-         * First time through we lookup the principal as given.
-         *
-         * Next we lookup a namespace principal, stripping off hostname labels
-         * from the left until we find one or get tired of looking or run out
-         * of labels.
-         */
-	ret = db->hdb_fetch_kvno(context, db, tmpprinc, flags, kvno, ent);
-	if (ret != HDB_ERR_NOENTRY || hdots == 0 || hdots < mindots || !tmp ||
-            !do_search)
-	    break;
+    /* First we lookup the principal as given */
+    ret = db->hdb_fetch_kvno(context, db, princ, flags, kvno, ent);
 
-        /*
-         * Breadcrumb:
-         *
-         *  - if we found a concrete principal, but it's been marked
-         *    as now-virtual, then we must keep going
-         *
-         * But this will be coded in the future.
-         *
-         * Maybe we can take attributes from the concrete principal...
-         */
+    /*
+     * Breadcrumb:
+     *
+     *  - if we found a concrete principal, but it's been marked
+     *    as now-virtual, then we must keep going
+     *
+     * But this will be coded in the future.
+     *
+     * Maybe we can take attributes from the concrete principal...
+     */
+    if (ret == HDB_ERR_NOENTRY && do_search && host && hdots &&
+        hdots >= mindots) {
+        struct hdb_namespace_index *idx =
+            namespace_index_get(context, db, hdb_private(db));
 
         /*
-         * The namespace's hostname will not have more labels than maxdots + 1.
-         * Thus we truncate immediately down to maxdots + 1 if we haven't yet.
+         * Next we lookup a namespace principal, stripping off hostname
+         * labels from the left until we find one or get tired of looking or
+         * run out of labels.  The namespace index, if we have one, lets us
+         * skip the hostnames that aren't namespaces.
          *
-         * Example: with maxdots == 3,
-         *          foo.bar.baz.app.blah.example -> baz.app.blah.example
+         * The namespace's hostname will not have more labels than maxdots +
+         * 1.  Example: with maxdots == 3, the first candidate for
+         * foo.bar.baz.app.blah.example is baz.app.blah.example.
          */
-        while (maxdots && hdots > maxdots && tmp) {
-            tmp = strchr(tmp, '.');
-            /* tmp != NULL because maxdots > 0 */
-            tmp++;
-            hdots--;
+        first = limit = (maxdots && hdots > maxdots) ? maxdots : hdots;
+        ret = make_namespace_princ(context, db, princ, &baseprinc);
+        while (ret == 0) {
+            tmp = next_namespace_candidate(idx, host, hdots, limit, &d);
+            if (tmp == NULL || (d != first && (d == 0 || d < mindots))) {
+                ret = HDB_ERR_NOENTRY;
+                break;
+            }
+            ret = krb5_principal_set_comp_string(context, baseprinc, 3, tmp);
+            if (ret == 0)
+                ret = db->hdb_fetch_kvno(context, db, baseprinc, flags, kvno,
+                                         ent);
+            if (ret != HDB_ERR_NOENTRY || d == 0)
+                break;
+            ret = 0;
+            limit = d - 1;
         }
-
-        if (baseprinc == NULL)
-            /* First go around, need a namespace princ.  Make it! */
-            ret2 = make_namespace_princ(context, db, tmpprinc, &baseprinc);
-            /* Update the hostname component */
-        if (ret2 == 0)
-            ret2 = krb5_principal_set_comp_string(context, baseprinc, 3, tmp);
-        if (ret2)
-            ret = ret2;
-
-        if (tmp) {
-            /* Strip off left-most label for the next go-around */
-            if ((tmp = strchr(tmp, '.')))
-                tmp++;
-            hdots--;
-        } /* else we'll break out after the next db->hdb_fetch_kvno() call */
     }
 
     /*
@@ -1397,7 +2078,7 @@ fetch_it(krb5_context context,
      * key derivation to do, but that's decided in derive_keys().
      */
     if (ret == 0) {
-        ret = derive_keys(context, flags, princ, !!baseprinc, t, etype, kvno,
+        ret = derive_keys(context, db, flags, princ, !!baseprinc, t, etype, kvno,
                           ent);
         if (ret == 0)
             ret = fix_keys(context, db, flags, t, kvno, ent);
@@ -67,6 +67,7 @@ hkt_destroy(krb5_context context, HDB *db)
 
     ret = hdb_clear_master_key(context, db);
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    hdb_free_private_state(context, db);
 
     free(k->path);
     free(k);
@@ -1883,6 +1883,7 @@ LDAP_destroy(krb5_context context, HDB * db)
     if (HDB2URL(db))
 	free(HDB2URL(db));
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    hdb_free_private_state(context, db);
     if (db->hdb_name)
 	free(db->hdb_name);
     free(db->hdb_db);
@@ -92,6 +92,9 @@ typedef struct mdb_info {
     MDB_txn *t;
     MDB_dbi d;
     MDB_cursor *c;
+    char *path;
+    dev_t dev;
+    ino_t ino;
     int oflags;
     mode_t mode;
     size_t mapsize;
@@ -103,6 +106,8 @@ struct keep_it_open {
     char *path;
     MDB_env *env;
     MDB_dbi d;
+    dev_t dev;
+    ino_t ino;
     unsigned int oflags;
     size_t refs;
     size_t mapsize;
@@ -137,6 +142,10 @@ HEIMDAL_MUTEX keep_them_open_lock = HEIMDAL_MUTEX_INITIALIZER;
  * larger than the mmap size.  We handle this by finding in `keep_them_open'
  * the env we already have, marking it unusable, and the finding some other
  * better one or opening a new one and adding it to the list.
+ *
+ * Read-only envs are also matched on the device and inode of the file, so
+ * that once hpropd or iprop renames a new LMDB into place we stop handing
+ * out the env for the old one.
  */
 static krb5_error_code
 my_mdb_env_create_and_open(krb5_context context,
@@ -201,9 +210,17 @@ my_mdb_env_create_and_open(krb5_context context,
             mapsize = p->mapsize + (p->mapsize >> 1);
         if (!p->valid || p->oflags != mi->oflags)
             continue;
+        if (mi->oflags == O_RDONLY &&
+            (p->dev != st.st_dev || p->ino != st.st_ino)) {
+            /* The file was replaced since this env was opened */
+            p->valid = 0;
+            continue;
+        }
         /* Found one; output it and get out */
         mi->e = p->env;
         mi->d = p->d;
+        mi->dev = p->dev;
+        mi->ino = p->ino;
         p->refs++;
         goto out;
     }
@@ -231,6 +248,8 @@ my_mdb_env_create_and_open(krb5_context context,
     mi->mapsize = n->mapsize = mapsize;
     mi->e = n->env;
     mi->d = n->d;
+    mi->dev = n->dev = st.st_dev;
+    mi->ino = n->ino = st.st_ino;
 
     /* Add this keep_it_open to the front of the list */
     n->next = keep_them_open;
@@ -321,10 +340,43 @@ my_reopen_mdb(krb5_context context, HDB *db, int mapfull)
 	ret = krb5_enomem(context);
     if (ret == 0)
         ret = my_mdb_env_create_and_open(context, mi, fn, mapfull);
-    free(fn);
+    if (ret == 0) {
+        free(mi->path);
+        mi->path = fn;
+    } else {
+        free(fn);
+    }
     return ret;
 }
 
+/*
+ * Read-only handles may be kept open indefinitely (HDB_CAP_F_KEEP_OPEN), so
+ * before each read check whether the LMDB was replaced and reopen if so.  An
+ * inode check is all that's needed: updates made in place are visible to
+ * each new read transaction anyways.
+ */
+static krb5_error_code
+my_mdb_refresh(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    struct stat st;
+
+    if (mi->oflags != O_RDONLY)
+        return 0;
+    if (mi->e != NULL &&
+        (mi->path == NULL || stat(mi->path, &st) == -1 ||
+         (st.st_dev == mi->dev && st.st_ino == mi->ino)))
+        return 0;
+
+    krb5_debug(context, 5, "HDB LMDB %s was replaced; reopening",
+               db->hdb_name);
+    mdb_cursor_close(mi->c);
+    mdb_txn_abort(mi->t);
+    mi->c = 0;
+    mi->t = 0;
+    return my_reopen_mdb(context, db, 0);
+}
+
 static krb5_error_code
 DB_close(krb5_context context, HDB *db)
 {
@@ -346,6 +398,8 @@ DB_destroy(krb5_context context, HDB *db)
 
     ret = hdb_clear_master_key(context, db);
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    hdb_free_private_state(context, db);
+    free(((mdb_info *)db->hdb_db)->path);
     free(db->hdb_name);
     free(db->hdb_db);
     free(db);
@@ -437,6 +491,10 @@ DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 
     /* Always start with a fresh cursor to pick up latest DB state */
 
+    ret = my_mdb_refresh(context, db);
+    if (ret)
+        return ret;
+
     do {
         if (mi->t)
             mdb_txn_abort(mi->t);
@@ -498,6 +556,7 @@ static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code ret;
     MDB_txn *txn = NULL;
     MDB_val k, v;
     int tries = 3;
@@ -506,6 +565,10 @@ DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    ret = my_mdb_refresh(context, db);
+    if (ret)
+        return ret;
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -671,7 +734,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+                                  HDB_CAP_F_KEEP_OPEN;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
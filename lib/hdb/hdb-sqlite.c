@@ -40,6 +40,8 @@ typedef struct hdb_sqlite_db {
     double version;
     sqlite3 *db;
     char *db_file;
+    dev_t db_dev;
+    ino_t db_ino;
 
     sqlite3_stmt *connect;
     sqlite3_stmt *get_version;
@@ -403,6 +405,20 @@ hdb_sqlite_close_database(krb5_context context, HDB *db)
     return 0;
 }
 
+static void
+hdb_sqlite_file_id(const char *fn, dev_t *dev, ino_t *ino)
+{
+    struct stat st;
+
+    if (stat(fn, &st) == 0) {
+        *dev = st.st_dev;
+        *ino = st.st_ino;
+    } else {
+        *dev = 0;
+        *ino = 0;
+    }
+}
+
 /**
  * Opens an sqlite database file and prepares it for use.
  * If the file does not exist it will be created.
@@ -467,11 +483,14 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
 
     if(ret) goto out;
 
+    hdb_sqlite_file_id(hsdb->db_file, &hsdb->db_dev, &hsdb->db_ino);
     return 0;
 
  out:
+    finalize_stmts(context, hsdb);
     if (hsdb->db)
         sqlite3_close(hsdb->db);
+    hsdb->db = NULL;
     if (created_file)
         unlink(hsdb->db_file);
     free(hsdb->db_file);
@@ -480,6 +499,49 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
     return ret;
 }
 
+/**
+ * Reopens the database if its file has been replaced since we opened
+ * it, e.g., by hpropd or iprop renaming a new database into place.
+ * The connection is otherwise kept open for the life of the handle.
+ *
+ * @param context The current krb5_context
+ * @param db      Heimdal database handle
+ *
+ * @return        0 if everything worked, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_refresh(krb5_context context, HDB *db)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    krb5_error_code ret;
+    dev_t dev;
+    ino_t ino;
+    char *fn;
+
+    if (hsdb->db_file == NULL) {
+        krb5_set_error_message(context, HDB_ERR_UK_RERROR,
+                               "sqlite database %s is not open", db->hdb_name);
+        return HDB_ERR_UK_RERROR;
+    }
+    hdb_sqlite_file_id(hsdb->db_file, &dev, &ino);
+    if (hsdb->db != NULL &&
+        (ino == 0 || (dev == hsdb->db_dev && ino == hsdb->db_ino)))
+        return 0;
+
+    fn = hsdb->db_file;
+    hsdb->db_file = NULL;
+    (void) hdb_sqlite_close_database(context, db);
+    hsdb->db = NULL;
+    ret = hdb_sqlite_make_database(context, db, fn);
+    if (ret) {
+        /* Keep the name so the next call can try again */
+        hsdb->db_file = fn;
+        return ret;
+    }
+    free(fn);
+    return 0;
+}
+
 /**
  * Retrieves an entry by searching for the given
  * principal in the Principal database table, both
@@ -500,10 +562,15 @@ hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal princi
     int sqlite_error;
     krb5_error_code ret;
     hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
-    sqlite3_stmt *fetch = hsdb->fetch;
+    sqlite3_stmt *fetch;
     krb5_data value;
     krb5_principal enterprise_principal = NULL;
 
+    ret = hdb_sqlite_refresh(context, db);
+    if (ret)
+	return ret;
+    fetch = hsdb->fetch;
+
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
 	if (principal->name.name_string.len != 1) {
 	    ret = KRB5_PARSE_MALFORMED;
@@ -818,6 +885,7 @@ hdb_sqlite_destroy(krb5_context context, HDB *db)
     hsdb = (hdb_sqlite_db*)(db->hdb_db);
 
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    hdb_free_private_state(context, db);
     free(hsdb->db_file);
     free(db->hdb_name);
     free(db->hdb_db);
@@ -905,6 +973,10 @@ hdb_sqlite_firstkey(krb5_context context, HDB *db, unsigned flags,
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
     krb5_error_code ret;
 
+    ret = hdb_sqlite_refresh(context, db);
+    if (ret)
+        return ret;
+
     sqlite3_reset(hsdb->get_all_entries);
 
     ret = hdb_sqlite_nextkey(context, db, flags, entry);
@@ -1049,7 +1121,7 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *filename)
 
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_KEEP_OPEN;
 
     (*db)->hdb_open = hdb_sqlite_open;
     (*db)->hdb_close = hdb_sqlite_close;
@@ -679,6 +679,9 @@ _hdb_keytab2hdb_entry(krb5_context context,
 static krb5_error_code
 load_config(krb5_context context, HDB *db)
 {
+    time_t ns_index_interval;
+    int cache_size, ns_index;
+
     db->enable_virtual_hostbased_princs =
         krb5_config_get_bool_default(context, NULL, FALSE, "hdb",
                                      "enable_virtual_hostbased_princs",
@@ -707,7 +710,20 @@ load_config(krb5_context context, HDB *db)
                                   "virtual_hostbased_princ_svcs", NULL)) {
         return krb5_enomem(context);
     }
-    return 0;
+    /* Settings for state kept outside struct HDB; see common.c */
+    cache_size =
+        krb5_config_get_int_default(context, NULL, 1024, "hdb",
+                                    "derived_key_cache_size", NULL);
+    ns_index =
+        krb5_config_get_bool_default(context, NULL, FALSE, "hdb",
+                                     "virtual_hostbased_princ_index",
+                                     NULL);
+    ns_index_interval =
+        krb5_config_get_time_default(context, NULL, 10, "hdb",
+                                     "virtual_hostbased_princ_index_interval",
+                                     NULL);
+    return _hdb_private_init(context, db, cache_size < 0 ? 0 : cache_size,
+                             ns_index, ns_index_interval);
 }
 
 /**
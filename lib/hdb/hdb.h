@@ -73,6 +73,12 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
 #define HDB_CAP_F_SHARED_DIRECTORY      8
+/*
+ * A handle opened O_RDONLY holds no locks between operations, sees committed
+ * updates, and reopens itself when its file is replaced (e.g., by hpropd or
+ * iprop), so callers may keep it open across fetches.
+ */
+#define HDB_CAP_F_KEEP_OPEN             16
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -37,6 +37,11 @@
 #include <pkinit_asn1.h>
 #include <base64.h>
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define HDB_KEYS_USE_THREADS 1
+#endif
+
 /*
  * free all the memory used by (len, keys)
  */
@@ -800,6 +805,120 @@ hdb_generate_key_set(krb5_context context, krb5_principal principal,
     return ret;
 }
 
+static krb5_error_code
+password_to_key(krb5_context context, const char *password, Key *key)
+{
+    krb5_salt salt;
+
+    salt.salttype = key->salt->type;
+    salt.saltvalue.length = key->salt->salt.length;
+    salt.saltvalue.data = key->salt->salt.data;
+
+    return krb5_string_to_key_salt(context, key->key.keytype, password,
+				   salt, &key->key);
+}
+
+#ifdef HDB_KEYS_USE_THREADS
+
+/*
+ * The string-to-key functions of the AES enctypes run thousands of
+ * PBKDF2 iterations each, so derive the keys of a key set in parallel,
+ * one thread per key.  Error messages are not safe to set from several
+ * threads on one context, so each thread works on its own copy of the
+ * context, and the message of the first key that failed is copied back
+ * to the caller's.
+ */
+
+struct s2k_job {
+    krb5_context context;
+    const char *password;
+    Key *key;
+    krb5_error_code ret;
+    pthread_t thread;
+    int started;
+};
+
+static void *
+s2k_thread(void *arg)
+{
+    struct s2k_job *job = arg;
+
+    job->ret = password_to_key(job->context, job->password, job->key);
+    return NULL;
+}
+
+static krb5_error_code
+password_to_keys_threaded(krb5_context context, const char *password,
+			  Key *keys, size_t num_keys)
+{
+    struct s2k_job *jobs;
+    krb5_error_code ret;
+    size_t i;
+
+    jobs = calloc(num_keys, sizeof(*jobs));
+    if (jobs == NULL)
+	return krb5_enomem(context);
+
+    /* The first key is done on this thread, with the caller's context */
+    for (i = 1; i < num_keys; i++) {
+	jobs[i].password = password;
+	jobs[i].key = &keys[i];
+	if (krb5_copy_context(context, &jobs[i].context) == 0 &&
+	    pthread_create(&jobs[i].thread, NULL, s2k_thread, &jobs[i]) == 0)
+	    jobs[i].started = 1;
+    }
+
+    ret = password_to_key(context, password, &keys[0]);
+
+    for (i = 1; i < num_keys; i++) {
+	if (!jobs[i].started)
+	    continue;
+	pthread_join(jobs[i].thread, NULL);
+	if (ret == 0 && jobs[i].ret) {
+	    const char *msg;
+
+	    ret = jobs[i].ret;
+	    msg = krb5_get_error_message(jobs[i].context, ret);
+	    krb5_set_error_message(context, ret, "%s", msg);
+	    krb5_free_error_message(jobs[i].context, msg);
+	}
+    }
+
+    /* Keys that did not get a thread */
+    for (i = 1; ret == 0 && i < num_keys; i++) {
+	if (!jobs[i].started)
+	    ret = password_to_key(context, password, &keys[i]);
+    }
+
+    for (i = 1; i < num_keys; i++) {
+	if (jobs[i].context)
+	    krb5_free_context(jobs[i].context);
+    }
+    free(jobs);
+
+    return ret;
+}
+
+#endif /* HDB_KEYS_USE_THREADS */
+
+static krb5_error_code
+password_to_keys(krb5_context context, const char *password,
+		 Key *keys, size_t num_keys)
+{
+    krb5_error_code ret = 0;
+    size_t i;
+
+#ifdef HDB_KEYS_USE_THREADS
+    if (num_keys > 1)
+	return password_to_keys_threaded(context, password, keys, num_keys);
+#endif
+    for (i = 0; i < num_keys; i++) {
+	ret = password_to_key(context, password, &keys[i]);
+	if (ret)
+	    break;
+    }
+    return ret;
+}
 
 krb5_error_code
 hdb_generate_key_set_password_with_ks_tuple(krb5_context context,
@@ -810,29 +929,13 @@ hdb_generate_key_set_password_with_ks_tuple(krb5_context context,
 					    Key **keys, size_t *num_keys)
 {
     krb5_error_code ret;
-    size_t i;
 
     ret = hdb_generate_key_set(context, principal, ks_tuple, n_ks_tuple,
 				keys, num_keys, 0);
     if (ret)
 	return ret;
 
-    for (i = 0; i < (*num_keys); i++) {
-	krb5_salt salt;
-	Key *key = &(*keys)[i];
-
-	salt.salttype = key->salt->type;
-	salt.saltvalue.length = key->salt->salt.length;
-	salt.saltvalue.data = key->salt->salt.data;
-
-	ret = krb5_string_to_key_salt (context,
-				       key->key.keytype,
-				       password,
-				       salt,
-				       &key->key);
-	if(ret)
-	    break;
-    }
+    ret = password_to_keys(context, password, *keys, *num_keys);
 
     if(ret) {
 	hdb_free_keys (context, *num_keys, *keys);
@@ -55,6 +55,7 @@ NDBM_destroy(krb5_context context, HDB *db)
 {
     hdb_clear_master_key(context, db);
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    hdb_free_private_state(context, db);
     free(db->hdb_name);
     free(db);
     return 0;
@@ -110,11 +110,36 @@ append_hex(krb5_context context, krb5_storage *sp,
     return sz;
 }
 
+/*
+ * Format `t' as YYYYmmddHHMMSS (UTC) into `buf'.  This is done by hand
+ * rather than with gmtime(), which is not reentrant, so that entries can
+ * be formatted from several threads at once (see kadmin dump --threads).
+ */
 static char *
-time2str(time_t t)
+time2str(time_t t, char *buf, size_t len)
 {
-    static char buf[128];
-    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmtime(&t));
+    int64_t days = (int64_t)t / 86400;
+    int64_t secs = (int64_t)t % 86400;
+    int64_t era, y;
+    unsigned doe, yoe, doy, mp, m, d;
+
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    /* civil date from days since the epoch, shifted to start on 0000-03-01 */
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = (unsigned)(days - era * 146097);
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+    snprintf(buf, len, "%04lld%02u%02u%02u%02u%02u", (long long)y, m, d,
+             (unsigned)(secs / 3600), (unsigned)(secs / 60 % 60),
+             (unsigned)(secs % 60));
     return buf;
 }
 
@@ -124,13 +149,15 @@ append_event(krb5_context context, krb5_storage *sp, Event *ev)
     krb5_error_code ret;
     ssize_t sz;
     char *pr = NULL;
+    char tbuf[32];
+
     if(ev == NULL)
 	return append_string(context, sp, "- ");
     if (ev->principal != NULL) {
        ret = krb5_unparse_name(context, ev->principal, &pr);
        if (ret) return -1; /* krb5_unparse_name() sets error info */
     }
-    sz = append_string(context, sp, "%s:%s ", time2str(ev->time),
+    sz = append_string(context, sp, "%s:%s ", time2str(ev->time, tbuf, sizeof(tbuf)),
                        pr ? pr : "UNKNOWN");
     free(pr);
     return sz;
@@ -216,6 +243,7 @@ append_mit_key(krb5_context context, krb5_storage *sp,
 static krb5_error_code
 entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 {
+    char tbuf[32];
     char *p;
     size_t i;
     krb5_error_code ret;
@@ -256,19 +284,19 @@ entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 
     /* --- valid start */
     if(ent->valid_start)
-	append_string(context, sp, "%s ", time2str(*ent->valid_start));
+	append_string(context, sp, "%s ", time2str(*ent->valid_start, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
     /* --- valid end */
     if(ent->valid_end)
-	append_string(context, sp, "%s ", time2str(*ent->valid_end));
+	append_string(context, sp, "%s ", time2str(*ent->valid_end, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
     /* --- password ends */
     if(ent->pw_end)
-	append_string(context, sp, "%s ", time2str(*ent->pw_end));
+	append_string(context, sp, "%s ", time2str(*ent->pw_end, tbuf, sizeof(tbuf)));
     else
 	append_string(context, sp, "- ");
 
@@ -289,7 +317,7 @@ entry2string_int (krb5_context context, krb5_storage *sp, hdb_entry *ent)
 
     /* --- generation number */
     if(ent->generation) {
-	append_string(context, sp, "%s:%d:%d ", time2str(ent->generation->time),
+	append_string(context, sp, "%s:%d:%d ", time2str(ent->generation->time, tbuf, sizeof(tbuf)),
 		      ent->generation->usec,
 		      ent->generation->gen);
     } else
@@ -553,7 +581,40 @@ hdb_entry2string(krb5_context context, hdb_entry *ent, char **str)
     return 0;
 }
 
-/* print a hdb_entry to (FILE*)data; suitable for hdb_foreach */
+/*
+ * Append the dump representation of `ent' in format `fmt', including the
+ * trailing newline, to `sp'.  This does not touch any shared state, so it
+ * may be called concurrently for different entries.
+ */
+
+krb5_error_code
+hdb_entry2dump(krb5_context context, hdb_entry *ent, hdb_dump_format_t fmt,
+               krb5_storage *sp)
+{
+    krb5_error_code ret;
+
+    switch (fmt) {
+    case HDB_DUMP_HEIMDAL:
+        ret = entry2string_int(context, sp, ent);
+        break;
+    case HDB_DUMP_MIT:
+        ret = entry2mit_string_int(context, sp, ent);
+        break;
+    default:
+        heim_abort("Only two dump formats supported: Heimdal and MIT");
+    }
+    if (ret == 0 && krb5_storage_write(sp, "\n", 1) != 1)
+        ret = ENOMEM;
+    return ret;
+}
+
+/*
+ * print a hdb_entry to (FILE*)data; suitable for hdb_foreach
+ *
+ * The line is formatted in memory and handed to stdio in one piece, so
+ * that the output stays buffered instead of costing a flush and a
+ * handful of unbuffered writes per entry.
+ */
 
 krb5_error_code
 hdb_print_entry(krb5_context context, HDB *db, hdb_entry_ex *entry,
@@ -562,30 +623,23 @@ hdb_print_entry(krb5_context context, HDB *db, hdb_entry_ex *entry,
     struct hdb_print_entry_arg *parg = data;
     krb5_error_code ret;
     krb5_storage *sp;
+    krb5_data d;
 
-    fflush(parg->out);
-    sp = krb5_storage_from_fd(fileno(parg->out));
+    sp = krb5_storage_emem();
     if (sp == NULL) {
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
 
-    switch (parg->fmt) {
-    case HDB_DUMP_HEIMDAL:
-        ret = entry2string_int(context, sp, &entry->entry);
-        break;
-    case HDB_DUMP_MIT:
-        ret = entry2mit_string_int(context, sp, &entry->entry);
-        break;
-    default:
-        heim_abort("Only two dump formats supported: Heimdal and MIT");
-    }
-    if (ret) {
-	krb5_storage_free(sp);
+    ret = hdb_entry2dump(context, &entry->entry, parg->fmt, sp);
+    if (ret == 0)
+        ret = krb5_storage_to_data(sp, &d);
+    krb5_storage_free(sp);
+    if (ret)
 	return ret;
-    }
 
-    krb5_storage_write(sp, "\n", 1);
-    krb5_storage_free(sp);
-    return 0;
+    if (fwrite(d.data, 1, d.length, parg->out) != d.length)
+        ret = errno ? errno : EIO;
+    krb5_data_free(&d);
+    return ret;
 }
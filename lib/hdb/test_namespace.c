@@ -60,6 +60,9 @@ typedef struct {
      * minute or three at a time.
      */
     heim_dict_t dict;
+    heim_array_t iter;  /* Snapshot of `dict' values for hdb_nextkey() */
+    size_t iter_pos;
+    size_t fetches;     /* Calls to hdb_fetch_kvno() */
 } TEST_HDB;
 
 struct hdb_called {
@@ -79,6 +82,8 @@ TDB_destroy(krb5_context context, HDB *db)
 {
     TEST_HDB *tdb = (void *)db;
 
+    hdb_free_private_state(context, db);
+    heim_release(tdb->iter);
     heim_release(tdb->dict);
     free(tdb->hdb.hdb_name);
     free(tdb);
@@ -105,22 +110,68 @@ TDB_unlock(krb5_context context, HDB *db)
     return 0;
 }
 
+static void
+TDB_iter_add(heim_object_t key, heim_object_t value, void *arg)
+{
+    heim_array_append_value(arg, value);
+}
+
+static krb5_error_code
+TDB_nextkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
+{
+    TEST_HDB *tdb = (void *)db;
+    heim_object_t v;
+    const void *ptr;
+    krb5_data data;
+
+    memset(entry, 0, sizeof(*entry));
+    while (tdb->iter && tdb->iter_pos < heim_array_get_length(tdb->iter)) {
+        v = heim_array_get_value(tdb->iter, tdb->iter_pos++);
+        ptr = heim_data_get_ptr(v);
+        data.data = rk_UNCONST(ptr);
+        data.length = heim_data_get_length(v);
+        /* Skip aliases */
+        if (hdb_value2entry(context, &data, &entry->entry) == 0)
+            return 0;
+    }
+    heim_release(tdb->iter);
+    tdb->iter = NULL;
+    return HDB_ERR_NOENTRY;
+}
+
 static krb5_error_code
 TDB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
-    /* XXX Implement */
-    /* Tricky thing: heim_dict_iterate_f() is inconvenient here */
-    /* We need this to check that virtual principals aren't created */
-    return 0;
+    TEST_HDB *tdb = (void *)db;
+
+    heim_release(tdb->iter);
+    if ((tdb->iter = heim_array_create()) == NULL)
+        return krb5_enomem(context);
+    tdb->iter_pos = 0;
+    heim_dict_iterate_f(tdb->dict, tdb->iter, TDB_iter_add);
+    return TDB_nextkey(context, db, flags, entry);
 }
 
 static krb5_error_code
-TDB_nextkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
+TDB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+               unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
 {
-    /* XXX Implement */
-    /* Tricky thing: heim_dict_iterate_f() is inconvenient here */
-    /* We need this to check that virtual principals aren't created */
-    return 0;
+    TEST_HDB *tdb = (void *)db;
+
+    tdb->fetches++;
+    return _hdb_fetch_kvno(context, db, principal, flags, kvno, entry);
+}
+
+/* Change our file so the namespace index sees that the DB changed */
+static void
+TDB_touch(HDB *db)
+{
+    int fd = open(db->hdb_name, O_WRONLY | O_APPEND);
+
+    if (fd != -1) {
+        (void) write(fd, "", 1);
+        (void) close(fd);
+    }
 }
 
 static krb5_error_code
@@ -162,6 +213,8 @@ TDB__put(krb5_context context, HDB *db, int rplc, krb5_data kd, krb5_data vd)
         ret = HDB_ERR_EXISTS;
     if (ret == 0 && heim_dict_set_value(tdb->dict, k, v))
         ret = krb5_enomem(context);
+    if (ret == 0)
+        TDB_touch(db);
     heim_release(k);
     heim_release(v);
     return ret;
@@ -178,8 +231,10 @@ TDB__del(krb5_context context, HDB *db, krb5_data key)
         ret = krb5_enomem(context);
     if (ret == 0 && (v = heim_dict_get_value(tdb->dict, k)) == NULL)
         ret = HDB_ERR_NOENTRY;
-    if (ret == 0)
+    if (ret == 0) {
         heim_dict_delete_key(tdb->dict, k);
+        TDB_touch(db);
+    }
     heim_release(k);
     return ret;
 }
@@ -202,6 +257,8 @@ hdb_test_create(krb5_context context, struct HDB **db, const char *arg)
         free(tdb);
         return krb5_enomem(context);
     }
+    /* We keep nothing in it; see TDB_touch() */
+    (void) close(open(arg, O_CREAT | O_TRUNC | O_WRONLY, 0600));
 
     tdb->hdb.hdb_db = NULL;
     tdb->hdb.hdb_master_key_set = 0;
@@ -209,7 +266,7 @@ hdb_test_create(krb5_context context, struct HDB **db, const char *arg)
     tdb->hdb.hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
     tdb->hdb.hdb_open  = TDB_open;
     tdb->hdb.hdb_close = TDB_close;
-    tdb->hdb.hdb_fetch_kvno = _hdb_fetch_kvno;
+    tdb->hdb.hdb_fetch_kvno = TDB_fetch_kvno;
     tdb->hdb.hdb_store = _hdb_store;
     tdb->hdb.hdb_remove = _hdb_remove;
     tdb->hdb.hdb_firstkey = TDB_firstkey;
@@ -634,6 +691,54 @@ fetch_entries(krb5_context context,
     free_EncryptionKey(&base_key);
 }
 
+/*
+ * Check that the namespace index spares us fetching namespaces that don't
+ * exist, and that it notices when a namespace goes away.
+ */
+static void
+check_namespace_index(krb5_context context, HDB *db)
+{
+    TEST_HDB *tdb = (void *)db;
+    krb5_error_code ret;
+    krb5_principal p, ns;
+    hdb_entry_ex ent;
+
+    /*
+     * With maxdots = 3 we'd otherwise fetch the principal, then
+     * c.d.bar.example, d.bar.example, and bar.example.
+     */
+    ret = krb5_parse_name(context, "HTTP/a.b.c.d.bar.example@BAR.EXAMPLE", &p);
+    if (ret == 0) {
+        tdb->fetches = 0;
+        ret = hdb_fetch_kvno(context, db, p, HDB_F_DECRYPT,
+                             krs[1].epoch + 1, 0, 0, &ent);
+    }
+    if (ret)
+        krb5_err(context, 1, ret, "virtual principal not found");
+    if (tdb->fetches != 2)
+        krb5_errx(context, 1, "namespace index not used (%lu fetches)",
+                  (unsigned long)tdb->fetches);
+    hdb_free_entry(context, &ent);
+
+    ret = krb5_parse_name(context, WK_PREFIX "_/bar.example@BAR.EXAMPLE", &ns);
+    if (ret == 0)
+        ret = db->hdb_remove(context, db, 0, ns);
+    if (ret)
+        krb5_err(context, 1, ret, "could not remove namespace");
+    tdb->fetches = 0;
+    ret = hdb_fetch_kvno(context, db, p, HDB_F_DECRYPT,
+                         krs[1].epoch + 1, 0, 0, &ent);
+    if (ret == 0)
+        krb5_errx(context, 1, "virtual principal exists without namespace");
+    if (ret != HDB_ERR_NOENTRY)
+        krb5_err(context, 1, ret, "wrong error code");
+    if (tdb->fetches != 1)
+        krb5_errx(context, 1, "namespace index not updated (%lu fetches)",
+                  (unsigned long)tdb->fetches);
+    krb5_free_principal(context, ns);
+    krb5_free_principal(context, p);
+}
+
 static void
 check_kvnos(krb5_context context)
 {
@@ -801,6 +906,7 @@ check_expected_kvnos(krb5_context context)
     "\tenable_virtual_hostbased_princs = true\n"    \
     "\tvirtual_hostbased_princ_mindots = 1\n"       \
     "\tvirtual_hostbased_princ_maxdots = 3\n"       \
+    "\tvirtual_hostbased_princ_index = true\n"      \
 
 int
 main(int argc, char **argv)
@@ -819,7 +925,7 @@ main(int argc, char **argv)
         ret = krb5_plugin_register(context, PLUGIN_TYPE_DATA, "hdb_test_interface",
                                    &hdb_test);
     if (ret == 0)
-        ret = hdb_create(context, &db, "test:mem");
+        ret = hdb_create(context, &db, "test:test_namespace.tdb");
     if (ret)
         krb5_err(context, 1, ret, "failed to setup HDB driver and test");
 
@@ -907,6 +1013,23 @@ main(int argc, char **argv)
      */
     check_kvnos(context);
 
+    /*
+     * Fetching the same virtual principals at different times derives many
+     * of the same keysets, so some of them must have come from the derived
+     * key cache (and check_kvnos() above shows they were the right ones).
+     */
+    {
+        uint64_t hits, misses;
+
+        ret = hdb_derived_key_cache_stats(context, db, &hits, &misses);
+        if (ret)
+            krb5_err(context, 1, ret, "hdb_derived_key_cache_stats");
+        if (hits == 0 || misses == 0)
+            krb5_errx(context, 1, "derived key cache not used (%llu hits, "
+                      "%llu misses)", (unsigned long long)hits,
+                      (unsigned long long)misses);
+    }
+
 #if 0
     /*
      * Check that for every virtual principal in `expected[]' we have the
@@ -926,6 +1049,8 @@ main(int argc, char **argv)
 
     print_em(context);
 
+    check_namespace_index(context, db);
+
     /*
      * XXX Test adding a third KR, a 4th KR, dropping KRs...
      */
@@ -933,6 +1058,7 @@ main(int argc, char **argv)
     /* Cleanup */
     for (i = 0; ret == 0 && i < sizeof(e) / sizeof(e[0]); i++)
         hdb_free_entry(context, &e[i]);
+    unlink(db->hdb_name);
     db->hdb_destroy(context, db);
     krb5_free_context(context);
     return 0;
@@ -198,6 +198,12 @@ hx509_context_init(hx509_context *contextp)
                                      HX509_DEFAULT_OCSP_TIME_DIFF,
                                      "libdefaults", "ocsp_time_dif", NULL);
 
+    context->revoke_reload_interval =
+        heim_config_get_time_default(context->hcontext, context->cf,
+                                     HX509_DEFAULT_REVOKE_RELOAD_INTERVAL,
+                                     "libdefaults", "revoke_reload_interval",
+                                     NULL);
+
     initialize_hx_error_table_r(&context->et_list);
     initialize_asn1_error_table_r(&context->et_list);
 
@@ -204,6 +204,8 @@ struct hx509_context_data {
 #define HX509_CTX_VERIFY_MISSING_OK	1
     int ocsp_time_diff;
 #define HX509_DEFAULT_OCSP_TIME_DIFF	(5*60)
+    int revoke_reload_interval;
+#define HX509_DEFAULT_REVOKE_RELOAD_INTERVAL	1
     heim_error_t error;
     struct et_list *et_list;
     char *querystat;
@@ -51,10 +51,25 @@
 
 #include "hx_locl.h"
 
+/*
+ * The entries of a CRL or an OCSP response sorted by serial number, so
+ * that looking a certificate up is a binary search rather than a scan
+ * of what may be a very long list.  Entries with the same serial
+ * number stay in the order they have in the file.
+ */
+
+struct serial_index {
+    const heim_integer *serial;
+    size_t entry;
+};
+
 struct revoke_crl {
     char *path;
     time_t last_modfied;
+    time_t last_check;
     CRLCertificateList crl;
+    struct serial_index *index;
+    size_t index_len;
     int verified;
     int failed_verify;
 };
@@ -62,7 +77,10 @@ struct revoke_crl {
 struct revoke_ocsp {
     char *path;
     time_t last_modfied;
+    time_t last_check;
     OCSPBasicOCSPResponse ocsp;
+    struct serial_index *index;
+    size_t index_len;
     hx509_certs certs;
     hx509_cert signer;
 };
@@ -120,10 +138,123 @@ _hx509_revoke_ref(hx509_revoke_ctx ctx)
     return ctx;
 }
 
+static int
+serial_index_cmp(const void *a, const void *b)
+{
+    const struct serial_index *x = a, *y = b;
+    int ret;
+
+    ret = der_heim_integer_cmp(x->serial, y->serial);
+    if (ret == 0)
+	ret = (x->entry > y->entry) - (x->entry < y->entry);
+    return ret;
+}
+
+/*
+ * Return the position in `index' of the first entry for `serial', or
+ * `len' if there is none.
+ */
+
+static size_t
+serial_index_find(const struct serial_index *index, size_t len,
+		  const heim_integer *serial)
+{
+    size_t lo = 0, hi = len, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (der_heim_integer_cmp(index[mid].serial, serial) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < len && der_heim_integer_cmp(index[lo].serial, serial) != 0)
+	return len;
+    return lo;
+}
+
+static int
+index_crl(const CRLCertificateList *crl,
+	  struct serial_index **index, size_t *len)
+{
+    const struct TBSCRLCertList_revokedCertificates *revoked =
+	crl->tbsCertList.revokedCertificates;
+    size_t i;
+
+    *index = NULL;
+    *len = 0;
+
+    if (revoked == NULL || revoked->len == 0)
+	return 0;
+
+    *index = malloc(revoked->len * sizeof((*index)[0]));
+    if (*index == NULL)
+	return ENOMEM;
+
+    for (i = 0; i < revoked->len; i++) {
+	(*index)[i].serial = &revoked->val[i].userCertificate;
+	(*index)[i].entry = i;
+    }
+    *len = revoked->len;
+    qsort(*index, *len, sizeof((*index)[0]), serial_index_cmp);
+
+    return 0;
+}
+
+static int
+index_ocsp(const OCSPBasicOCSPResponse *basic,
+	   struct serial_index **index, size_t *len)
+{
+    const struct OCSPResponseData_responses *responses =
+	&basic->tbsResponseData.responses;
+    size_t i;
+
+    *index = NULL;
+    *len = 0;
+
+    if (responses->len == 0)
+	return 0;
+
+    *index = malloc(responses->len * sizeof((*index)[0]));
+    if (*index == NULL)
+	return ENOMEM;
+
+    for (i = 0; i < responses->len; i++) {
+	(*index)[i].serial = &responses->val[i].certID.serialNumber;
+	(*index)[i].entry = i;
+    }
+    *len = responses->len;
+    qsort(*index, *len, sizeof((*index)[0]), serial_index_cmp);
+
+    return 0;
+}
+
+/*
+ * Check whether the file at `path' has changed since it was loaded.
+ * To keep busy verifiers from doing a stat() per certificate, this is
+ * done at most once every revoke_reload_interval seconds per file.
+ */
+
+static int
+revoke_file_changed(hx509_context context, const char *path,
+		    time_t *last_check, time_t last_modified)
+{
+    time_t t = time(NULL);
+    struct stat sb;
+
+    if (t >= *last_check &&
+	t - *last_check < context->revoke_reload_interval)
+	return 0;
+    *last_check = t;
+
+    return stat(path, &sb) == 0 && sb.st_mtime != last_modified;
+}
+
 static void
 free_ocsp(struct revoke_ocsp *ocsp)
 {
     free(ocsp->path);
+    free(ocsp->index);
     free_OCSPBasicOCSPResponse(&ocsp->ocsp);
     hx509_certs_free(&ocsp->certs);
     hx509_cert_free(ocsp->signer);
@@ -152,6 +283,7 @@ hx509_revoke_free(hx509_revoke_ctx *ctx)
 
     for (i = 0; i < (*ctx)->crls.len; i++) {
 	free((*ctx)->crls.val[i].path);
+	free((*ctx)->crls.val[i].index);
 	free_CRLCertificateList(&(*ctx)->crls.val[i].crl);
     }
 
@@ -327,7 +459,8 @@ load_ocsp(hx509_context context, struct revoke_ocsp *ocsp)
 {
     OCSPBasicOCSPResponse basic;
     hx509_certs certs = NULL;
-    size_t length;
+    struct serial_index *index;
+    size_t length, index_len;
     struct stat sb;
     void *data;
     int ret;
@@ -350,12 +483,20 @@ load_ocsp(hx509_context context, struct revoke_ocsp *ocsp)
 	return ret;
     }
 
+    ret = index_ocsp(&basic, &index, &index_len);
+    if (ret) {
+	free_OCSPBasicOCSPResponse(&basic);
+	hx509_clear_error_string(context);
+	return ret;
+    }
+
     if (basic.certs) {
 	size_t i;
 
 	ret = hx509_certs_init(context, "MEMORY:ocsp-certs", 0,
 			       NULL, &certs);
 	if (ret) {
+	    free(index);
 	    free_OCSPBasicOCSPResponse(&basic);
 	    return ret;
 	}
@@ -375,12 +516,16 @@ load_ocsp(hx509_context context, struct revoke_ocsp *ocsp)
     }
 
     ocsp->last_modfied = sb.st_mtime;
+    ocsp->last_check = time(NULL);
 
+    free(ocsp->index);
     free_OCSPBasicOCSPResponse(&ocsp->ocsp);
     hx509_certs_free(&ocsp->certs);
     hx509_cert_free(ocsp->signer);
 
     ocsp->ocsp = basic;
+    ocsp->index = index;
+    ocsp->index_len = index_len;
     ocsp->certs = certs;
     ocsp->signer = NULL;
 
@@ -417,7 +562,7 @@ hx509_revoke_add_ocsp(hx509_context context,
     path += 5;
 
     for (i = 0; i < ctx->ocsps.len; i++) {
-	if (strcmp(ctx->ocsps.val[0].path, path) == 0)
+	if (strcmp(ctx->ocsps.val[i].path, path) == 0)
 	    return 0;
     }
 
@@ -684,6 +829,17 @@ hx509_revoke_add_crl(hx509_context context,
 	return ret;
     }
 
+    ret = index_crl(&ctx->crls.val[ctx->crls.len].crl,
+		    &ctx->crls.val[ctx->crls.len].index,
+		    &ctx->crls.val[ctx->crls.len].index_len);
+    if (ret) {
+	free(ctx->crls.val[ctx->crls.len].path);
+	free_CRLCertificateList(&ctx->crls.val[ctx->crls.len].crl);
+	hx509_clear_error_string(context);
+	return ret;
+    }
+    ctx->crls.val[ctx->crls.len].last_check = time(NULL);
+
     ctx->crls.len++;
 
     return ret;
@@ -717,19 +873,19 @@ hx509_revoke_verify(hx509_context context,
     const Certificate *c = _hx509_get_cert(cert);
     const Certificate *p = _hx509_get_cert(parent_cert);
     unsigned long i, j, k;
+    size_t l;
     int ret;
 
     hx509_clear_error_string(context);
 
     for (i = 0; i < ctx->ocsps.len; i++) {
 	struct revoke_ocsp *ocsp = &ctx->ocsps.val[i];
-	struct stat sb;
 
 	/* check this ocsp apply to this cert */
 
 	/* check if there is a newer version of the file */
-	ret = stat(ocsp->path, &sb);
-	if (ret == 0 && ocsp->last_modfied != sb.st_mtime) {
+	if (revoke_file_changed(context, ocsp->path, &ocsp->last_check,
+				ocsp->last_modfied)) {
 	    ret = load_ocsp(context, ocsp);
 	    if (ret)
 		continue;
@@ -742,20 +898,22 @@ hx509_revoke_verify(hx509_context context,
 		continue;
 	}
 
-	for (j = 0; j < ocsp->ocsp.tbsResponseData.responses.len; j++) {
+	for (l = serial_index_find(ocsp->index, ocsp->index_len,
+				   &c->tbsCertificate.serialNumber);
+	     l < ocsp->index_len &&
+		 der_heim_integer_cmp(ocsp->index[l].serial,
+				      &c->tbsCertificate.serialNumber) == 0;
+	     l++) {
 	    heim_octet_string os;
 
-	    ret = der_heim_integer_cmp(&ocsp->ocsp.tbsResponseData.responses.val[j].certID.serialNumber,
-				   &c->tbsCertificate.serialNumber);
-	    if (ret != 0)
-		continue;
+	    j = ocsp->index[l].entry;
 
 	    /* verify issuer hashes hash */
 	    ret = _hx509_verify_signature(context,
 					  NULL,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.hashAlgorithm,
+					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.hashAlgorithm,
 					  &c->tbsCertificate.issuer._save,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.issuerNameHash);
+					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.issuerNameHash);
 	    if (ret != 0)
 		continue;
 
@@ -799,7 +957,6 @@ hx509_revoke_verify(hx509_context context,
 
     for (i = 0; i < ctx->crls.len; i++) {
 	struct revoke_crl *crl = &ctx->crls.val[i];
-	struct stat sb;
 	int diff;
 
 	/* check if cert.issuer == crls.val[i].crl.issuer */
@@ -808,14 +965,26 @@ hx509_revoke_verify(hx509_context context,
 	if (ret || diff)
 	    continue;
 
-	ret = stat(crl->path, &sb);
-	if (ret == 0 && crl->last_modfied != sb.st_mtime) {
+	if (revoke_file_changed(context, crl->path, &crl->last_check,
+				crl->last_modfied)) {
 	    CRLCertificateList cl;
+	    struct serial_index *index;
+	    size_t index_len;
+	    time_t t;
 
-	    ret = load_crl(context, crl->path, &crl->last_modfied, &cl);
+	    ret = load_crl(context, crl->path, &t, &cl);
 	    if (ret == 0) {
+		ret = index_crl(&cl, &index, &index_len);
+		if (ret)
+		    free_CRLCertificateList(&cl);
+	    }
+	    if (ret == 0) {
+		free(crl->index);
 		free_CRLCertificateList(&crl->crl);
 		crl->crl = cl;
+		crl->index = index;
+		crl->index_len = index_len;
+		crl->last_modfied = t;
 		crl->verified = 0;
 		crl->failed_verify = 0;
 	    }
@@ -848,13 +1017,15 @@ hx509_revoke_verify(hx509_context context,
 	    return 0;
 
 	/* check if cert is in crl */
-	for (j = 0; j < crl->crl.tbsCertList.revokedCertificates->len; j++) {
+	for (l = serial_index_find(crl->index, crl->index_len,
+				   &c->tbsCertificate.serialNumber);
+	     l < crl->index_len &&
+		 der_heim_integer_cmp(crl->index[l].serial,
+				      &c->tbsCertificate.serialNumber) == 0;
+	     l++) {
 	    time_t t;
 
-	    ret = der_heim_integer_cmp(&crl->crl.tbsCertList.revokedCertificates->val[j].userCertificate,
-				       &c->tbsCertificate.serialNumber);
-	    if (ret != 0)
-		continue;
+	    j = crl->index[l].entry;
 
 	    t = _hx509_Time2time_t(&crl->crl.tbsCertList.revokedCertificates->val[j].revocationDate);
 	    if (t > now)
@@ -657,6 +657,7 @@ krb5_free_context(krb5_context context)
     krb5_config_file_free (context, context->cf);
     free(rk_UNCONST(context->cc_ops));
     free(context->kt_types);
+    _krb5_crypto_cache_free(context);
     krb5_clear_error_message(context);
     krb5_set_extra_addresses(context, NULL);
     krb5_set_ignore_addresses(context, NULL);
@@ -142,6 +142,23 @@ AES_SHA1_PRF(krb5_context context,
     return ret;
 }
 
+static krb5_error_code
+AES_SHA1_encrypt_hmac(krb5_context context,
+		      krb5_crypto crypto,
+		      struct _krb5_key_data *key,
+		      struct _krb5_key_data *hkey,
+		      void *data,
+		      size_t len,
+		      krb5_boolean encryptp,
+		      void *ivec,
+		      void *hmac,
+		      unsigned int *hmaclen)
+{
+    return _krb5_evp_encrypt_cts_hmac(context, crypto, key, hkey, EVP_sha1(),
+				      FALSE, data, len, encryptp, ivec,
+				      hmac, hmaclen);
+}
+
 struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha1 = {
     ETYPE_AES128_CTS_HMAC_SHA1_96,
     "aes128-cts-hmac-sha1-96",
@@ -156,7 +173,9 @@ struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha1 = {
     _krb5_evp_encrypt_cts,
     _krb5_evp_encrypt_iov_cts,
     16,
-    AES_SHA1_PRF
+    AES_SHA1_PRF,
+    _krb5_evp_encrypt_cts_multi,
+    AES_SHA1_encrypt_hmac
 };
 
 struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
@@ -173,5 +192,7 @@ struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
     _krb5_evp_encrypt_cts,
     _krb5_evp_encrypt_iov_cts,
     16,
-    AES_SHA1_PRF
+    AES_SHA1_PRF,
+    _krb5_evp_encrypt_cts_multi,
+    AES_SHA1_encrypt_hmac
 };
@@ -200,6 +200,8 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_md5 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
+    NULL,
     NULL
 };
 #endif
@@ -218,7 +220,9 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_sha1 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     16,
-    DES3_prf
+    DES3_prf,
+    NULL,
+    NULL
 };
 
 #ifdef DES3_OLD_ENCTYPE
@@ -236,6 +240,8 @@ struct _krb5_encryption_type _krb5_enctype_old_des3_cbc_sha1 = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
+    NULL,
     NULL
 };
 #endif
@@ -254,6 +260,8 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_none = {
     _krb5_evp_encrypt,
     _krb5_evp_encrypt_iov,
     0,
+    NULL,
+    NULL,
     NULL
 };
 
@@ -381,7 +381,7 @@ _krb5_evp_encrypt_iov(krb5_context context,
     while (!_krb5_evp_iov_cursor_done(&cursor)) {
 
 	/* Number of bytes of data in this iovec that are in whole blocks */
-        wholeblocks = cursor.current.length & ~blockmask;
+        wholeblocks = cursor.current.length & blockmask;
 
         if (wholeblocks != 0) {
             EVP_Cipher(c, cursor.current.data,
@@ -573,6 +573,68 @@ _krb5_evp_encrypt_iov_cts(krb5_context context,
     return 0;
 }
 
+/*
+ * Encrypt the last two blocks of a CTS message: the whole blocks
+ * before them have been CBC encrypted, and p points at the last of
+ * those, followed by len (1 to blocksize) bytes of plaintext.
+ */
+
+static void
+evp_encrypt_cts_final(EVP_CIPHER_CTX *c, unsigned char *p, size_t len,
+		      size_t blocksize, void *ivec)
+{
+    unsigned char tmp[EVP_MAX_BLOCK_LENGTH], ivec2[EVP_MAX_BLOCK_LENGTH];
+    size_t i;
+
+    memcpy(ivec2, p, blocksize);
+
+    for (i = 0; i < len; i++)
+	tmp[i] = p[i + blocksize] ^ ivec2[i];
+    for (; i < blocksize; i++)
+	tmp[i] = 0 ^ ivec2[i];
+
+    EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    EVP_Cipher(c, p, tmp, blocksize);
+
+    memcpy(p + blocksize, ivec2, len);
+    if (ivec)
+	memcpy(ivec, p, blocksize);
+}
+
+/*
+ * Decrypt the last two blocks of a CTS message: p points at the second
+ * to last (whole) block, followed by len (1 to blocksize) bytes, and
+ * ivec2 is the ciphertext block before p, or the initial ivec.
+ */
+
+static void
+evp_decrypt_cts_final(EVP_CIPHER_CTX *c, unsigned char *p, size_t len,
+		      size_t blocksize, const unsigned char *ivec2,
+		      void *ivec)
+{
+    unsigned char tmp[EVP_MAX_BLOCK_LENGTH], tmp2[EVP_MAX_BLOCK_LENGTH];
+    unsigned char tmp3[EVP_MAX_BLOCK_LENGTH];
+    size_t i;
+
+    memcpy(tmp, p, blocksize);
+    EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    EVP_Cipher(c, tmp2, p, blocksize);
+
+    memcpy(tmp3, p + blocksize, len);
+    memcpy(tmp3 + len, tmp2 + len, blocksize - len); /* xor 0 */
+
+    for (i = 0; i < len; i++)
+	p[i + blocksize] = tmp2[i] ^ tmp3[i];
+
+    EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    EVP_Cipher(c, p, tmp3, blocksize);
+
+    for (i = 0; i < blocksize; i++)
+	p[i] ^= ivec2[i];
+    if (ivec)
+	memcpy(ivec, tmp, blocksize);
+}
+
 krb5_error_code
 _krb5_evp_encrypt_cts(krb5_context context,
 		      struct _krb5_key_data *key,
@@ -584,7 +646,7 @@ _krb5_evp_encrypt_cts(krb5_context context,
 {
     size_t i, blocksize;
     struct _krb5_evp_schedule *ctx = key->schedule->data;
-    unsigned char tmp[EVP_MAX_BLOCK_LENGTH], ivec2[EVP_MAX_BLOCK_LENGTH];
+    unsigned char ivec2[EVP_MAX_BLOCK_LENGTH];
     EVP_CIPHER_CTX *c;
     unsigned char *p;
 
@@ -612,57 +674,233 @@ _krb5_evp_encrypt_cts(krb5_context context,
 	p = data;
 	i = ((len - 1) / blocksize) * blocksize;
 	EVP_Cipher(c, p, p, i);
-	p += i - blocksize;
-	len -= i;
-	memcpy(ivec2, p, blocksize);
-
-	for (i = 0; i < len; i++)
-	    tmp[i] = p[i + blocksize] ^ ivec2[i];
-	for (; i < blocksize; i++)
-	    tmp[i] = 0 ^ ivec2[i];
-
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, p, tmp, blocksize);
-
-	memcpy(p + blocksize, ivec2, len);
-	if (ivec)
-	    memcpy(ivec, p, blocksize);
+	evp_encrypt_cts_final(c, p + i - blocksize, len - i, blocksize, ivec);
     } else {
-	unsigned char tmp2[EVP_MAX_BLOCK_LENGTH], tmp3[EVP_MAX_BLOCK_LENGTH];
-
 	p = data;
 	if (len > blocksize * 2) {
 	    /* remove last two blocks and round up, decrypt this with cbc, then do cts dance */
 	    i = ((((len - blocksize * 2) + blocksize - 1) / blocksize) * blocksize);
 	    memcpy(ivec2, p + i - blocksize, blocksize);
 	    EVP_Cipher(c, p, p, i);
-	    p += i;
-	    len -= i + blocksize;
 	} else {
+	    i = 0;
 	    if (ivec)
 		memcpy(ivec2, ivec, blocksize);
 	    else
 		memcpy(ivec2, zero_ivec, blocksize);
-	    len -= blocksize;
 	}
+	evp_decrypt_cts_final(c, p + i, len - i - blocksize, blocksize,
+			      ivec2, ivec);
+    }
+    return 0;
+}
 
-	memcpy(tmp, p, blocksize);
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, tmp2, p, blocksize);
+/*
+ * CTS encrypt or decrypt data in place, as _krb5_evp_encrypt_cts()
+ * does, and compute an HMAC over it in the same pass: the message is
+ * done in chunks, each going through the cipher and the HMAC while it
+ * is still in cache.  With mac_ciphertext (RFC 8009) the HMAC covers
+ * the initial ivec and the ciphertext, otherwise (RFC 3962) the
+ * plaintext.
+ */
+
+#define EVP_CTS_HMAC_CHUNK 4096
+
+krb5_error_code
+_krb5_evp_encrypt_cts_hmac(krb5_context context,
+			   krb5_crypto crypto,
+			   struct _krb5_key_data *key,
+			   struct _krb5_key_data *hkey,
+			   const EVP_MD *md,
+			   krb5_boolean mac_ciphertext,
+			   void *data,
+			   size_t len,
+			   krb5_boolean encryptp,
+			   void *ivec,
+			   void *hmac,
+			   unsigned int *hmaclen)
+{
+    struct _krb5_evp_schedule *ctx = key->schedule->data;
+    unsigned char ivec2[EVP_MAX_BLOCK_LENGTH];
+    unsigned char *p = data;
+    size_t blocksize, bulk, limit, done, macked, n;
+    krb5_boolean mac_first;
+    EVP_CIPHER_CTX *c;
+    HMAC_CTX *h;
 
-	memcpy(tmp3, p + blocksize, len);
-	memcpy(tmp3 + len, tmp2 + len, blocksize - len); /* xor 0 */
+    c = encryptp ? &ctx->ectx : &ctx->dctx;
 
-	for (i = 0; i < len; i++)
-	    p[i + blocksize] = tmp2[i] ^ tmp3[i];
+    blocksize = EVP_CIPHER_CTX_block_size(c);
 
+    if (len < blocksize) {
+	krb5_set_error_message(context, EINVAL,
+			       "message block too short");
+	return EINVAL;
+    }
+
+    if (crypto->hmacctx == NULL)
+	crypto->hmacctx = HMAC_CTX_new();
+    h = crypto->hmacctx;
+    if (h == NULL)
+	return krb5_enomem(context);
+
+    HMAC_Init_ex(h, hkey->key->keyvalue.data, hkey->key->keyvalue.length,
+		 md, NULL);
+    if (mac_ciphertext)
+	HMAC_Update(h, ivec ? ivec : zero_ivec, blocksize);
+
+    /* The HMAC input is the data before the cipher gets to it */
+    mac_first = encryptp ? !mac_ciphertext : mac_ciphertext;
+
+    /*
+     * The whole blocks done with plain CBC; the last two blocks are
+     * the CTS dance.  Encryption rewrites the last CBC block, so when
+     * MACing the output, stop short of that until the end.
+     */
+    if (len == blocksize)
+	bulk = len;
+    else if (encryptp)
+	bulk = ((len - 1) / blocksize) * blocksize;
+    else if (len > blocksize * 2)
+	bulk = ((len - blocksize * 2 + blocksize - 1) / blocksize) * blocksize;
+    else
+	bulk = 0;
+    limit = (encryptp && len > bulk) ? bulk - blocksize : bulk;
+
+    if (len == blocksize)
+	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    else if (ivec)
+	EVP_CipherInit_ex(c, NULL, NULL, NULL, ivec, -1);
+    else
 	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, p, tmp3, blocksize);
 
-	for (i = 0; i < blocksize; i++)
-	    p[i] ^= ivec2[i];
-	if (ivec)
-	    memcpy(ivec, tmp, blocksize);
+    if (!encryptp) {
+	if (bulk > 0)
+	    memcpy(ivec2, p + bulk - blocksize, blocksize);
+	else
+	    memcpy(ivec2, ivec ? ivec : zero_ivec, blocksize);
+    }
+
+    for (done = macked = 0; done < bulk; done += n) {
+	n = bulk - done;
+	if (n > EVP_CTS_HMAC_CHUNK)
+	    n = EVP_CTS_HMAC_CHUNK;
+
+	if (mac_first)
+	    HMAC_Update(h, p + done, n);
+	EVP_Cipher(c, p + done, p + done, n);
+	if (!mac_first && macked < limit) {
+	    size_t end = done + n < limit ? done + n : limit;
+
+	    HMAC_Update(h, p + macked, end - macked);
+	    macked = end;
+	}
+    }
+
+    if (len > bulk) {
+	if (mac_first)
+	    HMAC_Update(h, p + bulk, len - bulk);
+	if (encryptp)
+	    evp_encrypt_cts_final(c, p + bulk - blocksize, len - bulk,
+				  blocksize, ivec);
+	else
+	    evp_decrypt_cts_final(c, p + bulk, len - bulk - blocksize,
+				  blocksize, ivec2, ivec);
+    }
+    if (!mac_first && macked < len)
+	HMAC_Update(h, p + macked, len - macked);
+
+    HMAC_Final(h, hmac, hmaclen);
+    return 0;
+}
+
+/*
+ * CTS encrypt several independent messages.  The whole CBC blocks of
+ * all of them are passed to EVP_Cipher_multi() together, which can
+ * interleave them, and then the last two blocks of each are done as in
+ * _krb5_evp_encrypt_cts().  Messages may share a key: each message
+ * after the first with a given key gets its own copy of the cipher
+ * context, as EVP_Cipher_multi() needs one context per buffer.
+ */
+
+#define EVP_CTS_MULTI_CHUNK 16
+
+krb5_error_code
+_krb5_evp_encrypt_cts_multi(krb5_context context,
+			    struct _krb5_key_data * const *key,
+			    void * const *data,
+			    const size_t *len,
+			    void * const *ivec,
+			    size_t n)
+{
+    EVP_CIPHER_CTX *c[EVP_CTS_MULTI_CHUNK], *orig[EVP_CTS_MULTI_CHUNK];
+    EVP_CIPHER_CTX copy[EVP_CTS_MULTI_CHUNK];
+    void *p[EVP_CTS_MULTI_CHUNK];
+    size_t bulk[EVP_CTS_MULTI_CHUNK];
+    size_t i, j, k, m, blocksize;
+    int ret = 1;
+
+    for (i = 0; i < n; i++) {
+	struct _krb5_evp_schedule *ctx = key[i]->schedule->data;
+
+	if (len[i] < (size_t)EVP_CIPHER_CTX_block_size(&ctx->ectx)) {
+	    krb5_set_error_message(context, EINVAL,
+				   "message block too short");
+	    return EINVAL;
+	}
+    }
+
+    for (i = 0; i < n; i += m) {
+	m = n - i;
+	if (m > EVP_CTS_MULTI_CHUNK)
+	    m = EVP_CTS_MULTI_CHUNK;
+
+	for (j = 0; j < m; j++) {
+	    struct _krb5_evp_schedule *ctx = key[i + j]->schedule->data;
+	    const void *iv = ivec[i + j] ? ivec[i + j] : zero_ivec;
+
+	    orig[j] = c[j] = &ctx->ectx;
+	    for (k = 0; k < j; k++) {
+		if (orig[k] == orig[j]) {
+		    c[j] = &copy[j];
+		    EVP_CIPHER_CTX_init(c[j]);
+		    EVP_CipherInit_ex(c[j], EVP_CIPHER_CTX_cipher(orig[j]), NULL,
+				      key[i + j]->key->keyvalue.data, NULL, 1);
+		    break;
+		}
+	    }
+
+	    blocksize = EVP_CIPHER_CTX_block_size(c[j]);
+	    p[j] = data[i + j];
+	    if (len[i + j] == blocksize) {
+		iv = zero_ivec;
+		bulk[j] = blocksize;
+	    } else {
+		bulk[j] = ((len[i + j] - 1) / blocksize) * blocksize;
+	    }
+	    EVP_CipherInit_ex(c[j], NULL, NULL, NULL, iv, -1);
+	}
+
+	ret = EVP_Cipher_multi(c, p, (const void * const *)p, bulk, m);
+
+	for (j = 0; j < m; j++) {
+	    blocksize = EVP_CIPHER_CTX_block_size(c[j]);
+	    if (ret == 1 && len[i + j] > blocksize)
+		evp_encrypt_cts_final(c[j],
+				      (unsigned char *)p[j] + bulk[j] - blocksize,
+				      len[i + j] - bulk[j], blocksize,
+				      ivec[i + j]);
+	    if (c[j] != orig[j])
+		EVP_CIPHER_CTX_cleanup(c[j]);
+	}
+	if (ret != 1)
+	    break;
+    }
+
+    if (ret != 1) {
+	krb5_set_error_message(context, KRB5_CRYPTO_INTERNAL,
+			       "multi-buffer encryption failed");
+	return KRB5_CRYPTO_INTERNAL;
     }
     return 0;
 }
@@ -99,5 +99,7 @@ struct _krb5_encryption_type _krb5_enctype_null = {
     NULL_encrypt,
     NULL,
     0,
+    NULL,
+    NULL,
     NULL
 };
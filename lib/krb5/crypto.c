@@ -46,6 +46,7 @@ struct _krb5_key_usage {
 static krb5_error_code _get_derived_key(krb5_context, krb5_crypto,
 					unsigned, struct _krb5_key_data**);
 static struct _krb5_key_data *_new_derived_key(krb5_crypto crypto, unsigned usage);
+static struct _krb5_key_usage *find_key_usage(krb5_crypto, unsigned);
 
 static void free_key_schedule(krb5_context,
 			      struct _krb5_key_data *,
@@ -419,9 +420,15 @@ get_checksum_key(krb5_context context,
     if(ct->flags & F_DERIVED)
 	ret = _get_derived_key(context, crypto, usage, key);
     else if(ct->flags & F_VARIANT) {
+	struct _krb5_key_usage *ku;
 	size_t i;
 
-	*key = _new_derived_key(crypto, 0xff/* KRB5_KU_RFC1510_VARIANT */);
+	ku = find_key_usage(crypto, 0xff/* KRB5_KU_RFC1510_VARIANT */);
+	if (ku != NULL && ku->key.key != NULL) {
+	    *key = &ku->key;
+	    return 0;
+	}
+	*key = ku ? &ku->key : _new_derived_key(crypto, 0xff);
 	if (*key == NULL)
 	    return krb5_enomem(context);
 	ret = krb5_copy_keyblock(context, crypto->key.key, &(*key)->key);
@@ -909,6 +916,93 @@ derived_crypto(krb5_context context,
 #define CHECKSUMSIZE(C) ((C)->checksumsize)
 #define CHECKSUMTYPE(C) ((C)->type)
 
+/*
+ * Encrypt or decrypt data in place and compute its keyed checksum in
+ * the same pass, for encryption types with an encrypt_hmac function.
+ */
+
+static krb5_error_code
+encrypt_hmac(krb5_context context,
+	     krb5_crypto crypto,
+	     unsigned usage,
+	     void *data,
+	     size_t len,
+	     krb5_boolean encryptp,
+	     void *ivec,
+	     unsigned char *cksum)
+{
+    const struct _krb5_encryption_type *et = crypto->et;
+    struct _krb5_key_data *dkey, *ckey;
+    unsigned char hmac[EVP_MAX_MD_SIZE];
+    unsigned int hmaclen = sizeof(hmac);
+    krb5_error_code ret;
+
+    /* deriving a key may realloc the others, so look up ckey again */
+    ret = _get_derived_key(context, crypto, INTEGRITY_USAGE(usage), &ckey);
+    if (ret == 0)
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+    if (ret == 0)
+	ret = _key_schedule(context, dkey);
+    if (ret == 0)
+	ret = _get_derived_key(context, crypto, INTEGRITY_USAGE(usage), &ckey);
+    if (ret)
+	return ret;
+
+    ret = (*et->encrypt_hmac)(context, crypto, dkey, ckey, data, len,
+			      encryptp, ivec, hmac, &hmaclen);
+    if (ret)
+	return ret;
+
+    heim_assert(CHECKSUMSIZE(et->keyed_checksum) <= hmaclen,
+		"checksum too short");
+    memcpy(cksum, hmac, CHECKSUMSIZE(et->keyed_checksum));
+    memset_s(hmac, sizeof(hmac), 0, sizeof(hmac));
+    return 0;
+}
+
+static krb5_error_code
+decrypt_hmac(krb5_context context,
+	     krb5_crypto crypto,
+	     unsigned usage,
+	     void *data,
+	     size_t len,
+	     void *ivec,
+	     const unsigned char *cksum)
+{
+    const struct _krb5_encryption_type *et = crypto->et;
+    unsigned char c[EVP_MAX_MD_SIZE], old_ivec[EVP_MAX_IV_LENGTH];
+    krb5_data d1, d2;
+    krb5_error_code ret;
+
+    heim_assert(et->blocksize <= sizeof(old_ivec),
+		"blocksize too big for ivec buffer");
+    heim_assert(CHECKSUMSIZE(et->keyed_checksum) <= sizeof(c),
+		"checksum too big");
+
+    if (ivec)
+	memcpy(old_ivec, ivec, et->blocksize);
+
+    ret = encrypt_hmac(context, crypto, usage, data, len, FALSE, ivec, c);
+    if (ret)
+	return ret;
+
+    d1.data = c;
+    d1.length = CHECKSUMSIZE(et->keyed_checksum);
+    d2.data = rk_UNCONST(cksum);
+    d2.length = d1.length;
+    if (krb5_data_ct_cmp(&d1, &d2) != 0) {
+	/* leave the ivec as it was, as when checking before decrypting */
+	if (ivec)
+	    memcpy(ivec, old_ivec, et->blocksize);
+	ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+	krb5_set_error_message(context, ret,
+			       N_("Decrypt integrity check failed for checksum "
+				  "type %s, key type %s", ""),
+			       et->keyed_checksum->name, et->name);
+    }
+    return ret;
+}
+
 static krb5_error_code
 encrypt_internal_derived(krb5_context context,
 			 krb5_crypto crypto,
@@ -939,6 +1033,16 @@ encrypt_internal_derived(krb5_context context,
     q += et->confoundersize;
     memcpy(q, data, len);
 
+    if (et->encrypt_hmac != NULL) {
+	ret = encrypt_hmac(context, crypto, usage, p, block_sz, TRUE, ivec,
+			   p + block_sz);
+	if (ret)
+	    goto fail;
+	result->data = p;
+	result->length = total_sz;
+	return 0;
+    }
+
     ret = create_checksum(context,
 			  et->keyed_checksum,
 			  crypto,
@@ -1003,6 +1107,16 @@ encrypt_internal_enc_then_cksum(krb5_context context,
     q += et->confoundersize;
     memcpy(q, data, len);
 
+    if (et->encrypt_hmac != NULL) {
+	ret = encrypt_hmac(context, crypto, usage, p, block_sz, TRUE, ivec,
+			   p + block_sz);
+	if (ret)
+	    goto fail;
+	result->data = p;
+	result->length = total_sz;
+	return 0;
+    }
+
     ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
     if(ret)
 	goto fail;
@@ -1188,6 +1302,25 @@ decrypt_internal_derived(krb5_context context,
 
     len -= checksum_sz;
 
+    if (et->encrypt_hmac != NULL) {
+	ret = decrypt_hmac(context, crypto, usage, p, len, ivec, p + len);
+	if (ret) {
+	    memset_s(p, len, 0, len);
+	    free(p);
+	    return ret;
+	}
+
+	l = len - et->confoundersize;
+	memmove(p, p + et->confoundersize, l);
+	result->data = realloc(p, l);
+	if(result->data == NULL && l != 0) {
+	    free(p);
+	    return krb5_enomem(context);
+	}
+	result->length = l;
+	return 0;
+    }
+
     ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
     if(ret) {
 	free(p);
@@ -1261,6 +1394,31 @@ decrypt_internal_enc_then_cksum(krb5_context context,
 
     len -= checksum_sz;
 
+    if (et->encrypt_hmac != NULL) {
+	p = malloc(len);
+	if (len != 0 && p == NULL)
+	    return krb5_enomem(context);
+	memcpy(p, data, len);
+
+	ret = decrypt_hmac(context, crypto, usage, p, len, ivec,
+			   (unsigned char *)data + len);
+	if (ret) {
+	    memset_s(p, len, 0, len);
+	    free(p);
+	    return ret;
+	}
+
+	l = len - et->confoundersize;
+	memmove(p, p + et->confoundersize, l);
+	result->data = realloc(p, l);
+	if(result->data == NULL && l != 0) {
+	    free(p);
+	    return krb5_enomem(context);
+	}
+	result->length = l;
+	return 0;
+    }
+
     p = malloc(et->blocksize + len);
     if (p == NULL)
 	return krb5_enomem(context);
@@ -1584,6 +1742,229 @@ iov_pad_validate(const struct _krb5_encryption_type *et,
     return 0;
 }
 
+/*
+ * If the parts of an iov message that get encrypted (header, data and
+ * padding, in that order) are adjacent in memory, return them as one
+ * buffer so that they can be encrypted in place.
+ */
+
+static krb5_boolean
+iov_enc_contiguous(krb5_crypto_iov *data, int num_data, krb5_data *out)
+{
+    krb5_crypto_iov *hiv, *piv;
+    unsigned char *q;
+    int i;
+
+    hiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_HEADER);
+    piv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_PADDING);
+
+    q = (unsigned char *)hiv->data.data + hiv->data.length;
+    for (i = 0; i < num_data; i++) {
+	if (data[i].flags != KRB5_CRYPTO_TYPE_DATA || data[i].data.length == 0)
+	    continue;
+	if (data[i].data.data != q)
+	    return FALSE;
+	q += data[i].data.length;
+    }
+    if (piv && piv->data.length) {
+	if (piv->data.data != q)
+	    return FALSE;
+	q += piv->data.length;
+    }
+
+    out->data = hiv->data.data;
+    out->length = q - (unsigned char *)hiv->data.data;
+    return TRUE;
+}
+
+/*
+ * Whether encrypt_hmac() can work on an iov message in place: the
+ * encrypted parts must be one buffer, and the checksum must cover
+ * exactly those parts in the same order, so no SIGN_ONLY data.
+ */
+
+static krb5_boolean
+iov_enc_fusable(krb5_crypto_iov *data, int num_data, krb5_data *out)
+{
+    krb5_boolean header = FALSE, padding = FALSE;
+    int i;
+
+    for (i = 0; i < num_data; i++) {
+	if (data[i].data.length == 0)
+	    continue;
+	switch (data[i].flags) {
+	case KRB5_CRYPTO_TYPE_HEADER:
+	    header = TRUE;
+	    break;
+	case KRB5_CRYPTO_TYPE_DATA:
+	    if (!header || padding)
+		return FALSE;
+	    break;
+	case KRB5_CRYPTO_TYPE_PADDING:
+	    if (!header)
+		return FALSE;
+	    padding = TRUE;
+	    break;
+	case KRB5_CRYPTO_TYPE_SIGN_ONLY:
+	    return FALSE;
+	}
+    }
+
+    return iov_enc_contiguous(data, num_data, out);
+}
+
+/*
+ * The steps of krb5_encrypt_iov_ivec(), also used by
+ * krb5_encrypt_iov_ivec_multi(): check the layout of the message and
+ * fill in the confounder, encrypt it, and checksum it.
+ */
+
+static krb5_error_code
+iov_encrypt_prepare(krb5_context context,
+		    krb5_crypto crypto,
+		    krb5_crypto_iov *data,
+		    int num_data,
+		    krb5_crypto_iov **ptiv)
+{
+    size_t headersz, trailersz;
+    krb5_error_code ret;
+    const struct _krb5_encryption_type *et = crypto->et;
+    krb5_crypto_iov *tiv, *piv, *hiv;
+
+    if (num_data < 0) {
+        krb5_clear_error_message(context);
+	return KRB5_CRYPTO_INTERNAL;
+    }
+
+    if(!derived_crypto(context, crypto)) {
+	krb5_clear_error_message(context);
+	return KRB5_CRYPTO_INTERNAL;
+    }
+
+    headersz = et->confoundersize;
+    trailersz = CHECKSUMSIZE(et->keyed_checksum);
+
+    /* header */
+    hiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_HEADER);
+    if (hiv == NULL || hiv->data.length != headersz)
+	return KRB5_BAD_MSIZE;
+    krb5_generate_random_block(hiv->data.data, hiv->data.length);
+
+    /* padding */
+    ret = iov_pad_validate(et, data, num_data, &piv);
+    if(ret)
+	return ret;
+
+    /* trailer */
+    tiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_TRAILER);
+    if (tiv == NULL || tiv->data.length != trailersz)
+	return KRB5_BAD_MSIZE;
+
+    *ptiv = tiv;
+    return 0;
+}
+
+static krb5_error_code
+iov_encrypt_data(krb5_context context,
+		 krb5_crypto crypto,
+		 unsigned usage,
+		 krb5_crypto_iov *data,
+		 int num_data,
+		 void *ivec)
+{
+    krb5_data enc_data;
+    krb5_error_code ret;
+    struct _krb5_key_data *dkey;
+    const struct _krb5_encryption_type *et = crypto->et;
+
+    ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+    if(ret)
+	return ret;
+
+    ret = _key_schedule(context, dkey);
+    if(ret)
+	return ret;
+
+    if (et->encrypt_iov != NULL)
+	return (*et->encrypt_iov)(context, dkey, data, num_data, 1, usage,
+				  ivec);
+
+    ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
+    if (ret)
+	return ret;
+
+    ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
+			 1, usage, ivec);
+    if (ret == 0)
+	ret = iov_uncoalesce(context, &enc_data, data, num_data);
+
+    memset_s(enc_data.data, enc_data.length, 0, enc_data.length);
+    krb5_data_free(&enc_data);
+    return ret;
+}
+
+/*
+ * With F_ENC_THEN_CKSUM the checksum covers the initial ivec
+ * (old_ivec) and the encrypted message, otherwise the plaintext.
+ */
+
+static krb5_error_code
+iov_encrypt_cksum(krb5_context context,
+		  krb5_crypto crypto,
+		  unsigned usage,
+		  krb5_crypto_iov *data,
+		  int num_data,
+		  krb5_crypto_iov *tiv,
+		  unsigned char *old_ivec)
+{
+    Checksum cksum;
+    krb5_data ivec_data, sign_data;
+    krb5_error_code ret;
+    const struct _krb5_encryption_type *et = crypto->et;
+
+    if ((et->flags & F_ENC_THEN_CKSUM) == 0) {
+        cksum.checksum = tiv->data;
+        return create_checksum_iov(context,
+				   et->keyed_checksum,
+				   crypto,
+				   INTEGRITY_USAGE(usage),
+				   data,
+				   num_data,
+				   &cksum);
+    }
+
+    ivec_data.length = et->blocksize;
+    ivec_data.data = old_ivec;
+
+    ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
+    if(ret)
+	return ret;
+
+    ret = create_checksum(context,
+			  et->keyed_checksum,
+			  crypto,
+			  INTEGRITY_USAGE(usage),
+			  sign_data.data,
+			  sign_data.length,
+			  &cksum);
+
+    memset_s(sign_data.data, sign_data.length, 0, sign_data.length);
+    krb5_data_free(&sign_data);
+
+    if(ret == 0 && cksum.checksum.length != tiv->data.length) {
+	free_Checksum (&cksum);
+	krb5_clear_error_message (context);
+	ret = KRB5_CRYPTO_INTERNAL;
+    }
+    if (ret)
+	return ret;
+
+    /* save cksum at end */
+    memcpy(tiv->data.data, cksum.checksum.data, cksum.checksum.length);
+    free_Checksum (&cksum);
+    return 0;
+}
+
 /**
  * Inline encrypt a kerberos message
  *
@@ -1616,167 +1997,220 @@ krb5_encrypt_iov_ivec(krb5_context context,
 		      int num_data,
 		      void *ivec)
 {
-    size_t headersz, trailersz;
-    Checksum cksum;
-    krb5_data enc_data, sign_data;
+    krb5_data enc_data;
     krb5_error_code ret;
-    struct _krb5_key_data *dkey;
     const struct _krb5_encryption_type *et = crypto->et;
-    krb5_crypto_iov *tiv, *piv, *hiv;
-
-    if (num_data < 0) {
-        krb5_clear_error_message(context);
-	return KRB5_CRYPTO_INTERNAL;
-    }
-
-    if(!derived_crypto(context, crypto)) {
-	krb5_clear_error_message(context);
-	return KRB5_CRYPTO_INTERNAL;
-    }
+    krb5_crypto_iov *tiv;
 
-    krb5_data_zero(&enc_data);
-    krb5_data_zero(&sign_data);
-
-    headersz = et->confoundersize;
-    trailersz = CHECKSUMSIZE(et->keyed_checksum);
-
-    /* header */
-    hiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_HEADER);
-    if (hiv == NULL || hiv->data.length != headersz)
-	return KRB5_BAD_MSIZE;
-    krb5_generate_random_block(hiv->data.data, hiv->data.length);
-
-    /* padding */
-    ret = iov_pad_validate(et, data, num_data, &piv);
-    if(ret)
-	goto cleanup;
+    ret = iov_encrypt_prepare(context, crypto, data, num_data, &tiv);
+    if (ret)
+	return ret;
 
-    /* trailer */
-    tiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_TRAILER);
-    if (tiv == NULL || tiv->data.length != trailersz) {
-	ret = KRB5_BAD_MSIZE;
-	goto cleanup;
-    }
+    if (et->encrypt_hmac != NULL &&
+	iov_enc_fusable(data, num_data, &enc_data))
+	return encrypt_hmac(context, crypto, usage, enc_data.data,
+			    enc_data.length, TRUE, ivec, tiv->data.data);
 
     if (et->flags & F_ENC_THEN_CKSUM) {
 	unsigned char old_ivec[EVP_MAX_IV_LENGTH];
-	krb5_data ivec_data;
 
 	heim_assert(et->blocksize <= sizeof(old_ivec),
 		    "blocksize too big for ivec buffer");
 
-	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
-	if(ret)
-	    goto cleanup;
-
-	ret = _key_schedule(context, dkey);
-	if(ret)
-	    goto cleanup;
-
 	if (ivec)
 	    memcpy(old_ivec, ivec, et->blocksize);
 	else
 	    memset(old_ivec, 0, et->blocksize);
 
-	if (et->encrypt_iov != NULL) {
-	    ret = (*et->encrypt_iov)(context, dkey, data, num_data, 1, usage,
-				     ivec);
-	    if (ret)
-		goto cleanup;
-	} else {
-	    ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
-	    if (ret)
-		goto cleanup;
-
-	    ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
-				 1, usage, ivec);
-	    if (ret)
-		goto cleanup;
+	ret = iov_encrypt_data(context, crypto, usage, data, num_data, ivec);
+	if (ret == 0)
+	    ret = iov_encrypt_cksum(context, crypto, usage, data, num_data,
+				    tiv, old_ivec);
+    } else {
+	ret = iov_encrypt_cksum(context, crypto, usage, data, num_data,
+				tiv, NULL);
+	/* create_checksum may realloc the derived key space, so the
+	 * encryption key is looked up after it */
+	if (ret == 0)
+	    ret = iov_encrypt_data(context, crypto, usage, data, num_data,
+				   ivec);
+    }
 
-	    ret = iov_uncoalesce(context, &enc_data, data, num_data);
-	    if (ret)
-		goto cleanup;
-        }
+    return ret;
+}
 
-	ivec_data.length = et->blocksize;
-	ivec_data.data = old_ivec;
+struct iov_multi_state {
+    krb5_boolean batched;
+    krb5_boolean coalesced;
+    krb5_crypto_iov *tiv;
+    krb5_data enc_data;
+    unsigned char old_ivec[EVP_MAX_IV_LENGTH];
+};
 
-	ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
-	if(ret)
-	    goto cleanup;
+/**
+ * Inline encrypt several independent Kerberos messages.
+ *
+ * Each job is encrypted as with krb5_encrypt_iov_ivec(), but where
+ * the encryption type supports it the encryption of all of them is
+ * done together, so that it can be interleaved (for example
+ * AES-CBC with AES-NI, which is otherwise limited by the latency of
+ * each block depending on the one before it).  Jobs may share a
+ * crypto context.
+ *
+ * @param context Kerberos context
+ * @param jobs array of messages to encrypt, the result of each is
+ *        stored in its ret field
+ * @param njobs length of array
+ *
+ * @return Return 0 if all jobs succeeded, otherwise the error of the
+ * first one that failed.
+ * @ingroup krb5_crypto
+ */
 
-        ret = create_checksum(context,
-                              et->keyed_checksum,
-                              crypto,
-                              INTEGRITY_USAGE(usage),
-                              sign_data.data,
-                              sign_data.length,
-                              &cksum);
-
-        if(ret == 0 && cksum.checksum.length != trailersz) {
-            free_Checksum (&cksum);
-            krb5_clear_error_message (context);
-            ret = KRB5_CRYPTO_INTERNAL;
-        }
-        if (ret)
-            goto cleanup;
-
-        /* save cksum at end */
-        memcpy(tiv->data.data, cksum.checksum.data, cksum.checksum.length);
-        free_Checksum (&cksum);
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_encrypt_iov_ivec_multi(krb5_context context,
+			    krb5_crypto_iov_job *jobs,
+			    size_t njobs)
+{
+    struct iov_multi_state *st;
+    struct _krb5_key_data **keys = NULL;
+    void **bufs = NULL, **ivecs = NULL;
+    size_t *lens = NULL;
+    size_t i, j, n;
+    krb5_error_code ret, mret;
+
+    if (njobs == 1) {
+	jobs[0].ret = krb5_encrypt_iov_ivec(context, jobs[0].crypto,
+					    jobs[0].usage, jobs[0].data,
+					    jobs[0].num_data, jobs[0].ivec);
+	return jobs[0].ret;
+    }
+
+    st = calloc(njobs, sizeof(st[0]));
+    keys = calloc(njobs, sizeof(keys[0]));
+    bufs = calloc(njobs, sizeof(bufs[0]));
+    ivecs = calloc(njobs, sizeof(ivecs[0]));
+    lens = calloc(njobs, sizeof(lens[0]));
+    if (st == NULL || keys == NULL || bufs == NULL || ivecs == NULL ||
+	lens == NULL) {
+	ret = krb5_enomem(context);
+	for (i = 0; i < njobs; i++)
+	    jobs[i].ret = ret;
+	goto out;
+    }
 
-    } else {
-        cksum.checksum = tiv->data;
-        ret = create_checksum_iov(context,
-                              et->keyed_checksum,
-                              crypto,
-                              INTEGRITY_USAGE(usage),
-                              data,
-                              num_data,
-                              &cksum);
-        if (ret)
-            goto cleanup;
-
-        /* create_checksum may realloc the derived key space, so any keys
-         * obtained before it was called may no longer be valid */
-	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
-	if(ret)
-	    goto cleanup;
+    /*
+     * Check, checksum (unless the checksum is over the ciphertext) and
+     * get the encryption key of every message.
+     */
+    for (i = 0; i < njobs; i++) {
+	krb5_crypto_iov_job *job = &jobs[i];
+	const struct _krb5_encryption_type *et = job->crypto->et;
+	struct _krb5_key_data *dkey;
+
+	if (et->encrypt_multi == NULL) {
+	    job->ret = krb5_encrypt_iov_ivec(context, job->crypto, job->usage,
+					     job->data, job->num_data,
+					     job->ivec);
+	    continue;
+	}
 
-	ret = _key_schedule(context, dkey);
-	if(ret)
-	    goto cleanup;
+	ret = iov_encrypt_prepare(context, job->crypto, job->data,
+				  job->num_data, &st[i].tiv);
+	if (ret == 0 && (et->flags & F_ENC_THEN_CKSUM)) {
+	    heim_assert(et->blocksize <= sizeof(st[i].old_ivec),
+			"blocksize too big for ivec buffer");
+	    if (job->ivec)
+		memcpy(st[i].old_ivec, job->ivec, et->blocksize);
+	} else if (ret == 0) {
+	    ret = iov_encrypt_cksum(context, job->crypto, job->usage,
+				    job->data, job->num_data, st[i].tiv, NULL);
+	}
+	if (ret == 0)
+	    ret = _get_derived_key(context, job->crypto,
+				   ENCRYPTION_USAGE(job->usage), &dkey);
+	if (ret == 0)
+	    ret = _key_schedule(context, dkey);
+	if (ret == 0 &&
+	    !iov_enc_contiguous(job->data, job->num_data, &st[i].enc_data)) {
+	    ret = iov_coalesce(context, NULL, job->data, job->num_data, FALSE,
+			       &st[i].enc_data);
+	    st[i].coalesced = (ret == 0);
+	}
+	job->ret = ret;
+	st[i].batched = (ret == 0);
+    }
 
-        if (et->encrypt_iov != NULL) {
-            ret = (*et->encrypt_iov)(context, dkey, data, num_data, 1, usage,
-                                     ivec);
-            if (ret)
-                goto cleanup;
-        } else {
-            ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
-            if (ret)
-                goto cleanup;
+    /*
+     * Encrypt together all messages whose encryption types share an
+     * encrypt_multi function.  The derived keys are looked up again:
+     * deriving or checksumming with later keys may have reallocated
+     * the key space of a crypto context used earlier.
+     */
+    for (i = 0; i < njobs; i++) {
+	const struct _krb5_encryption_type *et;
 
-            ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
-                                 1, usage, ivec);
-            if (ret)
-                goto cleanup;
+	if (!st[i].batched)
+	    continue;
+	et = jobs[i].crypto->et;
+
+	for (n = 0, j = i; j < njobs; j++) {
+	    if (!st[j].batched || jobs[j].crypto->et->encrypt_multi !=
+		et->encrypt_multi)
+		continue;
+	    ret = _get_derived_key(context, jobs[j].crypto,
+				   ENCRYPTION_USAGE(jobs[j].usage), &keys[n]);
+	    heim_assert(ret == 0, "derived key disappeared");
+	    bufs[n] = st[j].enc_data.data;
+	    lens[n] = st[j].enc_data.length;
+	    ivecs[n] = jobs[j].ivec;
+	    n++;
+	}
 
-            ret = iov_uncoalesce(context, &enc_data, data, num_data);
-            if (ret)
-                goto cleanup;
-        }
+	mret = (*et->encrypt_multi)(context, keys, bufs, lens, ivecs, n);
+
+	for (j = i; j < njobs; j++) {
+	    if (!st[j].batched || jobs[j].crypto->et->encrypt_multi !=
+		et->encrypt_multi)
+		continue;
+	    st[j].batched = FALSE;
+	    ret = mret;
+	    if (st[j].coalesced) {
+		if (ret == 0)
+		    iov_uncoalesce(context, &st[j].enc_data, jobs[j].data,
+				   jobs[j].num_data);
+		memset_s(st[j].enc_data.data, st[j].enc_data.length, 0,
+			 st[j].enc_data.length);
+		krb5_data_free(&st[j].enc_data);
+		st[j].coalesced = FALSE;
+	    }
+	    if (ret == 0 && (jobs[j].crypto->et->flags & F_ENC_THEN_CKSUM))
+		ret = iov_encrypt_cksum(context, jobs[j].crypto, jobs[j].usage,
+					jobs[j].data, jobs[j].num_data,
+					st[j].tiv, st[j].old_ivec);
+	    jobs[j].ret = ret;
+	}
     }
 
-cleanup:
-    if (enc_data.data) {
-	memset_s(enc_data.data, enc_data.length, 0, enc_data.length);
-	krb5_data_free(&enc_data);
-    }
-    if (sign_data.data) {
-	memset_s(sign_data.data, sign_data.length, 0, sign_data.length);
-	krb5_data_free(&sign_data);
+    ret = 0;
+    for (i = 0; i < njobs && ret == 0; i++)
+	ret = jobs[i].ret;
+
+out:
+    if (st) {
+	for (i = 0; i < njobs; i++) {
+	    if (st[i].coalesced) {
+		memset_s(st[i].enc_data.data, st[i].enc_data.length, 0,
+			 st[i].enc_data.length);
+		krb5_data_free(&st[i].enc_data);
+	    }
+	}
     }
+    free(st);
+    free(keys);
+    free(bufs);
+    free(ivecs);
+    free(lens);
     return ret;
 }
 
@@ -1837,6 +2271,22 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	return KRB5_BAD_MSIZE;
     }
 
+    /*
+     * With F_ENC_THEN_CKSUM the checksum is verified below before
+     * anything is decrypted, so that the caller gets its ciphertext back
+     * on failure.  The fused pass can't do that, so it is only used for
+     * the other enctypes, which decrypt before verifying anyway, and
+     * then no unverified plaintext is left behind either.
+     */
+    if (et->encrypt_hmac != NULL && !(et->flags & F_ENC_THEN_CKSUM) &&
+	iov_enc_fusable(data, num_data, &enc_data)) {
+	ret = decrypt_hmac(context, crypto, usage, enc_data.data,
+			   enc_data.length, ivec, tiv->data.data);
+	if (ret == KRB5KRB_AP_ERR_BAD_INTEGRITY)
+	    memset_s(enc_data.data, enc_data.length, 0, enc_data.length);
+	return ret;
+    }
+
     krb5_data_zero(&enc_data);
     krb5_data_zero(&sign_data);
 
@@ -2413,17 +2863,82 @@ _krb5_derive_key(krb5_context context,
     return ret;
 }
 
+/*
+ * Derived keys live in a small open-addressed table keyed by usage number,
+ * so finding the key for a usage doesn't mean scanning every usage the
+ * context has seen.  Usage numbers handed to _get_derived_key() always
+ * carry a non-zero tag in the low byte (see ENCRYPTION_USAGE() and
+ * friends, and the 0xff RFC1510 variant), so 0 marks an empty slot.
+ */
+
+#define KEY_USAGE_INITIAL_SIZE 8	/* slots; must be a power of two */
+
+static size_t
+key_usage_slot(unsigned usage, size_t size)
+{
+    return (usage ^ (usage >> 8)) & (size - 1);
+}
+
+static struct _krb5_key_usage *
+find_key_usage(krb5_crypto crypto, unsigned usage)
+{
+    size_t mask = crypto->key_usage_size - 1;
+    size_t i;
+
+    if (crypto->key_usage_size == 0)
+	return NULL;
+    for (i = key_usage_slot(usage, crypto->key_usage_size);
+	 crypto->key_usage[i].usage != 0;
+	 i = (i + 1) & mask)
+	if (crypto->key_usage[i].usage == usage)
+	    return &crypto->key_usage[i];
+    return NULL;
+}
+
+static int
+grow_key_usage(krb5_crypto crypto)
+{
+    struct _krb5_key_usage *d;
+    size_t size, i, j;
+
+    size = crypto->key_usage_size ?
+	crypto->key_usage_size * 2 : KEY_USAGE_INITIAL_SIZE;
+    d = calloc(size, sizeof(*d));
+    if (d == NULL)
+	return ENOMEM;
+    for (i = 0; i < crypto->key_usage_size; i++) {
+	if (crypto->key_usage[i].usage == 0)
+	    continue;
+	for (j = key_usage_slot(crypto->key_usage[i].usage, size);
+	     d[j].usage != 0;
+	     j = (j + 1) & (size - 1))
+	    ;
+	d[j] = crypto->key_usage[i];
+    }
+    free(crypto->key_usage);
+    crypto->key_usage = d;
+    crypto->key_usage_size = size;
+    return 0;
+}
+
 static struct _krb5_key_data *
 _new_derived_key(krb5_crypto crypto, unsigned usage)
 {
-    struct _krb5_key_usage *d = crypto->key_usage;
-    d = realloc(d, (crypto->num_key_usage + 1) * sizeof(*d));
-    if(d == NULL)
+    struct _krb5_key_usage *d;
+    size_t i;
+
+    /* Keep the table at most 3/4 full so probes stay short */
+    if ((crypto->num_key_usage + 1) * 4 > crypto->key_usage_size * 3 &&
+	grow_key_usage(crypto))
 	return NULL;
-    crypto->key_usage = d;
-    d += crypto->num_key_usage++;
+    for (i = key_usage_slot(usage, crypto->key_usage_size);
+	 crypto->key_usage[i].usage != 0;
+	 i = (i + 1) & (crypto->key_usage_size - 1))
+	;
+    d = &crypto->key_usage[i];
     memset(d, 0, sizeof(*d));
     d->usage = usage;
+    crypto->num_key_usage++;
     return &d->key;
 }
 
@@ -2464,16 +2979,24 @@ _get_derived_key(krb5_context context,
 		 unsigned usage,
 		 struct _krb5_key_data **key)
 {
-    int i;
+    struct _krb5_key_usage *ku;
     struct _krb5_key_data *d;
     unsigned char constant[5];
 
     *key = NULL;
-    for(i = 0; i < crypto->num_key_usage; i++)
-	if(crypto->key_usage[i].usage == usage) {
-	    *key = &crypto->key_usage[i].key;
-	    return 0;
-	}
+    ku = find_key_usage(crypto, usage);
+    if (ku != NULL) {
+	*key = &ku->key;
+	return 0;
+    }
+    if (crypto->origin != NULL) {
+	/*
+	 * Use the cached context's key, deriving it there the first time,
+	 * with its key schedule: that only changes when it is built, and
+	 * each operation sets its own ivec.
+	 */
+	return _get_derived_key(context, crypto->origin, usage, key);
+    }
     d = _new_derived_key(crypto, usage);
     if (d == NULL)
 	return krb5_enomem(context);
@@ -2483,6 +3006,153 @@ _get_derived_key(krb5_context context,
     return _krb5_derive_key(context, crypto->et, d, constant, sizeof(constant));
 }
 
+/*
+ * Prepared crypto contexts for long-lived keys (see
+ * krb5_crypto_init_cached()), most recently used first.  Once a key is in
+ * here krb5_crypto_init_cached() hands out a clone of the cached context
+ * that uses the derived keys of the cached one, and their key schedules,
+ * instead of deriving and scheduling them again (see _get_derived_key());
+ * krb5_crypto_init() never looks here.  A clone has its own copy of the
+ * base key, ivec and HMAC state.  The cached contexts themselves are
+ * never handed out; each holds a reference for the cache and one for each
+ * of its clones.
+ */
+
+#define CRYPTO_CACHE_SIZE 32
+
+struct _krb5_crypto_cache {
+    size_t len;
+    krb5_crypto ent[CRYPTO_CACHE_SIZE];
+};
+
+static krb5_error_code crypto_free(krb5_context, krb5_crypto);
+
+static krb5_crypto
+crypto_cache_lookup(krb5_context context,
+		    const krb5_keyblock *key,
+		    krb5_enctype etype)
+{
+    struct _krb5_crypto_cache *cc = context->crypto_cache;
+    krb5_crypto c;
+    size_t i;
+
+    if (etype == (krb5_enctype)ETYPE_NULL)
+	etype = key->keytype;
+
+    for (i = 0; i < cc->len; i++) {
+	c = cc->ent[i];
+	if (c->et->type != etype ||
+	    c->key.key->keytype != key->keytype ||
+	    c->key.key->keyvalue.length != key->keyvalue.length ||
+	    ct_memcmp(c->key.key->keyvalue.data, key->keyvalue.data,
+		      key->keyvalue.length) != 0)
+	    continue;
+	memmove(&cc->ent[1], &cc->ent[0], i * sizeof(cc->ent[0]));
+	cc->ent[0] = c;
+	return c;
+    }
+    return NULL;
+}
+
+static void
+crypto_cache_release(krb5_context context, krb5_crypto c)
+{
+    if (c->refcnt > 1)
+	c->refcnt--;
+    else
+	crypto_free(context, c);
+}
+
+static krb5_error_code
+crypto_clone(krb5_context context, krb5_crypto origin, krb5_crypto *crypto)
+{
+    krb5_error_code ret;
+
+    ALLOC(*crypto, 1);
+    if (*crypto == NULL)
+	return krb5_enomem(context);
+    ret = krb5_copy_keyblock(context, origin->key.key, &(*crypto)->key.key);
+    if (ret) {
+	free(*crypto);
+	*crypto = NULL;
+	return ret;
+    }
+    (*crypto)->et = origin->et;
+    (*crypto)->origin = origin;
+    origin->refcnt++;
+    return 0;
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_crypto_cache_free(krb5_context context)
+{
+    struct _krb5_crypto_cache *cc = context->crypto_cache;
+    size_t i;
+
+    if (cc == NULL)
+	return;
+    for (i = 0; i < cc->len; i++)
+	crypto_cache_release(context, cc->ent[i]);
+    free(cc);
+    context->crypto_cache = NULL;
+}
+
+/**
+ * Like krb5_crypto_init(), but for a long-lived key (e.g., a KDC's
+ * krbtgt or service keys): a prepared crypto context is kept in a small
+ * cache in the Kerberos context, and subsequent krb5_crypto_init_cached()
+ * calls with the same key return a private clone of it that uses its
+ * derived keys and their key schedules rather than deriving and
+ * scheduling them again.  krb5_crypto_init() is not affected by the
+ * cache.  The least recently used contexts are dropped when the cache is
+ * full.
+ *
+ * The resulting crypto context belongs to the caller and must be released
+ * with krb5_crypto_destroy().  Since the cache is not locked, this should
+ * only be used with Kerberos contexts that are not shared between
+ * threads.
+ *
+ * @param context Kerberos context
+ * @param key the key block information with all key data
+ * @param etype the encryption type
+ * @param crypto the resulting crypto context
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_init_cached(krb5_context context,
+			const krb5_keyblock *key,
+			krb5_enctype etype,
+			krb5_crypto *crypto)
+{
+    struct _krb5_crypto_cache *cc = context->crypto_cache;
+    krb5_error_code ret;
+    krb5_crypto c;
+
+    if (cc == NULL) {
+	ALLOC(cc, 1);
+	if (cc == NULL)
+	    return krb5_enomem(context);
+	context->crypto_cache = cc;
+    }
+
+    if ((c = crypto_cache_lookup(context, key, etype)) == NULL) {
+	ret = krb5_crypto_init(context, key, etype, &c);
+	if (ret)
+	    return ret;
+	if (cc->len == CRYPTO_CACHE_SIZE)
+	    crypto_cache_release(context, cc->ent[--cc->len]);
+	memmove(&cc->ent[1], &cc->ent[0], cc->len * sizeof(cc->ent[0]));
+	cc->ent[0] = c;
+	cc->len++;
+	c->refcnt = 1;
+    }
+    return crypto_clone(context, c, crypto);
+}
+
 /**
  * Create a crypto context used for all encryption and signature
  * operation. The encryption type to use is taken from the key, but
@@ -2534,6 +3204,7 @@ krb5_crypto_init(krb5_context context,
     }
     (*crypto)->key.schedule = NULL;
     (*crypto)->num_key_usage = 0;
+    (*crypto)->key_usage_size = 0;
     (*crypto)->key_usage = NULL;
     return 0;
 }
@@ -2582,10 +3253,17 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_crypto_destroy(krb5_context context,
 		    krb5_crypto crypto)
 {
-    int i;
+    return crypto_free(context, crypto);
+}
+
+static krb5_error_code
+crypto_free(krb5_context context, krb5_crypto crypto)
+{
+    size_t i;
 
-    for(i = 0; i < crypto->num_key_usage; i++)
-	free_key_usage(context, &crypto->key_usage[i], crypto->et);
+    for(i = 0; i < crypto->key_usage_size; i++)
+	if (crypto->key_usage[i].usage != 0)
+	    free_key_usage(context, &crypto->key_usage[i], crypto->et);
     free(crypto->key_usage);
     _krb5_free_key_data(context, &crypto->key, crypto->et);
 
@@ -2595,6 +3273,9 @@ krb5_crypto_destroy(krb5_context context,
     if (crypto->hmacctx)
 	HMAC_CTX_free(crypto->hmacctx);
 
+    if (crypto->origin)
+	crypto_cache_release(context, crypto->origin);
+
     free (crypto);
     return 0;
 }
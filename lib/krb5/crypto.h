@@ -129,6 +129,22 @@ struct _krb5_encryption_type {
     size_t prf_length;
     krb5_error_code (*prf)(krb5_context,
 			   krb5_crypto, const krb5_data *, krb5_data *);
+    /* encrypt several messages at once, see krb5_encrypt_iov_ivec_multi() */
+    krb5_error_code (*encrypt_multi)(krb5_context context,
+				     struct _krb5_key_data * const *key,
+				     void * const *data,
+				     const size_t *len,
+				     void * const *ivec,
+				     size_t n);
+    /* encrypt or decrypt and compute the keyed checksum in one pass */
+    krb5_error_code (*encrypt_hmac)(krb5_context context,
+				    krb5_crypto crypto,
+				    struct _krb5_key_data *key,
+				    struct _krb5_key_data *hkey,
+				    void *data, size_t len,
+				    krb5_boolean encryptp,
+				    void *ivec,
+				    void *hmac, unsigned int *hmaclen);
 };
 
 #define ENCRYPTION_USAGE(U) (((U) << 8) | 0xAA)
@@ -214,8 +230,11 @@ struct krb5_crypto_data {
     struct _krb5_key_data key;
     EVP_MD_CTX *mdctx;
     HMAC_CTX *hmacctx;
-    int num_key_usage;
-    struct _krb5_key_usage *key_usage;
+    size_t num_key_usage;	/* slots in use */
+    size_t key_usage_size;	/* slots; zero or a power of two */
+    struct _krb5_key_usage *key_usage;	/* open-addressed by usage */
+    unsigned int refcnt;	/* of a cached context: the cache + its clones */
+    struct krb5_crypto_data *origin; /* cached context we were cloned from */
 };
 
 #endif
@@ -42,6 +42,8 @@
 
 /* file operations -------------------------------------------- */
 
+static void fkt_index_forget(const char *);
+
 struct fkt_data {
     char *filename;
     int flags;
@@ -516,6 +518,406 @@ fkt_end_seq_get(krb5_context context,
     return 0;
 }
 
+/*
+ * Index of a FILE keytab, used by fkt_get().
+ *
+ * Looking up an entry used to mean parsing the whole file up to the
+ * entry.  The index maps the name of each principal (without the realm,
+ * so that the wildcard realm "" still works) to the offsets of its
+ * entries, so that a lookup only reads the candidate entries.  Only
+ * offsets are kept; keys stay in the file.
+ *
+ * The index is built from one pass over the file under a shared lock,
+ * and is kept process-wide by file name, since most callers (e.g.,
+ * krb5_rd_req() and the GSS acceptor) resolve a new keytab handle for
+ * every lookup.  It is rebuilt whenever the file's identity, size or
+ * modification time changes, and dropped when this process changes the
+ * file.  A removal followed by an add into the hole it left does not
+ * change the size, so if both can have happened within the timestamp
+ * resolution of the build, a lookup that finds nothing rebuilds the
+ * index before giving up, but only if it was not built in the current
+ * second (a file with an mtime in the future would otherwise be parsed
+ * on every miss).  Finding something other than the expected entry at
+ * an indexed offset always rebuilds it.
+ */
+
+struct fkt_index_entry {
+    off_t offset;
+    uint32_t hash;
+    uint32_t next;		/* 1 + index of next entry in bucket, or 0 */
+    krb5_kvno vno;
+    krb5_enctype enctype;
+};
+
+#define FKT_INDEX_MAX 16	/* number of keytabs to keep an index for */
+
+struct fkt_index {
+    struct fkt_index *next;
+    char *filename;
+    unsigned int refcnt;	/* the cache + users, see fkt_indices */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    time_t built;
+    size_t nentries;
+    size_t nbuckets;		/* power of two */
+    uint32_t *buckets;		/* 1 + index of first entry, or 0 */
+    struct fkt_index_entry *entries;
+};
+
+static HEIMDAL_MUTEX fkt_index_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct fkt_index *fkt_indices;	/* most recently used first */
+
+static void
+fkt_index_free(struct fkt_index *idx)
+{
+    if (idx == NULL)
+	return;
+    free(idx->filename);
+    free(idx->buckets);
+    free(idx->entries);
+    free(idx);
+}
+
+static uint32_t
+fkt_principal_hash(krb5_const_principal p)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+    const char *s;
+
+    for (i = 0; i < p->name.name_string.len; i++) {
+	for (s = p->name.name_string.val[i]; *s; s++)
+	    h = (h ^ (unsigned char)*s) * 16777619U;
+	h = (h ^ '/') * 16777619U;
+    }
+    return h;
+}
+
+static void
+fkt_index_stamp(struct fkt_index *idx, const struct stat *st)
+{
+    idx->dev = st->st_dev;
+    idx->ino = st->st_ino;
+    idx->size = st->st_size;
+    idx->mtime = st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    idx->mtime_nsec = st->st_mtim.tv_nsec;
+#else
+    idx->mtime_nsec = 0;
+#endif
+}
+
+static int
+fkt_index_current(const struct fkt_index *idx, const struct stat *st)
+{
+    struct fkt_index tmp;
+
+    fkt_index_stamp(&tmp, st);
+    return idx->dev == tmp.dev && idx->ino == tmp.ino &&
+	idx->size == tmp.size && idx->mtime == tmp.mtime &&
+	idx->mtime_nsec == tmp.mtime_nsec;
+}
+
+static void
+fkt_index_release(struct fkt_index *idx)
+{
+    int last;
+
+    if (idx == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&fkt_index_mutex);
+    last = (--idx->refcnt == 0);
+    HEIMDAL_MUTEX_unlock(&fkt_index_mutex);
+    if (last)
+	fkt_index_free(idx);
+}
+
+/* Remove the index of `filename' from the cache; call with the lock */
+static struct fkt_index *
+fkt_index_unlink(const char *filename)
+{
+    struct fkt_index **ip, *idx;
+
+    for (ip = &fkt_indices; (idx = *ip) != NULL; ip = &idx->next) {
+	if (strcmp(idx->filename, filename) == 0) {
+	    *ip = idx->next;
+	    idx->next = NULL;
+	    if (--idx->refcnt == 0)
+		return idx;
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Return a reference to the cached index of `filename' if it is
+ * current for the file described by `st', else NULL.
+ */
+static struct fkt_index *
+fkt_index_get(const char *filename, const struct stat *st)
+{
+    struct fkt_index **ip, *idx;
+
+    HEIMDAL_MUTEX_lock(&fkt_index_mutex);
+    for (ip = &fkt_indices; (idx = *ip) != NULL; ip = &idx->next) {
+	if (strcmp(idx->filename, filename) != 0)
+	    continue;
+	if (!fkt_index_current(idx, st)) {
+	    idx = NULL;
+	    break;
+	}
+	*ip = idx->next;
+	idx->next = fkt_indices;
+	fkt_indices = idx;
+	idx->refcnt++;
+	break;
+    }
+    HEIMDAL_MUTEX_unlock(&fkt_index_mutex);
+    return idx;
+}
+
+/* Cache `idx', replacing any index of the same file */
+static void
+fkt_index_put(struct fkt_index *idx)
+{
+    struct fkt_index *old, **ip, *drop = NULL;
+    size_t n;
+
+    HEIMDAL_MUTEX_lock(&fkt_index_mutex);
+    old = fkt_index_unlink(idx->filename);
+    idx->refcnt++;
+    idx->next = fkt_indices;
+    fkt_indices = idx;
+    for (n = 0, ip = &fkt_indices; *ip && n < FKT_INDEX_MAX; n++)
+	ip = &(*ip)->next;
+    if (*ip) {
+	drop = *ip;
+	*ip = NULL;
+	if (--drop->refcnt != 0)
+	    drop = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&fkt_index_mutex);
+    fkt_index_free(old);
+    fkt_index_free(drop);
+}
+
+/* Drop the cached index of `filename', after changing the file */
+static void
+fkt_index_forget(const char *filename)
+{
+    struct fkt_index *idx;
+
+    HEIMDAL_MUTEX_lock(&fkt_index_mutex);
+    idx = fkt_index_unlink(filename);
+    HEIMDAL_MUTEX_unlock(&fkt_index_mutex);
+    fkt_index_free(idx);
+}
+
+/*
+ * Build an index of the keytab open in `c', which must be positioned
+ * just after the header.
+ */
+static krb5_error_code
+fkt_index_build(krb5_context context,
+		krb5_keytab id,
+		krb5_kt_cursor *c,
+		const char *filename,
+		const struct stat *st,
+		struct fkt_index **idxp)
+{
+    struct fkt_index *idx;
+    struct fkt_index_entry *ie;
+    krb5_keytab_entry entry;
+    krb5_error_code ret;
+    size_t alloced = 0;
+    size_t i, b;
+    off_t start;
+
+    *idxp = NULL;
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL || (idx->filename = strdup(filename)) == NULL) {
+	free(idx);
+	return krb5_enomem(context);
+    }
+    idx->refcnt = 1;
+    fkt_index_stamp(idx, st);
+    idx->built = time(NULL);
+
+    while ((ret = fkt_next_entry_int(context, id, &entry, c,
+				     &start, NULL)) == 0) {
+	if (idx->nentries == alloced) {
+	    alloced = alloced ? alloced * 2 : 64;
+	    ie = realloc(idx->entries, alloced * sizeof(idx->entries[0]));
+	    if (ie == NULL) {
+		krb5_kt_free_entry(context, &entry);
+		fkt_index_free(idx);
+		return krb5_enomem(context);
+	    }
+	    idx->entries = ie;
+	}
+	ie = &idx->entries[idx->nentries++];
+	ie->offset = start;
+	ie->hash = fkt_principal_hash(entry.principal);
+	ie->vno = entry.vno;
+	ie->enctype = entry.keyblock.keytype;
+	krb5_kt_free_entry(context, &entry);
+    }
+    if (ret != KRB5_KT_END) {
+	fkt_index_free(idx);
+	return ret;
+    }
+
+    for (idx->nbuckets = 16; idx->nbuckets < idx->nentries; )
+	idx->nbuckets <<= 1;
+    idx->buckets = calloc(idx->nbuckets, sizeof(idx->buckets[0]));
+    if (idx->buckets == NULL) {
+	fkt_index_free(idx);
+	return krb5_enomem(context);
+    }
+    /* insert backwards so that each bucket is in file order */
+    for (i = idx->nentries; i > 0; i--) {
+	ie = &idx->entries[i - 1];
+	b = ie->hash & (idx->nbuckets - 1);
+	ie->next = idx->buckets[b];
+	idx->buckets[b] = i;
+    }
+    *idxp = idx;
+    return 0;
+}
+
+/*
+ * Look up `principal, kvno, enctype' in `idx' using the same rules as
+ * the generic iteration in krb5_kt_get_entry(): an exact kvno (or its
+ * lower 8 bits, which is all old keytabs store) wins, otherwise with
+ * kvno 0 the highest kvno is returned.  Returns KRB5_KT_NOTFOUND if
+ * nothing matches and -1 if the index turns out to be stale.
+ */
+static krb5_error_code
+fkt_index_lookup(krb5_context context,
+		 krb5_keytab id,
+		 krb5_kt_cursor *c,
+		 struct fkt_index *idx,
+		 krb5_const_principal principal,
+		 krb5_kvno kvno,
+		 krb5_enctype enctype,
+		 krb5_keytab_entry *entry)
+{
+    struct fkt_index_entry *ie;
+    krb5_keytab_entry tmp;
+    krb5_error_code ret;
+    uint32_t h = fkt_principal_hash(principal);
+    uint32_t i;
+    off_t start;
+    int exact;
+
+    entry->vno = 0;
+    for (i = idx->buckets[h & (idx->nbuckets - 1)]; i; i = ie->next) {
+	ie = &idx->entries[i - 1];
+	if (ie->hash != h || (enctype && enctype != ie->enctype))
+	    continue;
+	exact = (kvno == ie->vno || (ie->vno < 256 && kvno % 256 == ie->vno));
+	if (!exact && !(kvno == 0 && ie->vno > entry->vno))
+	    continue;
+
+	krb5_storage_seek(c->sp, ie->offset, SEEK_SET);
+	ret = fkt_next_entry_int(context, id, &tmp, c, &start, NULL);
+	if (ret == 0 && (start != ie->offset || tmp.vno != ie->vno ||
+			 tmp.keyblock.keytype != ie->enctype)) {
+	    krb5_kt_free_entry(context, &tmp);
+	    ret = -1;
+	}
+	if (ret) {
+	    if (entry->vno)
+		krb5_kt_free_entry(context, entry);
+	    entry->vno = 0;
+	    return ret == KRB5_KT_END ? -1 : ret;
+	}
+	if (!krb5_kt_compare(context, &tmp, principal, 0, enctype)) {
+	    krb5_kt_free_entry(context, &tmp);
+	    continue;
+	}
+	if (entry->vno)
+	    krb5_kt_free_entry(context, entry);
+	ret = krb5_kt_copy_entry_contents(context, &tmp, entry);
+	krb5_kt_free_entry(context, &tmp);
+	if (ret || exact)
+	    return ret;
+    }
+    return entry->vno ? 0 : KRB5_KT_NOTFOUND;
+}
+
+static krb5_error_code KRB5_CALLCONV
+fkt_get(krb5_context context,
+	krb5_keytab id,
+	krb5_const_principal principal,
+	krb5_kvno kvno,
+	krb5_enctype enctype,
+	krb5_keytab_entry *entry)
+{
+    struct fkt_data *d = id->data;
+    struct fkt_index *idx;
+    krb5_kt_cursor c;
+    krb5_error_code ret;
+    struct stat st;
+
+    if (principal == NULL)
+	return _krb5_kt_get_entry_scan(context, id, principal, kvno,
+				       enctype, entry);
+
+    ret = fkt_start_seq_get(context, id, &c);
+    if (ret) {
+	/* see krb5_kt_get_entry_wrapped() */
+	context->error_code = KRB5_KT_NOTFOUND;
+	return KRB5_KT_NOTFOUND;
+    }
+    if (fstat(c.fd, &st) == -1) {
+	ret = errno;
+	fkt_end_seq_get(context, id, &c);
+	krb5_set_error_message(context, ret,
+			       N_("keytab %s stat failed: %s", ""),
+			       d->filename, strerror(ret));
+	return ret;
+    }
+
+    ret = -1;
+    idx = fkt_index_get(d->filename, &st);
+    if (idx) {
+	ret = fkt_index_lookup(context, id, &c, idx, principal, kvno,
+			       enctype, entry);
+	if (ret == KRB5_KT_NOTFOUND && idx->mtime >= idx->built &&
+	    time(NULL) != idx->built)
+	    ret = -1;
+	fkt_index_release(idx);
+    }
+    if (ret == -1) {
+	/* no index, or a possibly stale one; see above */
+	krb5_storage_seek(c.sp, 2, SEEK_SET);
+	ret = fkt_index_build(context, id, &c, d->filename, &st, &idx);
+	if (ret == 0) {
+	    ret = fkt_index_lookup(context, id, &c, idx, principal,
+				   kvno, enctype, entry);
+	    if (ret == -1) {
+		/* changed under our shared lock?! */
+		fkt_index_forget(d->filename);
+		ret = KRB5_KT_END;
+	    } else {
+		fkt_index_put(idx);
+	    }
+	    fkt_index_release(idx);
+	}
+    }
+    fkt_end_seq_get(context, id, &c);
+
+    if (ret == KRB5_KT_NOTFOUND)
+	return _krb5_kt_principal_not_found(context, ret, id, principal,
+					    enctype, kvno);
+    return ret;
+}
+
 static krb5_error_code KRB5_CALLCONV
 fkt_setup_keytab(krb5_context context,
 		 krb5_keytab id,
@@ -737,6 +1139,7 @@ fkt_add_entry(krb5_context context,
         ret = krb5_storage_fsync(sp);
     krb5_storage_free(sp);
     close(fd);
+    fkt_index_forget(d->filename);
     return ret;
 }
 
@@ -789,6 +1192,8 @@ fkt_remove_entry(krb5_context context,
 	krb5_kt_free_entry(context, &e);
     }
     (void) krb5_kt_end_seq_get(context, id, &cursor);
+    if (found)
+        fkt_index_forget(fkt->filename);
     if (ret == KRB5_KT_END)
         ret = 0;
     if (ret) {
@@ -812,7 +1217,7 @@ const krb5_kt_ops krb5_fkt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -828,7 +1233,7 @@ const krb5_kt_ops krb5_wrfkt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -844,7 +1249,7 @@ const krb5_kt_ops krb5_javakt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
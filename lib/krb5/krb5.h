@@ -437,6 +437,7 @@ typedef union {
 /* flags for krb5_verify_ap_req */
 
 #define KRB5_VERIFY_AP_REQ_IGNORE_INVALID	(1 << 0)
+#define KRB5_VERIFY_AP_REQ_CACHED_KEY		(1 << 1) /* long-lived key */
 
 #define KRB5_GC_CACHED			(1U << 0)
 #define KRB5_GC_USER_USER		(1U << 1)
@@ -945,6 +946,15 @@ typedef struct krb5_crypto_iov {
     krb5_data data;
 } krb5_crypto_iov;
 
+typedef struct krb5_crypto_iov_job {
+    krb5_crypto crypto;
+    unsigned usage;
+    krb5_crypto_iov *data;
+    int num_data;
+    void *ivec;
+    krb5_error_code ret;	/* OUT */
+} krb5_crypto_iov_job;
+
 
 /* Glue for MIT */
 
@@ -290,6 +290,7 @@ typedef struct krb5_context_data {
     krb5_name_canon_rule name_canon_rules;
     size_t config_include_depth;
     krb5_boolean no_ticket_store;       /* Don't store service tickets */
+    struct _krb5_crypto_cache *crypto_cache; /* krb5_crypto_init_cached() */
 } krb5_context_data;
 
 #define KRB5_DEFAULT_CCNAME_FILE "FILE:%{TEMP}/krb5cc_%{uid}"
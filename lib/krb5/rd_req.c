@@ -38,14 +38,18 @@ static krb5_error_code
 decrypt_tkt_enc_part (krb5_context context,
 		      krb5_keyblock *key,
 		      EncryptedData *enc_part,
-		      EncTicketPart *decr_part)
+		      EncTicketPart *decr_part,
+		      krb5_flags flags)
 {
     krb5_error_code ret;
     krb5_data plain;
     size_t len;
     krb5_crypto crypto;
 
-    ret = krb5_crypto_init(context, key, 0, &crypto);
+    if (flags & KRB5_VERIFY_AP_REQ_CACHED_KEY)
+	ret = krb5_crypto_init_cached(context, key, 0, &crypto);
+    else
+	ret = krb5_crypto_init(context, key, 0, &crypto);
     if (ret)
 	return ret;
     ret = krb5_decrypt_EncryptedData (context,
@@ -103,34 +107,62 @@ decrypt_authenticator (krb5_context context,
     return ret;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_decode_ap_req(krb5_context context,
-		   const krb5_data *inbuf,
-		   krb5_ap_req *ap_req)
+static krb5_error_code
+check_ap_req(krb5_context context, const krb5_ap_req *ap_req)
 {
-    krb5_error_code ret;
-    size_t len;
-    ret = decode_AP_REQ(inbuf->data, inbuf->length, ap_req, &len);
-    if (ret)
-	return ret;
     if (ap_req->pvno != 5){
-	free_AP_REQ(ap_req);
 	krb5_clear_error_message (context);
 	return KRB5KRB_AP_ERR_BADVERSION;
     }
     if (ap_req->msg_type != krb_ap_req){
-	free_AP_REQ(ap_req);
 	krb5_clear_error_message (context);
 	return KRB5KRB_AP_ERR_MSG_TYPE;
     }
     if (ap_req->ticket.tkt_vno != 5){
-	free_AP_REQ(ap_req);
 	krb5_clear_error_message (context);
 	return KRB5KRB_AP_ERR_BADVERSION;
     }
     return 0;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_decode_ap_req(krb5_context context,
+		   const krb5_data *inbuf,
+		   krb5_ap_req *ap_req)
+{
+    krb5_error_code ret;
+    size_t len;
+    ret = decode_AP_REQ(inbuf->data, inbuf->length, ap_req, &len);
+    if (ret)
+	return ret;
+    ret = check_ap_req(context, ap_req);
+    if (ret)
+	free_AP_REQ(ap_req);
+    return ret;
+}
+
+/*
+ * Like krb5_decode_ap_req(), but the ciphertexts in `ap_req' point into
+ * `inbuf' instead of being copied, so `inbuf' has to outlive `ap_req'.
+ * Free with free_AP_REQ_borrowed().
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_decode_ap_req_borrowed(krb5_context context,
+			     const krb5_data *inbuf,
+			     krb5_ap_req *ap_req)
+{
+    krb5_error_code ret;
+    size_t len;
+    ret = decode_AP_REQ_borrowed(inbuf->data, inbuf->length, ap_req, &len);
+    if (ret)
+	return ret;
+    ret = check_ap_req(context, ap_req);
+    if (ret)
+	free_AP_REQ_borrowed(ap_req);
+    return ret;
+}
+
 static krb5_error_code
 check_transited(krb5_context context, Ticket *ticket, EncTicketPart *enc)
 {
@@ -196,7 +228,7 @@ krb5_decrypt_ticket(krb5_context context,
 {
     EncTicketPart t;
     krb5_error_code ret;
-    ret = decrypt_tkt_enc_part (context, key, &ticket->enc_part, &t);
+    ret = decrypt_tkt_enc_part (context, key, &ticket->enc_part, &t, flags);
     if (ret)
 	return ret;
 
@@ -328,10 +360,11 @@ krb5_verify_ap_req2(krb5_context context,
     }
 
     if (ap_req->ap_options.use_session_key && ac->keyblock){
+	/* a session key is not worth caching */
 	ret = krb5_decrypt_ticket(context, &ap_req->ticket,
 				  ac->keyblock,
 				  &t->ticket,
-				  flags);
+				  flags & ~KRB5_VERIFY_AP_REQ_CACHED_KEY);
 	krb5_free_keyblock(context, ac->keyblock);
 	ac->keyblock = NULL;
     }else
@@ -34,21 +34,489 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+/*
+ * Replay cache types:
+ *
+ *  FILE:path	 entries appended to a file, scanned on every store
+ *  MEMORY:name	 in-process hash set with time-bucketed expiry; handles
+ *		 resolved with the same name share the set
+ *  SHM:name	 fixed-size table in an anonymous shared mapping, for
+ *		 servers that fork workers after resolving the cache; its
+ *		 size is [libdefaults] rcache_shm_slots, and whether a full
+ *		 table evicts live entries is rcache_shm_evict
+ */
+
+enum rc_type { RC_FILE, RC_MEMORY, RC_SHM };
+
+static const char *rc_type_names[] = { "FILE", "MEMORY", "SHM" };
+
+#if defined(HAVE_MMAP) && defined(MAP_SHARED) && \
+    (defined(MAP_ANON) || defined(MAP_ANONYMOUS)) && \
+    defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) && \
+    defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+#include <pthread.h>
+#define HAVE_RC_SHM 1
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#endif
+
+struct rc_mem;
+
 struct krb5_rcache_data {
     char *name;
+    enum rc_type type;
+    struct rc_mem *mem;		/* MEMORY: and SHM: */
+};
+
+struct rc_entry{
+    time_t stamp;
+    unsigned char data[16];
+};
+
+/*
+ * MEMORY: entries are hashed on the authenticator checksum and also
+ * threaded onto one of RC_MEM_BUCKETS lists by time stamp, each list
+ * covering 1/RC_MEM_BUCKETS of the lifespan.  When a list comes around
+ * to be reused for a newer slice of time, everything on it is past the
+ * lifespan and is freed in one go, so expiry never scans live entries.
+ */
+
+#define RC_MEM_BUCKETS 16
+#define RC_MEM_INITIAL_HASH 64	/* must be a power of two */
+
+/*
+ * SHM: the table can't grow or be rehashed under other processes, so it
+ * is a fixed open-addressed array; a store probes at most RC_SHM_PROBES
+ * slots, reusing the first empty or expired one.  If all of them are live
+ * the store fails, since forgetting a live entry would let its replay
+ * through, unless eviction of the oldest was asked for.  Slots are never
+ * emptied again (only reused), so a lookup may stop at an empty slot.
+ *
+ * The default size allows for RC_SHM_RATE stores per second over the
+ * lifespan, rounded up to a power of two.
+ */
+
+#define RC_SHM_RATE 200
+#define RC_SHM_MAX_SLOTS (1U << 24)
+#define RC_SHM_PROBES 64
+
+struct rc_mem_entry {
+    struct rc_mem_entry *hnext;	/* hash chain */
+    struct rc_mem_entry *tnext;	/* expiry bucket */
+    struct rc_entry ent;
+};
+
+#ifdef HAVE_RC_SHM
+struct rc_shm {
+    pthread_mutex_t lock;	/* process-shared and robust */
+    krb5_deltat lifespan;
+    uint32_t nslots;		/* a power of two */
+    int evict;			/* evict the oldest entry when full */
+    uint64_t evictions;
+    struct rc_entry slot[1];
+};
+#endif
+
+struct rc_mem {
+    char *name;
+    enum rc_type type;
+    unsigned int refcnt;
+    unsigned int dead:1;
+    struct rc_mem *next;
+    HEIMDAL_MUTEX mutex;
+    krb5_deltat lifespan;
+    struct rc_mem_entry **hash;
+    size_t hash_size;
+    size_t count;
+    struct {
+	time_t epoch;		/* stamp / bucket width of the entries */
+	struct rc_mem_entry *head;
+    } bucket[RC_MEM_BUCKETS];
+#ifdef HAVE_RC_SHM
+    struct rc_shm *shm;
+    size_t shm_size;
+#endif
 };
 
+static HEIMDAL_MUTEX rc_mem_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct rc_mem *rc_mem_head;
+
+static uint32_t
+rc_hash(const unsigned char *data)
+{
+    /* data is an MD5 checksum, so any four bytes will do */
+    return data[0] | (data[1] << 8) | (data[2] << 16) |
+	((uint32_t)data[3] << 24);
+}
+
+static void
+rc_mem_clear(struct rc_mem *m)
+{
+    struct rc_mem_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < RC_MEM_BUCKETS; i++) {
+	for (e = m->bucket[i].head; e != NULL; e = next) {
+	    next = e->tnext;
+	    free(e);
+	}
+	m->bucket[i].head = NULL;
+	m->bucket[i].epoch = 0;
+    }
+    if (m->hash)
+	memset(m->hash, 0, m->hash_size * sizeof(m->hash[0]));
+    m->count = 0;
+}
+
+static void
+rc_mem_free(struct rc_mem *m)
+{
+    rc_mem_clear(m);
+#ifdef HAVE_RC_SHM
+    if (m->shm)
+	munmap(m->shm, m->shm_size);
+#endif
+    HEIMDAL_MUTEX_destroy(&m->mutex);
+    free(m->hash);
+    free(m->name);
+    free(m);
+}
+
+#ifdef HAVE_RC_SHM
+
+/*
+ * The lock lives in the shared mapping, so it must be process-shared,
+ * and robust so that a worker dying while holding it doesn't wedge the
+ * others.  A dead owner can at worst have left one slot half-written,
+ * which is harmless, so the lock is just marked consistent again.
+ */
+
+static krb5_error_code
+rc_shm_lock(krb5_context context, struct rc_shm *shm)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(&shm->lock);
+    if (ret == EOWNERDEAD)
+	ret = pthread_mutex_consistent(&shm->lock);
+    if (ret) {
+	krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
+			       N_("Shared replay cache lock is unusable", ""));
+	return KRB5_RC_IO_UNKNOWN;
+    }
+    return 0;
+}
+
+static krb5_error_code
+rc_shm_alloc(krb5_context context, const char *name, krb5_deltat lifespan,
+	     struct rc_shm **out, size_t *sizep)
+{
+    pthread_mutexattr_t attr;
+    struct rc_shm *shm;
+    uint32_t nslots;
+    size_t size;
+    int n, ret;
+
+    *out = NULL;
+    n = krb5_config_get_int_default(context, NULL, lifespan * RC_SHM_RATE,
+				    "libdefaults", "rcache_shm_slots", NULL);
+    for (nslots = RC_SHM_PROBES; nslots < (uint32_t)n &&
+	 nslots < RC_SHM_MAX_SLOTS; nslots <<= 1)
+	;
+    size = offsetof(struct rc_shm, slot) + nslots * sizeof(shm->slot[0]);
+
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANON, -1, 0);
+    if (shm == MAP_FAILED) {
+	char buf[128];
+
+	ret = errno;
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "mmap(%s): %s", name, buf);
+	return ret;
+    }
+    shm->nslots = nslots;
+    shm->evict = krb5_config_get_bool_default(context, NULL, FALSE,
+					      "libdefaults", "rcache_shm_evict",
+					      NULL);
+
+    if ((ret = pthread_mutexattr_init(&attr)) == 0) {
+	ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (ret == 0)
+	    ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (ret == 0)
+	    ret = pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+    }
+    if (ret) {
+	munmap(shm, size);
+	krb5_set_error_message(context, ret,
+			       N_("Could not create lock for shared "
+				  "replay cache %s", ""), name);
+	return ret;
+    }
+    *out = shm;
+    *sizep = size;
+    return 0;
+}
+
+#endif /* HAVE_RC_SHM */
+
+static krb5_error_code
+rc_mem_alloc(krb5_context context, const char *name, enum rc_type type,
+	     struct rc_mem **out)
+{
+    struct rc_mem *m;
+
+    *out = NULL;
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    for (m = rc_mem_head; m != NULL; m = m->next)
+	if (m->type == type && strcmp(m->name, name) == 0)
+	    break;
+    if (m) {
+	HEIMDAL_MUTEX_lock(&m->mutex);
+	m->refcnt++;
+	HEIMDAL_MUTEX_unlock(&m->mutex);
+	HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	*out = m;
+	return 0;
+    }
+
+    m = calloc(1, sizeof(*m));
+    if (m == NULL || (m->name = strdup(name)) == NULL) {
+	HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	free(m);
+	return krb5_enomem(context);
+    }
+    m->type = type;
+    m->refcnt = 1;
+    m->lifespan = context->max_skew;
+    HEIMDAL_MUTEX_init(&m->mutex);
+    if (type == RC_SHM) {
+#ifdef HAVE_RC_SHM
+	krb5_error_code ret;
+
+	ret = rc_shm_alloc(context, name, m->lifespan, &m->shm, &m->shm_size);
+	if (ret) {
+	    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	    rc_mem_free(m);
+	    return ret;
+	}
+	m->shm->lifespan = m->lifespan;
+#endif
+    } else {
+	m->hash_size = RC_MEM_INITIAL_HASH;
+	m->hash = calloc(m->hash_size, sizeof(m->hash[0]));
+	if (m->hash == NULL) {
+	    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	    rc_mem_free(m);
+	    return krb5_enomem(context);
+	}
+    }
+    m->next = rc_mem_head;
+    rc_mem_head = m;
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+    *out = m;
+    return 0;
+}
+
+static void
+rc_mem_release(struct rc_mem *m)
+{
+    int last;
+
+    HEIMDAL_MUTEX_lock(&m->mutex);
+    last = (--m->refcnt == 0 && m->dead);
+    HEIMDAL_MUTEX_unlock(&m->mutex);
+    if (last)
+	rc_mem_free(m);
+}
+
+static void
+rc_mem_destroy(struct rc_mem *m)
+{
+    struct rc_mem **n;
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    HEIMDAL_MUTEX_lock(&m->mutex);
+    if (!m->dead) {
+	for (n = &rc_mem_head; *n != NULL; n = &(*n)->next) {
+	    if (*n == m) {
+		*n = m->next;
+		break;
+	    }
+	}
+	m->dead = 1;
+	rc_mem_clear(m);
+    }
+    HEIMDAL_MUTEX_unlock(&m->mutex);
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+}
+
+static void
+rc_mem_expire_bucket(struct rc_mem *m, size_t b)
+{
+    struct rc_mem_entry *e, *next, **p;
+
+    for (e = m->bucket[b].head; e != NULL; e = next) {
+	next = e->tnext;
+	p = &m->hash[rc_hash(e->ent.data) & (m->hash_size - 1)];
+	while (*p != e)
+	    p = &(*p)->hnext;
+	*p = e->hnext;
+	free(e);
+	m->count--;
+    }
+    m->bucket[b].head = NULL;
+}
+
+static void
+rc_mem_grow(struct rc_mem *m)
+{
+    struct rc_mem_entry **hash, *e, *next;
+    size_t size = m->hash_size * 2;
+    size_t i, h;
+
+    hash = calloc(size, sizeof(hash[0]));
+    if (hash == NULL)
+	return;			/* keep going with longer chains */
+    for (i = 0; i < m->hash_size; i++) {
+	for (e = m->hash[i]; e != NULL; e = next) {
+	    next = e->hnext;
+	    h = rc_hash(e->ent.data) & (size - 1);
+	    e->hnext = hash[h];
+	    hash[h] = e;
+	}
+    }
+    free(m->hash);
+    m->hash = hash;
+    m->hash_size = size;
+}
+
+static krb5_error_code
+rc_mem_store(krb5_context context, struct rc_mem *m, struct rc_entry *ent)
+{
+    struct rc_mem_entry *e;
+    time_t width, epoch, t;
+    size_t b;
+
+    HEIMDAL_MUTEX_lock(&m->mutex);
+    t = ent->stamp - m->lifespan;
+    for (e = m->hash[rc_hash(ent->data) & (m->hash_size - 1)];
+	 e != NULL;
+	 e = e->hnext) {
+	if (e->ent.stamp >= t &&
+	    memcmp(e->ent.data, ent->data, sizeof(ent->data)) == 0) {
+	    HEIMDAL_MUTEX_unlock(&m->mutex);
+	    krb5_clear_error_message(context);
+	    return KRB5_RC_REPLAY;
+	}
+    }
+
+    width = m->lifespan / RC_MEM_BUCKETS + 1;
+    epoch = ent->stamp / width;
+    b = epoch % RC_MEM_BUCKETS;
+    if (m->bucket[b].epoch < epoch) {
+	rc_mem_expire_bucket(m, b);
+	m->bucket[b].epoch = epoch;
+    }
+
+    e = malloc(sizeof(*e));
+    if (e == NULL) {
+	HEIMDAL_MUTEX_unlock(&m->mutex);
+	return krb5_enomem(context);
+    }
+    if (m->count >= m->hash_size)
+	rc_mem_grow(m);
+    e->ent = *ent;
+    e->hnext = m->hash[rc_hash(ent->data) & (m->hash_size - 1)];
+    m->hash[rc_hash(ent->data) & (m->hash_size - 1)] = e;
+    e->tnext = m->bucket[b].head;
+    m->bucket[b].head = e;
+    m->count++;
+    HEIMDAL_MUTEX_unlock(&m->mutex);
+    return 0;
+}
+
+#ifdef HAVE_RC_SHM
+
+static krb5_error_code
+rc_shm_store(krb5_context context, struct rc_shm *shm, struct rc_entry *ent)
+{
+    struct rc_entry *s, *free_slot = NULL, *oldest = NULL;
+    uint32_t h = rc_hash(ent->data);
+    uint64_t evictions = 0;
+    krb5_error_code ret;
+    time_t t;
+    size_t i;
+
+    if ((ret = rc_shm_lock(context, shm)))
+	return ret;
+    t = ent->stamp - shm->lifespan;
+    for (i = 0; i < RC_SHM_PROBES; i++) {
+	s = &shm->slot[(h + i) & (shm->nslots - 1)];
+	if (s->stamp == 0) {
+	    if (free_slot == NULL)
+		free_slot = s;
+	    break;
+	}
+	if (s->stamp < t) {
+	    if (free_slot == NULL)
+		free_slot = s;
+	    continue;
+	}
+	if (memcmp(s->data, ent->data, sizeof(ent->data)) == 0) {
+	    pthread_mutex_unlock(&shm->lock);
+	    krb5_clear_error_message(context);
+	    return KRB5_RC_REPLAY;
+	}
+	if (oldest == NULL || s->stamp < oldest->stamp)
+	    oldest = s;
+    }
+    if (free_slot == NULL) {
+	/* Every probed slot is live */
+	if (!shm->evict) {
+	    pthread_mutex_unlock(&shm->lock);
+	    krb5_set_error_message(context, KRB5_RC_IO_SPACE,
+				   N_("Shared replay cache is full; see "
+				      "rcache_shm_slots in krb5.conf", ""));
+	    return KRB5_RC_IO_SPACE;
+	}
+	free_slot = oldest;
+	evictions = ++shm->evictions;
+    }
+    *free_slot = *ent;
+    pthread_mutex_unlock(&shm->lock);
+    /* Log the first eviction, and then at every power of two */
+    if (evictions && (evictions & (evictions - 1)) == 0)
+	_krb5_debug(context, 0, "Shared replay cache is full: %llu live "
+		    "entries evicted", (unsigned long long)evictions);
+    return 0;
+}
+
+#endif /* HAVE_RC_SHM */
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_resolve(krb5_context context,
 		krb5_rcache id,
 		const char *name)
 {
+    krb5_error_code ret;
+
     id->name = strdup(name);
     if(id->name == NULL) {
 	krb5_set_error_message(context, KRB5_RC_MALLOC,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    if (id->type != RC_FILE) {
+	ret = rc_mem_alloc(context, name, id->type, &id->mem);
+	if (ret)
+	    return ret;
+    }
     return 0;
 }
 
@@ -57,8 +525,18 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    enum rc_type t;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    if (strcmp(type, "FILE") == 0)
+	t = RC_FILE;
+    else if (strcmp(type, "MEMORY") == 0)
+	t = RC_MEMORY;
+#ifdef HAVE_RC_SHM
+    else if (strcmp(type, "SHM") == 0)
+	t = RC_SHM;
+#endif
+    else {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +548,7 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->type = t;
     return 0;
 }
 
@@ -79,19 +558,26 @@ krb5_rc_resolve_full(krb5_context context,
 		     const char *string_name)
 {
     krb5_error_code ret;
+    size_t i, len = 0;
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    for (i = 0; i < sizeof(rc_type_names)/sizeof(rc_type_names[0]); i++) {
+	len = strlen(rc_type_names[i]);
+	if (strncmp(string_name, rc_type_names[i], len) == 0 &&
+	    string_name[len] == ':')
+	    break;
+    }
+    if (i == sizeof(rc_type_names)/sizeof(rc_type_names[0])) {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    ret = krb5_rc_resolve_type(context, id, rc_type_names[i]);
     if(ret)
 	return ret;
-    ret = krb5_rc_resolve(context, *id, string_name + 5);
+    ret = krb5_rc_resolve(context, *id, string_name + len + 1);
     if (ret) {
 	krb5_rc_close(context, *id);
 	*id = NULL;
@@ -118,20 +604,38 @@ krb5_rc_default(krb5_context context,
     return krb5_rc_resolve_full(context, id, krb5_rc_default_name(context));
 }
 
-struct rc_entry{
-    time_t stamp;
-    unsigned char data[16];
-};
-
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
+    FILE *f;
     struct rc_entry tmp;
     int ret;
 
+    if (id->mem) {
+	struct rc_mem *m = id->mem;
+
+	HEIMDAL_MUTEX_lock(&m->mutex);
+	rc_mem_clear(m);
+	m->lifespan = auth_lifespan;
+#ifdef HAVE_RC_SHM
+	if (m->shm) {
+	    ret = rc_shm_lock(context, m->shm);
+	    if (ret) {
+		HEIMDAL_MUTEX_unlock(&m->mutex);
+		return ret;
+	    }
+	    memset(m->shm->slot, 0, m->shm->nslots * sizeof(m->shm->slot[0]));
+	    m->shm->lifespan = auth_lifespan;
+	    pthread_mutex_unlock(&m->shm->lock);
+	}
+#endif
+	HEIMDAL_MUTEX_unlock(&m->mutex);
+	return 0;
+    }
+
+    f = fopen(id->name, "w");
     if(f == NULL) {
 	char buf[128];
 	ret = errno;
@@ -159,6 +663,10 @@ krb5_rc_destroy(krb5_context context,
 {
     int ret;
 
+    if (id->mem) {
+	rc_mem_destroy(id->mem);
+	return krb5_rc_close(context, id);
+    }
     if(remove(id->name) < 0) {
 	char buf[128];
 	ret = errno;
@@ -173,6 +681,8 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+    if (id->mem)
+	rc_mem_release(id->mem);
     free(id->name);
     free(id);
     return 0;
@@ -210,6 +720,12 @@ krb5_rc_store(krb5_context context,
 
     ent.stamp = time(NULL);
     checksum_authenticator(rep, ent.data);
+#ifdef HAVE_RC_SHM
+    if (id->mem && id->mem->shm)
+	return rc_shm_store(context, id->mem->shm, &ent);
+#endif
+    if (id->mem)
+	return rc_mem_store(context, id->mem, &ent);
     f = fopen(id->name, "r");
     if(f == NULL) {
 	char buf[128];
@@ -267,9 +783,21 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
+    FILE *f;
     int r;
     struct rc_entry ent;
+
+    if (id->mem) {
+#ifdef HAVE_RC_SHM
+	if (id->mem->shm) {
+	    *auth_lifespan = id->mem->shm->lifespan;
+	    return 0;
+	}
+#endif
+	*auth_lifespan = id->mem->lifespan;
+	return 0;
+    }
+    f = fopen(id->name, "r");
     r = fread(&ent, sizeof(ent), 1, f);
     fclose(f);
     if(r){
@@ -291,7 +819,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return rc_type_names[id->type];
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -128,6 +128,57 @@ time_s2k(krb5_context context,
 
 }
 
+/*
+ * Contexts handed out for a cached key must be private clones: destroying
+ * one must not affect another, and data encrypted with one must decrypt
+ * with the other, and with an uncached context for the same key.
+ */
+static void
+check_cached_crypto(krb5_context context, krb5_enctype etype)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto c1, c2, c3;
+    krb5_data data, plain;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    ret = krb5_crypto_init_cached(context, &key, 0, &c1);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init_cached");
+    ret = krb5_crypto_init_cached(context, &key, 0, &c2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init_cached");
+    ret = krb5_crypto_init(context, &key, 0, &c3);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    if (c1 == c2 || c1 == c3 || c2 == c3)
+	krb5_errx(context, 1, "cached crypto context handed out twice");
+
+    ret = krb5_encrypt(context, c1, 3, "hello", 5, &data);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt");
+    krb5_crypto_destroy(context, c1);
+
+    ret = krb5_decrypt(context, c2, 3, data.data, data.length, &plain);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt");
+    if (plain.length != 5 || memcmp(plain.data, "hello", 5) != 0)
+	krb5_errx(context, 1, "cached crypto context: wrong plaintext");
+    krb5_data_free(&plain);
+    krb5_crypto_destroy(context, c2);
+
+    ret = krb5_decrypt(context, c3, 3, data.data, data.length, &plain);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt");
+    krb5_data_free(&plain);
+    krb5_data_free(&data);
+    krb5_crypto_destroy(context, c3);
+    krb5_free_keyblock_contents(context, &key);
+}
+
 static int version_flag = 0;
 static int help_flag	= 0;
 
@@ -197,6 +248,8 @@ main(int argc, char **argv)
 
 	krb5_enctype_enable(context, enctypes[i]);
 
+	check_cached_crypto(context, enctypes[i]);
+
 	time_encryption(context, 16, enctypes[i], enciter);
 	time_encryption(context, 32, enctypes[i], enciter);
 	time_encryption(context, 512, enctypes[i], enciter);
@@ -93,7 +93,337 @@ test_wrapping(krb5_context context,
     krb5_free_keyblock_contents(context, &key);
 }
 
+/*
+ * Check that messages decrypt back to what was encrypted, with sizes
+ * either side of the chunks the AES enctypes encrypt and MAC in, and
+ * that a single flipped bit anywhere in the ciphertext is detected.
+ */
+
+static void
+test_roundtrip(krb5_context context, krb5_enctype etype)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto crypto;
+    krb5_data data, plain;
+    unsigned char *buf;
+    size_t size, i, max_size = 3 * 4096 + 100;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    ret = krb5_crypto_init(context, &key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    buf = malloc(max_size);
+    if (buf == NULL)
+	krb5_errx(context, 1, "out of memory");
+    for (i = 0; i < max_size; i++)
+	buf[i] = i * 7;
+
+    for (size = 0; size < max_size; size += (size < 64) ? 1 : 509) {
+	ret = krb5_encrypt(context, crypto, 3, buf, size, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "encrypt size %lu", (unsigned long)size);
+
+	ret = krb5_decrypt(context, crypto, 3, data.data, data.length, &plain);
+	if (ret)
+	    krb5_err(context, 1, ret, "decrypt size %lu", (unsigned long)size);
+	if (plain.length < size ||	/* may be padded */
+	    memcmp(plain.data, buf, size) != 0)
+	    krb5_errx(context, 1, "size %lu: decrypted data mismatch",
+		      (unsigned long)size);
+	krb5_data_free(&plain);
+
+	i = (size * 13) % data.length;
+	((unsigned char *)data.data)[i] ^= 0x10;
+	ret = krb5_decrypt(context, crypto, 3, data.data, data.length, &plain);
+	if (ret == 0)
+	    krb5_errx(context, 1, "size %lu: corrupt byte %lu not detected",
+		      (unsigned long)size, (unsigned long)i);
+	krb5_data_free(&data);
+    }
+
+    free(buf);
+    krb5_crypto_destroy(context, crypto);
+    krb5_free_keyblock_contents(context, &key);
+}
+
+/*
+ * Check what an in-place iov decryption leaves in the caller's buffers
+ * when the checksum doesn't match: the untouched ciphertext where the
+ * checksum is over the ciphertext (aes-sha2), and no unverified
+ * plaintext where it is over the plaintext (aes-sha1).
+ */
+
+static void
+test_iov_bad_integrity(krb5_context context)
+{
+    struct {
+	krb5_enctype etype;
+	krb5_boolean keeps_ciphertext;
+    } tests[] = {
+	{ ETYPE_AES128_CTS_HMAC_SHA1_96, FALSE },
+	{ KRB5_ENCTYPE_AES128_CTS_HMAC_SHA256_128, TRUE }
+    };
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto crypto;
+    krb5_crypto_iov iov[4];
+    unsigned char *msg, *saved;
+    size_t i, j, size = 5000, hlen, plen, tlen, len;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+	ret = krb5_generate_random_keyblock(context, tests[i].etype, &key);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+	ret = krb5_crypto_init(context, &key, 0, &crypto);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_crypto_init");
+
+	krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_HEADER, &hlen);
+	krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_PADDING, &plen);
+	krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_TRAILER, &tlen);
+	len = hlen + size + plen + tlen;
+
+	msg = malloc(len);
+	saved = malloc(len);
+	if (msg == NULL || saved == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	memset(msg + hlen, 'x', size);
+
+	iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	iov[0].data.data = msg;
+	iov[0].data.length = hlen;
+	iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[1].data.data = msg + hlen;
+	iov[1].data.length = size;
+	iov[2].flags = KRB5_CRYPTO_TYPE_PADDING;
+	iov[2].data.data = msg + hlen + size;
+	iov[2].data.length = plen;
+	iov[3].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	iov[3].data.data = msg + hlen + size + plen;
+	iov[3].data.length = tlen;
+
+	ret = krb5_encrypt_iov_ivec(context, crypto, 3, iov, 4, NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_encrypt_iov_ivec");
+
+	msg[len - 1] ^= 0x10;
+	memcpy(saved, msg, len);
+	ret = krb5_decrypt_iov_ivec(context, crypto, 3, iov, 4, NULL);
+	if (ret != KRB5KRB_AP_ERR_BAD_INTEGRITY)
+	    krb5_errx(context, 1, "%d: corrupt checksum not detected (%d)",
+		      tests[i].etype, ret);
+	if (tests[i].keeps_ciphertext) {
+	    if (memcmp(msg, saved, len) != 0)
+		krb5_errx(context, 1, "%d: ciphertext changed on failure",
+			  tests[i].etype);
+	} else {
+	    for (j = 0; j < hlen + size; j++)
+		if (msg[j] != 0)
+		    krb5_errx(context, 1, "%d: plaintext left on failure",
+			      tests[i].etype);
+	}
+
+	free(saved);
+	free(msg);
+	krb5_crypto_destroy(context, crypto);
+	krb5_free_keyblock_contents(context, &key);
+    }
+}
+
+/*
+ * Use enough key usages on one crypto context that its derived key table
+ * has to grow, and check that each usage still gets its own key: data
+ * must decrypt under the usage it was encrypted with, in a context that
+ * has seen every other usage first, and not under a neighbouring one.
+ */
+
+#define NUM_USAGES 40
+
+static void
+test_usages(krb5_context context, krb5_enctype etype)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto crypto, crypto2;
+    krb5_data data[NUM_USAGES], plain;
+    char buf[] = "key usage test";
+    unsigned usage;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
 
+    ret = krb5_crypto_init(context, &key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    ret = krb5_crypto_init(context, &key, 0, &crypto2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    for (usage = 0; usage < NUM_USAGES; usage++) {
+	ret = krb5_encrypt(context, crypto, usage + 1, buf, sizeof(buf),
+			   &data[usage]);
+	if (ret)
+	    krb5_err(context, 1, ret, "encrypt usage %u", usage + 1);
+    }
+
+    for (usage = NUM_USAGES; usage > 0; usage--) {
+	ret = krb5_decrypt(context, crypto2, usage, data[usage - 1].data,
+			   data[usage - 1].length, &plain);
+	if (ret)
+	    krb5_err(context, 1, ret, "decrypt usage %u", usage);
+	if (plain.length < sizeof(buf) ||	/* may be padded */
+	    memcmp(plain.data, buf, sizeof(buf)) != 0)
+	    krb5_errx(context, 1, "usage %u: decrypted data mismatch", usage);
+	krb5_data_free(&plain);
+
+	ret = krb5_decrypt(context, crypto, usage % NUM_USAGES + 1,
+			   data[usage - 1].data, data[usage - 1].length,
+			   &plain);
+	if (ret == 0)
+	    krb5_errx(context, 1, "usage %u decrypted with usage %u",
+		      usage, usage % NUM_USAGES + 1);
+    }
+
+    for (usage = 0; usage < NUM_USAGES; usage++)
+	krb5_data_free(&data[usage]);
+    krb5_crypto_destroy(context, crypto);
+    krb5_crypto_destroy(context, crypto2);
+    krb5_free_keyblock_contents(context, &key);
+}
+
+/*
+ * Encrypt a batch of messages with krb5_encrypt_iov_ivec_multi(), mixing
+ * enctypes, with several messages per crypto context and key usage and
+ * some messages split over separate buffers, and check that each one
+ * decrypts on its own, with the same resulting ivec where one is used.
+ */
+
+#define NUM_JOBS 40
+
+static void
+test_multi(krb5_context context)
+{
+    krb5_enctype etypes[] = {
+	ETYPE_DES3_CBC_SHA1,
+	ETYPE_AES128_CTS_HMAC_SHA1_96,
+	ETYPE_AES256_CTS_HMAC_SHA1_96,
+	KRB5_ENCTYPE_AES128_CTS_HMAC_SHA256_128,
+	KRB5_ENCTYPE_AES256_CTS_HMAC_SHA384_192
+    };
+    const int netypes = sizeof(etypes) / sizeof(etypes[0]);
+    krb5_keyblock key[sizeof(etypes) / sizeof(etypes[0])];
+    krb5_crypto crypto[sizeof(etypes) / sizeof(etypes[0])];
+    krb5_crypto_iov iov[NUM_JOBS][5];
+    krb5_crypto_iov_job jobs[NUM_JOBS];
+    unsigned char ivec[NUM_JOBS][16], ivec2[NUM_JOBS][16];
+    unsigned char *msg[NUM_JOBS], *split[NUM_JOBS];
+    krb5_error_code ret;
+    krb5_data plain;
+    size_t i, j, size, hlen, plen, tlen;
+    int e;
+
+    for (e = 0; e < netypes; e++) {
+	ret = krb5_generate_random_keyblock(context, etypes[e], &key[e]);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+	ret = krb5_crypto_init(context, &key[e], 0, &crypto[e]);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_crypto_init");
+    }
+
+    for (i = 0; i < NUM_JOBS; i++) {
+	e = i % netypes;
+	size = 1 + i * 37;
+
+	krb5_crypto_length(context, crypto[e], KRB5_CRYPTO_TYPE_HEADER, &hlen);
+	krb5_crypto_length(context, crypto[e], KRB5_CRYPTO_TYPE_PADDING, &plen);
+	krb5_crypto_length(context, crypto[e], KRB5_CRYPTO_TYPE_TRAILER, &tlen);
+
+	msg[i] = malloc(hlen + size + plen + tlen);
+	split[i] = malloc(size);
+	if (msg[i] == NULL || split[i] == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	memset(msg[i] + hlen, i, size);
+
+	iov[i][0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	iov[i][0].data.data = msg[i];
+	iov[i][0].data.length = hlen;
+	iov[i][1].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[i][1].data.data = msg[i] + hlen;
+	iov[i][1].data.length = size;
+	iov[i][2].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+	iov[i][2].data.data = "sign only";
+	iov[i][2].data.length = 0;
+	iov[i][3].flags = KRB5_CRYPTO_TYPE_PADDING;
+	iov[i][3].data.data = msg[i] + hlen + size;
+	iov[i][3].data.length = plen;
+	iov[i][4].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	iov[i][4].data.data = msg[i] + hlen + size + plen;
+	iov[i][4].data.length = tlen;
+
+	/* every third message has its data somewhere else */
+	if (i % 3 == 0) {
+	    memcpy(split[i], msg[i] + hlen, size);
+	    iov[i][1].data.data = split[i];
+	}
+
+	jobs[i].crypto = crypto[e];
+	jobs[i].usage = 1 + (i / netypes) % 2;
+	jobs[i].data = iov[i];
+	jobs[i].num_data = 5;
+	jobs[i].ivec = NULL;
+	if (i % 2 == 0) {
+	    krb5_generate_random_block(ivec[i], sizeof(ivec[i]));
+	    memcpy(ivec2[i], ivec[i], sizeof(ivec[i]));
+	    jobs[i].ivec = ivec[i];
+	}
+    }
+
+    ret = krb5_encrypt_iov_ivec_multi(context, jobs, NUM_JOBS);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt_iov_ivec_multi");
+
+    for (i = 0; i < NUM_JOBS; i++) {
+	e = i % netypes;
+	size = 1 + i * 37;
+
+	if (jobs[i].ret)
+	    krb5_err(context, 1, jobs[i].ret, "job %lu", (unsigned long)i);
+	if (i % 3 == 0)
+	    memcpy(msg[i] + iov[i][0].data.length, split[i], size);
+	/* padding may have shrunk, move the trailer up behind it */
+	memmove((unsigned char *)iov[i][3].data.data + iov[i][3].data.length,
+		iov[i][4].data.data, iov[i][4].data.length);
+
+	ret = krb5_decrypt_ivec(context, crypto[e], jobs[i].usage, msg[i],
+				iov[i][0].data.length + size +
+				iov[i][3].data.length + iov[i][4].data.length,
+				&plain, jobs[i].ivec ? ivec2[i] : NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "decrypt job %lu", (unsigned long)i);
+	for (j = 0; j < size; j++)
+	    if (plain.length < size ||
+		((unsigned char *)plain.data)[j] != (unsigned char)i)
+		krb5_errx(context, 1, "job %lu: decrypted data mismatch",
+			  (unsigned long)i);
+	if (jobs[i].ivec && memcmp(ivec[i], ivec2[i], sizeof(ivec[i])) != 0)
+	    krb5_errx(context, 1, "job %lu: ivec mismatch", (unsigned long)i);
+	krb5_data_free(&plain);
+	free(msg[i]);
+	free(split[i]);
+    }
+
+    for (e = 0; e < netypes; e++) {
+	krb5_crypto_destroy(context, crypto[e]);
+	krb5_free_keyblock_contents(context, &key[e]);
+    }
+}
 
 static int version_flag = 0;
 static int help_flag	= 0;
@@ -161,7 +491,13 @@ main(int argc, char **argv)
 
 	test_wrapping(context, 0, 1024, 1, enctypes[i]);
 	test_wrapping(context, 1024, 1024 * 100, 1024, enctypes[i]);
+	if (!krb5_is_enctype_weak(context, enctypes[i])) {
+	    test_roundtrip(context, enctypes[i]);
+	    test_usages(context, enctypes[i]);	/* single DES ignores usage */
+	}
     }
+    test_iov_bad_integrity(context);
+    test_multi(context);
     krb5_free_context(context);
 
     return 0;
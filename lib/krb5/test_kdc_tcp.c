@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Exercise the KDC's TCP and HTTP transports the way kinit never does:
+ * several requests in one write on a kept-alive connection, and a
+ * request split over writes.  The request is the first AS-REQ of an
+ * initial credentials exchange for the given client; any AS-REP or
+ * KRB-ERROR will do as its reply.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+#include <getarg.h>
+
+static int http_flag = 0;
+static int version_flag = 0;
+static int help_flag	= 0;
+
+static struct getargs args[] = {
+    {"http",	0,	arg_flag,	&http_flag,
+     "use the HTTP transport", NULL },
+    {"version",	0,	arg_flag,	&version_flag,
+     "print version", NULL },
+    {"help",	0,	arg_flag,	&help_flag,
+     NULL, NULL }
+};
+
+static void
+usage(int ret)
+{
+    arg_printusage(args, sizeof(args)/sizeof(*args), NULL,
+		   "host port client-principal");
+    exit(ret);
+}
+
+static void
+send_all(int s, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+	n = send(s, p, len, 0);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    err(1, "send");
+	p += n;
+	len -= n;
+    }
+}
+
+static void
+recv_all(int s, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+	n = recv(s, p, len, 0);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    err(1, "recv");
+	if (n == 0)
+	    errx(1, "connection closed with %lu bytes outstanding",
+		 (unsigned long)len);
+	p += n;
+	len -= n;
+    }
+}
+
+static int
+connect_kdc(const char *host, const char *port)
+{
+    struct addrinfo hints, *ai, *a;
+    int ret, s = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(host, port, &hints, &ai);
+    if (ret)
+	errx(1, "getaddrinfo(%s, %s): %s", host, port, gai_strerror(ret));
+    for (a = ai; a != NULL; a = a->ai_next) {
+	s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if (s < 0)
+	    continue;
+	if (connect(s, a->ai_addr, a->ai_addrlen) == 0)
+	    break;
+	close(s);
+	s = -1;
+    }
+    freeaddrinfo(ai);
+    if (s < 0)
+	err(1, "connect to %s port %s", host, port);
+    return s;
+}
+
+static void
+check_reply(const unsigned char *p, size_t len, int i)
+{
+    /* [APPLICATION 11] AS-REP or [APPLICATION 30] KRB-ERROR */
+    if (len == 0 || (p[0] != 0x6b && p[0] != 0x7e))
+	errx(1, "reply %d is not an AS-REP or KRB-ERROR", i);
+}
+
+static void
+read_tcp_reply(int s, int i)
+{
+    unsigned char l[4], *p;
+    unsigned long len;
+
+    recv_all(s, l, sizeof(l));
+    _krb5_get_int(l, &len, sizeof(l));
+    if (len > 65536)
+	errx(1, "reply %d is too long (%lu bytes)", i, len);
+    if ((p = malloc(len ? len : 1)) == NULL)
+	err(1, "malloc");
+    recv_all(s, p, len);
+    check_reply(p, len, i);
+    free(p);
+}
+
+static void
+test_tcp(const char *host, const char *port, const krb5_data *req)
+{
+    unsigned char *buf, *p;
+    size_t len = 4 + req->length;
+    int s;
+
+    if ((buf = malloc(2 * len)) == NULL)
+	err(1, "malloc");
+    for (p = buf; p < buf + 2 * len; p += len) {
+	_krb5_put_int(p, req->length, 4);
+	memcpy(p + 4, req->data, req->length);
+    }
+
+    s = connect_kdc(host, port);
+
+    /* Two requests in one write: both must be answered */
+    send_all(s, buf, 2 * len);
+    read_tcp_reply(s, 1);
+    read_tcp_reply(s, 2);
+
+    /* A request whose length prefix is split over two writes */
+    send_all(s, buf, 2);
+    sleep(1);
+    send_all(s, buf + 2, len - 2);
+    read_tcp_reply(s, 3);
+
+    close(s);
+    free(buf);
+}
+
+/*
+ * Read one HTTP response.  With `bodylen' NULL it must be a 404 that
+ * runs to the end of the connection; otherwise it must be a 200, and
+ * its Content-Length body (a length-prefixed KDC reply) is returned.
+ */
+static char *
+read_http_reply(int s, int i, size_t *bodylen)
+{
+    char hdr[4096], *p, *body;
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < 4 || memcmp(hdr + len - 4, "\r\n\r\n", 4) != 0) {
+	if (len == sizeof(hdr) - 1)
+	    errx(1, "response %d: header too long", i);
+	recv_all(s, hdr + len, 1);
+	len++;
+    }
+    hdr[len] = '\0';
+    if (strncmp(hdr, "HTTP/1.1 ", sizeof("HTTP/1.1 ") - 1) != 0)
+	errx(1, "response %d: bad status line", i);
+
+    if (bodylen == NULL) {
+	/* Read to end of file */
+	size_t size = 1024;
+
+	if ((body = malloc(size)) == NULL)
+	    err(1, "malloc");
+	len = 0;
+	for (;;) {
+	    if (len == size - 1) {
+		size *= 2;
+		if ((body = realloc(body, size)) == NULL)
+		    err(1, "realloc");
+	    }
+	    n = recv(s, body + len, size - 1 - len, 0);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0)
+		err(1, "recv");
+	    if (n == 0)
+		break;
+	    len += n;
+	}
+	body[len] = '\0';
+	if (strncmp(hdr + sizeof("HTTP/1.1 ") - 1, "404", 3) != 0)
+	    errx(1, "response %d: expected 404", i);
+	return body;
+    }
+
+    if (strncmp(hdr + sizeof("HTTP/1.1 ") - 1, "200", 3) != 0)
+	errx(1, "response %d: expected 200", i);
+    for (p = hdr; (p = strstr(p, "\r\n")) != NULL; p += 2)
+	if (strncasecmp(p + 2, "Content-Length:",
+			sizeof("Content-Length:") - 1) == 0)
+	    break;
+    if (p == NULL)
+	errx(1, "response %d: no Content-Length", i);
+    len = strtoul(p + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+    if (len < 4 || len > 65536)
+	errx(1, "response %d: bad Content-Length", i);
+    if ((body = malloc(len)) == NULL)
+	err(1, "malloc");
+    recv_all(s, body, len);
+    *bodylen = len;
+    return body;
+}
+
+static void
+test_http(const char *host, const char *port, const krb5_data *req)
+{
+    char *b64, *get, *get2, *body;
+    size_t len;
+    int i, s;
+
+    if (rk_base64_encode(req->data, req->length, &b64) < 0)
+	errx(1, "out of memory");
+    if (asprintf(&get, "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+		 b64, host) < 0 || get == NULL)
+	errx(1, "out of memory");
+    if (asprintf(&get2, "%s%s", get, get) < 0 || get2 == NULL)
+	errx(1, "out of memory");
+
+    s = connect_kdc(host, port);
+
+    /* Two pipelined requests on a kept-alive connection */
+    send_all(s, get2, strlen(get2));
+    for (i = 1; i <= 2; i++) {
+	body = read_http_reply(s, i, &len);
+	check_reply((unsigned char *)body + 4, len - 4, i);
+	free(body);
+    }
+
+    /* A non-KDC request gets all of its 404 before the close */
+    send_all(s, "GET /- HTTP/1.1\r\n\r\n",
+	     sizeof("GET /- HTTP/1.1\r\n\r\n") - 1);
+    body = read_http_reply(s, 3, NULL);
+    len = strlen(body);
+    if (len < 3 || strcmp(body + len - 3, "?\r\n") != 0)
+	errx(1, "response 3: truncated 404 body");
+    free(body);
+
+    close(s);
+    free(get2);
+    free(get);
+    free(b64);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    krb5_init_creds_context ctx;
+    krb5_principal client;
+    krb5_data in, out;
+    unsigned int flags = 0;
+    int optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    argc -= optidx;
+    argv += optidx;
+
+    if (argc != 3)
+	usage(1);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    ret = krb5_parse_name(context, argv[2], &client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+
+    ret = krb5_init_creds_init(context, client, NULL, NULL, 0, NULL, &ctx);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_init_creds_init");
+
+    krb5_data_zero(&in);
+    krb5_data_zero(&out);
+    ret = krb5_init_creds_step(context, ctx, &in, &out, NULL, &flags);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_init_creds_step");
+
+    alarm(60);
+    if (http_flag)
+	test_http(argv[0], argv[1], &out);
+    else
+	test_tcp(argv[0], argv[1], &out);
+
+    krb5_init_creds_free(context, ctx);
+    krb5_free_principal(context, client);
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -170,6 +170,132 @@ test_memory_keytab(krb5_context context, const char *keytab, const char *keytab2
     krb5_free_keyblock_contents(context, &entry3.keyblock);
 }
 
+/*
+ * Test that lookups in a FILE keytab, which go through an index, find
+ * the same entries as iterating would, and notice changes to the file.
+ */
+
+static void
+add_file_entry(krb5_context context, krb5_keytab id, const char *name,
+	       krb5_kvno kvno, krb5_enctype enctype)
+{
+    krb5_error_code ret;
+    krb5_keytab_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    ret = krb5_parse_name(context, name, &entry.principal);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    entry.vno = kvno;
+    ret = krb5_generate_random_keyblock(context, enctype, &entry.keyblock);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_kt_add_entry(context, id, &entry);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_add_entry");
+    krb5_kt_free_entry(context, &entry);
+}
+
+static krb5_error_code
+get_file_entry(krb5_context context, krb5_keytab id, const char *name,
+	       krb5_kvno kvno, krb5_enctype enctype, krb5_kvno *found)
+{
+    krb5_error_code ret;
+    krb5_principal p;
+    krb5_keytab_entry entry;
+
+    ret = krb5_parse_name(context, name, &p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    ret = krb5_kt_get_entry(context, id, p, kvno, enctype, &entry);
+    if (ret == 0) {
+	if (!krb5_principal_compare(context, p, entry.principal) &&
+	    strcmp(p->realm, "") != 0)
+	    krb5_errx(context, 1, "got the wrong principal for %s", name);
+	if (enctype && entry.keyblock.keytype != enctype)
+	    krb5_errx(context, 1, "got the wrong enctype for %s", name);
+	*found = entry.vno;
+	krb5_kt_free_entry(context, &entry);
+    }
+    krb5_free_principal(context, p);
+    return ret;
+}
+
+static void
+test_file_keytab_index(krb5_context context, const char *keytab)
+{
+    krb5_error_code ret;
+    krb5_keytab id, id2;
+    krb5_keytab_entry entry;
+    krb5_kvno vno;
+    char name[64];
+    int i;
+
+    ret = krb5_kt_resolve(context, keytab, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_resolve");
+    ret = krb5_kt_resolve(context, keytab, &id2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_resolve");
+
+    for (i = 0; i < 100; i++) {
+	snprintf(name, sizeof(name), "host/h%d.su.se@SU.SE", i);
+	add_file_entry(context, id, name, 1, ETYPE_AES256_CTS_HMAC_SHA1_96);
+	add_file_entry(context, id, name, 2, ETYPE_AES256_CTS_HMAC_SHA1_96);
+	add_file_entry(context, id, name, 2, ETYPE_AES128_CTS_HMAC_SHA1_96);
+    }
+    add_file_entry(context, id, "lha@SU.SE", 300,
+		   ETYPE_AES256_CTS_HMAC_SHA1_96);
+
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 0,
+		       ETYPE_AES256_CTS_HMAC_SHA1_96, &vno) || vno != 2)
+	krb5_errx(context, 1, "highest kvno not found");
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 1,
+		       ETYPE_AES256_CTS_HMAC_SHA1_96, &vno) || vno != 1)
+	krb5_errx(context, 1, "kvno 1 not found");
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 2,
+		       ETYPE_AES128_CTS_HMAC_SHA1_96, &vno) || vno != 2)
+	krb5_errx(context, 1, "aes128 key not found");
+    if (get_file_entry(context, id, "host/h99.su.se@", 0, 0, &vno) ||
+	vno != 2)
+	krb5_errx(context, 1, "wildcard realm not found");
+    if (get_file_entry(context, id, "lha@SU.SE", 300, 0, &vno) || vno != 300)
+	krb5_errx(context, 1, "32-bit kvno not found");
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 3, 0, &vno) == 0)
+	krb5_errx(context, 1, "found kvno that does not exist");
+    if (get_file_entry(context, id, "host/h100.su.se@SU.SE", 0, 0, &vno) == 0)
+	krb5_errx(context, 1, "found principal that does not exist");
+
+    /* changes through another handle must be seen */
+    memset(&entry, 0, sizeof(entry));
+    ret = krb5_parse_name(context, "host/h42.su.se@SU.SE", &entry.principal);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    entry.vno = 2;
+    entry.keyblock.keytype = ETYPE_AES256_CTS_HMAC_SHA1_96;
+    ret = krb5_kt_remove_entry(context, id2, &entry);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_remove_entry");
+    krb5_free_principal(context, entry.principal);
+
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 0,
+		       ETYPE_AES256_CTS_HMAC_SHA1_96, &vno) || vno != 1)
+	krb5_errx(context, 1, "removed entry still found");
+
+    add_file_entry(context, id2, "host/h100.su.se@SU.SE", 5,
+		   ETYPE_AES256_CTS_HMAC_SHA1_96);
+    if (get_file_entry(context, id, "host/h100.su.se@SU.SE", 0, 0, &vno) ||
+	vno != 5)
+	krb5_errx(context, 1, "added entry not found");
+
+    ret = krb5_kt_close(context, id2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_close");
+    ret = krb5_kt_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_destroy");
+}
+
 static void
 perf_add(krb5_context context, krb5_keytab id, int times)
 {
@@ -283,6 +409,8 @@ main(int argc, char **argv)
 
 	test_memory_keytab(context, "MEMORY:foo", "MEMORY:foo2");
 
+	test_file_keytab_index(context, "FILE:test_keytab_index.keytab");
+
     }
 
     krb5_free_context(context);
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of KTH nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY KTH AND ITS CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL KTH OR ITS CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <getarg.h>
+#include <err.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+static char *cname_comp = "user";
+
+static void
+make_auth(Authenticator *auth, KerberosTime ctime, int cusec)
+{
+    memset(auth, 0, sizeof(*auth));
+    auth->crealm = "TEST.H5L.SE";
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = &cname_comp;
+    auth->ctime = ctime;
+    auth->cusec = cusec;
+}
+
+static krb5_rcache
+open_rcache(krb5_context context, const char *name, krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+    krb5_rcache id;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full(%s)", name);
+    ret = krb5_rc_initialize(context, id, lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize(%s)", name);
+    return id;
+}
+
+static void
+store(krb5_context context, krb5_rcache id, Authenticator *auth,
+      krb5_error_code expected)
+{
+    krb5_error_code ret;
+
+    ret = krb5_rc_store(context, id, auth);
+    if (ret != expected)
+	krb5_errx(context, 1, "%s:%s: store of cusec %d returned %d, "
+		  "expected %d", krb5_rc_get_type(context, id),
+		  krb5_rc_get_name(context, id), (int)auth->cusec,
+		  (int)ret, (int)expected);
+}
+
+static void
+check_rcache(krb5_context context, const char *name, const char *type)
+{
+    Authenticator a, b;
+    krb5_deltat lifespan;
+    krb5_error_code ret;
+    krb5_rcache id;
+    time_t now = time(NULL);
+
+    id = open_rcache(context, name, 300);
+
+    if (strcmp(krb5_rc_get_type(context, id), type) != 0)
+	krb5_errx(context, 1, "%s: type %s", name,
+		  krb5_rc_get_type(context, id));
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret || lifespan != 300)
+	krb5_errx(context, 1, "%s: lifespan %d", name, (int)lifespan);
+
+    make_auth(&a, now, 1);
+    make_auth(&b, now, 2);
+    store(context, id, &a, 0);
+    store(context, id, &a, KRB5_RC_REPLAY);
+    store(context, id, &b, 0);
+    store(context, id, &b, KRB5_RC_REPLAY);
+
+    /* A new handle on the same cache sees what was stored before */
+    if (strcmp(type, "FILE") != 0) {
+	krb5_rcache id2;
+
+	ret = krb5_rc_resolve_full(context, &id2, name);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_resolve_full(%s)", name);
+	store(context, id2, &a, KRB5_RC_REPLAY);
+	krb5_rc_close(context, id2);
+    }
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy(%s)", name);
+}
+
+static void
+check_memory_expiry(krb5_context context)
+{
+    Authenticator a;
+    krb5_rcache id;
+    int i;
+
+    /* Enough entries to force the hash table to grow a few times */
+    id = open_rcache(context, "MEMORY:expiry", 1);
+    for (i = 0; i < 1000; i++) {
+	make_auth(&a, 1000, i);
+	store(context, id, &a, 0);
+    }
+    for (i = 0; i < 1000; i++) {
+	make_auth(&a, 1000, i);
+	store(context, id, &a, KRB5_RC_REPLAY);
+    }
+    sleep(2);
+    make_auth(&a, 1000, 0);
+    store(context, id, &a, 0);
+    krb5_rc_destroy(context, id);
+}
+
+/*
+ * A store into a small SHM table whose probed slots are all live fails,
+ * unless rcache_shm_evict is set, in which case it evicts the oldest
+ * entry instead.
+ */
+static void
+check_shm_full(krb5_context context)
+{
+    krb5_error_code ret;
+    Authenticator a;
+    krb5_rcache id;
+    time_t now = time(NULL);
+    int i;
+
+    ret = krb5_set_config(context, "[libdefaults]\n"
+			  "\trcache_shm_slots = 64\n");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config");
+    id = open_rcache(context, "SHM:full", 300);
+    for (i = 0; i < 64; i++) {
+	make_auth(&a, now, i);
+	store(context, id, &a, 0);
+    }
+    store(context, id, &a, KRB5_RC_REPLAY);
+    make_auth(&a, now, i);
+    store(context, id, &a, KRB5_RC_IO_SPACE);
+    krb5_rc_destroy(context, id);
+
+    ret = krb5_set_config(context, "[libdefaults]\n"
+			  "\trcache_shm_slots = 64\n"
+			  "\trcache_shm_evict = true\n");
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config");
+    id = open_rcache(context, "SHM:evict", 300);
+    for (i = 0; i < 1000; i++) {
+	make_auth(&a, now, i);
+	store(context, id, &a, 0);
+    }
+    store(context, id, &a, KRB5_RC_REPLAY);
+    krb5_rc_destroy(context, id);
+}
+
+static void
+check_resolve(krb5_context context)
+{
+    static const char *bad[] = { "BOGUS:x", "FILEX:x", "FILE", "/tmp/x:y" };
+    krb5_error_code ret;
+    krb5_rcache id;
+    size_t i;
+
+    for (i = 0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+	ret = krb5_rc_resolve_full(context, &id, bad[i]);
+	if (ret != KRB5_RC_TYPE_NOTFOUND)
+	    krb5_errx(context, 1, "krb5_rc_resolve_full(%s) returned %d",
+		      bad[i], (int)ret);
+    }
+}
+
+#ifdef HAVE_FORK
+static void
+check_shm_fork(krb5_context context)
+{
+    Authenticator a;
+    krb5_rcache id;
+    int status;
+    pid_t pid;
+
+    id = open_rcache(context, "SHM:fork", 300);
+    make_auth(&a, time(NULL), 42);
+
+    pid = fork();
+    if (pid < 0)
+	krb5_err(context, 1, errno, "fork");
+    if (pid == 0) {
+	store(context, id, &a, 0);
+	_exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	WEXITSTATUS(status) != 0)
+	krb5_errx(context, 1, "SHM child failed");
+
+    /* The child's store must be visible here */
+    store(context, id, &a, KRB5_RC_REPLAY);
+    krb5_rc_destroy(context, id);
+}
+#endif
+
+static void
+time_rcache(krb5_context context, const char *name, int count)
+{
+    struct timeval tv1, tv2;
+    Authenticator a;
+    krb5_rcache id;
+    time_t now = time(NULL);
+    int i;
+
+    id = open_rcache(context, name, 300);
+
+    gettimeofday(&tv1, NULL);
+    for (i = 0; i < count; i++) {
+	make_auth(&a, now, i);
+	store(context, id, &a, 0);
+    }
+    gettimeofday(&tv2, NULL);
+
+    timevalsub(&tv2, &tv1);
+
+    printf("%s %d stores time: %3ld.%06ld\n",
+	   krb5_rc_get_type(context, id), count,
+	   (long)tv2.tv_sec, (long)tv2.tv_usec);
+    krb5_rc_destroy(context, id);
+}
+
+static int benchmark_count = 0;
+static int version_flag = 0;
+static int help_flag	= 0;
+
+static struct getargs args[] = {
+    {"benchmark", 0,	arg_integer,	&benchmark_count,
+     "time this many stores with each replay cache type", "count" },
+    {"version",	0,	arg_flag,	&version_flag,
+     "print version", NULL },
+    {"help",	0,	arg_flag,	&help_flag,
+     NULL, NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args,
+		    sizeof(args)/sizeof(*args),
+		    NULL,
+		    "");
+    exit (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    krb5_rcache id;
+    char *file;
+    int optidx = 0;
+    int have_shm;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    if (asprintf(&file, "FILE:test_rcache.%lu", (unsigned long)getpid()) < 0 ||
+	file == NULL)
+	errx(1, "out of memory");
+
+    have_shm = (krb5_rc_resolve_type(context, &id, "SHM") == 0);
+    if (have_shm)
+	krb5_rc_close(context, id);
+
+    if (benchmark_count > 0) {
+	time_rcache(context, file, benchmark_count);
+	time_rcache(context, "MEMORY:bench", benchmark_count);
+	if (have_shm) {
+	    ret = krb5_set_config(context, "[libdefaults]\n"
+				  "\trcache_shm_evict = true\n");
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_set_config");
+	    time_rcache(context, "SHM:bench", benchmark_count);
+	}
+    } else {
+	check_resolve(context);
+	check_rcache(context, file, "FILE");
+	check_rcache(context, "MEMORY:test", "MEMORY");
+	check_memory_expiry(context);
+	if (have_shm) {
+	    check_rcache(context, "SHM:test", "SHM");
+#ifdef HAVE_FORK
+	    check_shm_fork(context);
+#endif
+	    check_shm_full(context);
+	}
+    }
+
+    free(file);
+    krb5_free_context(context);
+
+    return 0;
+}